@@ -0,0 +1,308 @@
+// bench.hh
+// Jabber client library benchmarks
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifndef INCL_BENCH_HH
+#define INCL_BENCH_HH
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+* A small harness shared by the benchmark programs.
+* Each case is a round of work over a known number of items (and
+* optionally bytes).  Rounds are repeated until a sample has run for
+* long enough to time, several samples are taken, and the median is
+* reported so one noisy sample doesn't move the result.  Results go to
+* stderr as text and, with --json, to a file for comparing runs.
+*/
+namespace bench {
+
+typedef std::vector<std::pair<std::string, long> > Params;
+
+/**
+* A deterministic random number generator, so every run of a
+* benchmark sees the same input on every platform.
+*/
+class Random
+{
+public:
+    Random(unsigned long seed = 1) : _state(seed) { }
+
+    // A number in [0, range)
+    unsigned long next(unsigned long range)
+    {
+        _state = _state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (unsigned long) (_state >> 33) % range;
+    }
+
+private:
+    unsigned long long _state;
+};
+
+class Runner
+{
+public:
+    /**
+    * Read the common options:
+    *   --json FILE     also write the results to FILE
+    *   --filter TEXT   only run cases whose name contains TEXT
+    *   --quick         use the small sizes only, for a smoke test
+    *   --min-time SEC  time each sample for at least SEC seconds
+    */
+    Runner(const std::string& suite, int argc, char** argv)
+        : _suite(suite), _quick(false), _min_time(0.2), _samples(5)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--json" && i + 1 < argc)
+                _json = argv[++i];
+            else if (arg == "--filter" && i + 1 < argc)
+                _filter = argv[++i];
+            else if (arg == "--quick")
+                _quick = true;
+            else if (arg == "--min-time" && i + 1 < argc)
+                _min_time = atof(argv[++i]);
+            else
+            {
+                std::cerr << "usage: " << argv[0] << " [--json FILE] [--filter TEXT]"
+                          << " [--quick] [--min-time SEC]" << std::endl;
+                exit(2);
+            }
+        }
+        if (_quick)
+            _min_time = std::min(_min_time, 0.02);
+    }
+
+    bool quick() const
+    { return _quick; }
+
+    /**
+    * Time a case.
+    * @param name The case name; params are appended for display.
+    * @param params Sizes the case was run at, recorded in the results.
+    * @param items Items each call of round processes.
+    * @param bytes Bytes each call of round processes, or 0.
+    * @param round One round of the work.
+    */
+    void run(const std::string& name, const Params& params, long items,
+             long bytes, std::function<void ()> round)
+    {
+        std::string label = name;
+        for (size_t i = 0; i < params.size(); ++i)
+        {
+            std::ostringstream os;
+            os << "/" << params[i].first << "=" << params[i].second;
+            label += os.str();
+        }
+        if (!_filter.empty() && label.find(_filter) == std::string::npos)
+            return;
+
+        // Warm up, and find how many rounds make a sample long enough
+        long rounds = 1;
+        for (;;)
+        {
+            double secs = timeRounds(round, rounds);
+            if (secs >= _min_time / 4 || rounds >= (1L << 30))
+            {
+                rounds = std::max(1L, (long) (rounds * _min_time / std::max(secs, 1e-9)));
+                break;
+            }
+            rounds *= 4;
+        }
+
+        std::vector<double> samples;
+        for (int i = 0; i < _samples; ++i)
+            samples.push_back(timeRounds(round, rounds) * 1e9 / (rounds * items));
+        std::vector<double> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+        double ns = sorted[sorted.size() / 2];
+
+        Result r;
+        r.name = name;
+        r.params = params;
+        r.rounds = rounds;
+        r.items = items;
+        r.bytes = bytes;
+        r.ns_per_item = ns;
+        r.samples = samples;
+        _results.push_back(r);
+
+        fprintf(stderr, "%-48s %12.1f ns/item %14.0f items/s", label.c_str(),
+                ns, 1e9 / ns);
+        if (bytes > 0)
+            fprintf(stderr, " %9.1f MB/s", bytes * (1e9 / ns) / items / 1e6);
+        fprintf(stderr, "\n");
+    }
+
+    /**
+    * Write the JSON results if asked for.
+    * @return The exit code for main().
+    */
+    int finish()
+    {
+        if (_json.empty())
+            return 0;
+
+        std::ofstream out(_json.c_str());
+        out << "{\n  \"suite\": \"" << _suite << "\",\n"
+            << "  \"quick\": " << (_quick ? "true" : "false") << ",\n"
+            << "  \"results\": [";
+        for (size_t i = 0; i < _results.size(); ++i)
+        {
+            const Result& r = _results[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"params\": {";
+            for (size_t p = 0; p < r.params.size(); ++p)
+                out << (p ? ", " : "") << "\"" << r.params[p].first << "\": "
+                    << r.params[p].second;
+            out << "}, \"rounds\": " << r.rounds
+                << ", \"items_per_round\": " << r.items
+                << ", \"ns_per_item\": " << r.ns_per_item
+                << ", \"items_per_sec\": " << 1e9 / r.ns_per_item;
+            if (r.bytes > 0)
+                out << ", \"bytes_per_sec\": " << r.bytes * (1e9 / r.ns_per_item) / r.items;
+            out << ", \"samples_ns_per_item\": [";
+            for (size_t s = 0; s < r.samples.size(); ++s)
+                out << (s ? ", " : "") << r.samples[s];
+            out << "]}";
+        }
+        out << "\n  ]\n}\n";
+        return out ? 0 : 1;
+    }
+
+private:
+    struct Result
+    {
+        std::string         name;
+        Params              params;
+        long                rounds;
+        long                items;
+        long                bytes;
+        double              ns_per_item;
+        std::vector<double> samples;
+    };
+
+    static double timeRounds(std::function<void ()>& round, long rounds)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (long i = 0; i < rounds; ++i)
+            round();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::string         _suite;
+    std::string         _json;
+    std::string         _filter;
+    bool                _quick;
+    double              _min_time;
+    int                 _samples;
+    std::vector<Result> _results;
+};
+
+/**
+* A JID for user number n, on one of a few hosts.
+*/
+inline std::string jid(long n, const char* resource = NULL)
+{
+    std::ostringstream os;
+    os << "user" << n << "@host" << (n % 7) << ".example.org";
+    if (resource != NULL)
+        os << "/" << resource;
+    return os.str();
+}
+
+/**
+* A mix of stanzas shaped like a busy client's stream: mostly
+* presence and chat, with some roster pushes, disco replies and
+* pings.  The same seed always gives the same stanzas.
+*/
+inline std::vector<std::string> stanzaMix(int count, unsigned long seed = 1)
+{
+    static const char* shows[] = { "away", "chat", "dnd", "xa" };
+    static const char* words[] = { "hello", "are", "you", "there", "lunch",
+                                   "meeting", "&lt;soon&gt;", "ok", "later" };
+    Random rnd(seed);
+    std::vector<std::string> mix;
+    for (int i = 0; i < count; ++i)
+    {
+        std::ostringstream os;
+        std::string from = jid(rnd.next(1000), "home");
+        std::string to = jid(0, "work");
+        unsigned long kind = rnd.next(100);
+        if (kind < 40)
+        {
+            os << "<presence from='" << from << "' to='" << to << "'";
+            if (rnd.next(10) == 0)
+                os << " type='unavailable'/>";
+            else
+                os << "><show>" << shows[rnd.next(4)] << "</show><status>"
+                   << words[rnd.next(9)] << " " << words[rnd.next(9)]
+                   << "</status><priority>" << rnd.next(10) << "</priority>"
+                   << "<c xmlns='http://jabber.org/protocol/caps' node='http://example.org/client' ver='1.0'/>"
+                   << "</presence>";
+        }
+        else if (kind < 75)
+        {
+            os << "<message from='" << from << "' to='" << to << "' type='chat' id='m" << i << "'>"
+               << "<body>";
+            for (unsigned long w = 1 + rnd.next(20); w > 0; --w)
+                os << words[rnd.next(9)] << " ";
+            os << "</body><thread>t" << rnd.next(50) << "</thread>"
+               << "<x xmlns='jabber:x:event'><composing/></x></message>";
+        }
+        else if (kind < 85)
+        {
+            os << "<iq type='set' id='r" << i << "'><query xmlns='jabber:iq:roster'>"
+               << "<item jid='" << jid(rnd.next(1000)) << "' name='Friend " << i
+               << "' subscription='both'><group>Friends</group></item></query></iq>";
+        }
+        else if (kind < 95)
+        {
+            os << "<iq from='" << from << "' to='" << to << "' type='result' id='d" << i << "'>"
+               << "<query xmlns='http://jabber.org/protocol/disco#info'>"
+               << "<identity category='client' type='pc'/>"
+               << "<feature var='http://jabber.org/protocol/disco#info'/>"
+               << "<feature var='jabber:iq:version'/><feature var='jabber:iq:last'/>"
+               << "</query></iq>";
+        }
+        else
+        {
+            os << "<iq from='" << from << "' to='" << to << "' type='get' id='p" << i << "'>"
+               << "<ping xmlns='urn:xmpp:ping'/></iq>";
+        }
+        mix.push_back(os.str());
+    }
+    return mix;
+}
+
+}; // namespace bench
+
+#endif // INCL_BENCH_HH
@@ -0,0 +1,251 @@
+// jabberoobench.cc
+// Jabber client library benchmarks: sessions and their databases
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include "bench.hh"
+
+#include "jabberoo.hh"
+#include <sigc++/object_slot.h>
+
+using namespace jabberoo;
+using namespace std;
+
+namespace {
+
+const char* SERVER = "host0.example.org";
+const char* STREAM_START =
+    "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+    "from='host0.example.org' id='bench'>";
+
+// Stands in for the socket and the application's handlers
+class Client : public SigC::Object
+{
+public:
+    Client() : handled(0)
+    {
+	session.evtTransmitXML.connect(SigC::slot(*this, &Client::onTransmit));
+    }
+
+    // Start a stream, without authenticating
+    void open()
+    {
+	session.connect(SERVER, Session::atPlaintextAuth, "user0", "work",
+			"secret", false, false);
+	session.push(STREAM_START, strlen(STREAM_START));
+    }
+
+    void close()
+    {
+	session.push("</stream:stream>", 16);
+    }
+
+    // The id of the last iq we sent
+    string lastID() const
+    {
+	string::size_type start = sent.find(" id='");
+	if (start == string::npos)
+	    return "";
+	start += 5;
+	return sent.substr(start, sent.find('\'', start) - start);
+    }
+
+    void onTransmit(const char* xml)
+    { sent = xml; }
+    void onElement(const judo::Element& e)
+    { handled++; }
+    void onDisco(const DiscoDB::Item* item)
+    { handled++; }
+
+    // Declared first, since the session sends on its way out
+    string  sent;
+    long    handled;
+    Session session;
+};
+
+// Every roster and presence benchmark needs sizes well beyond what a
+// desktop client sees
+vector<long> sizes(bench::Runner& runner, long small, long large)
+{
+    vector<long> result;
+    for (long n = small; n <= (runner.quick() ? small : large); n *= 10)
+	result.push_back(n);
+    return result;
+}
+
+void benchPresenceDB(bench::Runner& runner)
+{
+    static const char* resources[] = { "home", "work", "phone", "laptop" };
+
+    vector<long> counts = sizes(runner, 10000, 1000000);
+    for (size_t c = 0; c < counts.size(); ++c)
+    {
+	long count = counts[c];
+	vector<Presence> presences;
+	for (long i = 0; i < count; ++i)
+	{
+	    Presence p(bench::jid(i / 4, resources[i % 4]), Presence::ptAvailable,
+		       Presence::stOnline, "", "1");
+	    p.getBaseElement().putAttrib("from", bench::jid(i / 4, resources[i % 4]));
+	    presences.push_back(p);
+	}
+
+	Client client;
+	PresenceDB& pdb = client.session.presenceDB();
+	bench::Params params;
+	params.push_back(make_pair(string("resources"), count));
+	runner.run("presencedb/insert", params, count, 0, [&]() {
+	    pdb.clear();
+	    for (size_t i = 0; i < presences.size(); ++i)
+		pdb.insert(presences[i]);
+	});
+
+	// Look up a fixed random sample of what is there
+	vector<string> lookups;
+	bench::Random rnd;
+	for (int i = 0; i < 10000; ++i)
+	    lookups.push_back(bench::jid(rnd.next(count / 4), resources[rnd.next(4)]));
+	runner.run("presencedb/find", params, lookups.size(), 0, [&]() {
+	    for (size_t i = 0; i < lookups.size(); ++i)
+		pdb.find(lookups[i]);
+	});
+	runner.run("presencedb/available", params, lookups.size(), 0, [&]() {
+	    for (size_t i = 0; i < lookups.size(); ++i)
+		pdb.available(lookups[i]);
+	});
+    }
+}
+
+judo::Element* rosterQuery(long first, long count, const string& group)
+{
+    judo::Element* query = new judo::Element("query");
+    query->putAttrib("xmlns", "jabber:iq:roster");
+    for (long i = first; i < first + count; ++i)
+    {
+	judo::Element* item = query->addElement("item");
+	item->putAttrib("jid", bench::jid(i));
+	item->putAttrib("name", "Contact " + bench::jid(i));
+	item->putAttrib("subscription", "both");
+	item->addElement("group", group);
+    }
+    return query;
+}
+
+void benchRoster(bench::Runner& runner)
+{
+    vector<long> counts = sizes(runner, 100, 10000);
+    for (size_t c = 0; c < counts.size(); ++c)
+    {
+	long count = counts[c];
+	Client client;
+	Roster& roster = client.session.roster();
+	unique_ptr<judo::Element> query(rosterQuery(0, count, "Friends"));
+
+	bench::Params params;
+	params.push_back(make_pair(string("items"), count));
+	runner.run("roster/load", params, count, 0, [&]() {
+	    roster.reset();
+	    roster.update(*query);
+	});
+
+	// Single item pushes into the full roster, moving contacts
+	// between groups
+	vector<judo::Element*> pushes;
+	for (int i = 0; i < 100; ++i)
+	    pushes.push_back(rosterQuery(i * count / 100, 1, (i % 2) ? "Work" : "Friends"));
+	runner.run("roster/push", params, pushes.size(), 0, [&]() {
+	    for (size_t i = 0; i < pushes.size(); ++i)
+		roster.update(*pushes[i]);
+	});
+	for (size_t i = 0; i < pushes.size(); ++i)
+	    delete pushes[i];
+    }
+}
+
+void benchDisco(bench::Runner& runner)
+{
+    Client client;
+    client.open();
+    DiscoDB& disco = client.session.discoDB();
+
+    // Ask for an item, answer it, and count the callback
+    const int requests = 100;
+    runner.run("disco/callback", bench::Params(), requests, 0, [&]() {
+	disco.clear();
+	for (int i = 0; i < requests; ++i)
+	{
+	    string jid = bench::jid(i);
+	    disco.cache(jid, SigC::slot(client, &Client::onDisco));
+	    string reply = "<iq type='result' from='" + jid + "' id='" + client.lastID() + "'>"
+		"<query xmlns='http://jabber.org/protocol/disco#info'>"
+		"<identity category='client' type='pc'/>"
+		"<feature var='jabber:iq:version'/><feature var='jabber:iq:last'/>"
+		"</query></iq>";
+	    client.session.push(reply.c_str(), reply.size());
+	}
+    });
+    if (client.handled == 0)
+	abort();
+}
+
+// A whole stream through a Session, with its handlers and databases
+void benchSession(bench::Runner& runner)
+{
+    vector<string> mix = bench::stanzaMix(1000);
+    string stream;
+    for (size_t i = 0; i < mix.size(); ++i)
+	stream += mix[i];
+
+    static const int counts[] = { 0, 10, 100 };
+    for (int c = 0; c < 3; ++c)
+    {
+	Client client;
+	for (int i = 0; i < counts[c]; ++i)
+	{
+	    string query = (i % 2) ?
+		"/presence[@from='" + bench::jid(i * 37 % 1000, "home") + "']" :
+		"/message[@from='" + bench::jid(i * 37 % 1000, "home") + "']/body";
+	    client.session.registerXPath(query, SigC::slot(client, &Client::onElement));
+	}
+
+	bench::Params params;
+	params.push_back(make_pair(string("queries"), (long) counts[c]));
+	runner.run("session/push", params, mix.size(), stream.size(), [&]() {
+	    client.open();
+	    for (size_t pos = 0; pos < stream.size(); pos += 4096)
+		client.session.push(stream.data() + pos,
+				    min((size_t) 4096, stream.size() - pos));
+	    client.close();
+	});
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    bench::Runner runner("jabberoobench", argc, argv);
+
+    benchPresenceDB(runner);
+    benchRoster(runner);
+    benchDisco(runner);
+    benchSession(runner);
+
+    return runner.finish();
+}
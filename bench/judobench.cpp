@@ -0,0 +1,184 @@
+// judobench.cpp
+// libjudo benchmarks: parsing, serializing and XPath
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include "bench.hh"
+
+#include <judo.hpp>
+#include <XPath.h>
+
+using namespace judo;
+using namespace std;
+
+namespace {
+
+const int STANZAS = 1000;
+const char* STREAM_START =
+    "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' "
+    "from='host0.example.org' id='bench' version='1.0'>";
+
+// Counts and frees what the stream parses
+class Sink : public ElementStreamEventListener
+{
+public:
+    Sink() : elements(0) { }
+    void onDocumentStart(Element* e) { delete e; }
+    void onElement(Element* e) { elements++; delete e; }
+    void onCDATA(CDATA* c) { delete c; }
+    void onDocumentEnd() { }
+
+    long elements;
+};
+
+// Push a whole stream through a fresh ElementStream in socket sized
+// reads
+void benchPush(bench::Runner& runner, const vector<string>& mix)
+{
+    string stream = STREAM_START;
+    for (size_t i = 0; i < mix.size(); ++i)
+        stream += mix[i];
+
+    static const int chunks[] = { 512, 4096, 65536 };
+    for (int backend = 0; backend < 2; ++backend)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            int chunk = chunks[c];
+            bench::Params params;
+            params.push_back(make_pair(string("chunk"), (long) chunk));
+            runner.run(backend ? "push/xmpp" : "push/expat", params,
+                       mix.size(), stream.size(), [&, backend, chunk]() {
+                Sink sink;
+                ElementStream es(&sink);
+                if (backend)
+                    es.setBackend(new XMPPBackend());
+                for (size_t pos = 0; pos < stream.size(); pos += chunk)
+                    es.push(stream.data() + pos,
+                            min((size_t) chunk, stream.size() - pos));
+                if (sink.elements != (long) mix.size())
+                    abort();
+            });
+        }
+    }
+
+    // Reading straight into the parser's buffer
+    bench::Params params;
+    params.push_back(make_pair(string("chunk"), 4096L));
+    runner.run("commit/xmpp", params, mix.size(), stream.size(), [&]() {
+        Sink sink;
+        ElementStream es(&sink, new XMPPBackend());
+        for (size_t pos = 0; pos < stream.size(); pos += 4096)
+        {
+            int size = min((size_t) 4096, stream.size() - pos);
+            memcpy(es.getBuffer(size), stream.data() + pos, size);
+            es.commit(size);
+        }
+    });
+}
+
+void benchToString(bench::Runner& runner, const vector<Element*>& elems)
+{
+    long bytes = 0;
+    for (size_t i = 0; i < elems.size(); ++i)
+        bytes += elems[i]->toString().size();
+
+    runner.run("toString", bench::Params(), elems.size(), bytes, [&]() {
+        for (size_t i = 0; i < elems.size(); ++i)
+            elems[i]->toString();
+    });
+    runner.run("toStringRaw", bench::Params(), elems.size(), bytes, [&]() {
+        for (size_t i = 0; i < elems.size(); ++i)
+            elems[i]->toStringRaw();
+    });
+}
+
+// Queries like a client registers: a few broad handlers, then one per
+// contact it is watching
+vector<string> makeQueries(int count)
+{
+    static const char* common[] = {
+        "/message[@type='chat']/body",
+        "/message/x[@xmlns='jabber:x:event']/composing",
+        "/presence[@type='unavailable']",
+        "/iq[@type='set']/query[@xmlns='jabber:iq:roster']",
+        "/iq[@type='get']/*[@xmlns='urn:xmpp:ping']",
+        "/iq[@type='result']/query[@xmlns='http://jabber.org/protocol/disco#info']/feature",
+        "/presence/c[@xmlns='http://jabber.org/protocol/caps']",
+        "/message[@type='groupchat']",
+    };
+    vector<string> queries;
+    for (int i = 0; i < count; ++i)
+    {
+        if (i < 8)
+            queries.push_back(common[i]);
+        else
+            queries.push_back("/presence[@from='" + bench::jid(i * 37 % 1000, "home") + "']");
+    }
+    return queries;
+}
+
+void benchXPath(bench::Runner& runner, const vector<Element*>& elems)
+{
+    static const int counts[] = { 1, 10, 100 };
+    for (int c = 0; c < 3; ++c)
+    {
+        vector<string> texts = makeQueries(counts[c]);
+        vector<XPath::Query*> queries;
+        for (size_t i = 0; i < texts.size(); ++i)
+            queries.push_back(new XPath::Query(texts[i]));
+
+        bench::Params params;
+        params.push_back(make_pair(string("queries"), (long) counts[c]));
+        runner.run("xpath/check", params, elems.size(), 0, [&]() {
+            for (size_t e = 0; e < elems.size(); ++e)
+                for (size_t q = 0; q < queries.size(); ++q)
+                    queries[q]->check(*elems[e]);
+        });
+
+        for (size_t i = 0; i < queries.size(); ++i)
+            delete queries[i];
+    }
+
+    vector<string> texts = makeQueries(8);
+    runner.run("xpath/construct", bench::Params(), texts.size(), 0, [&]() {
+        for (size_t i = 0; i < texts.size(); ++i)
+            XPath::Query q(texts[i]);
+    });
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    bench::Runner runner("judobench", argc, argv);
+
+    vector<string> mix = bench::stanzaMix(STANZAS);
+    vector<Element*> elems;
+    for (size_t i = 0; i < mix.size(); ++i)
+        elems.push_back(ElementStream::parseAtOnce(mix[i].c_str()));
+
+    benchPush(runner, mix);
+    benchToString(runner, elems);
+    benchXPath(runner, elems);
+
+    for (size_t i = 0; i < elems.size(); ++i)
+        delete elems[i];
+    return runner.finish();
+}
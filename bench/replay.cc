@@ -0,0 +1,362 @@
+// replay.cc
+// Replay a WireTrace through a Session
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include "jabberoo.hh"
+#include "wiretrace.hh"
+#include <sigc++/object_slot.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <new>
+#include <thread>
+#include <vector>
+
+using namespace jabberoo;
+using namespace std;
+
+// Count every allocation the process makes; the replay is single
+// threaded, so a plain counter will do
+static unsigned long g_allocs = 0;
+
+// Allocations, including those the pool served from its free lists
+// without calling operator new
+static unsigned long allocations()
+{
+    return g_allocs + judo::getPoolStats().reused;
+}
+
+void* operator new(size_t size)
+{
+    g_allocs++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace {
+
+typedef chrono::steady_clock Clock;
+
+struct Stanza
+{
+    long long time;   // Microseconds into the trace
+    string    key;    // name/type, to group the results by
+    string    xml;
+    bool      answer; // An iq result or error
+};
+
+// Splits the received side of a trace back into stanzas, each stamped
+// with the time of the chunk which completed it
+class Splitter : public judo::ElementStreamEventListener
+{
+public:
+    Splitter() : time(0) { }
+
+    void onDocumentStart(judo::Element* e)
+    {
+        header = e->toStringEx(false, false);
+        delete e;
+    }
+
+    void onElement(judo::Element* e)
+    {
+        Stanza s;
+        s.time = time;
+        s.key = e->getName();
+        string type = e->getAttrib("type");
+        if (!type.empty())
+            s.key += "/" + type;
+        s.xml = e->toStringRaw();
+        s.answer = (e->getName() == "iq") && (type == "result" || type == "error");
+        stanzas.push_back(s);
+        delete e;
+    }
+
+    void onCDATA(judo::CDATA* c) { delete c; }
+    void onDocumentEnd() { }
+
+    long long      time;
+    string         header;
+    vector<Stanza> stanzas;
+};
+
+// Latencies and allocations of one kind of stanza
+struct Stats
+{
+    Stats() : allocs(0) { }
+
+    vector<double> usecs;
+    unsigned long  allocs;
+};
+
+// Stands in for the server: answers every iq get or set the session
+// sends with an empty result, so the replay doesn't depend on the
+// answers in the trace matching what this build asks
+class Loopback : public SigC::Object
+{
+public:
+    Loopback(Session& s) : _session(s)
+    {
+        s.evtTransmitXML.connect(SigC::slot(*this, &Loopback::onTransmit));
+    }
+
+    // Push the answers to whatever the session has sent
+    void answer(map<string, Stats>& stats)
+    {
+        while (!_answers.empty())
+        {
+            string xml = _answers.front();
+            _answers.pop_front();
+
+            unsigned long allocs = allocations();
+            Clock::time_point start = Clock::now();
+            _session.push(xml.c_str(), xml.size());
+            Stats& st = stats["iq/result (loopback)"];
+            st.usecs.push_back(chrono::duration<double, micro>(Clock::now() - start).count());
+            st.allocs += allocations() - allocs;
+        }
+    }
+
+private:
+    void onTransmit(const char* xml)
+    {
+        if (strncmp(xml, "<iq", 3) != 0)
+            return;
+
+        judo::Element* iq = NULL;
+        try {
+            iq = judo::ElementStream::parseAtOnce(xml);
+        } catch (...) {
+            return;
+        }
+        if (iq->cmpAttrib("type", "get") || iq->cmpAttrib("type", "set"))
+        {
+            judo::Element result("iq");
+            result.putAttrib("type", "result");
+            result.putAttrib("id", iq->getAttrib("id"));
+            if (!iq->getAttrib("to").empty())
+                result.putAttrib("from", iq->getAttrib("to"));
+            _answers.push_back(result.toString());
+        }
+        delete iq;
+    }
+
+    Session&      _session;
+    deque<string> _answers;
+};
+
+// Quote a string for JSON
+string jsonString(const string& s)
+{
+    string out = "\"";
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+void usage(const char* name)
+{
+    cerr << "usage: " << name << " [--fast] [--loopback] [--pool] [--json FILE]"
+         << " [--user NAME] [--server HOST] [--resource RES] TRACE" << endl
+         << "  --fast      push as fast as possible instead of at the recorded pace" << endl
+         << "  --loopback  answer the session's iqs here, not from the trace" << endl
+         << "  --pool      allocate the session's memory from judo::poolResource()" << endl;
+    exit(2);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    bool fast = false, loopback = false, pool = false;
+    string json, trace;
+    string user = "replay", server = "localhost", resource = "replay";
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--fast")
+            fast = true;
+        else if (arg == "--loopback")
+            loopback = true;
+        else if (arg == "--pool")
+            pool = true;
+        else if (arg == "--json" && i + 1 < argc)
+            json = argv[++i];
+        else if (arg == "--user" && i + 1 < argc)
+            user = argv[++i];
+        else if (arg == "--server" && i + 1 < argc)
+            server = argv[++i];
+        else if (arg == "--resource" && i + 1 < argc)
+            resource = argv[++i];
+        else if (arg[0] != '-' && trace.empty())
+            trace = arg;
+        else
+            usage(argv[0]);
+    }
+    if (trace.empty())
+        usage(argv[0]);
+
+    // Split what was received into stanzas up front, so the replay
+    // only times the session
+    Splitter splitter;
+    long long transmitted = 0;
+    try {
+        WireTrace::Reader reader(trace);
+        judo::ElementStream stream(&splitter);
+        WireTrace::Record r;
+        while (reader.next(r))
+        {
+            if (r.dir == WireTrace::dirTransmit)
+            {
+                transmitted++;
+                continue;
+            }
+            splitter.time = r.time;
+            stream.push(r.data.c_str(), r.data.size());
+        }
+    } catch (const XCP& e) {
+        cerr << trace << ": " << e.getMessage() << endl;
+        return 1;
+    } catch (const judo::ElementStream::exception::ParserError& e) {
+        cerr << trace << ": " << e.getMessage() << endl;
+        return 1;
+    }
+    if (splitter.header.empty())
+    {
+        cerr << trace << ": no stream was received" << endl;
+        return 1;
+    }
+    cerr << trace << ": " << splitter.stanzas.size() << " stanzas received, "
+         << transmitted << " chunks sent" << endl;
+
+    Session session(pool ? judo::poolResource() : NULL);
+    unique_ptr<Loopback> lb(loopback ? new Loopback(session) : NULL);
+    map<string, Stats> stats;
+
+    session.connect(server, Session::atPlaintextAuth, user, resource, "replay");
+    session.push(splitter.header.c_str(), splitter.header.size());
+    if (lb.get() != NULL)
+        lb->answer(stats);
+
+    long pushed = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < splitter.stanzas.size(); ++i)
+    {
+        const Stanza& s = splitter.stanzas[i];
+        if (lb.get() != NULL && s.answer)
+            continue;
+        if (!fast)
+            this_thread::sleep_until(start + chrono::microseconds(s.time));
+
+        unsigned long allocs = allocations();
+        Clock::time_point before = Clock::now();
+        session.push(s.xml.c_str(), s.xml.size());
+        Stats& st = stats[s.key];
+        st.usecs.push_back(chrono::duration<double, micro>(Clock::now() - before).count());
+        st.allocs += allocations() - allocs;
+        pushed++;
+
+        if (lb.get() != NULL)
+            lb->answer(stats);
+    }
+    double secs = chrono::duration<double>(Clock::now() - start).count();
+    session.disconnect();
+
+    fprintf(stderr, "%ld stanzas in %.3f s, %.0f stanzas/s\n\n", pushed, secs, pushed / secs);
+    fprintf(stderr, "%-28s %8s %10s %10s %10s %10s %12s\n", "stanza", "count",
+            "mean us", "p50 us", "p99 us", "max us", "allocs/each");
+
+    ofstream out;
+    if (!json.empty())
+    {
+        out.open(json.c_str());
+        out << "{\n  \"trace\": " << jsonString(trace) << ",\n"
+            << "  \"fast\": " << (fast ? "true" : "false") << ",\n"
+            << "  \"loopback\": " << (loopback ? "true" : "false") << ",\n"
+            << "  \"pool\": " << (pool ? "true" : "false") << ",\n"
+            << "  \"stanzas\": " << pushed << ",\n"
+            << "  \"seconds\": " << secs << ",\n"
+            << "  \"stanzas_per_sec\": " << pushed / secs << ",\n"
+            << "  \"types\": [";
+    }
+
+    bool first = true;
+    for (map<string, Stats>::iterator it = stats.begin(); it != stats.end(); ++it)
+    {
+        vector<double>& v = it->second.usecs;
+        sort(v.begin(), v.end());
+        double total = 0;
+        for (size_t i = 0; i < v.size(); ++i)
+            total += v[i];
+        double mean = total / v.size();
+        double p50 = v[v.size() / 2];
+        double p99 = v[min(v.size() - 1, v.size() * 99 / 100)];
+        double allocs = (double) it->second.allocs / v.size();
+
+        fprintf(stderr, "%-28s %8lu %10.2f %10.2f %10.2f %10.2f %12.1f\n",
+                it->first.c_str(), (unsigned long) v.size(), mean, p50, p99,
+                v.back(), allocs);
+        if (out.is_open())
+        {
+            out << (first ? "\n" : ",\n") << "    {\"stanza\": " << jsonString(it->first)
+                << ", \"count\": " << v.size() << ", \"mean_us\": " << mean
+                << ", \"p50_us\": " << p50 << ", \"p99_us\": " << p99
+                << ", \"max_us\": " << v.back() << ", \"allocs_per_stanza\": " << allocs << "}";
+        }
+        first = false;
+    }
+
+    if (out.is_open())
+        out << "\n  ]\n}\n";
+    return 0;
+}
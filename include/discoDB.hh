@@ -114,7 +114,13 @@ namespace jabberoo {
             void addIdentity(const std::string& category, 
                              const std::string& type);
 
+            /// The bytes the item holds, itself included
+            size_t getMemorySize() const;
+
         private:
+            friend class DiscoDB;
+
+            size_t _counted;    // Bytes the DiscoDB counted for it
             std::string _jid;
             std::string _node;
             std::string _name;
@@ -123,9 +129,16 @@ namespace jabberoo {
             IdentityList _identities;
         };
 
-        typedef std::map<std::string, DiscoDB::Item*>::iterator iterator;
-        typedef std::map<std::string, DiscoDB::Item*>::const_iterator const_iterator;
         typedef SigC::Slot1<void, const DiscoDB::Item*> DiscoCallbackFunc;
+    private:
+        // Allocated from the Session's memory resource
+        typedef std::multimap<std::string, DiscoDB::Item*, std::less<std::string>,
+            judo::Allocator<std::pair<const std::string, DiscoDB::Item*> > > ItemMap;
+        typedef std::multimap<std::string, DiscoCallbackFunc, std::less<std::string>,
+            judo::Allocator<std::pair<const std::string, DiscoCallbackFunc> > > CallbackMap;
+    public:
+        typedef ItemMap::iterator iterator;
+        typedef ItemMap::const_iterator const_iterator;
 
         class XCP_NotCached : public XCP{};
 
@@ -181,7 +194,15 @@ namespace jabberoo {
         { return _items.end(); }
 
         void erase(iterator it)
-        { delete it->second; _items.erase(it); }
+        { uncount(it); delete it->second; _items.erase(it); }
+
+        /// The number of items in the cache
+        int size() const
+        { return _items.size(); }
+
+        /// The bytes the cache and its waiting callbacks hold
+        size_t getMemoryUsed() const
+        { return _bytes; }
 
         /**
          * Signal is fired whenever a new item is added to the cache.
@@ -190,17 +211,19 @@ namespace jabberoo {
         SigC::Signal1<void, const DiscoDB::Item&> signal_cache_updated;
 
     private:
-        typedef std::multimap<std::string, DiscoDB::Item*> ItemMap;
-        typedef std::multimap<std::string, DiscoCallbackFunc> CallbackMap;
-
         jabberoo::Session& _session;
         CallbackMap _callbacks;
         ItemMap _items;
+        size_t _bytes;
 
         void browseCB(const judo::Element& e);
         void discoInfoCB(const judo::Element& e);
         void discoItemsCB(const judo::Element& e);
         void runCallbacks(const std::string& jid, const DiscoDB::Item* item);
+        // Keep _bytes up to date as items and callbacks come and go
+        void counted(DiscoDB::Item* item);
+        void uncount(iterator it);
+        void addCallback(const std::string& key, DiscoCallbackFunc f);
     };
 } // namespace jabberoo
 
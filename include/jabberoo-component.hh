@@ -43,6 +43,7 @@
 #include <map>
 #include <XPath.h>
 #include <packet.hh>
+#include <sessionstats.hh>
 
 namespace jabberoo {
     
@@ -75,20 +76,32 @@ public:
 
     void unregisterXPath(judo::XPath::Query* id);
 
+    void forward(const judo::Element& e, const std::string& to, const std::string& from);
+
     ComponentSession& operator>>(const char* buffer) { push(buffer, strlen(buffer)); return *this; } 
-    ComponentSession& operator<<(const Packet& p) { evtTransmitXML(p.toString().c_str()); return *this;}
-    ComponentSession& operator<<(const char* buffer) { evtTransmitXML(buffer); return *this;}
+    ComponentSession& operator<<(const Packet& p) { transmit(p.getBaseElement().toStringRaw().c_str()); return *this;}
+    ComponentSession& operator<<(const char* buffer) { transmit(buffer); return *this;}
     virtual void push(const char* data, int datasz);
+    virtual void commit(int datasz);
 
+    /**
+    * Get a snapshot of the session's counters, from any thread.
+    * @see getProcessStats()
+    */
+    SessionStats getStats() const;
 
     SigC::Signal1<void, const char*>        evtTransmitXML;
     SigC::Signal0<void>         evtConnected;
 protected:
     virtual void onDocumentStart(judo::Element* t);
     virtual void onElement(judo::Element* t);
+    virtual bool onElementStart(const char* name, const char** attribs);
     virtual void onCDATA(judo::CDATA* c);
     virtual void onDocumentEnd();
 
+    // Send XML out through evtTransmitXML, counting it
+    void transmit(const char* xml);
+
 private:
     std::string _server;
     std::string _componentID;
@@ -97,6 +110,15 @@ private:
     ConnectionState _connState;
     std::list<judo::XPath::Query*> _XPaths;
     std::map<judo::XPath::Query*, ElementCallbackFunc> _XPCallbacks;
+    // Outcome of each query for the packet being parsed, in list
+    // order, decided from its start tag. Only the root step and its
+    // predicates are decided this way. The decisions stand while
+    // _XPGeneration, which every change to _XPaths bumps, is still
+    // the one they were made at.
+    std::vector<judo::XPath::Op::Match> _XPDecisions;
+    unsigned long _XPDecisionGeneration;
+    unsigned long _XPGeneration;
+    SessionCounters _counters;
 };
 
 } // namespace jabberoo
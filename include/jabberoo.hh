@@ -49,6 +49,8 @@
 #include <message.hh>
 #include <presence.hh>
 #include <session.hh>
+#include <sessionstats.hh>
+#include <wiretrace.hh>
 #include <XCP.hh>
 #include <sha.h>
 
@@ -66,6 +66,7 @@ namespace jabberoo {
     class Session;
     class DiscoDB;
     class PresenceDB;
+    class WireTap;
     typedef SigC::Slot1<void, const ::judo::Element&> ElementCallbackFunc;
     const int ERR_UNAUTHORIZED = 401;
 }
@@ -74,6 +74,14 @@ namespace jabberoo
 		*/
 	       Message(const judo::Element& t);
 
+	       /**
+		* Construct a message which shares the base element of a Packet.
+		* No copy of the element is made until either Packet is modified.
+		* @see jabberoo::Packet
+		* @param p A Packet which should have a message base element
+		*/
+	       Message(const Packet& p);
+
 	       /**
 		* Construct a message to a JabberID with a body.
 		* Note that setting a body here is oh-so-slightly faster than calling
@@ -173,7 +181,7 @@ namespace jabberoo
 		* be generated and sent.
 		* @return The delivered message event which should be sent.
 		*/
-	       Message Message::delivered() const;
+	       Message delivered() const;
 
 	       /**
 		* Create a message event stating that this Message has been displayed.
@@ -181,7 +189,7 @@ namespace jabberoo
 		* be generated and sent.
 		* @return The displayed message event which should be sent.
 		*/	       
-	       Message Message::displayed() const;
+	       Message displayed() const;
 
 	       /**
 		* Create a message event stating that this Message is being replied to.
@@ -189,7 +197,7 @@ namespace jabberoo
 		* be generated and sent.
 		* @return The composing message event which should be sent.
 		*/
-	       Message Message::composing() const;
+	       Message composing() const;
 
 
            /**
@@ -199,9 +207,7 @@ namespace jabberoo
            { return _timestamp; }
 	       // Static class methods
 	       /**
-		* Sets the date and time format.AM_CONDITIONAL(DEBUG, test x$debug = xyes)
-test=no
-AM_CONDITIONAL(TEST, test x$test = xyes)
+		* Sets the date and time format.
 		* @param format A string date and time format.
 		*/
 	       static void setDateTimeFormat(const std::string& format);
@@ -216,6 +222,8 @@ AM_CONDITIONAL(TEST, test x$test = xyes)
 	       static std::string translateType(Type mtype);
 	       static Type   translateType(const std::string& mtype);
 	  private:
+	       void init();
+
 	       Type  _type;
 	       time_t _timestamp;
 	       static std::string _dtFormat;
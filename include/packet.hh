@@ -35,6 +35,8 @@
 #include <judo.hpp>
 #include <jabberoofwd.h>
 
+#include <atomic>
+
 namespace jabberoo {
      /**
       * A Jabber Packet with standard attributes.
@@ -57,6 +59,56 @@ namespace jabberoo {
 		*/
 	       Packet(const judo::Element& t);
 
+	       /**
+		* Jabber Packet constructor which adopts a judo::Element.
+		* The Packet takes ownership of t and will delete it once the
+		* last Packet sharing it goes away. No copy of the tree is made.
+		* @param t A heap allocated judo::Element
+		*/
+	       explicit Packet(judo::Element* t);
+
+	       /**
+		* Jabber Packet constructor which moves from a judo::Element.
+		* The children and attributes of t are moved into the Packet,
+		* leaving t empty.
+		* @param t A judo::Element
+		*/
+	       explicit Packet(judo::Element&& t);
+
+	       /**
+		* Copy constructor.
+		* The new Packet shares the base element of p; the tree is only
+		* copied when one of the two Packets is modified.
+		* @param p The Packet to share
+		*/
+	       Packet(const Packet& p);
+
+	       /**
+		* Move constructor.
+		* Takes over the base element of p without copying it.  p is
+		* left with an empty base element with no name, which it
+		* shares with every other moved-from Packet until it is
+		* modified.
+		* @param p The Packet to move from
+		*/
+	       Packet(Packet&& p);
+
+	       /**
+		* Assignment.
+		* Releases the current base element and shares the one of p.
+		* @param p The Packet to share
+		*/
+	       Packet& operator=(const Packet& p);
+
+	       /**
+		* Move assignment.
+		* p is left as after the move constructor.
+		* @param p The Packet to move from
+		*/
+	       Packet& operator=(Packet&& p);
+
+	       ~Packet();
+
 	       // Common ops
 	       /**
 		* from attribute on the base element.
@@ -146,7 +198,16 @@ namespace jabberoo {
 		* @param tnamespace The namespace of the x element to return.
 		* @return A pointer to the x element.
 		*/
-	       judo::Element* findX(const std::string& tnamespace) const;
+	       const judo::Element* findX(const std::string& tnamespace) const;
+
+	       /**
+		* Get the x (extension) element which has an xmlns of tnamespace
+		* for modification.
+		* @see judo::Element
+		* @param tnamespace The namespace of the x element to return.
+		* @return A pointer to the x element.
+		*/
+	       judo::Element* findX(const std::string& tnamespace);
 
 	       /**
 		* Erase an x element from the packet.
@@ -159,13 +220,49 @@ namespace jabberoo {
 
 	       /**
 		* Access to the base element
+		* If the base element is shared with other Packets it is copied
+		* first, so modifications never show up in those Packets.
 		* @see judo::Element
 		* @return A reference to the base element of the Jabber Packet as a judo::Element
 		*/
 	       judo::Element& getBaseElement();
 
-	  protected:
-	       judo::Element _base;
+	       /**
+		* Whether the base element is shared with another Packet.
+		* @return true if a modification would copy the base element.
+		*/
+	       bool isShared() const;
+
+	       /**
+		* The bytes the Packet holds beyond itself.
+		* A base element shared with other Packets is counted in full.
+		*/
+	       size_t getMemorySize() const;
+
+	  private:
+	       // Reference counted holder for the base element.  The count
+	       // is atomic so copies may be released on different threads;
+	       // the element itself is still only safe on one thread.
+	       struct Shared
+	       {
+		    Shared(judo::Element* e)
+			 : elem(e), refs(1)
+			 {}
+		    ~Shared()
+			 { delete elem; }
+
+		    judo::Element*   elem;
+		    std::atomic<int> refs;
+	       };
+
+	       void release();
+	       void detach();
+
+	       // The empty base element moved-from Packets share; it
+	       // holds a reference of its own so it is never deleted
+	       static Shared* empty();
+
+	       Shared* _shared;
 	  };
 } // namespace jabberoo
 
@@ -84,6 +84,14 @@ namespace jabberoo
 		*/
 	       Presence(const judo::Element& t);
 
+	       /**
+		* Construct a Presence Packet which shares the base element of a Packet.
+		* No copy of the element is made until either Packet is modified.
+		* @see jabberoo::Packet
+		* @param p A Packet which should have a presence base element
+		*/
+	       Presence(const Packet& p);
+
 	       /**
 		* Construct a Presence Packet based upon given values
 		* @see jabberoo::Packet
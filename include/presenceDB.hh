@@ -41,6 +41,7 @@
 #include <map>
 #include <jabberoofwd.h>
 #include <jutil.hh>
+#include <MemoryResource.h>
 
 namespace jabberoo
 {
@@ -55,8 +56,13 @@ namespace jabberoo
 	  : public SigC::Object
      {
      public:
-	  typedef std::list<Presence>::iterator             iterator;
-	  typedef std::list<Presence>::const_iterator       const_iterator;
+	  /**
+	   * The Presences of one user@host, best first, allocated from
+	   * the Session's memory resource.
+	   */
+	  typedef std::list<Presence, judo::Allocator<Presence> > PresenceList;
+	  typedef PresenceList::iterator                    iterator;
+	  typedef PresenceList::const_iterator              const_iterator;
 	  typedef std::pair<const_iterator, const_iterator> range;
 	  /**
 	   * This is thrown if a JID is not in the database.
@@ -120,11 +126,45 @@ namespace jabberoo
 	   * Whether the default Presence for user@host is available.
 	   */
 	  bool           available(const std::string& jid) const;
+	  /**
+	   * The number of user@hosts with presence in the database.
+	   */
+	  int            size() const { return _DB.size(); }
+	  /**
+	   * The bytes the database holds, Presences included.
+	   */
+	  size_t         getMemoryUsed() const { return _Bytes; }
+	  /**
+	   * Remove the user@host whose presence changed longest ago.
+	   * Unlike receiving unavailable presence, no event is fired.
+	   * @return false if the database was empty.
+	   */
+	  bool           dropOldest();
      private:
-	  typedef std::map<std::string, std::list<Presence>, jutil::CaseInsensitiveCmp > db;
+	  typedef std::list<std::string, judo::Allocator<std::string> > AgeList;
+	  // The Presences of a user@host, the bytes they take, and where
+	  // the user@host is in _Ages
+	  struct Entry
+	  {
+	       Entry(const PresenceList::allocator_type& a)
+		    : presences(a), bytes(0) {}
+	       PresenceList      presences;
+	       size_t            bytes;
+	       AgeList::iterator age;
+	  };
+	  typedef std::map<std::string, Entry, jutil::CaseInsensitiveCmp,
+			   judo::Allocator<std::pair<const std::string, Entry> > > db;
 	  db::const_iterator find_or_throw(const std::string& jid) const;
+	  // The entry for a user@host, made empty on the map's resource
+	  // if there isn't one
+	  db::iterator entry(const std::string& jid);
+	  // Recount an entry which has changed, and make it the newest
+	  void       updated(db::iterator it);
+	  void       erase(db::iterator it);
 	  Session&   _Owner;
 	  db         _DB;
+	  AgeList    _Ages;  // user@hosts, least recently changed first
+	  size_t     _Bytes;
      };
 } // namespace jabberoo
 
@@ -0,0 +1,144 @@
+// recvring.hh
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifndef INCL_JABBEROO_RECVRING_HH
+#define INCL_JABBEROO_RECVRING_HH
+
+#include <jabberoofwd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace jabberoo {
+
+/**
+* A fixed size ring of bytes between one writer and one reader thread.
+* The writer reads from its socket straight into the ring and the
+* reader parses straight out of it; neither takes a lock unless it has
+* to wait for the other.  Waiting sides are only woken when they have
+* said they are waiting, so a busy pair never touches the mutex.
+*/
+EXPORT class RecvRing
+{
+public:
+    /**
+    * Create an empty ring.
+    * @param capacity Bytes the ring holds, rounded up to a power of two.
+    */
+    RecvRing(int capacity);
+
+    // Writer side
+    /**
+    * Get the free space to read data into.
+    * This is contiguous, so it may be less than all the free space
+    * when the free space wraps around the end of the ring.
+    * @param size Set to the number of bytes available, 0 if full.
+    * @return The start of the free space.
+    */
+    char* getWriteBuffer(int& size);
+
+    /**
+    * Hand bytes written into getWriteBuffer() to the reader.
+    * @param datasz Number of bytes written.
+    * @return true if the ring was empty, so the reader may need waking.
+    */
+    bool commit(int datasz);
+
+    /**
+    * Get all the free space, including any which wraps around.
+    * @return The number of bytes which may be written.
+    */
+    int writable() const;
+
+    /**
+    * Block until there is free space or the ring is closed.
+    * @return false if the ring was closed.
+    */
+    bool waitWritable();
+
+    // Reader side
+    /**
+    * Get the data which is ready to read.
+    * Like getWriteBuffer(), this is contiguous and may be only part
+    * of what is ready.
+    * @param size Set to the number of bytes ready, 0 if empty.
+    * @return The start of the data.
+    */
+    const char* getReadBuffer(int& size);
+
+    /**
+    * Release bytes the reader is finished with to the writer.
+    * @param datasz Number of bytes read.
+    */
+    void consume(int datasz);
+
+    /**
+    * Get all the data which is ready, including any which wraps around.
+    * @return The number of bytes which may be read.
+    */
+    int readable() const;
+
+    /**
+    * Block until there is data or the ring is closed.
+    * @return false if the ring was closed and is empty.
+    */
+    bool waitReadable();
+
+    /**
+    * Wake both sides for good; waits return at once from now on.
+    */
+    void close();
+
+    /**
+    * Number of bytes the ring holds.
+    */
+    int capacity() const
+    { return _data.size(); }
+
+private:
+    RecvRing(const RecvRing&);
+    RecvRing& operator=(const RecvRing&);
+
+    void wake(std::atomic<bool>& waiting);
+
+    std::vector<char>   _data;
+    size_t              _mask;
+
+    // Total bytes ever written and read; each is only stored by its
+    // own side, and padded onto its own cache line
+    char                _pad0[64];
+    std::atomic<size_t> _written;
+    char                _pad1[64];
+    std::atomic<size_t> _read;
+    char                _pad2[64];
+
+    std::atomic<bool>       _writer_waiting;
+    std::atomic<bool>       _reader_waiting;
+    std::atomic<bool>       _closed;
+    std::mutex              _lock;
+    std::condition_variable _wakeup;
+};
+
+}; // namespace jabberoo
+
+#endif // INCL_JABBEROO_RECVRING_HH
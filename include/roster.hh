@@ -42,6 +42,7 @@
 #include <jabberoofwd.h>
 #include <presence.hh>
 #include <jutil.hh>
+#include <MemoryResource.h>
 
 namespace jabberoo
 {
@@ -184,9 +185,12 @@ namespace jabberoo
 		    bool         _pending;
                     std::string       _nickname;
                     std::string       _jid;
+		    size_t       _counted;  // Bytes the Roster counted for it
                };
 	       
-	       typedef std::map<std::string, Item, jutil::CaseInsensitiveCmp> ItemMap;
+	       // Allocated from the Session's memory resource
+	       typedef std::map<std::string, Item, jutil::CaseInsensitiveCmp,
+				judo::Allocator<std::pair<const std::string, Item> > > ItemMap;
 
 	       // Non-const iterators
 	       typedef jutil::ValueIterator<ItemMap::iterator, Item > iterator;
@@ -287,6 +291,12 @@ namespace jabberoo
                */
                int size() const
                { return _items.size(); }
+               /**
+               * Get the bytes the roster holds: its items, their groups
+               * and the index of items by group.
+               */
+               size_t getMemoryUsed() const
+               { return _bytes; }
 
                // Translation
                static std::string translateS10N(Subscription stype);
@@ -323,12 +333,15 @@ namespace jabberoo
           private:
 	       friend class Item;
 	       void mergeItemGroups(const std::string& itemjid, const std::set<std::string>& oldgrp, const std::set<std::string>& newgrp);
+               void addItemToGroup(const std::string& group, const std::string& jid);
                void removeItemFromGroup(const std::string& group, const std::string& jid);
+               void counted(ItemMap::value_type& v);
 	       void removeItemFromAllGroups(const Item& item);
 	       void deleteAgent(const judo::Element& iq);
                ItemMap                   _items;
                std::map<std::string, std::set<std::string> > _groups;
                Session&                  _owner;
+               size_t                    _bytes;
      };
 
 }  // namespace jabberoo
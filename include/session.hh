@@ -36,18 +36,31 @@
 #include <discoDB.hh>
 #include <roster.hh>
 #include <presenceDB.hh>
+#include <recvring.hh>
+#include <sessionstats.hh>
+#include <strand.hh>
 
 #include <judo.hpp>
+#include <XPath.h>
+#include <XPathStatic.h>
 
 #include <sigc++/object.h>
 #include <sigc++/signal.h>
 #include <sigc++/slot.h>
 
+#include <chrono>
+#include <map>
+#include <mutex>
 
 namespace jabberoo {
 
      typedef SigC::Slot1<void, const judo::Element&> ElementCallbackFunc;
 
+     /**
+      * Latency summaries keyed by a handler's label or an iq's namespace.
+      */
+     typedef std::map<std::string, LatencyHistogram::Summary> LatencyTable;
+
      /**
       * A session with a Jabber server.
       * This class provides common operations needed for raw communication between the client and the server.
@@ -81,14 +94,52 @@ namespace jabberoo {
 		    csConnected     /**< Connected. */
 	       };
 
+	       /**
+		* What the session does when it holds more memory than its
+		* budget allows.  Whatever the policy, a session which is
+		* still over budget afterwards is disconnected.
+		* @see setMemoryBudget()
+		*/
+	       enum BudgetPolicy
+	       {
+		    bpEvictCaches,  /**< Clear the DiscoDB, then drop the oldest presences. */
+		    bpDropPresence, /**< Drop the oldest presences. */
+		    bpDisconnect    /**< Disconnect at once. */
+	       };
+
+	       /**
+		* The bytes a session holds, by what holds them.
+		* @see getMemoryUsage()
+		*/
+	       struct MemoryUsage
+	       {
+		    size_t parse;    /**< The stanza being parsed, and input not yet parsed. */
+		    size_t presence; /**< The PresenceDB. */
+		    size_t roster;   /**< The Roster and its groups. */
+		    size_t disco;    /**< The DiscoDB and the callbacks waiting on it. */
+		    size_t iq;       /**< iq callbacks waiting for an answer. */
+		    size_t output;   /**< Packets from postPacket() not yet sent. */
+
+		    size_t total() const
+		    { return parse + presence + roster + disco + iq + output; }
+	       };
+
 	       // Initializers
 	       /**
 		* Construct a Session.
 		* This constructs a Session.
+		* The Elements it parses and its roster, presence and disco
+		* caches are allocated from a resource of its own, which
+		* passes the allocations on to upstream.
+		* @param upstream Where the session's memory comes from, or
+		* NULL for judo::newDeleteResource(), even when the Session
+		* is made within another's scope.  judo::poolResource()
+		* recycles what each stanza used for the next one.
 		* @see push();
 		* @see evtTransmitXML
+		* @see getMemoryResource()
 		*/
-	       Session();
+	       explicit Session(judo::MemoryResource* upstream = NULL);
 	       /**
 		* Deconstruct a Session.
 		* This frees memory the Session was using.
@@ -110,7 +161,7 @@ namespace jabberoo {
 		* Send text.
 		* Sends raw text through the session. Usually, this should be well-formed XML.
 		*/
-	       Session& operator<<(const char* buffer) { evtTransmitXML(buffer); return *this;}
+	       Session& operator<<(const char* buffer) { transmit(buffer); return *this;}
 	  public:
 	       // Connectivity ops
 	       /**
@@ -153,13 +204,121 @@ namespace jabberoo {
 		*/
 	       virtual void push(const char* data, int datasz);
 
+	       /**
+		* Get a buffer for the socket connector to read raw XML into.
+		* Data read into this buffer is parsed where it is, instead of
+		* being copied into the parser as push() does.
+		* @param size The most bytes which will be read.
+		* @return A buffer of at least size bytes, valid until commit().
+		* @see commit()
+		*/
+	       char* getBuffer(int size);
+
+	       /**
+		* Push raw XML which was read into the buffer from getBuffer().
+		* @param datasz Number of bytes read into the buffer.
+		* @see push()
+		*/
+	       virtual void commit(int datasz);
+
+	       /**
+		* Run this session on a Strand.
+		* Once bound, post() and postPacket() hand their work to the
+		* strand, so the session is only ever used by one worker at a
+		* time and needs no locking.  Bind the strand before posting
+		* anything; it must outlive the session.
+		* @param strand The strand, or NULL to run post() at once.
+		* @see Strand
+		*/
+	       void setStrand(Strand* strand) { _Strand = strand; }
+
+	       /**
+		* Get the Strand the session runs on.
+		* @return The strand, or NULL if the session has none.
+		*/
+	       Strand* getStrand() const { return _Strand; }
+
+	       /**
+		* Push raw XML to the session from any thread.
+		* The data is copied and pushed on the session's strand, so
+		* the socket connector needn't be the thread which parses.
+		* @param data Character data to give to the session.
+		* @param datasz Size of the character data to give to the session.
+		* @see push()
+		*/
+	       void post(const char* data, int datasz);
+
+	       /**
+		* Send a Packet through the session from any thread.
+		* This is how a handler running for one session sends through
+		* another.  The packet is copied on the calling thread and
+		* sent from the session's strand.
+		* @param p The Packet to send.
+		*/
+	       void postPacket(const Packet& p);
+
+	       /**
+		* Give the session a ring buffer for a reader thread to fill.
+		* The reader thread writes into getRecvRing()->getWriteBuffer()
+		* and calls commitRecv(); the session parses what has arrived
+		* with drainRecv() on its own thread.  Call this before the
+		* reader starts.
+		* @param capacity Size of the ring in bytes, or 0 to remove it.
+		* @see RecvRing
+		*/
+	       void setRecvRing(int capacity);
+
+	       /**
+		* Get the ring buffer set with setRecvRing().
+		* @return The ring, or NULL if the session has none.
+		*/
+	       RecvRing* getRecvRing() { return _Ring.get(); }
+
+	       /**
+		* Copy everything sent and received into a tap, closing
+		* any tap set before.  This is how WireLog::attach() and
+		* detach() hook a session; call those instead.
+		* @param tap The tap, or NULL to stop.
+		*/
+	       void setWireTap(WireTap* tap);
+
+	       /**
+		* Hand data read into the ring to the session.
+		* Call this from the reader thread.  If the session runs on a
+		* Strand a drain is posted to it, unless one is already
+		* waiting to run, so a burst of reads is parsed in one go.
+		* @param datasz Number of bytes read into the ring.
+		*/
+	       void commitRecv(int datasz);
+
+	       /**
+		* Parse everything which has arrived in the ring.
+		* Call this on the session's thread when it has no Strand;
+		* sessions on a strand are drained for you.
+		* @return The number of bytes parsed.
+		*/
+	       int drainRecv();
+
 	       /**
 		* Register an iq callback.
 		* The callback will be called once an iq message with the given id is received.
 		* @param id The id of the iq message which was sent.
 		* @param f The function to call.
+		* @param label What the iq asks, usually its namespace.  Round
+		*        trips and callback times are kept per label.
+		* @see getIQLatencies()
+		*/
+	       void registerIQ(const std::string& id, ElementCallbackFunc f,
+			       const std::string& label = "");
+
+	       /**
+		* Drop iq callbacks which have waited too long for an answer.
+		* Call this now and then; an answer which arrives after its
+		* callback was dropped goes to evtIQ instead.
+		* @param seconds How long a callback may wait.
+		* @return The number of callbacks dropped.
 		*/
-	       void registerIQ(const std::string& id, ElementCallbackFunc f);
+	       int expireIQ(int seconds);
 
         /**
         * Register a judo::XPath callback
@@ -167,17 +326,38 @@ namespace jabberoo {
         * @param query The judo::xpath query to search on
         * @param f the function to call
         * @param incoming When true, default, it is on the incoming data, otherwise it is on the outgoing data
+        * @param label Names the callback in getHandlerLatencies(); those
+        *        without one are timed together
         * @return The id of the registered judo::XPath
         */
            judo::XPath::Query* registerXPath(const std::string& query,
-               ElementCallbackFunc f, bool incoming=true);
+               ElementCallbackFunc f, bool incoming=true,
+               const std::string& label = "");
+
+        /**
+        * Register a callback for a query built at compile time with
+        * JUDO_XPATH, which is checked without running the judo::XPath
+        * interpreter.
+        * @param query The query, as returned by JUDO_XPATH
+        * @param f the function to call
+        * @param incoming When true, default, it is on the incoming data, otherwise it is on the outgoing data
+        * @param label Names the callback in getHandlerLatencies()
+        * @return The id of the registered query
+        */
+           template <class Expr>
+           judo::XPath::Matcher* registerXPath(const judo::XPath::StaticQuery<Expr>& query,
+               ElementCallbackFunc f, bool incoming=true,
+               const std::string& label = "")
+           {
+               return addXPath(new judo::XPath::StaticQuery<Expr>(query), f, incoming, label);
+           }
 
         /**
         * Unregister a judo::XPath callback
         * 
         * @param id The id to remove
         */
-        void unregisterXPath(judo::XPath::Query* id, bool incoming=true);
+        void unregisterXPath(judo::XPath::Matcher* id, bool incoming=true);
 
 	       /**
 		* Query a namespace on a specific JabberID.
@@ -229,6 +409,73 @@ namespace jabberoo {
 		*/
 	       PresenceDB&       presenceDB();
 
+	       /**
+		* Get a snapshot of the session's counters.
+		* This may be called from any thread.  The entry counts are as
+		* of the last stanza the session dispatched.
+		* @see getProcessStats()
+		* @return The counters.
+		*/
+	       SessionStats getStats() const;
+
+	       /**
+		* Get the resource the session allocates from.
+		* It is the default resource while the session parses,
+		* dispatches and sends, so handlers allocate from it too.
+		* Anything allocated from it may outlive the session; the
+		* resource is deleted once all of it has been freed.
+		* @return The resource, which counts the bytes in use.
+		*/
+	       judo::CountingResource* getMemoryResource() const { return _MemResource; }
+
+	       /**
+		* Get the bytes the session holds for its peer.
+		* Unlike getMemoryResource(), this counts strings, and
+		* Packets which have been posted to the session but not yet
+		* handled.  Call this on the session's thread.
+		* @return The bytes, by what holds them.
+		*/
+	       MemoryUsage getMemoryUsage() const;
+
+	       /**
+		* Limit the memory the session may hold for its peer, so a
+		* peer which floods it with presences or sends an endless
+		* stanza can't exhaust the process.  The budget is checked
+		* as input is parsed and after each stanza is dispatched;
+		* when it is exceeded evtOverBudget is emitted and the policy
+		* applied.  A session which is still over budget is
+		* disconnected as if the stream had ended, and ignores its
+		* input until connect() is called again.
+		* @param bytes The budget, or 0 for none.
+		* @param policy What to do when it is exceeded.
+		* @see getMemoryUsage()
+		*/
+	       void setMemoryBudget(size_t bytes, BudgetPolicy policy = bpEvictCaches);
+
+	       /**
+		* Get the budget set with setMemoryBudget().
+		* @return The budget in bytes, or 0 for none.
+		*/
+	       size_t getMemoryBudget() const { return _Budget; }
+
+	       /**
+		* Get how long XPath and iq callbacks have taken to run.
+		* XPath callbacks are keyed by the label they were registered
+		* with and iq callbacks by their label, prefixed with "iq ".
+		* This may be called from any thread.
+		* @return A summary of each label's times.
+		*/
+	       LatencyTable getHandlerLatencies() const;
+
+	       /**
+		* Get how long iqs have taken to be answered, timed from
+		* registerIQ() or queryNamespace() to the reply.
+		* This may be called from any thread.
+		* @return A summary of the round trips for each label.
+		*/
+	       LatencyTable getIQLatencies() const;
+
+
 	       // Property accessors
 	       /**
 		* Get the AuthType which was used.
@@ -309,6 +556,12 @@ namespace jabberoo {
 		* @see Session::disconnect()
 		*/
            SigC::Signal0<void>                     evtDisconnected;
+	       /**
+		* This event is emitted when the session goes over its
+		* memory budget, before the budget's policy is applied.
+		* @see setMemoryBudget()
+		*/
+           SigC::Signal1<void, const MemoryUsage&> evtOverBudget;
 	       // Basic signals
 	       /**
 		* This event is emitted when a Message is received.
@@ -406,13 +659,50 @@ namespace jabberoo {
 	       // ElementStream events
 	       virtual void onDocumentStart(judo::Element* t);
 	       virtual void onElement(judo::Element* t);
+	       virtual bool onElementStart(const char* name, const char** attribs);
 	       virtual void onCDATA(judo::CDATA* c);
 	       virtual void onDocumentEnd();
 
+	       // Outcome of each incoming XPath query for the packet being
+	       // parsed, in list order, decided from its start tag. Only
+	       // the root step and its predicates are decided this way;
+	       // the rest of a query's path is checked on the built tree.
+	       // The decisions stand while the list is at the generation
+	       // they were made at.
+	       struct XPDecisionList
+	       {
+		    XPDecisionList() : generation(0) {}
+		    std::vector<judo::XPath::Op::Match> matches;
+		    unsigned long generation;
+	       };
+	       // size is the packet's bytes on the wire, or 0 if it wasn't
+	       // parsed
+	       void dispatch(judo::Element* elem, const XPDecisionList& decisions, long size);
+
+	       // Add a query to the incoming or outgoing list, taking
+	       // ownership of it
+	       judo::XPath::Matcher* addXPath(judo::XPath::Matcher* matcher, 
+					      ElementCallbackFunc f, bool incoming,
+					      const std::string& label);
+
+	       // The histogram for label, or NULL without stats
+	       LatencyHistogram* latencies(std::map<std::string, LatencyHistogram>& table,
+					   const std::string& label);
+	       LatencyTable summarize(const std::map<std::string, LatencyHistogram>& table) const;
+
 	       // Basic packet handlers
-	       void handleMessage(judo::Element& t);
-	       void handlePresence(judo::Element& t);
-	       void handleIQ(judo::Element& t);
+	       void handleMessage(const Packet& t);
+	       void handlePresence(const Packet& t);
+	       void handleIQ(const judo::Element& t);
+
+	       // Send XML out through evtTransmitXML, counting it
+	       void transmit(const char* xml);
+
+	       // Apply the memory budget.  The parser can't be reset while
+	       // it is on the stack, so while parsing a session which must
+	       // be disconnected is only marked, and a later check does it.
+	       void checkBudget(bool parsing);
+	       void shed();
 
 	  private:
 	       // Values
@@ -432,21 +722,72 @@ namespace jabberoo {
 	       bool            _StreamStart;
 	       // Whether or not we want to use jabber:iq:auth
 	       bool            _Authenticate;
+	       // Buffer handed out by getBuffer()
+	       char*           _RecvBuffer;
+	       // Strand which post() runs on, if any
+	       Strand*         _Strand;
+	       // Ring a reader thread fills, and whether a drain of it is
+	       // already posted to _Strand
+	       std::unique_ptr<RecvRing> _Ring;
+	       std::atomic<bool> _RingDrainPosted;
+	       // Where a WireLog captures the traffic, if anywhere
+	       WireTap*        _WireTap;
+	       // What the session has done, for getStats()
+	       SessionCounters _Counters;
+	       // Memory budget, and whether the session must be or has
+	       // been disconnected for going over it
+	       size_t          _Budget;
+	       BudgetPolicy    _BudgetPolicy;
+	       bool            _OverBudget;
+	       bool            _Shed;
+	       // Bytes posted to _Strand and not yet parsed, or sent
+	       std::atomic<size_t> _PostedIn;
+	       std::atomic<size_t> _PostedOut;
+	       // Where the caches and parsed Elements are allocated from;
+	       // declared before them so it is there to construct them
+	       judo::CountingResource* _MemResource;
+	       // Callback times and iq round trips, by label; the lock is
+	       // only for adding labels and reading from other threads
+	       std::map<std::string, LatencyHistogram> _HandlerTimes;
+	       std::map<std::string, LatencyHistogram> _ReplyTimes;
+	       mutable std::mutex _TimesLock;
 	       // Structures
-           std::multimap<std::string, ElementCallbackFunc> _Callbacks;			 /* IQ callback funcs */
-           typedef std::list<std::pair<judo::XPath::Query*, ElementCallbackFunc> > XPQueryList;
+           struct IQCallback
+           {
+               ElementCallbackFunc func;
+               std::string label;
+               std::chrono::steady_clock::time_point sent;
+               LatencyHistogram* handlerTime;
+               LatencyHistogram* replyTime;
+           };
+           typedef std::multimap<std::string, IQCallback> IQCallbackMap;
+           IQCallbackMap _Callbacks;			 /* IQ callback funcs */
+           size_t _CallbackBytes;
+           static size_t callbackSize(const IQCallbackMap::value_type& cb);
+           struct XPHandler
+           {
+               judo::XPath::Matcher* query;
+               ElementCallbackFunc   func;
+               std::string           label;
+               LatencyHistogram*     timing;
+           };
+           typedef std::list<XPHandler> XPQueryList;
            struct queryFinder : 
                public std::unary_function<XPQueryList::value_type, bool>
            {
-               queryFinder(judo::XPath::Query* key) : _key(key) { }
-               bool operator()(const XPQueryList::value_type val) const
+               queryFinder(judo::XPath::Matcher* key) : _key(key) { }
+               bool operator()(const XPQueryList::value_type& val) const
                {
-                   return val.first == _key;
+                   return val.query == _key;
                }
-               judo::XPath::Query* _key;
+               judo::XPath::Matcher* _key;
            };
            XPQueryList _incoming_queries;
            XPQueryList _outgoing_queries;
+           // Bumped whenever _incoming_queries changes, which voids
+           // decisions made before
+           unsigned long _XPGeneration;
+           XPDecisionList _XPDecisions;
 	       // Internal roster & presence db structures
 	       Roster          _Roster;
            DiscoDB         _DDB;
@@ -0,0 +1,318 @@
+// sessionstats.hh
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifndef INCL_JABBEROO_SESSIONSTATS_HH
+#define INCL_JABBEROO_SESSIONSTATS_HH
+
+#include <jabberoofwd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <string.h>
+
+// The library counts through JABBEROO_STAT(), which leaves the
+// counting out altogether when it was configured with --disable-stats
+#ifdef JABBEROO_STATS
+#define JABBEROO_STAT(x) x
+#else
+#define JABBEROO_STAT(x)
+#endif
+
+namespace jabberoo {
+
+/**
+* A snapshot of what a Session or ComponentSession has done.
+* @see Session::getStats()
+* @see getProcessStats()
+*/
+EXPORT struct SessionStats
+{
+    /**
+    * The kinds of stanza which are counted apart.
+    */
+    enum StanzaType
+    {
+        stMessage,
+        stPresence,
+        stIQ,
+        stOther,
+        stCount
+    };
+
+    SessionStats();
+
+    /**
+    * Which kind of stanza an element or its XML is.
+    * @param xml The element's name, or XML starting with its start tag.
+    */
+    static StanzaType classify(const char* xml);
+
+    /**
+    * Add another snapshot's counts to this one.
+    */
+    SessionStats& operator+=(const SessionStats& s);
+
+    /**
+    * The counts as lines of "name value".
+    */
+    std::string toString() const;
+
+    /**
+    * The counts as a JSON object.
+    */
+    std::string toJSON() const;
+
+    bool enabled;  /**< False if the library was built without stats. */
+
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long stanzasIn[stCount];
+    unsigned long long stanzasOut[stCount];
+
+    unsigned long long parseNanos;     /**< Parsing, not counting dispatch. */
+    unsigned long long dispatchNanos;  /**< Running handlers for stanzas. */
+
+    unsigned long long xpathEvals;     /**< Queries checked against a stanza. */
+    unsigned long long xpathMatches;   /**< Queries whose callback was called. */
+
+    unsigned long long iqPending;      /**< Callbacks waiting for an answer. */
+    unsigned long long iqCompleted;
+    unsigned long long iqTimedOut;     /**< @see Session::expireIQ() */
+
+    unsigned long long rosterItems;
+    unsigned long long presenceJIDs;
+    unsigned long long discoItems;
+};
+
+/**
+* The live counters behind SessionStats.
+* Only the session's own thread writes them, so they are bumped with a
+* relaxed load and store rather than a locked add, and any thread may
+* take a snapshot.  Every SessionCounters adds itself to a process wide
+* list, so getProcessStats() can total them.
+*/
+EXPORT class SessionCounters
+{
+public:
+    typedef std::atomic<unsigned long long> Counter;
+
+    SessionCounters();
+    ~SessionCounters();
+
+    static void add(Counter& c, unsigned long long n = 1)
+    { c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+    static void set(Counter& c, unsigned long long n)
+    { c.store(n, std::memory_order_relaxed); }
+
+    static unsigned long long now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+    * Times a push into the parser, less the dispatching it did.
+    */
+    class ParseTimer
+    {
+    public:
+        ParseTimer(SessionCounters& c)
+            : _c(c), _dispatch(c.dispatchNanos.load(std::memory_order_relaxed)),
+              _start(now())
+        { }
+        ~ParseTimer()
+        {
+            add(_c.parseNanos, (now() - _start) -
+                (_c.dispatchNanos.load(std::memory_order_relaxed) - _dispatch));
+        }
+    private:
+        SessionCounters&   _c;
+        unsigned long long _dispatch;
+        unsigned long long _start;
+    };
+
+    /**
+    * Count a chunk of XML on its way out.
+    */
+    void transmitted(const char* xml, size_t size)
+    {
+        add(bytesOut, size);
+        if (xml[0] == '<' && xml[1] != '/' && xml[1] != '?' && strncmp(xml, "<stream:", 8) != 0)
+            add(stanzasOut[SessionStats::classify(xml + 1)]);
+    }
+
+    /**
+    * Copy the counts into a snapshot.
+    */
+    void snapshot(SessionStats& s) const;
+
+    Counter bytesIn;
+    Counter bytesOut;
+    Counter stanzasIn[SessionStats::stCount];
+    Counter stanzasOut[SessionStats::stCount];
+    Counter parseNanos;
+    Counter dispatchNanos;
+    Counter xpathEvals;
+    Counter xpathMatches;
+    Counter iqCompleted;
+    Counter iqTimedOut;
+
+    // Gauges, which aren't carried into the process totals once the
+    // session has gone
+    Counter iqPending;
+    Counter rosterItems;
+    Counter presenceJIDs;
+    Counter discoItems;
+
+private:
+    SessionCounters(const SessionCounters&);
+    SessionCounters& operator=(const SessionCounters&);
+};
+
+/**
+* A histogram of latencies in nanoseconds, bucketed by powers of two
+* which are each split into 16 linear buckets, so any value is
+* recorded to within about 6%.  Latencies from 1ns to about 18 minutes
+* fit; longer ones are counted as 18 minutes.  Like SessionCounters it
+* has a single writer and may be read from any thread.
+*/
+EXPORT class LatencyHistogram
+{
+public:
+    /**
+    * The figures usually wanted from a histogram, in nanoseconds.
+    */
+    struct Summary
+    {
+        unsigned long long count;
+        unsigned long long mean;
+        unsigned long long p50;
+        unsigned long long p99;
+        unsigned long long p999;
+        unsigned long long max;
+    };
+
+    LatencyHistogram();
+
+    /**
+    * Record one latency.
+    */
+    void record(unsigned long long nanos)
+    {
+        SessionCounters::add(_buckets[bucket(nanos)]);
+        SessionCounters::add(_count);
+        SessionCounters::add(_total, nanos);
+        if (nanos > _max.load(std::memory_order_relaxed))
+            SessionCounters::set(_max, nanos);
+    }
+
+    /**
+    * The latency which a fraction of those recorded are no greater
+    * than, give or take the width of its bucket.
+    * @param fraction Between 0 and 1, so 0.99 for the 99th percentile.
+    * @return The latency, or 0 if nothing has been recorded.
+    */
+    unsigned long long percentile(double fraction) const;
+
+    /**
+    * Get the count, mean, median, 99th and 99.9th percentiles and
+    * maximum.
+    */
+    Summary summarize() const;
+
+private:
+    enum
+    {
+        SUB_BITS      = 4,
+        SUB_COUNT     = 1 << SUB_BITS,
+        MAX_MAGNITUDE = 40,
+        BUCKETS       = SUB_COUNT + (MAX_MAGNITUDE - SUB_BITS + 1) * SUB_COUNT
+    };
+
+    static int bucket(unsigned long long v)
+    {
+        if (v < SUB_COUNT)
+            return v;
+        int m = magnitude(v);
+        if (m > MAX_MAGNITUDE)
+            return BUCKETS - 1;
+        return SUB_COUNT + (m - SUB_BITS) * SUB_COUNT +
+            ((v >> (m - SUB_BITS)) & (SUB_COUNT - 1));
+    }
+
+    static int magnitude(unsigned long long v)
+    {
+#ifdef __GNUC__
+        return 63 - __builtin_clzll(v);
+#else
+        int m = 0;
+        while (v >>= 1)
+            m++;
+        return m;
+#endif
+    }
+
+    // The largest value which falls in bucket i
+    static unsigned long long highest(int i);
+
+    SessionCounters::Counter _buckets[BUCKETS];
+    SessionCounters::Counter _count;
+    SessionCounters::Counter _total;
+    SessionCounters::Counter _max;
+
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator=(const LatencyHistogram&);
+};
+
+/**
+* Records the time from its construction to its destruction in a
+* histogram, if it is given one.
+*/
+EXPORT class LatencyTimer
+{
+public:
+    LatencyTimer(LatencyHistogram* h)
+        : _h(h), _start(h != NULL ? SessionCounters::now() : 0)
+    { }
+    ~LatencyTimer()
+    {
+        if (_h != NULL)
+            _h->record(SessionCounters::now() - _start);
+    }
+private:
+    LatencyHistogram*  _h;
+    unsigned long long _start;
+};
+
+/**
+* Total the counters of every session the process has had.
+* Sessions which have been destroyed still count, but their entry
+* counts and pending iqs don't.
+* @return The totals.
+*/
+EXPORT SessionStats getProcessStats();
+
+}; // namespace jabberoo
+
+#endif // INCL_JABBEROO_SESSIONSTATS_HH
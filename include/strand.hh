@@ -0,0 +1,226 @@
+// strand.hh
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifndef INCL_JABBEROO_STRAND_HH
+#define INCL_JABBEROO_STRAND_HH
+
+#include <jabberoofwd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jabberoo {
+
+/**
+* An unbounded multiple producer, single consumer queue.
+* Any thread may push() without taking a lock; only one thread at a
+* time may pop().  A push() which is still in progress may not be
+* visible to pop() yet, so a consumer which knows an item is coming
+* has to retry.
+*/
+template <class T>
+class MPSCQueue
+{
+public:
+    MPSCQueue()
+        : _head(new Node), _tail(_head.load())
+    { }
+
+    ~MPSCQueue()
+    {
+        T item;
+        while (pop(item))
+            ;
+        delete _tail;
+    }
+
+    /**
+    * Add an item to the back of the queue.
+    * @param item The item to add.
+    */
+    void push(T item)
+    {
+        Node* node = new Node;
+        node->item = std::move(item);
+        Node* prev = _head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+    * Take the item from the front of the queue.
+    * @param item Set to the item taken.
+    * @return false if no item was ready.
+    */
+    bool pop(T& item)
+    {
+        Node* next = _tail->next.load(std::memory_order_acquire);
+        if (next == NULL)
+            return false;
+
+        // next becomes the new empty front node
+        item = std::move(next->item);
+        delete _tail;
+        _tail = next;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        Node() : next(NULL) { }
+
+        std::atomic<Node*> next;
+        T                  item;
+    };
+
+    MPSCQueue(const MPSCQueue&);
+    MPSCQueue& operator=(const MPSCQueue&);
+
+    std::atomic<Node*> _head;
+    Node*              _tail;
+};
+
+class WorkerPool;
+
+/**
+* A serial queue of work on a WorkerPool.
+* Tasks posted to a Strand run one at a time and in the order they
+* were posted, but not on any particular thread.  Binding a Session
+* to a Strand therefore lets any worker parse and dispatch for it
+* without the Session, its Roster or its databases needing locks.
+*/
+EXPORT class Strand
+{
+public:
+    typedef std::function<void ()> Task;
+
+    /**
+    * Create a Strand which runs on pool.
+    * The pool must outlive the Strand.
+    */
+    Strand(WorkerPool& pool);
+
+    /**
+    * Destroy the Strand.
+    * Tasks which are still queued are dropped, so nothing may be
+    * posted or running when the Strand is destroyed.
+    */
+    ~Strand();
+
+    /**
+    * Queue a task to run on this strand.
+    * This is safe to call from any thread, including from a task.
+    * @param task The task to run.
+    */
+    void post(Task task);
+
+    /**
+    * Whether the calling thread is running a task of this strand.
+    */
+    bool isCurrent() const;
+
+    /**
+    * Get the pool the strand runs on.
+    */
+    WorkerPool& getPool() const
+    { return _pool; }
+
+private:
+    friend class WorkerPool;
+
+    Strand(const Strand&);
+    Strand& operator=(const Strand&);
+
+    void run();
+
+    WorkerPool&       _pool;
+    MPSCQueue<Task>   _tasks;
+    // Tasks posted but not yet run.  Whoever raises this from zero
+    // schedules the strand, so it is never queued twice.
+    std::atomic<int>  _pending;
+};
+
+/**
+* A fixed set of threads which run ready Strands.
+* Each worker keeps its own queue of ready strands and takes work
+* from the other workers' queues when its own runs dry.
+*/
+EXPORT class WorkerPool
+{
+public:
+    /**
+    * Start the workers.
+    * @param threads The number of workers, or 0 for one per core.
+    */
+    WorkerPool(unsigned threads = 0);
+
+    /**
+    * Run all the work already queued, then stop the workers.
+    */
+    ~WorkerPool();
+
+    /**
+    * The number of worker threads.
+    */
+    unsigned size() const
+    { return _workers.size(); }
+
+    /**
+    * Most tasks a worker runs from one strand before giving the
+    * other ready strands a turn.
+    */
+    static const int BATCH = 64;
+
+private:
+    friend class Strand;
+
+    struct Worker
+    {
+        std::mutex          lock;
+        std::deque<Strand*> ready;
+        std::thread         thread;
+    };
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    void schedule(Strand* strand);
+    Strand* next(unsigned index);
+    void run(unsigned index);
+
+    std::vector<std::unique_ptr<Worker> > _workers;
+    std::atomic<unsigned>   _next_worker;
+    std::atomic<int>        _ready;
+    std::atomic<int>        _sleeping;
+    std::atomic<bool>       _stopping;
+    std::mutex              _idle_lock;
+    std::condition_variable _idle;
+};
+
+}; // namespace jabberoo
+
+#endif // INCL_JABBEROO_STRAND_HH
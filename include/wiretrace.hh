@@ -0,0 +1,303 @@
+// wiretrace.hh
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifndef INCL_JABBEROO_WIRETRACE_HH
+#define INCL_JABBEROO_WIRETRACE_HH
+
+#include <jabberoofwd.h>
+#include <JID.hh>
+#include <XCP.hh>
+#include <recvring.hh>
+
+#include <sigc++/object.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+namespace jabberoo {
+
+class WireLog;
+
+/**
+* Records everything a Session sends and receives to a trace file.
+* Each chunk of XML is written as it passes evtRecvXML or
+* evtTransmitXML, framed with its direction, length and the time since
+* the previous chunk, so a trace can be replayed with its original
+* pacing.
+*
+* The file starts with the 8 bytes "JTRACE1\n".  Each record is then
+* one byte of direction (0 received, 1 transmitted), the microseconds
+* since the previous record and the length of the data as unsigned
+* LEB128 varints, and the data itself.
+*/
+EXPORT class WireTrace : public SigC::Object
+{
+public:
+    enum Direction
+    {
+        dirRecv,     /**< XML received from the server. */
+        dirTransmit  /**< XML sent to the server. */
+    };
+
+    /**
+    * A chunk of XML read back from a trace.
+    */
+    struct Record
+    {
+        Direction   dir;
+        long long   time;  /**< Microseconds since the trace started. */
+        std::string data;
+    };
+
+    /**
+    * Reads the records of a trace file in order.
+    */
+    class Reader
+    {
+    public:
+        /**
+        * Open a trace.
+        * @param filename The trace file.
+        * @exception XCP_BadTrace The file isn't a trace.
+        */
+        Reader(const std::string& filename);
+
+        /**
+        * Read the next record.
+        * @param r Set to the record.
+        * @return false at the end of the trace.
+        * @exception XCP_BadTrace The trace is cut short or corrupt.
+        */
+        bool next(Record& r);
+
+    private:
+        std::ifstream _in;
+        long long     _time;
+        long long     _size;  // Of the file, which no record can run past
+    };
+
+    class XCP_BadTrace : public XCP
+    {
+    public:
+        XCP_BadTrace(const char* msg) : XCP(msg) { }
+    };
+
+    /**
+    * Start recording a session.
+    * Recording stops when the WireTrace is destroyed.
+    * @param s The Session to record.
+    * @param filename The trace file, which is overwritten.
+    * @exception XCP_BadTrace The file can't be written.
+    */
+    WireTrace(Session& s, const std::string& filename);
+
+    /**
+    * Write out anything still buffered.
+    */
+    void flush();
+
+private:
+    void onRecv(const char* xml);
+    void onTransmit(const char* xml);
+    void write(Direction dir, const char* data, size_t datasz);
+
+    std::ofstream _out;
+    std::chrono::steady_clock::time_point _last;
+};
+
+/**
+* The capturing end of a WireLog, one for each Session attached to it.
+* Only the session's own thread captures into it, and only the
+* WireLog's flusher reads from it, so neither takes a lock.
+* @see WireLog::attach()
+*/
+EXPORT class WireTap
+{
+public:
+    /**
+    * Copy a chunk of XML into the ring with the time it was seen.
+    * If the ring is full the chunk is counted as dropped rather than
+    * waited for.
+    * @param dir Whether the chunk was received or sent.
+    * @param data The chunk, which need not be terminated.
+    * @param datasz Number of bytes in the chunk.
+    */
+    void capture(WireTrace::Direction dir, const char* data, size_t datasz);
+
+    /**
+    * Stop capturing for good.  The flusher writes out what is left and
+    * then deletes the tap, so it must not be used after this.
+    */
+    void close();
+
+private:
+    friend class WireLog;
+
+    WireTap(WireLog& log, Session& s, int capacity);
+    WireTap(const WireTap&);
+    WireTap& operator=(const WireTap&);
+
+    enum State
+    {
+        tsUndecided,  // Nothing captured yet
+        tsRecording,
+        tsIgnored     // Filtered or sampled out
+    };
+
+    // How each chunk is framed in the ring
+    struct Header
+    {
+        unsigned long long time;  // Nanoseconds, steady clock
+        unsigned int       size;
+        unsigned int       dir;
+    };
+
+    WireLog&          _log;
+    Session&          _session;
+    State             _state;
+    std::string       _filename;
+    RecvRing          _ring;
+    std::atomic<bool> _closed;
+
+    // The flusher's side
+    std::ofstream      _out;
+    bool               _have_header;
+    Header             _header;
+    unsigned long long _last;
+};
+
+/**
+* Records sessions to trace files in the background, cheaply enough to
+* leave on in production.  Each attached session copies what it sends
+* and receives into a ring of its own, which costs a memcpy; a flusher
+* thread writes the rings out every 50ms.  Unlike WireTrace, chunks
+* are taken with their lengths straight from Session::push() and
+* commit(), so they needn't be terminated.
+*
+* Each recorded session gets its own file in the WireTrace format,
+* named after its bare JID, which WireTrace::Reader and bench/replay
+* read.  A session can be left out by a JID filter or by sampling;
+* which is decided from its JID when it first sends or receives,
+* normally the stream header sent by Session::connect().
+*
+* Sessions must be detached or destroyed before their WireLog.
+*/
+EXPORT class WireLog
+{
+public:
+    /**
+    * Start the flusher.
+    * @param dir The directory to write the trace files into.
+    * @param capacity Bytes in each session's ring; chunks which don't
+    * fit before the flusher next runs are dropped.
+    */
+    WireLog(const std::string& dir, int capacity = 256 * 1024);
+
+    /**
+    * Write out what is left and stop the flusher.
+    */
+    ~WireLog();
+
+    /**
+    * Record only one in every n sessions which pass the JID filter.
+    * @param n 1, the default, to record them all.
+    */
+    void setSampling(unsigned n);
+
+    /**
+    * Record only sessions of the JIDs added here, rather than all of
+    * them.
+    * @param jid A bare JID, or a full one to match one resource.
+    */
+    void addJID(const std::string& jid);
+
+    /**
+    * Start recording a session, replacing any WireLog it had.
+    * @param s The Session, on its own thread.
+    */
+    void attach(Session& s);
+
+    /**
+    * Stop recording a session.
+    * @param s The Session, on its own thread.
+    */
+    void detach(Session& s);
+
+    /**
+    * Wait until everything captured so far is written out.
+    */
+    void flush();
+
+    /**
+    * The number of chunks dropped because a ring was full.
+    */
+    unsigned long long getDropped() const
+    { return _dropped.load(std::memory_order_relaxed); }
+
+    /**
+    * The number of sessions whose trace file couldn't be created.
+    * Nothing they capture is written anywhere.
+    */
+    unsigned long long getUnwritable() const
+    { return _unwritable.load(std::memory_order_relaxed); }
+
+private:
+    friend class WireTap;
+
+    WireLog(const WireLog&);
+    WireLog& operator=(const WireLog&);
+
+    // Whether to record the tap's session, naming its file if so
+    bool decide(WireTap& tap);
+
+    void run();
+    void drain(WireTap& tap);
+
+    std::string                          _dir;
+    int                                  _capacity;
+    unsigned                             _sampling;
+    unsigned long                        _candidates;
+    unsigned long                        _files;
+    std::set<std::string, JID::Compare>  _jids;
+    std::atomic<unsigned long long>      _dropped;
+    std::atomic<unsigned long long>      _unwritable;
+
+    // Taps are added by attach() and removed by the flusher once they
+    // are closed and drained; the lock also guards the pass counts
+    std::list<WireTap*>      _taps;
+    std::mutex               _lock;
+    std::condition_variable  _wakeup;
+    bool                     _stopping;
+    unsigned long            _passes;
+    unsigned long            _wanted;
+    std::thread              _flusher;
+};
+
+}; // namespace jabberoo
+
+#endif // INCL_JABBEROO_WIRETRACE_HH
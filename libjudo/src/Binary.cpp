@@ -0,0 +1,537 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      Binary.cpp
+// Description:   Compact binary form of Element trees
+//
+//   License:
+//
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//
+//============================================================================
+
+#include "Binary.h"
+
+#include <algorithm>
+#include <cstdint>
+
+using namespace judo;
+using namespace std;
+
+namespace
+{
+    const char MAGIC[4] = { 'J', 'B', 'X', '1' };
+    const char TAG_ELEMENT = 0x01;
+    const char TAG_TEXT = 0x02;
+
+    void putVarint(string& out, size_t v)
+    {
+	while (v >= 0x80)
+	{
+	    out += char((v & 0x7f) | 0x80);
+	    v >>= 7;
+	}
+	out += char(v);
+    }
+
+    void putU32(string& out, size_t pos, uint32_t v)
+    {
+	for (int i = 0; i < 4; i++)
+	    out[pos + i] = char((v >> (8 * i)) & 0xff);
+    }
+
+    bool lessText(const TextView& a, const TextView& b)
+    {
+	int c = memcmp(a.data, b.data, min(a.size, b.size));
+	return c < 0 || (c == 0 && a.size < b.size);
+    }
+
+    bool sameText(const TextView& a, const TextView& b)
+    {
+	return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+    }
+
+    uint32_t getU32(const char* p)
+    {
+	const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+	return uint32_t(u[0]) | (uint32_t(u[1]) << 8) |
+	    (uint32_t(u[2]) << 16) | (uint32_t(u[3]) << 24);
+    }
+
+    // Read a varint from a checked document
+    size_t getVarint(const char*& p)
+    {
+	size_t v = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+	    unsigned char c = *p++;
+	    v |= size_t(c & 0x7f) << shift;
+	    if ((c & 0x80) == 0)
+		return v;
+	}
+    }
+
+    // Read a varint of up to 32 bits, which must end before end
+    bool readVarint(const char*& p, const char* end, size_t& v)
+    {
+	v = 0;
+	for (int shift = 0; shift < 35 && p < end; shift += 7)
+	{
+	    unsigned char c = *p++;
+	    v |= size_t(c & 0x7f) << shift;
+	    if ((c & 0x80) == 0)
+		return v <= 0xffffffffUL;
+	}
+	return false;
+    }
+}
+
+BinaryEncoder::BinaryEncoder()
+    : _out(MAGIC, sizeof(MAGIC)), _in_start(false), _done(false)
+{
+    _out.append(4, '\0');
+}
+
+unsigned BinaryEncoder::intern(const string& name)
+{
+    pair<NameMap::iterator, bool> r = _ids.insert(make_pair(name, (unsigned) _names.size()));
+    if (r.second)
+	_names.push_back(&r.first->first);
+    return r.first->second;
+}
+
+// Write the attributes of the innermost element, now that no more
+// can be put
+void BinaryEncoder::flushStart()
+{
+    putVarint(_out, _attribs.size());
+    for (size_t i = 0; i < _attribs.size(); i++)
+    {
+	putVarint(_out, _attribs[i].first);
+	putVarint(_out, _attribs[i].second.size());
+	_out += _attribs[i].second;
+    }
+    _attribs.clear();
+    _in_start = false;
+}
+
+/**
+   Start an element, as the root or as a child of the element
+   being written.
+*/
+void BinaryEncoder::startElement(const string& name)
+{
+    assert(!_done);
+    if (_in_start)
+	flushStart();
+
+    _out += TAG_ELEMENT;
+    putVarint(_out, intern(name));
+    _open.push_back(_out.size());
+    _out.append(4, '\0');
+    _in_start = true;
+}
+
+/**
+   Put an attribute on the element just started, replacing any
+   with the same name.
+*/
+void BinaryEncoder::putAttrib(const string& name, const string& value)
+{
+    assert(_in_start);
+    unsigned id = intern(name);
+    for (size_t i = 0; i < _attribs.size(); i++)
+    {
+	if (_attribs[i].first == id)
+	{
+	    _attribs[i].second = value;
+	    return;
+	}
+    }
+    _attribs.push_back(make_pair(id, value));
+}
+
+/**
+   Add unescaped text to the element being written.
+*/
+void BinaryEncoder::addText(const char* data, size_t size)
+{
+    assert(!_open.empty());
+    if (_in_start)
+	flushStart();
+
+    _out += TAG_TEXT;
+    putVarint(_out, size);
+    _out.append(data, size);
+}
+
+void BinaryEncoder::endElement()
+{
+    assert(!_open.empty());
+    if (_in_start)
+	flushStart();
+
+    size_t pos = _open.back();
+    _open.pop_back();
+    putU32(_out, pos, uint32_t(_out.size() - (pos + 4)));
+    if (_open.empty())
+	_done = true;
+}
+
+void BinaryEncoder::encode(const Element& e)
+{
+    startElement(e.getName());
+    // Attributes come out of the map sorted and unique, so there is
+    // nothing for putAttrib() to check
+    for (Element::AttribMap::const_iterator it = e._attribs.begin(); it != e._attribs.end(); ++it)
+	_attribs.push_back(make_pair(intern(it->first), it->second));
+
+    for (Element::const_iterator it = e.begin(); it != e.end(); ++it)
+    {
+	if ((*it)->getType() == Node::ntElement)
+	    encode(*static_cast<const Element*>(*it));
+	else
+	    addText(static_cast<const CDATA*>(*it)->getText());
+    }
+    endElement();
+}
+
+string BinaryEncoder::finish()
+{
+    assert(_done);
+
+    putU32(_out, sizeof(MAGIC), uint32_t(_out.size()));
+    putVarint(_out, _names.size());
+    for (size_t i = 0; i < _names.size(); i++)
+    {
+	putVarint(_out, _names[i]->size());
+	_out += *_names[i];
+    }
+
+    string result;
+    result.swap(_out);
+    _out.assign(MAGIC, sizeof(MAGIC));
+    _out.append(4, '\0');
+    _names.clear();
+    _ids.clear();
+    _done = false;
+    return result;
+}
+
+/**
+   Encode an Element as a document of its own.
+*/
+string BinaryEncoder::encodeAtOnce(const Element& e)
+{
+    BinaryEncoder enc;
+    enc.encode(e);
+    return enc.finish();
+}
+
+BinaryDocument::BinaryDocument(const char* data, size_t size)
+    : _data(data), _size(size)
+{
+    typedef exception::FormatError FormatError;
+
+    if (size < HEADER_SIZE || memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+	throw FormatError("Not a binary document", 0);
+
+    size_t names = getU32(data + sizeof(MAGIC));
+    if (names < HEADER_SIZE || names > size)
+	throw FormatError("Name table offset out of range", sizeof(MAGIC));
+
+    // Read the name table
+    const char* end = data + size;
+    const char* p = data + names;
+    size_t count;
+    if (!readVarint(p, end, count))
+	throw FormatError("Truncated name table", p - data);
+    _names.reserve(min(count, size));
+    for (size_t i = 0; i < count; i++)
+    {
+	size_t len;
+	if (!readVarint(p, end, len) || len > size_t(end - p))
+	    throw FormatError("Truncated name table", p - data);
+	_names.push_back(TextView(p, len));
+	p += len;
+    }
+    if (p != end)
+	throw FormatError("Data after the name table", p - data);
+
+    // Each name is in the table once, so names with the same index
+    // are the same and names with different ones aren't
+    vector<TextView> sorted(_names);
+    sort(sorted.begin(), sorted.end(), lessText);
+    vector<TextView>::iterator dup = adjacent_find(sorted.begin(), sorted.end(), sameText);
+    if (dup != sorted.end())
+	throw FormatError("Name repeated in the name table", dup->data - data);
+
+    // Walk the tree, keeping the end of each open element so
+    // nothing overruns its parent
+    const char* limit = data + names;
+    vector<const char*> ends;
+    vector<size_t> seen;
+    p = data + HEADER_SIZE;
+    if (p == limit || *p != TAG_ELEMENT)
+	throw FormatError("Root is not an element", p - data);
+    do
+    {
+	if (!ends.empty() && p == ends.back())
+	{
+	    ends.pop_back();
+	    continue;
+	}
+	end = ends.empty() ? limit : ends.back();
+
+	size_t v;
+	const char* start = p++;
+	if (*start == TAG_ELEMENT)
+	{
+	    if (!readVarint(p, end, v) || v >= _names.size())
+		throw FormatError("Bad element name", start - data);
+	    if (end - p < 4 || getU32(p) > size_t(end - p - 4))
+		throw FormatError("Element overruns its parent", start - data);
+	    const char* content_end = p + 4 + getU32(p);
+	    p += 4;
+
+	    size_t attribs;
+	    if (!readVarint(p, content_end, attribs))
+		throw FormatError("Truncated attributes", start - data);
+	    seen.clear();
+	    for (size_t i = 0; i < attribs; i++)
+	    {
+		if (!readVarint(p, content_end, v) || v >= _names.size())
+		    throw FormatError("Bad attribute name", p - data);
+		seen.push_back(v);
+		if (!readVarint(p, content_end, v) || v > size_t(content_end - p))
+		    throw FormatError("Truncated attribute value", p - data);
+		p += v;
+	    }
+	    sort(seen.begin(), seen.end());
+	    if (adjacent_find(seen.begin(), seen.end()) != seen.end())
+		throw FormatError("Repeated attribute name", start - data);
+	    ends.push_back(content_end);
+	}
+	else if (*start == TAG_TEXT)
+	{
+	    if (!readVarint(p, end, v) || v > size_t(end - p))
+		throw FormatError("Text overruns its parent", start - data);
+	    p += v;
+	}
+	else
+	    throw FormatError("Unknown record", start - data);
+    } while (!ends.empty());
+
+    if (p != limit)
+	throw FormatError("Data after the root element", p - data);
+}
+
+/**
+   Decode a document into an Element.
+   @returns The root Element, which the caller owns
+   @exception exception::FormatError The data is not a valid document
+*/
+Element* BinaryDocument::decodeAtOnce(const char* data, size_t size)
+{
+    BinaryDocument doc(data, size);
+    return doc.getRoot().toElement();
+}
+
+void BinaryNode::AttribIterator::read()
+{
+    if (_left == 0)
+	return;
+    _cur.name = _doc->_names[getVarint(_p)];
+    size_t len = getVarint(_p);
+    _cur.value = TextView(_p, len);
+    _p += len;
+}
+
+Node::Type BinaryNode::getType() const
+{
+    return (*_p == TAG_ELEMENT) ? Node::ntElement : Node::ntCDATA;
+}
+
+TextView BinaryNode::getName() const
+{
+    if (*_p != TAG_ELEMENT)
+	return TextView("#CDATA", 6);
+    const char* p = _p + 1;
+    return _doc->_names[getVarint(p)];
+}
+
+TextView BinaryNode::getText() const
+{
+    if (*_p != TAG_TEXT)
+	return TextView();
+    const char* p = _p + 1;
+    size_t len = getVarint(p);
+    return TextView(p, len);
+}
+
+const char* BinaryNode::content(const char*& end) const
+{
+    const char* p = _p + 1;
+    getVarint(p);
+    end = p + 4 + getU32(p);
+    return p + 4;
+}
+
+const char* BinaryNode::next() const
+{
+    const char* end;
+    if (*_p == TAG_ELEMENT)
+	content(end);
+    else
+    {
+	TextView text = getText();
+	end = text.data + text.size;
+    }
+    return end;
+}
+
+BinaryNode::AttribIterator BinaryNode::attribBegin() const
+{
+    if (*_p != TAG_ELEMENT)
+	return AttribIterator();
+    const char* end;
+    const char* p = content(end);
+    size_t count = getVarint(p);
+    return AttribIterator(_doc, p, count);
+}
+
+bool BinaryNode::findAttrib(const string& name, TextView& value) const
+{
+    for (AttribIterator it = attribBegin(); it != attribEnd(); ++it)
+    {
+	if (it->name == name)
+	{
+	    value = it->value;
+	    return true;
+	}
+    }
+    return false;
+}
+
+string BinaryNode::getAttrib(const string& name) const
+{
+    TextView value;
+    if (findAttrib(name, value))
+	return value.str();
+    return "";
+}
+
+BinaryNode::iterator BinaryNode::begin() const
+{
+    if (*_p != TAG_ELEMENT)
+	return iterator();
+    const char* end;
+    const char* p = content(end);
+    for (size_t count = getVarint(p); count > 0; count--)
+    {
+	getVarint(p);
+	p += getVarint(p);
+    }
+    return iterator(_doc, p);
+}
+
+BinaryNode::iterator BinaryNode::end() const
+{
+    if (*_p != TAG_ELEMENT)
+	return iterator();
+    const char* end;
+    content(end);
+    return iterator(_doc, end);
+}
+
+BinaryNode BinaryNode::findElement(const string& name) const
+{
+    for (iterator it = begin(); it != end(); ++it)
+    {
+	BinaryNode child = *it;
+	if (child.getType() == Node::ntElement && child.getName() == name)
+	    return child;
+    }
+    return BinaryNode();
+}
+
+string BinaryNode::getCDATA() const
+{
+    for (iterator it = begin(); it != end(); ++it)
+    {
+	if ((*it).getType() == Node::ntCDATA)
+	    return (*it).getText().str();
+    }
+    return string();
+}
+
+Element* BinaryNode::toElement() const
+{
+    assert(getType() == Node::ntElement);
+    Element* e = new Element(getName().str());
+    fill(e);
+    return e;
+}
+
+// Helper for toElement
+void BinaryNode::fill(Element* e) const
+{
+    for (AttribIterator it = attribBegin(); it != attribEnd(); ++it)
+	e->putAttrib(it->name.str(), it->value.str());
+    for (iterator it = begin(); it != end(); ++it)
+    {
+	BinaryNode child = *it;
+	if (child.getType() == Node::ntElement)
+	    child.fill(e->addElement(child.getName().str()));
+	else
+	    e->addCDATA(child.getText().str());
+    }
+}
+
+string BinaryNode::toString() const
+{
+    string result;
+    accumulate(result);
+    return result;
+}
+
+// Helper for toString
+void BinaryNode::accumulate(string& out) const
+{
+    if (*_p != TAG_ELEMENT)
+    {
+	out += escape(getText().str());
+	return;
+    }
+
+    TextView name = getName();
+    out += '<';
+    out.append(name.data, name.size);
+    for (AttribIterator it = attribBegin(); it != attribEnd(); ++it)
+    {
+	out += ' ';
+	out.append(it->name.data, it->name.size);
+	out += "='" + escape(it->value.str()) + "'";
+    }
+
+    iterator it = begin();
+    if (it == end())
+    {
+	out += "/>";
+	return;
+    }
+    out += '>';
+    for (; it != end(); ++it)
+	(*it).accumulate(out);
+    out += "</";
+    out.append(name.data, name.size);
+    out += '>';
+}
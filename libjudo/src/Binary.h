@@ -0,0 +1,337 @@
+#ifndef INCL_JUDO_BINARY_H
+#define INCL_JUDO_BINARY_H
+
+#include "judo.hpp"
+
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace judo
+{
+    /*
+      A compact binary form of an Element tree, for keeping or
+      handing over stanzas without writing and parsing XML:
+
+        "JBX1" u32(name table offset) element
+
+        element    = 0x01 varint(name) u32(content length)
+                     varint(attribute count)
+                     { varint(name) varint(length) bytes }
+                     { element | text }
+        text       = 0x02 varint(length) bytes
+        name table = varint(count) { varint(length) bytes }
+
+      Names of elements and attributes are written once, in the
+      table at the end, and referred to by their index in it. Text
+      and attribute values are unescaped. The u32s are little
+      endian, and varints are LEB128. The name table runs to the
+      end of the buffer.
+    */
+
+    /**
+       Read-only text within a buffer; it is not NUL terminated.
+    */
+    struct TextView
+    {
+	const char* data;
+	std::size_t size;
+
+	TextView()
+	    : data(NULL), size(0) {}
+	TextView(const char* d, std::size_t s)
+	    : data(d), size(s) {}
+
+	std::string str() const
+	    { return std::string(data, size); }
+	bool operator==(const std::string& s) const
+	    { return s.size() == size && s.compare(0, size, data, size) == 0; }
+	bool operator!=(const std::string& s) const
+	    { return !(*this == s); }
+    };
+
+    /**
+       Writes the binary form a piece at a time, so a tree can be
+       encoded without being built, such as from SAX events.
+       Attributes must be put before the element's first child.
+       @see BinaryDocument
+    */
+    class BinaryEncoder
+    {
+    public:
+	BinaryEncoder();
+
+	void startElement(const std::string& name);
+	void putAttrib(const std::string& name, const std::string& value);
+	void addText(const char* data, std::size_t size);
+	void addText(const std::string& text)
+	    { addText(text.data(), text.size()); }
+	void endElement();
+
+	/**
+	   Encode a whole Element, as the root or as a child of the
+	   element being written.
+	*/
+	void encode(const Element& e);
+
+	/**
+	   Finish the document, whose root must have been ended.
+	   @returns The encoded document; the encoder is left empty,
+	   ready for the next
+	*/
+	std::string finish();
+
+	static std::string encodeAtOnce(const Element& e);
+
+    private:
+	BinaryEncoder(const BinaryEncoder&);
+	BinaryEncoder& operator=(const BinaryEncoder&);
+
+	typedef std::map<std::string, unsigned> NameMap;
+
+	std::string          _out;
+	NameMap              _ids;
+	std::vector<const std::string*> _names;
+	// Where the content length of each open element goes
+	std::vector<std::size_t> _open;
+	// Attributes of the innermost element, held until we know
+	// how many it has
+	std::vector<std::pair<unsigned, std::string> > _attribs;
+	bool                 _in_start;
+	bool                 _done;
+
+	unsigned intern(const std::string& name);
+	void     flushStart();
+    };
+
+    class BinaryDocument;
+
+    /**
+       A read-only view of an element or text in a BinaryDocument.
+       It is only valid while the document's buffer is.
+    */
+    class BinaryNode
+    {
+    public:
+	struct Attrib
+	{
+	    TextView name;
+	    TextView value;
+	};
+
+	/**
+	   Iterates over the attributes of an element.
+	*/
+	class AttribIterator
+	{
+	public:
+	    typedef std::forward_iterator_tag iterator_category;
+	    typedef Attrib         value_type;
+	    typedef std::ptrdiff_t difference_type;
+	    typedef const Attrib*  pointer;
+	    typedef const Attrib&  reference;
+
+	    AttribIterator()
+		: _doc(NULL), _p(NULL), _left(0) {}
+
+	    const Attrib& operator*() const
+		{ return _cur; }
+	    const Attrib* operator->() const
+		{ return &_cur; }
+	    AttribIterator& operator++()
+		{ _left--; read(); return *this; }
+	    AttribIterator operator++(int)
+		{ AttribIterator old = *this; ++(*this); return old; }
+	    bool operator==(const AttribIterator& it) const
+		{ return _left == it._left; }
+	    bool operator!=(const AttribIterator& it) const
+		{ return _left != it._left; }
+
+	private:
+	    friend class BinaryNode;
+
+	    AttribIterator(const BinaryDocument* doc, const char* p, std::size_t left)
+		: _doc(doc), _p(p), _left(left) { read(); }
+	    void read();
+
+	    const BinaryDocument* _doc;
+	    const char*           _p;
+	    std::size_t           _left;
+	    Attrib                _cur;
+	};
+
+	/**
+	   Iterates over the children of an element.
+	*/
+	class iterator
+	{
+	public:
+	    typedef std::forward_iterator_tag iterator_category;
+	    typedef BinaryNode     value_type;
+	    typedef std::ptrdiff_t difference_type;
+	    typedef const BinaryNode* pointer;
+	    typedef BinaryNode     reference;
+
+	    iterator()
+		: _doc(NULL), _p(NULL) {}
+
+	    BinaryNode operator*() const
+		{ return BinaryNode(_doc, _p); }
+	    iterator& operator++()
+		{ _p = BinaryNode(_doc, _p).next(); return *this; }
+	    iterator operator++(int)
+		{ iterator old = *this; ++(*this); return old; }
+	    bool operator==(const iterator& it) const
+		{ return _p == it._p; }
+	    bool operator!=(const iterator& it) const
+		{ return _p != it._p; }
+
+	private:
+	    friend class BinaryNode;
+
+	    iterator(const BinaryDocument* doc, const char* p)
+		: _doc(doc), _p(p) {}
+
+	    const BinaryDocument* _doc;
+	    const char*           _p;
+	};
+
+	/**
+	   Make a null node, as findElement() returns when there is no
+	   match.
+	*/
+	BinaryNode()
+	    : _doc(NULL), _p(NULL) {}
+
+	explicit operator bool() const
+	    { return _p != NULL; }
+
+	Node::Type getType() const;
+
+	/**
+	   Get the name of an element, or "#CDATA" for text.
+	*/
+	TextView getName() const;
+
+	/**
+	   Get the unescaped text of a text node; an element has none.
+	*/
+	TextView getText() const;
+
+	AttribIterator attribBegin() const;
+	AttribIterator attribEnd() const
+	    { return AttribIterator(); }
+
+	/**
+	   Look up an attribute of an element.
+	   @param value Set to the value, if there is one
+	   @returns True if the element has the attribute
+	*/
+	bool findAttrib(const std::string& name, TextView& value) const;
+	std::string getAttrib(const std::string& name) const;
+
+	iterator begin() const;
+	iterator end() const;
+
+	/**
+	   Get the first child element with a name.
+	   @returns The element, or a null node if there is none
+	*/
+	BinaryNode findElement(const std::string& name) const;
+
+	/**
+	   Get the text of an element's first text child, or nothing
+	   if it has none.
+	   @see Element::getCDATA
+	*/
+	std::string getCDATA() const;
+
+	/**
+	   Build an Element from an element.
+	   @returns The new Element, which the caller owns
+	*/
+	Element* toElement() const;
+
+	/**
+	   Get the XML of this node, as Node::toString would give for
+	   the tree it was encoded from.
+	*/
+	std::string toString() const;
+
+    private:
+	friend class BinaryDocument;
+
+	BinaryNode(const BinaryDocument* doc, const char* p)
+	    : _doc(doc), _p(p) {}
+
+	// The start of the content of an element, and its end
+	const char* content(const char*& end) const;
+	// The record after this one
+	const char* next() const;
+
+	void accumulate(std::string& out) const;
+	void fill(Element* e) const;
+
+	const BinaryDocument* _doc;
+	const char*           _p;
+    };
+
+    /**
+       Reads the binary form in place: the views it gives out point
+       into the buffer, which may be a mapped file. The buffer is
+       checked through when the document is made, so a bad one
+       throws then, rather than when it is read.
+       @see BinaryEncoder
+    */
+    class BinaryDocument
+    {
+    public:
+	/**
+	   @param data The encoded document, which must outlive this
+	   and every view of it
+	   @param size The size of the document
+	   @exception exception::FormatError The data is not a valid
+	   document, or an element has an attribute twice
+	*/
+	BinaryDocument(const char* data, std::size_t size);
+
+	BinaryNode getRoot() const
+	    { return BinaryNode(this, _data + HEADER_SIZE); }
+
+	static Element* decodeAtOnce(const char* data, std::size_t size);
+
+	struct exception
+	{
+	    class FormatError
+	    {
+	    public:
+		FormatError(const std::string& message, std::size_t offset)
+		    : _message(message), _offset(offset)
+		    {}
+		const std::string& getMessage() const
+		    { return _message; }
+		/**
+		   Get where in the buffer the problem was found.
+		*/
+		std::size_t getOffset() const
+		    { return _offset; }
+	    private:
+		std::string _message;
+		std::size_t _offset;
+	    };
+	};
+
+	static const std::size_t HEADER_SIZE = 8;
+
+    private:
+	friend class BinaryNode;
+
+	const char*           _data;
+	std::size_t           _size;
+	std::vector<TextView> _names;
+    };
+}
+
+#endif // INCL_JUDO_BINARY_H
@@ -27,6 +27,9 @@
 //============================================================================
 
 #include "judo.hpp"
+
+#include <cstdint>
+#include <mutex>
 using namespace judo;
 using namespace std;
 
@@ -49,19 +52,95 @@ private:
     Element& _parent;
 };
 
+// Each Node is preceded by the resource it was allocated from and
+// the size asked for, in a header which keeps the Node itself aligned
+struct NodeHeader
+{
+    MemoryResource* resource;
+    size_t          size;
+};
+static const size_t NODE_HEADER =
+    (sizeof(NodeHeader) + alignof(std::max_align_t) - 1)
+    / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+void* Node::operator new(size_t size)
+{
+    MemoryResource* r = getDefaultResource();
+    char* p = static_cast<char*>(r->allocate(size + NODE_HEADER));
+    NodeHeader* h = reinterpret_cast<NodeHeader*>(p);
+    h->resource = r;
+    h->size = size;
+    return p + NODE_HEADER;
+}
+
+void Node::operator delete(void* p, size_t)
+{
+    if (p == NULL)
+	return;
+    char* base = static_cast<char*>(p) - NODE_HEADER;
+    NodeHeader* h = reinterpret_cast<NodeHeader*>(base);
+    h->resource->deallocate(base, h->size + NODE_HEADER);
+}
+
+void* Node::operator new(size_t size, const nothrow_t&) noexcept
+{
+    try
+    {
+	return operator new(size);
+    }
+    catch (bad_alloc&)
+    {
+	return NULL;
+    }
+}
+
+// Only called when a constructor throws after the nothrow new above
+void Node::operator delete(void* p, const nothrow_t&) noexcept
+{
+    operator delete(p, size_t(0));
+}
+
+// Threads reading a shared Element may build its lazy children or
+// its child index at the same time; they take turns on one of these
+// locks, picked by the Element's address
+static const size_t BUILD_LOCKS = 64;
+static mutex G_build_locks[BUILD_LOCKS];
+
+static mutex& buildLock(const Element* e)
+{
+    return G_build_locks[(reinterpret_cast<uintptr_t>(e) / sizeof(Element)) % BUILD_LOCKS];
+}
+
+// First-match lookup tables; see Element::index()
+struct Element::ChildIndex
+{
+    map<string, Element*> names;
+    map<string, Element*> xmlns;
+
+    void add(Element* e)
+	{
+	    // insert() keeps the existing entry, so the first child wins
+	    names.insert(make_pair(e->getName(), e));
+	    AttribMap::const_iterator it = e->_attribs.find("xmlns");
+	    if (it != e->_attribs.end())
+		xmlns.insert(make_pair(it->second, e));
+	}
+};
+
 /**
    Default constructor
    @param name Name of this tag
    @param attribs Expat-style attributes of this element
 */
 Element::Element(const string& name, const char** attribs)
-    : Node(name, Node::ntElement)
+    : Node(name, Node::ntElement),
+      _first(NULL), _last(NULL), _count(0), _index(NULL), _lazy(NULL)
 {
     // Process expat attribs
     if (attribs != NULL)
     {
 	int i = 0;
-	while (attribs[i] != '\0')
+	while (attribs[i] != NULL)
 	{
 	    _attribs.insert(make_pair(string(attribs[i]), string(attribs[i+1])));
 	    i += 2;
@@ -72,19 +151,31 @@ Element::Element(const string& name, const char** attribs)
 // Copy constructor
 Element::Element(const Element& e)
     : Node(e.getName(), Node::ntElement),
-      _attribs(e._attribs)
+      _first(NULL), _last(NULL), _count(0),
+      _attribs(e._attribs), _index(NULL), _lazy(NULL)
 {
-    for_each(e._children.begin(), e._children.end(), P_NodeCopier(*this));
+    // Unparsed content is copied as is
+    string* lazy = e.copyLazy();
+    if (lazy != NULL)
+	_lazy = lazy;
+    else
+	for_each(e.begin(), e.end(), P_NodeCopier(*this));
 }
 
-static void _releaseChild(Node* n)
+// Move constructor; takes over the children and attributes of e,
+// leaving it an empty element
+Element::Element(Element&& e)
+    : Node(std::string(), Node::ntElement),
+      _first(NULL), _last(NULL), _count(0), _index(NULL), _lazy(NULL)
 {
-    delete n;
+    _name.swap(e._name);
+    _attribs.swap(e._attribs);
+    takeChildren(e);
 }
 
 Element::~Element()
 {
-    for_each(_children.begin(), _children.end(), _releaseChild);
+    releaseChildren();
 }
 
 Element& Element::operator=(const Element& e)
@@ -94,25 +185,198 @@ Element& Element::operator=(const Element& e)
 	  return *this;
     // Copy underlying members
     Node::operator=(e);
+    attribChanged("xmlns");
 
     // Release pre-existing children/attribs if necessary
-    if (!_children.empty()) {
-	 // Release child nodes
-	 for_each(_children.begin(), _children.end(), _releaseChild);
-	 _children.clear();
-    }
+    releaseChildren();
     if (!_attribs.empty()) 
 	 _attribs.clear();
      // Copy children/attribs from t
-     if (!e._children.empty())
+     string* lazy = e.copyLazy();
+     if (lazy != NULL)
+	  _lazy = lazy;
+     else if (!e.empty())
 	  // Copy each individual element in t._Children
-	  for_each(e._children.begin(), e._children.end(), P_NodeCopier(*this));
+	  for_each(e.begin(), e.end(), P_NodeCopier(*this));
      if (!e._attribs.empty())
 	  _attribs = e._attribs;
 
      return *this;
 }
 
+Element& Element::operator=(Element&& e)
+{
+    if (this == &e)
+	return *this;
+
+    releaseChildren();
+    _attribs.clear();
+
+    _name.swap(e._name);
+    _attribs.swap(e._attribs);
+    takeChildren(e);
+    attribChanged("xmlns");
+
+    return *this;
+}
+
+// Link a child in at the end of the sibling chain
+void Element::link(Node* child)
+{
+    assert(child->_parent == NULL);
+    materialize();
+
+    child->_parent = this;
+    child->_prev = _last;
+    child->_next = NULL;
+    if (_last != NULL)
+	_last->_next = child;
+    else
+	_first = child;
+    _last = child;
+    _count++;
+
+    // Appending can't change an earlier first match, so the index
+    // only needs the new child added
+    ChildIndex* index = _index.load(memory_order_relaxed);
+    if (index != NULL && child->getType() == Node::ntElement)
+	index->add(static_cast<Element*>(child));
+}
+
+// Unlink a child from the sibling chain
+void Element::unlink(Node* child)
+{
+    assert(child->_parent == this);
+
+    if (child->_prev != NULL)
+	child->_prev->_next = child->_next;
+    else
+	_first = child->_next;
+    if (child->_next != NULL)
+	child->_next->_prev = child->_prev;
+    else
+	_last = child->_prev;
+    child->_parent = NULL;
+    child->_prev = child->_next = NULL;
+    _count--;
+
+    dropIndex();
+}
+
+// Take over the children of e (used when moving)
+void Element::takeChildren(Element& e)
+{
+    _first = e._first;
+    _last = e._last;
+    _count = e._count;
+    _index.store(e._index.load(memory_order_relaxed), memory_order_relaxed);
+    for (Node* n = _first; n != NULL; n = n->_next)
+	n->_parent = this;
+    // Last, so readers who see no unparsed content see the children
+    _lazy.store(e._lazy.load(memory_order_relaxed), memory_order_release);
+
+    e._first = e._last = NULL;
+    e._count = 0;
+    e._index = NULL;
+    e._lazy = NULL;
+}
+
+// Delete all children
+void Element::releaseChildren()
+{
+    Node* n = _first;
+    while (n != NULL)
+    {
+	Node* next = n->_next;
+	delete n;
+	n = next;
+    }
+    _first = _last = NULL;
+    _count = 0;
+    dropIndex();
+    delete _lazy.exchange(NULL);
+}
+
+void Element::clear()
+{
+    // Unparsed content has no nodes anyone could hold on to
+    delete _lazy.exchange(NULL);
+    while (_first != NULL)
+	unlink(_first);
+}
+
+/**
+   Build the child lookup index if needed.
+   @returns The name and xmlns lookup tables for this element
+*/
+const Element::ChildIndex& Element::index() const
+{
+    ChildIndex* index = _index.load(memory_order_acquire);
+    if (index != NULL)
+	return *index;
+
+    lock_guard<mutex> guard(buildLock(this));
+    index = _index.load(memory_order_relaxed);
+    if (index == NULL)
+    {
+	index = new ChildIndex();
+	for (Node* n = _first; n != NULL; n = n->_next)
+	{
+	    if (n->getType() == Node::ntElement)
+		index->add(static_cast<Element*>(n));
+	}
+	_index.store(index, memory_order_release);
+    }
+    return *index;
+}
+
+void Element::dropIndex() const
+{
+    delete _index.exchange(NULL, memory_order_relaxed);
+}
+
+// Parse the content captured by a lazy ElementStream into child
+// nodes. The stream already checked that it is well-formed, and kept
+// it in a form which parses on its own; the content is only let go
+// once the children are in, so a failure leaves us as we were.
+void Element::buildLazy() const
+{
+    lock_guard<mutex> guard(buildLock(this));
+    // Another reader may have built them while we waited
+    const string* content = _lazy.load(memory_order_relaxed);
+    if (content == NULL)
+	return;
+
+    string doc = "<" + getName() + ">";
+    doc += *content;
+    doc += "</" + getName() + ">";
+    unique_ptr<Element> e(ElementStream::parseAtOnce(doc.c_str()));
+
+    Element* self = const_cast<Element*>(this);
+    dropIndex();
+    self->takeChildren(*e);
+    delete content;
+}
+
+// Copy the unparsed content, or return NULL if the children have
+// been built; another thread may be building them as we look
+string* Element::copyLazy() const
+{
+    if (_lazy.load(memory_order_acquire) == NULL)
+	return NULL;
+    lock_guard<mutex> guard(buildLock(this));
+    string* lazy = _lazy.load(memory_order_relaxed);
+    return (lazy != NULL) ? new string(*lazy) : NULL;
+}
+
+// Our parent indexes us by name and xmlns, so let it know when the
+// latter changes
+void Element::attribChanged(const string& name)
+{
+    if (_parent != NULL && _parent->_index.load(memory_order_relaxed) != NULL && name == "xmlns")
+	_parent->dropIndex();
+}
+
 /**
    Add a new child element to "this" element.
    @param name Name of child element
@@ -122,7 +386,7 @@ Element& Element::operator=(const Element& e)
 Element* Element::addElement(const string& name, const char** attribs)
 {
     Element* result = new Element(name, attribs);
-    _children.push_back(result);
+    link(result);
     return result;
 }
 
@@ -142,6 +406,37 @@ Element* Element::addElement(const string& name, const string& value, bool escap
 }
 
 
+/**
+   Add a new child element with a solitary section of unescaped
+   character data, moving the name and data into the new nodes
+   rather than copying them.
+   @param name Name of child element
+   @param value Character data which will be stored in new
+   child element
+   @returns Pointer to the new child element
+*/
+Element* Element::addElement(string&& name, string&& value)
+{
+    Element* result = new Element(string());
+    result->_name.swap(name);
+    link(result);
+    result->addCDATA(std::move(value));
+    return result;
+}
+
+/**
+   Add an existing element as a child of "this" element. The
+   subtree of e is moved into the new child, so no copy is made.
+   @param e Element to move in
+   @returns Pointer to the new child element
+*/
+Element* Element::addElement(Element&& e)
+{
+    Element* result = new Element(std::move(e));
+    link(result);
+    return result;
+}
+
 /**
    Add character data to "this" element. This automatically
    merges adjacent sections of CDATA (if the parser splits
@@ -153,21 +448,44 @@ Element* Element::addElement(const string& name, const string& value, bool escap
 */
 CDATA* Element::addCDATA(const char* data, int datasz, bool escaped)
 {
+    materialize();
     CDATA *result;
-    if (!_children.empty() && _children.back()->getType() == Node::ntCDATA)
+    if (_last != NULL && _last->getType() == Node::ntCDATA)
     {
-	result = static_cast<CDATA*>(_children.back());
+	result = static_cast<CDATA*>(_last);
 	result->appendText(data, datasz, escaped);
     }
     else
     {
 	result = new CDATA(data, datasz, escaped);
-	_children.push_back(result);
+	link(result);
     }
     return result;
 }
 
 
+/**
+   Add unescaped character data to "this" element, taking over the
+   string's buffer when it starts a new CDATA node. Adjacent
+   sections of CDATA are merged as with the other addCDATA.
+   @param data Character data to add
+   @returns Pointer to the object which holds the data
+*/
+CDATA* Element::addCDATA(string&& data)
+{
+    materialize();
+    if (_last != NULL && _last->getType() == Node::ntCDATA)
+    {
+	CDATA* result = static_cast<CDATA*>(_last);
+	result->appendText(data.c_str(), data.size());
+	return result;
+    }
+
+    CDATA* result = new CDATA(std::move(data));
+    link(result);
+    return result;
+}
+
 bool Element::hasAttrib(const std::string& name) const
 {
     return _attribs.count(name) > 0;
@@ -181,6 +499,23 @@ bool Element::hasAttrib(const std::string& name) const
 void Element::putAttrib(const string& name, const string& value)
 {
     _attribs[name] = value;
+    attribChanged(name);
+}
+
+/**
+   Store an attribute (key/value pair) on this element, moving the
+   strings in instead of copying them.
+   @param name Attribute name/key
+   @value value Attribute value
+*/
+void Element::putAttrib(string&& name, string&& value)
+{
+    attribChanged(name);
+    AttribMap::iterator it = _attribs.lower_bound(name);
+    if (it != _attribs.end() && it->first == name)
+	it->second = std::move(value);
+    else
+	_attribs.insert(it, make_pair(std::move(name), std::move(value)));
 }
 
 /**
@@ -190,13 +525,25 @@ void Element::putAttrib(const string& name, const string& value)
 */
 string Element::getAttrib(const string& name) const
 {
-    map<string,string>::const_iterator it = _attribs.find(name);
+    AttribMap::const_iterator it = _attribs.find(name);
     if (it != _attribs.end())
 	return it->second;
     else
 	return "";
 }
 
+/**
+   Look up an attribute value without copying it.
+   @param name Attribute name/key to retrieve
+   @returns Pointer to the value of the attribute, or NULL if it is
+   not set. Changing the attributes invalidates it.
+*/
+const string* Element::findAttrib(const string& name) const
+{
+    AttribMap::const_iterator it = _attribs.find(name);
+    return (it != _attribs.end()) ? &it->second : NULL;
+}
+
 /**
    Delete an attribute key/value
    @param name Attribute name/key to delete
@@ -204,6 +551,7 @@ string Element::getAttrib(const string& name) const
 void Element::delAttrib(const string& name)
 {
     _attribs.erase(name);
+    attribChanged(name);
 }
 
 /**
@@ -215,7 +563,7 @@ void Element::delAttrib(const string& name)
 */
 bool Element::cmpAttrib(const string& name, const string& value) const
 {
-    map<string, string>::const_iterator it = _attribs.find(name);
+    AttribMap::const_iterator it = _attribs.find(name);
     if (it != _attribs.end())
 	return it->second == value;
     else
@@ -256,10 +604,10 @@ string Element::toStringEx(bool recursive, bool closetag) const
     acc << "<" << getName();
     for_each(_attribs.begin(), _attribs.end(), acc);
 
-    if (recursive && !_children.empty())
+    if (recursive && !empty())
     {
 	acc << ">";
-	for_each(_children.begin(), _children.end(), acc);
+	for_each(begin(), end(), acc);
 	if (closetag)
 	    acc << "</" << getName() << ">";
     }
@@ -273,6 +621,66 @@ string Element::toStringEx(bool recursive, bool closetag) const
     return result;
 }
 
+/**
+   Serialize this Element without parsing content which has not
+   been materialized yet; that content is copied from the input
+   as is. The result is equivalent XML to toString(), though not
+   necessarily identical text, and costs time in proportion to the
+   parts of the tree which have been built, not to its size.
+   @param attribs Attributes to write on this Element in place of
+   its own, or NULL
+   @see ElementStream::setLazyDepth
+*/
+string Element::toStringRaw(const map<string,string>* attribs) const
+{
+    string result;
+    XMLAccumulator acc(result);
+
+    accumulateRaw(acc, attribs);
+
+    return result;
+}
+
+// Helper for toStringRaw
+void Element::accumulateRaw(XMLAccumulator& acc, const map<string,string>* attribs) const
+{
+    acc << "<" << getName();
+    if (attribs != NULL)
+	for_each(attribs->begin(), attribs->end(), acc);
+    else
+	for_each(_attribs.begin(), _attribs.end(), acc);
+    if (_lazy.load(memory_order_acquire) != NULL)
+    {
+	// Unless another reader built the children while we waited
+	lock_guard<mutex> guard(buildLock(this));
+	const string* lazy = _lazy.load(memory_order_relaxed);
+	if (lazy != NULL)
+	{
+	    acc << ">" << *lazy << "</" << getName() << ">";
+	    return;
+	}
+    }
+    if (_first != NULL)
+    {
+	acc << ">";
+	for (const Node* n = _first; n != NULL; n = n->_next)
+	{
+	    if (n->getType() == Node::ntElement)
+	    {
+		const Element* e = static_cast<const Element*>(n);
+		e->accumulateRaw(acc, NULL);
+	    }
+	    else
+		n->accumulate(acc);
+	}
+	acc << "</" << getName() << ">";
+    }
+    else
+    {
+	acc << "/>";
+    }
+}
+
 /** 
     Accumulate a properly escaped XML string representation of
     this object
@@ -282,10 +690,10 @@ void Element::accumulate(XMLAccumulator& acc) const
 {
     acc << "<" << getName();
     for_each(_attribs.begin(), _attribs.end(), acc);
-    if (!_children.empty())
+    if (!empty())
     {
 	acc << ">";
-	for_each(_children.begin(), _children.end(), acc);
+	for_each(begin(), end(), acc);
 	acc << "</" << getName() << ">";
     }
     else
@@ -294,50 +702,95 @@ void Element::accumulate(XMLAccumulator& acc) const
     }
 }
 
+/**
+    Count the bytes this Element holds, without building the children
+    of a lazy one.
+    @see Node::getMemorySize
+*/
+size_t Element::getMemorySize() const
+{
+    size_t total = NODE_HEADER + sizeof(Element) + heapSize(_name);
+    for (AttribMap::const_iterator it = _attribs.begin(); it != _attribs.end(); ++it)
+	total += MAP_NODE_OVERHEAD + sizeof(*it) +
+	    heapSize(it->first) + heapSize(it->second);
+    if (_lazy.load(memory_order_acquire) != NULL)
+    {
+	// A lazy element has no children until another reader builds
+	// them, and then no content
+	lock_guard<mutex> guard(buildLock(this));
+	const string* lazy = _lazy.load(memory_order_relaxed);
+	if (lazy != NULL)
+	    total += sizeof(string) + heapSize(*lazy);
+    }
+    for (const Node* n = _first; n != NULL; n = n->_next)
+	total += n->getMemorySize();
+    const ChildIndex* index = _index.load(memory_order_acquire);
+    if (index != NULL)
+    {
+	total += sizeof(ChildIndex);
+	const map<string, Element*>* tables[] = { &index->names, &index->xmlns };
+	for (int i = 0; i < 2; i++)
+	    for (map<string, Element*>::const_iterator it = tables[i]->begin();
+		 it != tables[i]->end(); ++it)
+		total += MAP_NODE_OVERHEAD + sizeof(*it) + heapSize(it->first);
+    }
+    return total;
+}
+
+size_t CDATA::getMemorySize() const
+{
+    return NODE_HEADER + sizeof(CDATA) + heapSize(_name) + heapSize(_text);
+}
+
 /** 
     Retrieve the first CDATA child of this element
     @returns a reference to the first CDATA string
 */
 string Element::getCDATA() const
 {
-    list<Node*>::const_iterator it = _children.begin();
-    for (; it != _children.end(); ++it)
+    materialize();
+    const Node* n = _first;
+    for (; n != NULL; n = n->_next)
     {
-	if ((*it)->getType() == ntCDATA)
+	if (n->getType() == ntCDATA)
 	    break;
     }
-    if (it != _children.end())
-	return static_cast<const CDATA*>(*it)->getText();
+    if (n != NULL)
+	return static_cast<const CDATA*>(n)->getText();
     else
 	return string();
 }
 
 /**
    Locate the first child node which has the specified name and type.
+   Elements with many children answer this from an index.
    @param name Name of the child Node to find.
    @returns Iterator pointing to the child Node, or end() if no such
    child was found
 */
 Element::iterator Element::find(const string& name, Node::Type type)
 {
-    iterator result = begin();
-    for (; result != end(); ++result)
-    {
-	if (((*result)->getType() == type) && 
-	    ((*result)->getName() == name))
-	    break;
-    }
-    return result;
+    const_iterator it = static_cast<const Element*>(this)->find(name, type);
+    return iterator(*it, this);
 }
 
 /**
    Locate the first child node which has the specified name and type.
+   Elements with many children answer this from an index.
    @param name Name of the child Node to find.
    @returns const Iterator pointing to the child Node, or end() if no such
    child was found
 */
 Element::const_iterator Element::find(const string& name, Node::Type type) const
 {
+    materialize();
+    if (type == Node::ntElement && _count >= INDEX_THRESHOLD)
+    {
+	const map<string, Element*>& names = index().names;
+	map<string, Element*>::const_iterator it = names.find(name);
+	return const_iterator((it != names.end()) ? it->second : NULL, this);
+    }
+
     const_iterator result = begin();
     for (; result != end(); ++result)
     {
@@ -348,7 +801,6 @@ Element::const_iterator Element::find(const string& name, Node::Type type) const
     return result;
 }
 
-
 /**
    Locate the first child node which has the specified
    name and is an Element.
@@ -382,6 +834,44 @@ const Element* Element::findElement(const string& name) const
 }
 
 
+/**
+   Locate the first child Element which has the specified xmlns
+   attribute. Elements with many children answer this from an index.
+   @param xmlns Namespace of the child Element to find.
+   @returns Pointer to the matching child Element, or NULL if
+   no such child was found
+*/
+const Element* Element::findElementByXmlns(const string& xmlns) const
+{
+    materialize();
+    if (_count >= INDEX_THRESHOLD)
+    {
+	const map<string, Element*>& ns = index().xmlns;
+	map<string, Element*>::const_iterator it = ns.find(xmlns);
+	return (it != ns.end()) ? it->second : NULL;
+    }
+
+    for (const Node* n = _first; n != NULL; n = n->_next)
+    {
+	if ((n->getType() == Node::ntElement) &&
+	    static_cast<const Element*>(n)->cmpAttrib("xmlns", xmlns))
+	    return static_cast<const Element*>(n);
+    }
+    return NULL;
+}
+
+/**
+   Locate the first child Element which has the specified xmlns
+   attribute.
+   @param xmlns Namespace of the child Element to find.
+   @returns Pointer to the matching child Element, or NULL if
+   no such child was found
+*/
+Element* Element::findElementByXmlns(const string& xmlns)
+{
+    return const_cast<Element*>(static_cast<const Element*>(this)->findElementByXmlns(xmlns));
+}
+
 /**
    Locate the first child Element which has the specified name and
    erase it. As a result of this, the child Element's sub-children are
@@ -403,10 +893,22 @@ void Element::eraseElement(const string& name)
 Node* Element::detachChild(iterator it)
 {
     Node* retval = *it;
-    _children.erase(it);
+    unlink(retval);
     return retval;
 }
 
+/**
+   Detach a child node from this element and hand ownership of
+   it to the caller.
+   The iterator is invalidated after this call.
+   @param it iterator pointing to child node pointer
+   @return - the child node
+*/
+unique_ptr<Node> Element::releaseChild(iterator it)
+{
+    return unique_ptr<Node>(detachChild(it));
+}
+
 /**
    Locate the first child node which has the specified name
    and extract the CDATA from it
@@ -26,20 +26,49 @@
 // $Id: ElementStream.cpp,v 1.2 2002/07/13 19:30:19 temas Exp $
 //============================================================================
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "judo.hpp"
+#include "Probes.h"
+#include <new>
 using namespace judo;
 using namespace std;
 
 
-ElementStream::ElementStream(ElementStreamEventListener* l)
-    : _parser_ready(false), _event_listener(l)
+/**
+   Constructor
+   @param l Listener for parse events
+   @param backend Tokenizer to use, which the stream takes ownership
+   of. The default is expat.
+*/
+ElementStream::ElementStream(ElementStreamEventListener* l, ParserBackend* backend)
+    : _backend(backend), _lazy_depth(0), _sax_listener(NULL), _event_listener(l)
 {
+    if (_backend == NULL)
+	_backend = new ExpatBackend();
     reset();
 }
 
 ElementStream::~ElementStream()
 {
-    XML_ParserFree(_parser);
+    // Drop any partially built packet, as reset() does
+    if (!_element_stack.empty())
+	delete _element_stack.front();
+    delete _backend;
+}
+
+/**
+   Replace the tokenizer. This resets the stream.
+   @param backend New tokenizer, which the stream takes ownership of
+*/
+void ElementStream::setBackend(ParserBackend* backend)
+{
+    assert(backend != NULL);
+    delete _backend;
+    _backend = backend;
+    reset();
 }
 
 /**
@@ -50,9 +79,48 @@ ElementStream::~ElementStream()
 void ElementStream::push(const char* data, int datasz)
 {
     assert(_document_ended != true);
-    if (!XML_Parse(_parser, data, datasz, 0))
+    // Lazy mode needs the input of any element it leaves unparsed
+    if (_lazy_depth > 0)
+	_raw.append(data, datasz);
+    _pushed += datasz;
+    if (!_backend->parse(data, datasz))
     {
-	throw exception::ParserError(XML_GetErrorCode(_parser));
+	throw exception::ParserError(_backend->getErrorCode());
+    }
+}
+
+/**
+   Get a buffer to read data into, to be parsed by commit(). Data
+   read into this buffer is parsed in place, which saves the copy
+   that push() makes.
+   @param size Maximum number of bytes which will be read
+   @returns Buffer of at least size bytes, valid until the next
+   call to commit, push or reset
+*/
+char* ElementStream::getBuffer(int size)
+{
+    assert(_document_ended != true);
+    _buffer = _backend->getBuffer(size);
+    if (_buffer == NULL)
+	throw bad_alloc();
+    return _buffer;
+}
+
+/**
+   Parse data which has been read into the buffer returned by
+   getBuffer()
+   @param datasz Length of the data, at most the requested size
+*/
+void ElementStream::commit(int datasz)
+{
+    assert(_buffer != NULL);
+    if (_lazy_depth > 0)
+	_raw.append(_buffer, datasz);
+    _buffer = NULL;
+    _pushed += datasz;
+    if (!_backend->parseBuffer(datasz))
+    {
+	throw exception::ParserError(_backend->getErrorCode());
     }
 }
 
@@ -64,32 +132,164 @@ void ElementStream::reset()
     // Reset status flags
     _document_started = false;
     _document_ended = false;
+    // Drop any partially built packet
+    if (!_element_stack.empty())
+    {
+	delete _element_stack.front();
+	_element_stack.clear();
+    }
+    _lazy_nesting = 0;
+    _sax_nesting = 0;
+    _skip_nesting = 0;
+    _element_start = 0;
+    _element_size = 0;
+    _pending = 0;
+    _pushed = 0;
+    _consumed = 0;
+    _buffer = NULL;
+    _raw.clear();
+    _raw_base = 0;
+    _lazy_xml.clear();
 
-    // Release the current parser and create
-    // a new one
-    if (_parser_ready)
-	XML_ParserFree(_parser);
-    _parser = XML_ParserCreate(NULL);
-    _parser_ready = true;
-    
-    // Setup callbacks
-    XML_SetUserData(_parser, this);
-    XML_SetElementHandler(_parser, &ElementStream::onStartElement, 
-			  &ElementStream::onEndElement);
-    XML_SetCharacterDataHandler(_parser, &ElementStream::onCDATA);
+    // Restart the parser and setup callbacks
+    _backend->reset(this, &ElementStream::onStartElement, 
+		    &ElementStream::onEndElement, &ElementStream::onCDATA);
+}
+
+/**
+   Set the depth below which elements are not built as they are
+   parsed. With a depth of 1 only the name and attributes of each
+   packet-level element are built; with 2 its immediate children
+   are built too, and so on. The content of the elements at that
+   depth is kept as raw XML and parsed the first time someone looks
+   at their children (see Element::isMaterialized). This makes
+   parsing much cheaper for packets which are only routed or
+   filtered on their headers. A depth of 0, the default, builds
+   every element.
+
+   Elements below the lazy depth are never offered to the SAX
+   listener: they are held, whole, in the content of their lazy
+   ancestor. To stream large payloads through the listener, set a
+   depth no deeper than the elements it selects.
+   @param depth Number of element levels to build eagerly
+   @see setSAXListener
+*/
+void ElementStream::setLazyDepth(int depth)
+{
+    assert(depth >= 0);
+    // The input of a packet in progress has not been kept
+    assert(_element_stack.empty());
+    _lazy_depth = depth;
+}
+
+/**
+   Set the listener which receives the selected elements as
+   individual start, end and text events instead of as built
+   Elements.
+   @param l SAX event listener, or NULL to build every element
+   @see ElementStreamSAXListener
+   @see setLazyDepth, below whose depth elements are not offered to
+   the listener
+*/
+void ElementStream::setSAXListener(ElementStreamSAXListener* l)
+{
+    assert(_sax_nesting == 0);
+    _sax_listener = l;
+}
+
+// Forget the input before the given stream offset
+void ElementStream::trimRaw(long offset)
+{
+    _raw.erase(0, offset - _raw_base);
+    _raw_base = offset;
+}
+
+// Forget the input up to the end of the current event, when nothing
+// lazy can need it: within SAX elements, which are never inside lazy
+// content, and between top-level elements
+void ElementStream::trimRawEvent()
+{
+    if (_lazy_depth > 0)
+	trimRaw(_backend->getCurrentByteIndex() + _backend->getCurrentByteCount());
 }
 
 void ElementStream::onStartElement(void* userdata, const char* name, const char** attribs)
 {
     ElementStream* ts = (ElementStream*)userdata;
+    ts->consumed();
+
+    // Inside the content of a lazy element; just keep track of
+    // where it ends
+    if (ts->_lazy_nesting > 0)
+    {
+	ts->_lazy_nesting++;
+	ts->lazyStart(name, attribs);
+	return;
+    }
+
+    // Inside a skipped packet
+    if (ts->_skip_nesting > 0)
+    {
+	ts->_skip_nesting++;
+	return;
+    }
+
+    // Inside an element handed to the SAX listener
+    if (ts->_sax_nesting > 0)
+    {
+	ts->_sax_nesting++;
+	ts->_sax_listener->onStartElement(name, attribs, ts->_element_stack.size() + ts->_sax_nesting);
+	ts->trimRawEvent();
+	return;
+    }
 
     // If the document has started..
     if (ts->_document_started)
     {
+	int depth = ts->_element_stack.size() + 1;
+
+	if (depth == 1)
+	{
+	    ts->_element_start = ts->_backend->getCurrentByteIndex();
+	    ts->_element_size = ts->_backend->getCurrentByteCount();
+	    ts->_pending = 0;
+	    JUDO_PROBE1(stanza_start, name);
+
+	    if (!ts->_event_listener->onElementStart(name, attribs))
+	    {
+		ts->_skip_nesting = 1;
+		return;
+	    }
+	}
+
+	// Elements selected by the SAX listener are not built; the
+	// parent only gets an empty element with the same attributes
+	if (ts->_sax_listener != NULL && 
+	    ts->_sax_listener->selectElement(name, attribs, depth))
+	{
+	    if (!ts->_element_stack.empty())
+		ts->_pending += ts->_element_stack.back()->addElement(name, attribs)->getMemorySize();
+	    ts->_sax_nesting = 1;
+	    ts->_sax_listener->onStartElement(name, attribs, depth);
+	    ts->trimRawEvent();
+	    return;
+	}
+
 	if (!ts->_element_stack.empty())
 	    ts->_element_stack.push_back(ts->_element_stack.back()->addElement(name, attribs));
 	else
 	    ts->_element_stack.push_back(new Element(name, attribs));
+	ts->_pending += ts->_element_stack.back()->getMemorySize();
+
+	// Content of elements at the lazy depth starts after this
+	// tag; nothing before it is needed any more
+	if (depth == ts->_lazy_depth)
+	{
+	    ts->_lazy_nesting = 1;
+	    ts->_lazy_body = ts->_backend->getCurrentByteIndex() + 
+		ts->_backend->getCurrentByteCount();
+	    ts->trimRaw(ts->_lazy_body);
+	}
     }
     // Document hasn't started; we need to generate a document start
     // event
@@ -104,12 +304,66 @@ void ElementStream::onStartElement(void* userdata, const char* name, const char*
 void ElementStream::onEndElement(void* userdata, const char* name)
 {
     ElementStream* ts = (ElementStream*)userdata;
+    ts->consumed();
+
+    if (ts->_lazy_nesting > 1)
+    {
+	ts->_lazy_nesting--;
+	ts->lazyEnd(name);
+	return;
+    }
+    if (ts->_skip_nesting > 0)
+    {
+	ts->_skip_nesting--;
+	if (ts->_skip_nesting == 0)
+	{
+	    ts->endElement(name);
+	    ts->trimRawEvent();
+	}
+	return;
+    }
+    if (ts->_sax_nesting > 0)
+    {
+	ts->_sax_listener->onEndElement(name, ts->_element_stack.size() + ts->_sax_nesting);
+	ts->_sax_nesting--;
+	if (ts->_sax_nesting == 0 && ts->_element_stack.empty())
+	    ts->endElement(name);
+	ts->trimRawEvent();
+	return;
+    }
+    // Closing a lazy element; hand it the content we skipped. Empty
+    // elements have no content to keep.
+    if (ts->_lazy_nesting == 1)
+    {
+	long end = ts->_backend->getCurrentByteIndex();
+	string* content = NULL;
+	if (!ts->_backend->isVerbatim())
+	{
+	    if (!ts->_lazy_xml.empty())
+		content = new string(std::move(ts->_lazy_xml));
+	    ts->_lazy_xml.clear();
+	}
+	else if (end > ts->_lazy_body)
+	    content = new string(ts->_raw, ts->_lazy_body - ts->_raw_base, end - ts->_lazy_body);
+	if (content != NULL)
+	{
+	    ts->_element_stack.back()->_lazy = content;
+	    ts->_pending += sizeof(string) + heapSize(*content);
+	}
+	ts->_lazy_nesting = 0;
+    }
 
     switch (ts->_element_stack.size())
     {
 	// Only one remaining element on the stack; thus we must be
 	// closing the packet-level element
     case 1:
+	ts->endElement(name);
+	// Elements above the lazy depth trim nothing as they start, so
+	// the input of a packet with none goes now
+	ts->trimRawEvent();
+	// The element is the listener's now
+	ts->_pending = 0;
 	ts->_event_listener->onElement(ts->_element_stack.back());
 	ts->_element_stack.pop_back();
 	break;
@@ -124,14 +378,87 @@ void ElementStream::onEndElement(void* userdata, const char* name)
     }
 }
 
+// A top-level element has been parsed up to its end tag
+void ElementStream::endElement(const char* name)
+{
+    // The end tag of an empty element is reported at its start tag
+    long end = _backend->getCurrentByteIndex() + _backend->getCurrentByteCount();
+    if (end - _element_start > _element_size)
+	_element_size = end - _element_start;
+    JUDO_PROBE2(stanza_end, name, _element_size);
+}
+
+// Lazy content is kept as its input, unless that wouldn't parse the
+// same on its own, such as when it isn't UTF-8 or refers to entities
+// from a DTD; then it is written out as UTF-8 from the events, and
+// the input isn't needed
+void ElementStream::lazyStart(const char* name, const char** attribs)
+{
+    if (_backend->isVerbatim())
+	return;
+    _lazy_xml += '<';
+    _lazy_xml += name;
+    for (int i = 0; attribs[i] != NULL; i += 2)
+    {
+	_lazy_xml += ' ';
+	_lazy_xml += attribs[i];
+	_lazy_xml += "='";
+	_lazy_xml += escape(attribs[i + 1]);
+	_lazy_xml += '\'';
+    }
+    _lazy_xml += '>';
+    trimRawEvent();
+}
+
+void ElementStream::lazyEnd(const char* name)
+{
+    if (_backend->isVerbatim())
+	return;
+    _lazy_xml += "</";
+    _lazy_xml += name;
+    _lazy_xml += '>';
+    trimRawEvent();
+}
+
+void ElementStream::lazyText(const char* cdata, int cdatasz)
+{
+    if (_backend->isVerbatim())
+	return;
+    _lazy_xml += escape(string(cdata, cdatasz));
+    trimRawEvent();
+}
+
 void ElementStream::onCDATA(void* userdata, const char* cdata, int cdatasz)
 {
     ElementStream* ts = (ElementStream*)userdata;
+    ts->consumed();
 
+    if (ts->_lazy_nesting > 0)
+    {
+	ts->lazyText(cdata, cdatasz);
+	return;
+    }
+    if (ts->_skip_nesting > 0)
+	return;
+    if (ts->_sax_nesting > 0)
+    {
+	ts->_sax_listener->onText(cdata, cdatasz, ts->_element_stack.size() + ts->_sax_nesting);
+	ts->trimRawEvent();
+	return;
+    }
     if (!ts->_element_stack.empty())
-	ts->_element_stack.back()->addCDATA(cdata, cdatasz, true);
+    {
+	// Text is appended to the last child if that is text too
+	Element* e = ts->_element_stack.back();
+	size_t before = (e->_last != NULL && e->_last->getType() == Node::ntCDATA) ?
+	    e->_last->getMemorySize() : 0;
+	ts->_pending += e->addCDATA(cdata, cdatasz, true)->getMemorySize() - before;
+    }
     else
+    {
 	ts->_event_listener->onCDATA(new CDATA(cdata, cdatasz, true));
+	ts->trimRawEvent();
+    }
 }
 
 
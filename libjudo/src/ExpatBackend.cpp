@@ -0,0 +1,146 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      ExpatBackend.cpp
+// Description:   ElementStream parser backend using expat
+// 
+//   License:
+// 
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.  
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//============================================================================
+
+#include "judo.hpp"
+
+#include <cctype>
+using namespace judo;
+using namespace std;
+
+ExpatBackend::ExpatBackend()
+    : _parser(NULL), _userdata(NULL), _start(NULL), _end(NULL), _cdata(NULL),
+      _verbatim(true), _sniffed(0), _buffer(NULL)
+{}
+
+ExpatBackend::~ExpatBackend()
+{
+    if (_parser != NULL)
+	XML_ParserFree(_parser);
+}
+
+void ExpatBackend::reset(void* userdata, StartHandler start, EndHandler end, 
+			 CDATAHandler cdata)
+{
+    // Release the current parser and create
+    // a new one
+    if (_parser != NULL)
+	XML_ParserFree(_parser);
+    _parser = XML_ParserCreate(NULL);
+
+    _userdata = userdata;
+    _start = start;
+    _end = end;
+    _cdata = cdata;
+    _verbatim = true;
+    _sniffed = 0;
+    _buffer = NULL;
+
+    XML_SetUserData(_parser, this);
+    XML_SetElementHandler(_parser, onStart, onEnd);
+    XML_SetCharacterDataHandler(_parser, onCDATA);
+    XML_SetXmlDeclHandler(_parser, onXmlDecl);
+    XML_SetStartDoctypeDeclHandler(_parser, onDoctype);
+}
+
+bool ExpatBackend::parse(const char* data, int datasz)
+{
+    sniff(data, datasz);
+    return XML_Parse(_parser, data, datasz, 0) != 0;
+}
+
+char* ExpatBackend::getBuffer(int size)
+{
+    _buffer = static_cast<char*>(XML_GetBuffer(_parser, size));
+    return _buffer;
+}
+
+bool ExpatBackend::parseBuffer(int datasz)
+{
+    sniff(_buffer, datasz);
+    return XML_ParseBuffer(_parser, datasz, 0) != 0;
+}
+
+long ExpatBackend::getCurrentByteIndex() const
+{
+    return XML_GetCurrentByteIndex(_parser);
+}
+
+int ExpatBackend::getCurrentByteCount() const
+{
+    return XML_GetCurrentByteCount(_parser);
+}
+
+int ExpatBackend::getErrorCode() const
+{
+    return XML_GetErrorCode(_parser);
+}
+
+// Expat reads UTF-16 without a declaration, from a byte order mark
+// or a NUL in the first two bytes
+void ExpatBackend::sniff(const char* data, int datasz)
+{
+    for (int i = 0; i < datasz && _sniffed < 2; i++, _sniffed++)
+    {
+	unsigned char c = data[i];
+	if (c == 0 || (_sniffed == 0 && (c == 0xfe || c == 0xff)))
+	    _verbatim = false;
+    }
+}
+
+void ExpatBackend::onStart(void* backend, const char* name, const char** attribs)
+{
+    ExpatBackend* b = static_cast<ExpatBackend*>(backend);
+    b->_start(b->_userdata, name, attribs);
+}
+
+void ExpatBackend::onEnd(void* backend, const char* name)
+{
+    ExpatBackend* b = static_cast<ExpatBackend*>(backend);
+    b->_end(b->_userdata, name);
+}
+
+void ExpatBackend::onCDATA(void* backend, const char* cdata, int cdatasz)
+{
+    ExpatBackend* b = static_cast<ExpatBackend*>(backend);
+    b->_cdata(b->_userdata, cdata, cdatasz);
+}
+
+void ExpatBackend::onXmlDecl(void* backend, const XML_Char* version,
+			     const XML_Char* encoding, int standalone)
+{
+    if (encoding == NULL)
+	return;
+    static const char UTF8[] = "utf-8";
+    size_t i = 0;
+    for (; encoding[i] != '\0' && i < sizeof(UTF8) - 1; i++)
+    {
+	if (tolower((unsigned char) encoding[i]) != UTF8[i])
+	    break;
+    }
+    if (encoding[i] != '\0' || i != sizeof(UTF8) - 1)
+	static_cast<ExpatBackend*>(backend)->_verbatim = false;
+}
+
+// Even without an internal subset, an external one may declare
+// entities the content refers to
+void ExpatBackend::onDoctype(void* backend, const XML_Char* name, const XML_Char* sysid,
+			     const XML_Char* pubid, int has_internal_subset)
+{
+    static_cast<ExpatBackend*>(backend)->_verbatim = false;
+}
@@ -0,0 +1,361 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      MemoryResource.cpp
+// Description:   Memory resources for containers and Nodes
+//
+//   License:
+//
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//
+//============================================================================
+
+#include "MemoryResource.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <set>
+
+using namespace judo;
+using namespace std;
+
+namespace
+{
+    class NewDeleteResource : public MemoryResource
+    {
+    protected:
+	void* doAllocate(size_t bytes, size_t)
+	    { return ::operator new(bytes); }
+	void doDeallocate(void* p, size_t, size_t)
+	    { ::operator delete(p); }
+	bool doIsEqual(const MemoryResource& other) const
+	    { return dynamic_cast<const NewDeleteResource*>(&other) != NULL; }
+    };
+
+    NewDeleteResource G_new_delete;
+    atomic<MemoryResource*> G_default(&G_new_delete);
+
+    // The innermost ResourceScope of each thread
+    thread_local MemoryResource* T_scoped = NULL;
+
+    // Pooled blocks are a whole number of grains, up to POOL_CLASSES
+    // grains; each class has a free list of at most POOL_CLASS_BYTES
+    const size_t POOL_GRAIN = alignof(max_align_t);
+    const size_t POOL_CLASSES = 512 / POOL_GRAIN;
+    const size_t POOL_CLASS_BYTES = 64 * 1024;
+
+    struct FreeBlock
+    {
+	FreeBlock* next;
+    };
+
+    typedef atomic<unsigned long long> PoolCounter;
+
+    // A thread's free lists. Only the thread writes the counters, so
+    // they are bumped with a relaxed load and store, and any thread
+    // may read them.
+    struct PoolCache
+    {
+	PoolCache();
+	~PoolCache();
+
+	static void add(PoolCounter& c, long n = 1)
+	    { c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed); }
+
+	void trim();
+	void snapshot(PoolStats& s) const;
+
+	FreeBlock*  lists[POOL_CLASSES];
+	size_t      counts[POOL_CLASSES];
+	PoolCounter allocations;
+	PoolCounter reused;
+	PoolCounter oversized;
+	PoolCounter cached;
+	PoolCounter cachedBytes;
+    };
+
+    // Every thread's cache, and what exited threads did
+    struct PoolRegistry
+    {
+	mutex           lock;
+	set<PoolCache*> live;
+	PoolStats       retired;
+    };
+
+    PoolRegistry& poolRegistry()
+    {
+	// Never destroyed, so threads which outlive main() can still
+	// take themselves off it
+	static PoolRegistry* r = new PoolRegistry();
+	return *r;
+    }
+
+    // The calling thread's cache, or NULL once it has been destroyed
+    // at thread exit
+    thread_local PoolCache* T_pool = NULL;
+    thread_local bool       T_pool_gone = false;
+
+    PoolCache* threadPool()
+    {
+	if (T_pool == NULL && !T_pool_gone)
+	{
+	    static thread_local PoolCache cache;
+	    T_pool = &cache;
+	}
+	return T_pool;
+    }
+
+    PoolCache::PoolCache()
+	: allocations(0), reused(0), oversized(0), cached(0), cachedBytes(0)
+    {
+	for (size_t i = 0; i < POOL_CLASSES; i++)
+	{
+	    lists[i] = NULL;
+	    counts[i] = 0;
+	}
+	PoolRegistry& r = poolRegistry();
+	lock_guard<mutex> guard(r.lock);
+	r.live.insert(this);
+    }
+
+    PoolCache::~PoolCache()
+    {
+	T_pool = NULL;
+	T_pool_gone = true;
+	trim();
+
+	PoolStats s;
+	snapshot(s);
+	PoolRegistry& r = poolRegistry();
+	lock_guard<mutex> guard(r.lock);
+	r.live.erase(this);
+	r.retired.allocations += s.allocations;
+	r.retired.reused += s.reused;
+	r.retired.oversized += s.oversized;
+    }
+
+    void PoolCache::trim()
+    {
+	for (size_t i = 0; i < POOL_CLASSES; i++)
+	{
+	    while (lists[i] != NULL)
+	    {
+		FreeBlock* b = lists[i];
+		lists[i] = b->next;
+		::operator delete(b);
+	    }
+	    counts[i] = 0;
+	}
+	cached.store(0, memory_order_relaxed);
+	cachedBytes.store(0, memory_order_relaxed);
+    }
+
+    void PoolCache::snapshot(PoolStats& s) const
+    {
+	s.allocations = allocations.load(memory_order_relaxed);
+	s.reused = reused.load(memory_order_relaxed);
+	s.oversized = oversized.load(memory_order_relaxed);
+	s.cached = cached.load(memory_order_relaxed);
+	s.cachedBytes = cachedBytes.load(memory_order_relaxed);
+    }
+
+    class PoolResource : public MemoryResource
+    {
+    protected:
+	void* doAllocate(size_t bytes, size_t align)
+	{
+	    size_t c = (bytes + POOL_GRAIN - 1) / POOL_GRAIN;
+	    PoolCache* p = threadPool();
+	    if (c > POOL_CLASSES || align > POOL_GRAIN)
+	    {
+		if (p != NULL)
+		    PoolCache::add(p->oversized);
+		return ::operator new(bytes);
+	    }
+	    if (c == 0)
+		c = 1;
+	    if (p == NULL)
+		return ::operator new(c * POOL_GRAIN);
+
+	    PoolCache::add(p->allocations);
+	    FreeBlock* b = p->lists[c - 1];
+	    if (b == NULL)
+		return ::operator new(c * POOL_GRAIN);
+
+	    p->lists[c - 1] = b->next;
+	    p->counts[c - 1]--;
+	    PoolCache::add(p->reused);
+	    PoolCache::add(p->cached, -1);
+	    PoolCache::add(p->cachedBytes, -(long) (c * POOL_GRAIN));
+	    return b;
+	}
+
+	void doDeallocate(void* ptr, size_t bytes, size_t align)
+	{
+	    size_t c = (bytes + POOL_GRAIN - 1) / POOL_GRAIN;
+	    PoolCache* p = threadPool();
+	    if (c == 0)
+		c = 1;
+	    if (c > POOL_CLASSES || align > POOL_GRAIN || p == NULL ||
+		(p->counts[c - 1] + 1) * c * POOL_GRAIN > POOL_CLASS_BYTES)
+	    {
+		::operator delete(ptr);
+		return;
+	    }
+
+	    FreeBlock* b = static_cast<FreeBlock*>(ptr);
+	    b->next = p->lists[c - 1];
+	    p->lists[c - 1] = b;
+	    p->counts[c - 1]++;
+	    PoolCache::add(p->cached);
+	    PoolCache::add(p->cachedBytes, c * POOL_GRAIN);
+	}
+
+	bool doIsEqual(const MemoryResource& other) const
+	    { return dynamic_cast<const PoolResource*>(&other) != NULL; }
+    };
+
+    PoolResource G_pool;
+}
+
+MemoryResource* judo::newDeleteResource()
+{
+    return &G_new_delete;
+}
+
+MemoryResource* judo::poolResource()
+{
+    return &G_pool;
+}
+
+PoolStats judo::getPoolStats()
+{
+    PoolRegistry& r = poolRegistry();
+    lock_guard<mutex> guard(r.lock);
+    PoolStats total = r.retired;
+    for (set<PoolCache*>::const_iterator it = r.live.begin(); it != r.live.end(); ++it)
+    {
+	PoolStats s;
+	(*it)->snapshot(s);
+	total.allocations += s.allocations;
+	total.reused += s.reused;
+	total.oversized += s.oversized;
+	total.cached += s.cached;
+	total.cachedBytes += s.cachedBytes;
+    }
+    return total;
+}
+
+void judo::trimPool()
+{
+    PoolCache* p = threadPool();
+    if (p != NULL)
+	p->trim();
+}
+
+MemoryResource* judo::getDefaultResource()
+{
+    MemoryResource* r = T_scoped;
+    return (r != NULL) ? r : G_default.load(memory_order_acquire);
+}
+
+MemoryResource* judo::setDefaultResource(MemoryResource* r)
+{
+    return G_default.exchange((r != NULL) ? r : &G_new_delete);
+}
+
+ResourceScope::ResourceScope(MemoryResource* r)
+    : _previous(T_scoped)
+{
+    T_scoped = r;
+}
+
+ResourceScope::~ResourceScope()
+{
+    T_scoped = _previous;
+}
+
+MonotonicResource::MonotonicResource(size_t block, MemoryResource* upstream)
+    : _upstream((upstream != NULL) ? upstream : newDeleteResource()),
+      _next_size(block), _cur(NULL), _end(NULL)
+{}
+
+MonotonicResource::~MonotonicResource()
+{
+    release();
+    if (!_blocks.empty())
+	_upstream->deallocate(_blocks[0].data, _blocks[0].size);
+}
+
+void MonotonicResource::release()
+{
+    if (_blocks.empty())
+	return;
+
+    for (size_t i = 1; i < _blocks.size(); i++)
+	_upstream->deallocate(_blocks[i].data, _blocks[i].size);
+    _blocks.resize(1);
+    _cur = _blocks[0].data;
+    _end = _cur + _blocks[0].size;
+}
+
+void* MonotonicResource::doAllocate(size_t bytes, size_t align)
+{
+    uintptr_t p = (reinterpret_cast<uintptr_t>(_cur) + align - 1) & ~(uintptr_t) (align - 1);
+    if (_cur == NULL || p + bytes > reinterpret_cast<uintptr_t>(_end))
+    {
+	// Start a new block big enough for this, and at least as big
+	// as the next size, which a block of 0 leaves to this
+	Block b;
+	b.size = max(_next_size, bytes + align);
+	b.data = static_cast<char*>(_upstream->allocate(b.size));
+	_blocks.push_back(b);
+	_next_size = b.size * 2;
+
+	_cur = b.data;
+	_end = b.data + b.size;
+	p = (reinterpret_cast<uintptr_t>(_cur) + align - 1) & ~(uintptr_t) (align - 1);
+    }
+    _cur = reinterpret_cast<char*>(p + bytes);
+    return reinterpret_cast<void*>(p);
+}
+
+CountingResource::CountingResource(MemoryResource* upstream)
+    : _upstream((upstream != NULL) ? upstream : newDeleteResource()),
+      _in_use(0), _peak(0), _refs(1)
+{}
+
+void* CountingResource::doAllocate(size_t bytes, size_t align)
+{
+    void* p = _upstream->allocate(bytes, align);
+    _refs.fetch_add(1, memory_order_relaxed);
+    size_t in_use = _in_use.fetch_add(bytes, memory_order_relaxed) + bytes;
+    size_t peak = _peak.load(memory_order_relaxed);
+    while (in_use > peak &&
+	   !_peak.compare_exchange_weak(peak, in_use, memory_order_relaxed))
+	;
+    return p;
+}
+
+void CountingResource::doDeallocate(void* p, size_t bytes, size_t align)
+{
+    _upstream->deallocate(p, bytes, align);
+    _in_use.fetch_sub(bytes, memory_order_relaxed);
+    if (_refs.fetch_sub(1, memory_order_acq_rel) == 1)
+	delete this;
+}
+
+void CountingResource::deleteWhenUnused()
+{
+    if (_refs.fetch_sub(1, memory_order_acq_rel) == 1)
+	delete this;
+}
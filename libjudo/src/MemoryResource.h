@@ -0,0 +1,304 @@
+#ifndef INCL_JUDO_MEMORY_RESOURCE_H
+#define INCL_JUDO_MEMORY_RESOURCE_H
+
+#include <cstddef>
+#include <atomic>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace judo
+{
+    /**
+       Where a container or Node gets its memory from, after
+       C++17's std::pmr::memory_resource. Subclasses implement
+       doAllocate, doDeallocate and doIsEqual.
+    */
+    class MemoryResource
+    {
+    public:
+	virtual ~MemoryResource() {}
+
+	/**
+	   Allocate memory.
+	   @param bytes Size of the block
+	   @param align Alignment of the block, a power of two
+	   @exception std::bad_alloc The resource is exhausted
+	*/
+	void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t))
+	    { return doAllocate(bytes, align); }
+
+	/**
+	   Give back memory from allocate() with the same size and
+	   alignment.
+	*/
+	void deallocate(void* p, std::size_t bytes, std::size_t align = alignof(std::max_align_t))
+	    { doDeallocate(p, bytes, align); }
+
+	/**
+	   Determine whether memory from one resource may be given
+	   back to the other.
+	*/
+	bool isEqual(const MemoryResource& other) const
+	    { return this == &other || doIsEqual(other); }
+
+    protected:
+	virtual void* doAllocate(std::size_t bytes, std::size_t align) = 0;
+	virtual void  doDeallocate(void* p, std::size_t bytes, std::size_t align) = 0;
+	virtual bool  doIsEqual(const MemoryResource& other) const = 0;
+    };
+
+    /**
+       The resource which uses global operator new and delete.
+    */
+    MemoryResource* newDeleteResource();
+
+    /**
+       Get the resource containers and Nodes use when none is given:
+       the innermost ResourceScope on this thread, or else the
+       process default, which starts as newDeleteResource().
+    */
+    MemoryResource* getDefaultResource();
+
+    /**
+       Replace the process default resource.
+       @param r The new default, or NULL for newDeleteResource()
+       @returns The old default
+    */
+    MemoryResource* setDefaultResource(MemoryResource* r);
+
+    /**
+       The resource which keeps freed blocks of up to 512 bytes, the
+       sizes of Nodes and container nodes, on free lists of the
+       thread which freed them, and hands them out again before
+       going to operator new. Once a thread has handled a few
+       stanzas, building and deleting more of the same shape costs
+       it no calls into the global heap. Each thread keeps at most
+       64K of each size, and gives its blocks back when it exits.
+       Use it as the process default, or as the upstream of a
+       Session's resource.
+    */
+    MemoryResource* poolResource();
+
+    /**
+       What poolResource() has done, over every thread.
+    */
+    struct PoolStats
+    {
+	unsigned long long allocations;  // Blocks handed out
+	unsigned long long reused;       // ... which came off a free list
+	unsigned long long oversized;    // Blocks too big to pool
+	unsigned long long cached;       // Blocks on free lists now
+	std::size_t        cachedBytes;
+
+	/**
+	   Get the fraction of allocations which reused a block.
+	*/
+	double reuseRate() const
+	    { return allocations ? double(reused) / allocations : 0.0; }
+    };
+
+    /**
+       Get the counts of poolResource(). Any thread may call this.
+    */
+    PoolStats getPoolStats();
+
+    /**
+       Give the free blocks of the calling thread back to operator
+       delete, such as when it will be idle for a while.
+    */
+    void trimPool();
+
+    /**
+       Makes a resource this thread's default until the scope is
+       destroyed, so everything built in between, including what a
+       parser builds, comes from it. Scopes nest.
+    */
+    class ResourceScope
+    {
+    public:
+	ResourceScope(MemoryResource* r);
+	~ResourceScope();
+    private:
+	ResourceScope(const ResourceScope&);
+	ResourceScope& operator=(const ResourceScope&);
+
+	MemoryResource* _previous;
+    };
+
+    /**
+       A standard allocator which allocates from a MemoryResource,
+       like std::pmr::polymorphic_allocator. A default constructed
+       one uses getDefaultResource(), and so does a copy of a
+       container. Unlike polymorphic_allocator, the allocator moves
+       and swaps with the container's contents, so containers on
+       different resources may be moved or swapped cheaply; what each
+       allocated still goes back to where it came from.
+    */
+    template <class T>
+    class Allocator
+    {
+    public:
+	typedef T              value_type;
+	typedef T*             pointer;
+	typedef const T*       const_pointer;
+	typedef T&             reference;
+	typedef const T&       const_reference;
+	typedef std::size_t    size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	typedef std::false_type propagate_on_container_copy_assignment;
+	typedef std::true_type  propagate_on_container_move_assignment;
+	typedef std::true_type  propagate_on_container_swap;
+
+	template <class U>
+	struct rebind { typedef Allocator<U> other; };
+
+	Allocator()
+	    : _resource(getDefaultResource()) {}
+	Allocator(MemoryResource* r)
+	    : _resource(r) {}
+	template <class U>
+	Allocator(const Allocator<U>& a)
+	    : _resource(a.resource()) {}
+
+	T* allocate(size_type n)
+	    { return static_cast<T*>(_resource->allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T* p, size_type n)
+	    { _resource->deallocate(p, n * sizeof(T), alignof(T)); }
+
+	size_type max_size() const
+	    { return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+	template <class U, class... Args>
+	void construct(U* p, Args&&... args)
+	    { ::new((void*) p) U(std::forward<Args>(args)...); }
+	template <class U>
+	void destroy(U* p)
+	    { p->~U(); }
+
+	Allocator select_on_container_copy_construction() const
+	    { return Allocator(); }
+
+	MemoryResource* resource() const
+	    { return _resource; }
+
+    private:
+	MemoryResource* _resource;
+    };
+
+    template <class T, class U>
+    bool operator==(const Allocator<T>& a, const Allocator<U>& b)
+    { return a.resource()->isEqual(*b.resource()); }
+
+    template <class T, class U>
+    bool operator!=(const Allocator<T>& a, const Allocator<U>& b)
+    { return !(a == b); }
+
+    /**
+       Allocates by bumping a pointer through blocks got from an
+       upstream resource, and frees nothing until release() or its
+       destruction, which free everything at once. This suits memory
+       with a known end, such as everything built while handling one
+       stanza. Only one thread may use it at a time.
+    */
+    class MonotonicResource : public MemoryResource
+    {
+    public:
+	/**
+	   @param block The size of the first block, or 0 to size it
+	   by the first allocation; each block after it is twice the
+	   size of the last, or as big as the allocation it is for
+	   @param upstream Where the blocks come from, or NULL for
+	   newDeleteResource(); not the default resource, which may
+	   be a scope's that the blocks would then be charged to
+	*/
+	MonotonicResource(std::size_t block = 4096, MemoryResource* upstream = NULL);
+	~MonotonicResource();
+
+	/**
+	   Free everything allocated, keeping the first block.
+	*/
+	void release();
+
+    protected:
+	void* doAllocate(std::size_t bytes, std::size_t align);
+	void  doDeallocate(void*, std::size_t, std::size_t) {}
+	bool  doIsEqual(const MemoryResource&) const { return false; }
+
+    private:
+	MonotonicResource(const MonotonicResource&);
+	MonotonicResource& operator=(const MonotonicResource&);
+
+	struct Block
+	{
+	    char*       data;
+	    std::size_t size;
+	};
+
+	MemoryResource*    _upstream;
+	std::vector<Block> _blocks;
+	std::size_t        _next_size;
+	char*              _cur;
+	char*              _end;
+    };
+
+    /**
+       Passes allocations on to an upstream resource, counting the
+       bytes in use. Any thread may allocate and free through it.
+       One made with new may be handed to deleteWhenUnused(), for
+       when what was allocated from it can outlive its owner.
+    */
+    class CountingResource : public MemoryResource
+    {
+    public:
+	/**
+	   @param upstream Where the memory comes from, or NULL for
+	   newDeleteResource(); not the default resource, which may
+	   be another CountingResource in scope that this one's bytes
+	   would then be counted against too
+	*/
+	CountingResource(MemoryResource* upstream = NULL);
+
+	/**
+	   Get the bytes allocated and not yet freed.
+	*/
+	std::size_t getBytesInUse() const
+	    { return _in_use.load(std::memory_order_relaxed); }
+
+	/**
+	   Get the most bytes which have been in use at once.
+	*/
+	std::size_t getPeakBytes() const
+	    { return _peak.load(std::memory_order_relaxed); }
+
+	MemoryResource* getUpstream() const
+	    { return _upstream; }
+
+	/**
+	   Delete the resource once everything allocated from it has
+	   been freed, which may be at once. Nothing may be allocated
+	   from it after this.
+	*/
+	void deleteWhenUnused();
+
+    protected:
+	void* doAllocate(std::size_t bytes, std::size_t align);
+	void  doDeallocate(void* p, std::size_t bytes, std::size_t align);
+	bool  doIsEqual(const MemoryResource&) const { return false; }
+
+    private:
+	CountingResource(const CountingResource&);
+	CountingResource& operator=(const CountingResource&);
+
+	MemoryResource*          _upstream;
+	std::atomic<std::size_t> _in_use;
+	std::atomic<std::size_t> _peak;
+	// Live allocations, plus one until deleteWhenUnused()
+	std::atomic<std::size_t> _refs;
+    };
+}
+
+#endif // INCL_JUDO_MEMORY_RESOURCE_H
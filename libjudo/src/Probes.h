@@ -0,0 +1,68 @@
+#ifndef INCL_JUDO_PROBES_H
+#define INCL_JUDO_PROBES_H
+
+// USDT tracepoints for perf, bpftrace and systemtap, shared by libjudo
+// and jabberoo; they are only compiled in when configured with
+// --enable-usdt.  All probes are in the "jabberoo" provider, e.g.
+//
+//   bpftrace -e 'usdt:/usr/lib/libjabberoo.so:jabberoo:dispatch_entry
+//                { printf("%s %d\n", str(arg0), arg1); }'
+//
+// Until a tracer attaches, a probe is a single nop.  Each probe also
+// has a semaphore the tracer raises while it is attached, so a probe
+// whose arguments cost something to work out can be wrapped in
+// JUDO_PROBE_ENABLED().
+//
+// The config.h which defines JABBEROO_USDT must be included first.
+
+// Every probe, so their semaphores can be declared and defined
+#define JUDO_PROBES(P)          \
+    P(stanza_start)             \
+    P(stanza_end)               \
+    P(dispatch_entry)           \
+    P(dispatch_return)          \
+    P(xpath_match)              \
+    P(iq_callback)              \
+    P(transmit)                 \
+    P(presencedb_insert)        \
+    P(presencedb_remove)        \
+    P(presencedb_clear)         \
+    P(roster_add)               \
+    P(roster_update)            \
+    P(roster_remove)            \
+    P(roster_reset)
+
+#ifdef JABBEROO_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define JUDO_PROBE_SEMAPHORE(name) jabberoo_##name##_semaphore
+#define JUDO_PROBE_DECLARE(name) \
+    extern "C" unsigned short JUDO_PROBE_SEMAPHORE(name);
+#define JUDO_PROBE_DEFINE(name) \
+    extern "C" { unsigned short JUDO_PROBE_SEMAPHORE(name) \
+        __attribute__((section(".probes"))) = 0; }
+
+JUDO_PROBES(JUDO_PROBE_DECLARE)
+
+#define JUDO_PROBE_ENABLED(name) \
+    __builtin_expect(JUDO_PROBE_SEMAPHORE(name) != 0, 0)
+#define JUDO_PROBE0(name) DTRACE_PROBE(jabberoo, name)
+#define JUDO_PROBE1(name, a) DTRACE_PROBE1(jabberoo, name, a)
+#define JUDO_PROBE2(name, a, b) DTRACE_PROBE2(jabberoo, name, a, b)
+#define JUDO_PROBE3(name, a, b, c) DTRACE_PROBE3(jabberoo, name, a, b, c)
+
+#else
+
+#define JUDO_PROBE_DEFINE(name)
+#define JUDO_PROBE_ENABLED(name) false
+// Statements still, so a probe can be the body of an if
+#define JUDO_PROBE0(name) do { } while (0)
+#define JUDO_PROBE1(name, a) do { } while (0)
+#define JUDO_PROBE2(name, a, b) do { } while (0)
+#define JUDO_PROBE3(name, a, b, c) do { } while (0)
+
+#endif
+
+#endif // INCL_JUDO_PROBES_H
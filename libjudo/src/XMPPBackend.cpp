@@ -0,0 +1,649 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      XMPPBackend.cpp
+// Description:   ElementStream parser backend for XMPP's restricted XML
+//
+//   License:
+//
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//============================================================================
+
+#include "judo.hpp"
+#include <cctype>
+#include <cstdlib>
+using namespace judo;
+using namespace std;
+
+// XML whitespace
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// The characters XML allows
+static inline bool isChar(unsigned long c)
+{
+    return (c >= 0x20 && c <= 0xD7FF) || c == '\t' || c == '\n' || c == '\r' ||
+	(c >= 0xE000 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0x10FFFF);
+}
+
+// Name characters; anything outside ASCII is let through, as
+// isChars() has checked it is UTF-8
+static inline bool isNameStart(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+	c == ':' || c >= 0x80;
+}
+
+static inline bool isNameChar(unsigned char c)
+{
+    return isNameStart(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+static bool isName(const char* p, const char* end)
+{
+    if (p == end || !isNameStart(*p))
+	return false;
+    for (p++; p < end; p++)
+    {
+	if (!isNameChar(*p))
+	    return false;
+    }
+    return true;
+}
+
+// Check that [p, end) is UTF-8 made up of XML characters
+static bool isChars(const char* p, const char* end)
+{
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(p);
+    const unsigned char* e = reinterpret_cast<const unsigned char*>(end);
+    while (s < e)
+    {
+	unsigned char c = *s;
+	if (c < 0x80)
+	{
+	    if (c < 0x20 && !isChar(c))
+		return false;
+	    s++;
+	    continue;
+	}
+
+	int n;
+	unsigned long code, least;
+	if (c >= 0xC2 && c <= 0xDF)
+	    n = 1, code = c & 0x1F, least = 0x80;
+	else if (c >= 0xE0 && c <= 0xEF)
+	    n = 2, code = c & 0x0F, least = 0x800;
+	else if (c >= 0xF0 && c <= 0xF4)
+	    n = 3, code = c & 0x07, least = 0x10000;
+	else
+	    return false;
+	if (e - s <= n)
+	    return false;
+	for (int i = 1; i <= n; i++)
+	{
+	    if ((s[i] & 0xC0) != 0x80)
+		return false;
+	    code = (code << 6) | (s[i] & 0x3F);
+	}
+	if (code < least || !isChar(code))
+	    return false;
+	s += n + 1;
+    }
+    return true;
+}
+
+// The number of bytes at the end of [p, end) which start a UTF-8
+// sequence that is not finished yet
+static size_t partialChar(const char* p, const char* end)
+{
+    for (int n = 1; n <= 3 && end - p >= n; n++)
+    {
+	unsigned char c = end[-n];
+	if ((c & 0xC0) != 0x80)
+	{
+	    int len = (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : (c >= 0xC0) ? 2 : 1;
+	    return (len > n) ? n : 0;
+	}
+    }
+    return 0;
+}
+
+// Check that [p, end), which starts with '&', is a reference up to
+// its ';', or if it is not whole, the start of one
+static bool isRef(const char* p, const char* end, bool whole)
+{
+    p++;
+    if (p == end)
+	return !whole;
+    if (*p != '#')
+    {
+	if (!isNameStart(*p))
+	    return false;
+	for (p++; p < end; p++)
+	{
+	    if (!isNameChar(*p))
+		return false;
+	}
+	return true;
+    }
+
+    p++;
+    bool hex = (p < end && *p == 'x');
+    if (hex)
+	p++;
+    if (p == end)
+	return !whole;
+    for (; p < end; p++)
+    {
+	if (hex ? !isxdigit((unsigned char)*p) : !isdigit((unsigned char)*p))
+	    return false;
+    }
+    return true;
+}
+
+// Check for the end of a CDATA section, which text may not have
+static bool hasSectionEnd(const char* p, const char* end)
+{
+    for (const char* q = p + 2; q < end; q++)
+    {
+	q = static_cast<const char*>(memchr(q, '>', end - q));
+	if (q == NULL)
+	    return false;
+	if (q[-1] == ']' && q[-2] == ']')
+	    return true;
+    }
+    return false;
+}
+
+// Append a character reference to dest as UTF-8
+static bool appendCharRef(unsigned long c, string& dest)
+{
+    if (!isChar(c))
+	return false;
+
+    if (c < 0x80)
+	dest += (char)c;
+    else if (c < 0x800)
+    {
+	dest += (char)(0xC0 | (c >> 6));
+	dest += (char)(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+	dest += (char)(0xE0 | (c >> 12));
+	dest += (char)(0x80 | ((c >> 6) & 0x3F));
+	dest += (char)(0x80 | (c & 0x3F));
+    }
+    else
+    {
+	dest += (char)(0xF0 | (c >> 18));
+	dest += (char)(0x80 | ((c >> 12) & 0x3F));
+	dest += (char)(0x80 | ((c >> 6) & 0x3F));
+	dest += (char)(0x80 | (c & 0x3F));
+    }
+    return true;
+}
+
+XMPPBackend::XMPPBackend()
+    : _pos(0), _end(0), _base(0), _prolog(true), _finished(false),
+      _event_index(-1), _event_count(0), _error(XML_ERROR_NONE),
+      _userdata(NULL), _start(NULL), _end_handler(NULL), _cdata(NULL)
+{}
+
+void XMPPBackend::reset(void* userdata, StartHandler start, EndHandler end,
+			CDATAHandler cdata)
+{
+    _pos = _end = 0;
+    _base = 0;
+    _open.clear();
+    _prolog = true;
+    _finished = false;
+    _event_index = -1;
+    _event_count = 0;
+    _error = XML_ERROR_NONE;
+
+    _userdata = userdata;
+    _start = start;
+    _end_handler = end;
+    _cdata = cdata;
+}
+
+bool XMPPBackend::parse(const char* data, int datasz)
+{
+    memcpy(getBuffer(datasz), data, datasz);
+    return parseBuffer(datasz);
+}
+
+char* XMPPBackend::getBuffer(int size)
+{
+    // Move the unparsed input to the front first
+    if (_pos > 0)
+    {
+	memmove(&_buf[0], &_buf[_pos], _end - _pos);
+	_base += _pos;
+	_end -= _pos;
+	_pos = 0;
+    }
+    if (_buf.size() <= _end + size)
+	_buf.resize(_end + size + 1);
+    return &_buf[_end];
+}
+
+bool XMPPBackend::parseBuffer(int datasz)
+{
+    _end += datasz;
+    return run();
+}
+
+// Tokenize as much of the buffered input as possible
+bool XMPPBackend::run()
+{
+    if (_error != XML_ERROR_NONE)
+	return false;
+
+    while (_pos < _end)
+    {
+	const char* p = &_buf[_pos];
+	const char* end = &_buf[0] + _end;
+	int n;
+
+	if (*p != '<')
+	    n = text(p, end);
+	else if (end - p < 2)
+	    n = 0;
+	else if (p[1] == '/')
+	    n = endTag(p, end);
+	else if (p[1] == '?' || p[1] == '!')
+	    n = special(p, end);
+	else
+	    n = startTag(p, end);
+
+	if (n < 0)
+	    return false;
+	if (n == 0)
+	    break;
+	_pos += n;
+    }
+    return true;
+}
+
+// Character data up to the next tag
+int XMPPBackend::text(const char* p, const char* end)
+{
+    const char* lt = static_cast<const char*>(memchr(p, '<', end - p));
+    const char* stop = (lt != NULL) ? lt : end;
+
+    // Outside the root element only whitespace, and a byte order
+    // mark at the very start, are allowed
+    if (_open.empty())
+    {
+	if (_prolog && offset(p) == 0 && (unsigned char)*p == 0xEF)
+	{
+	    if (end - p < 3)
+		return 0;
+	    if (memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+		return 3;
+	}
+	for (const char* q = p; q < stop; q++)
+	{
+	    if (!isSpace(*q))
+		return fail(_finished ? XML_ERROR_JUNK_AFTER_DOC_ELEMENT : XML_ERROR_SYNTAX);
+	}
+	_prolog = false;
+	return stop - p;
+    }
+
+    // Hold back what the next input may complete: a reference, for
+    // however long it is until its ';' comes or it goes bad, a UTF-8
+    // sequence, a "]]" which may be the start of "]]>", or a CR
+    if (lt == NULL)
+    {
+	const char* q = stop;
+	while (q > p && q[-1] != ';' && q[-1] != '&')
+	    q--;
+	if (q > p && q[-1] == '&' && isRef(q - 1, stop, false))
+	    stop = q - 1;
+	stop -= partialChar(p, stop);
+	for (int i = 0; i < 2 && stop > p && stop[-1] == ']'; i++)
+	    stop--;
+	if (stop > p && stop[-1] == '\r')
+	    stop--;
+	if (stop == p)
+	    return 0;
+    }
+
+    if (!emitText(p, stop, p, false))
+	return -1;
+    return stop - p;
+}
+
+// Report character data, which is passed straight from the buffer
+// unless it has references or line ends to translate
+bool XMPPBackend::emitText(const char* p, const char* end, const char* token, bool section)
+{
+    _event_index = offset(token);
+    _event_count = (section ? end + 3 : end) - token;
+
+    if (!isChars(p, end) || (!section && hasSectionEnd(p, end)))
+    {
+	fail(XML_ERROR_INVALID_TOKEN);
+	return false;
+    }
+
+    if ((section || memchr(p, '&', end - p) == NULL) && memchr(p, '\r', end - p) == NULL)
+    {
+	_cdata(_userdata, p, end - p);
+	return true;
+    }
+
+    if (section)
+    {
+	_text.clear();
+	for (; p < end; p++)
+	{
+	    if (*p != '\r')
+		_text += *p;
+	    else if (p + 1 == end || p[1] != '\n')
+		_text += '\n';
+	}
+    }
+    else if (!decode(p, end, _text, false))
+	return false;
+
+    _cdata(_userdata, _text.data(), _text.size());
+    return true;
+}
+
+// Expand references and normalize line ends (and, in attribute
+// values, other whitespace)
+bool XMPPBackend::decode(const char* p, const char* end, string& dest, bool attrib)
+{
+    dest.clear();
+    while (p < end)
+    {
+	char c = *p;
+	if (c == '&')
+	{
+	    const char* semi = static_cast<const char*>(memchr(p, ';', end - p));
+	    if (semi == NULL || !isRef(p, semi, true))
+	    {
+		fail(XML_ERROR_INVALID_TOKEN);
+		return false;
+	    }
+	    const char* ent = p + 1;
+	    size_t len = semi - ent;
+	    if (len > 1 && ent[0] == '#')
+	    {
+		bool hex = (ent[1] == 'x');
+		const char* digits = hex ? ent + 2 : ent + 1;
+		char* numend;
+		unsigned long code = strtoul(digits, &numend, hex ? 16 : 10);
+		if (numend != semi || !isxdigit((unsigned char)*digits) ||
+		    !appendCharRef(code, dest))
+		{
+		    fail(XML_ERROR_BAD_CHAR_REF);
+		    return false;
+		}
+	    }
+	    else if (len == 3 && memcmp(ent, "amp", 3) == 0)
+		dest += '&';
+	    else if (len == 2 && memcmp(ent, "lt", 2) == 0)
+		dest += '<';
+	    else if (len == 2 && memcmp(ent, "gt", 2) == 0)
+		dest += '>';
+	    else if (len == 4 && memcmp(ent, "quot", 4) == 0)
+		dest += '"';
+	    else if (len == 4 && memcmp(ent, "apos", 4) == 0)
+		dest += '\'';
+	    else
+	    {
+		fail(XML_ERROR_UNDEFINED_ENTITY);
+		return false;
+	    }
+	    p = semi + 1;
+	}
+	else if (c == '\r')
+	{
+	    dest += attrib ? ' ' : '\n';
+	    p++;
+	    if (p < end && *p == '\n')
+		p++;
+	}
+	else if (attrib && (c == '\n' || c == '\t'))
+	{
+	    dest += ' ';
+	    p++;
+	}
+	else if (attrib && c == '<')
+	{
+	    fail(XML_ERROR_INVALID_TOKEN);
+	    return false;
+	}
+	else
+	{
+	    dest += c;
+	    p++;
+	}
+    }
+    return true;
+}
+
+// Start tag or empty element tag
+int XMPPBackend::startTag(const char* p, const char* end)
+{
+    if (_finished)
+	return fail(XML_ERROR_JUNK_AFTER_DOC_ELEMENT);
+
+    // Find the end of the tag, skipping over attribute values; a
+    // quote can only start a value, right after the '='
+    const char* q = p + 1;
+    bool assign = false;
+    for (;;)
+    {
+	if (q >= end)
+	    return 0;
+	char c = *q;
+	if (c == '>')
+	    break;
+	if (c == '"' || c == '\'')
+	{
+	    if (!assign)
+		return fail(XML_ERROR_INVALID_TOKEN);
+	    const char* close = static_cast<const char*>(memchr(q + 1, c, end - q - 1));
+	    const char* lt = static_cast<const char*>(memchr(q + 1, '<', (close ? close : end) - q - 1));
+	    if (lt != NULL)
+		return fail(XML_ERROR_INVALID_TOKEN);
+	    if (close == NULL)
+		return 0;
+	    q = close;
+	    assign = false;
+	}
+	else if (c == '<')
+	    return fail(XML_ERROR_INVALID_TOKEN);
+	else if (!isSpace(c))
+	    assign = (c == '=');
+	q++;
+    }
+    const char* gt = q;
+    bool empty = (gt[-1] == '/');
+    const char* tagend = empty ? gt - 1 : gt;
+    if (!isChars(p + 1, gt))
+	return fail(XML_ERROR_INVALID_TOKEN);
+
+    // Element name
+    const char* name = p + 1;
+    for (q = name; q < tagend && !isSpace(*q); q++)
+	;
+    if (!isName(name, q))
+	return fail(XML_ERROR_INVALID_TOKEN);
+    if (_strings.empty())
+	_strings.resize(1);
+    _strings[0].assign(name, q);
+
+    // Attributes
+    size_t count = 1;
+    for (;;)
+    {
+	const char* ws = q;
+	while (q < tagend && isSpace(*q))
+	    q++;
+	if (q == tagend)
+	    break;
+	if (q == ws)
+	    return fail(XML_ERROR_INVALID_TOKEN);
+
+	const char* aname = q;
+	while (q < tagend && *q != '=' && !isSpace(*q))
+	    q++;
+	const char* anameend = q;
+	while (q < tagend && isSpace(*q))
+	    q++;
+	if (!isName(aname, anameend) || q == tagend || *q != '=')
+	    return fail(XML_ERROR_INVALID_TOKEN);
+	q++;
+	while (q < tagend && isSpace(*q))
+	    q++;
+	if (q == tagend || (*q != '"' && *q != '\''))
+	    return fail(XML_ERROR_INVALID_TOKEN);
+	const char* value = q + 1;
+	q = static_cast<const char*>(memchr(value, *q, tagend - value));
+	if (q == NULL)
+	    return fail(XML_ERROR_INVALID_TOKEN);
+
+	if (_strings.size() < count + 2)
+	    _strings.resize(count + 2);
+	_strings[count].assign(aname, anameend);
+	for (size_t i = 1; i < count; i += 2)
+	{
+	    if (_strings[i] == _strings[count])
+		return fail(XML_ERROR_DUPLICATE_ATTRIBUTE);
+	}
+	if (!decode(value, q, _strings[count + 1], true))
+	    return -1;
+	count += 2;
+	q++;
+    }
+
+    _attribs.clear();
+    for (size_t i = 1; i < count; i++)
+	_attribs.push_back(_strings[i].c_str());
+    _attribs.push_back(NULL);
+
+    _prolog = false;
+    _open.push_back(_strings[0]);
+    _event_index = offset(p);
+    _event_count = gt + 1 - p;
+    _start(_userdata, _open.back().c_str(), &_attribs[0]);
+
+    // Empty elements end right after the tag, like with expat
+    if (empty)
+    {
+	_event_index += _event_count;
+	_event_count = 0;
+	_end_handler(_userdata, _open.back().c_str());
+	_open.pop_back();
+	_finished = _open.empty();
+    }
+    return gt + 1 - p;
+}
+
+// End tag
+int XMPPBackend::endTag(const char* p, const char* end)
+{
+    const char* gt = static_cast<const char*>(memchr(p + 2, '>', end - p - 2));
+    if (gt == NULL)
+	return 0;
+
+    const char* name = p + 2;
+    const char* nameend = gt;
+    while (nameend > name && isSpace(nameend[-1]))
+	nameend--;
+    if (_open.empty() || _open.back().size() != (size_t)(nameend - name) ||
+	memcmp(_open.back().data(), name, nameend - name) != 0)
+	return fail(XML_ERROR_TAG_MISMATCH);
+
+    _event_index = offset(p);
+    _event_count = gt + 1 - p;
+    _end_handler(_userdata, _open.back().c_str());
+    _open.pop_back();
+    _finished = _open.empty();
+    return gt + 1 - p;
+}
+
+// XML declaration or CDATA section; comments, DTDs and other
+// processing instructions are not allowed in XMPP
+int XMPPBackend::special(const char* p, const char* end)
+{
+    if (p[1] == '?')
+    {
+	if (end - p < 6)
+	    return 0;
+	if (memcmp(p, "<?xml", 5) != 0 || !isSpace(p[5]))
+	    return fail(XML_ERROR_SYNTAX);
+	if (!_prolog)
+	    return fail(XML_ERROR_MISPLACED_XML_PI);
+
+	const char* q = p + 2;
+	for (;;)
+	{
+	    q = static_cast<const char*>(memchr(q, '?', end - q));
+	    if (q == NULL || end - q < 2)
+		return 0;
+	    if (q[1] == '>')
+		break;
+	    q++;
+	}
+
+	// Only UTF-8 is supported
+	string decl(p, q);
+	string::size_type enc = decl.find("encoding");
+	if (enc != string::npos)
+	{
+	    string::size_type quote = decl.find_first_of("'\"", enc);
+	    string::size_type close = (quote != string::npos) ? 
+		decl.find(decl[quote], quote + 1) : string::npos;
+	    if (close == string::npos)
+		return fail(XML_ERROR_SYNTAX);
+	    string name = decl.substr(quote + 1, close - quote - 1);
+	    transform(name.begin(), name.end(), name.begin(), ::toupper);
+	    if (name != "UTF-8")
+		return fail(XML_ERROR_UNKNOWN_ENCODING);
+	}
+	_prolog = false;
+	return q + 2 - p;
+    }
+
+    static const char section[] = "<![CDATA[";
+    size_t n = min((size_t)(end - p), sizeof(section) - 1);
+    if (memcmp(p, section, n) != 0)
+	return fail(XML_ERROR_SYNTAX);
+    if (n < sizeof(section) - 1)
+	return 0;
+    if (_open.empty())
+	return fail(XML_ERROR_SYNTAX);
+
+    const char* data = p + sizeof(section) - 1;
+    const char* q = data;
+    for (;;)
+    {
+	q = static_cast<const char*>(memchr(q, ']', end - q));
+	if (q == NULL || end - q < 3)
+	    return 0;
+	if (q[1] == ']' && q[2] == '>')
+	    break;
+	q++;
+    }
+    if (!emitText(data, q, p, true))
+	return -1;
+    return q + 3 - p;
+}
@@ -2,21 +2,94 @@
 #include "XPathOps.h"
 #include "XPathFunctions.h"
 
+#include <algorithm>
+#include <mutex>
+
 using namespace std;
 using namespace judo;
 using namespace judo::XPath;
 
-FunctionMap judo::XPath::functions;
+/**
+* The parsed form of a query, shared by every Query built from the
+* same string.
+*/
+class Query::Compiled
+{
+public:
+    Compiled(const std::string& query);
+    ~Compiled();
+
+    OpList _ops;
+    Program _program;
+
+private:
+    std::string _query;
+
+    void deleteOps();
+    bool parseQuery();
+    char getNextToken(std::string::size_type& cur);
+    std::string getNextIdentifier(std::string::size_type& pos);
+    Op* getOp(std::string::size_type& pos, char in_context = 0);
+};
+
+namespace
+{
+    // Characters which end an identifier
+    struct TokenTable
+    {
+        bool is_token[256];
+
+        TokenTable()
+        {
+            const char* tokens = "/[]@\"'=!():, ";
+            for (int i = 0; i < 256; ++i)
+                is_token[i] = false;
+            for (const char* t = tokens; *t != '\0'; ++t)
+                is_token[(unsigned char)*t] = true;
+        }
+    };
+    const TokenTable token_table;
+}
+
+Query::Compiled::Compiled(const std::string& query) :
+    _query(query)
+{
+    try
+    {
+        if (!parseQuery())
+            throw Invalid();
+        for (OpList::iterator it = _ops.begin(); it != _ops.end(); ++it)
+            (*it)->compile(_program);
+    }
+    catch (...)
+    {
+        deleteOps();
+        throw;
+    }
+}
+
+Query::Compiled::~Compiled()
+{
+    deleteOps();
+}
 
-char Query::getNextToken(string::size_type& cur)
+void Query::Compiled::deleteOps()
+{
+    while (!_ops.empty())
+    {
+        Op *op = _ops.back();
+        _ops.pop_back();
+        delete op;
+    }
+}
+
+char Query::Compiled::getNextToken(string::size_type& cur)
 {
     if (cur == std::string::npos)
         return 0;
 
-    std::list<char>::iterator it = find (_tokens.begin(), _tokens.end(),
-            _query[cur]);;
-
-    while (it == _tokens.end())
+    while (cur >= _query.length() || 
+           !token_table.is_token[(unsigned char)_query[cur]])
     {
         cur++;
         if (cur > _query.length())
@@ -24,19 +97,18 @@ char Query::getNextToken(string::size_type& cur)
             cur = _query.length();
             return 0;
         }
-        it = find(_tokens.begin(), _tokens.end(), _query[cur]);
     }
-    return *it;
+    return _query[cur];
 }
 
-std::string Query::getNextIdentifier(string::size_type& pos)
+std::string Query::Compiled::getNextIdentifier(string::size_type& pos)
 {
     string::size_type sp = pos;
     getNextToken(pos);
     return _query.substr(sp, pos - sp);
 }
 
-Op* Query::getOp(std::string::size_type& pos, char in_context)
+Op* Query::Compiled::getOp(std::string::size_type& pos, char in_context)
 {
     Op* ret_op = NULL;
 
@@ -178,13 +250,14 @@ Op* Query::getOp(std::string::size_type& pos, char in_context)
                     if (!ident.empty())
                     {
                         int op_pos = _ops.size();
-                        if (XPath::functions.count(ident) == 0)
+                        Function* func = find_function(ident);
+                        if (func == NULL)
                         {
                             std::cerr << "No function named " << ident << 
                                 " has been defined." << std::endl;
                             throw Invalid();
                         }
-                        ret_op = new FunctionOp(ident);
+                        ret_op = new FunctionOp(ident, func);
 
                         getOp(pos, token);
 
@@ -262,7 +335,7 @@ Op* Query::getOp(std::string::size_type& pos, char in_context)
     return ret_op;
 }
 
-bool Query::parseQuery()
+bool Query::Compiled::parseQuery()
 {
     Op* op = NULL;
     string::size_type pos = 0;
@@ -279,58 +352,536 @@ bool Query::parseQuery()
     return true;
 }
     
-bool Query::check(const judo::Element& root)
+Query::Query(const std::string query) :
+    _compiled(compile(query))
+{ }
+
+std::shared_ptr<const Query::Compiled> Query::compile(const std::string& query)
 {
-    judo::Element check_elem(root);
-    Value* ctxt = execute(&check_elem);
-    bool matched = ctxt->check();
-    delete ctxt;
-    return matched;
+    // Entries only last while some Query holds them, so queries built
+    // from untrusted or changing text don't pile up
+    typedef std::map<std::string, std::weak_ptr<const Compiled> > Cache;
+    static Cache cache;
+    static size_t sweep_at = 64;
+    static std::mutex cache_lock;
+
+    std::lock_guard<std::mutex> lock(cache_lock);
+    Cache::iterator it = cache.find(query);
+    if (it != cache.end())
+    {
+        std::shared_ptr<const Compiled> compiled = it->second.lock();
+        if (compiled)
+            return compiled;
+    }
+
+    std::shared_ptr<const Compiled> compiled(new Compiled(query));
+    if (it != cache.end())
+        it->second = compiled;
+    else
+        cache.insert(Cache::value_type(query, compiled));
+
+    // Drop the entries of dead queries once the cache has doubled
+    if (cache.size() >= sweep_at)
+    {
+        for (it = cache.begin(); it != cache.end(); )
+        {
+            if (it->second.expired())
+                cache.erase(it++);
+            else
+                ++it;
+        }
+        sweep_at = std::max<size_t>(64, cache.size() * 2);
+    }
+    return compiled;
+}
+
+const Query::OpList& Query::getOps() const
+{
+    return _compiled->_ops;
+}
+
+bool Query::check(const judo::Element& root) const
+{
+    return _compiled->_program.run(root, NULL);
+}
+
+Op::Match Query::checkStart(const char* name, const char** attribs) const
+{
+    const OpList& ops = _compiled->_ops;
+
+    // The root step, then any predicates on the root
+    Op::Match result = Op::MATCH_YES;
+    for (OpList::const_iterator it = ops.begin(); it != ops.end(); ++it)
+    {
+        if (it != ops.begin() && !(*it)->isType(Op::OP_CONTEXT_CONDITION))
+            return Op::MATCH_UNKNOWN;
+
+        Op::Match m = (*it)->checkStart(name, attribs);
+        if (m == Op::MATCH_NO)
+            return Op::MATCH_NO;
+        if (m == Op::MATCH_UNKNOWN)
+        {
+            if (it == ops.begin())
+                return Op::MATCH_UNKNOWN;
+            result = Op::MATCH_UNKNOWN;
+        }
+    }
+    return result;
 }
 
 Value* Query::execute(judo::Element* root)
 {
-    OpList::iterator it = _ops.begin();
+    Value* ctxt = new Value();
+    ctxt->setMatch(_compiled->_program.run(*root, ctxt));
+    return ctxt;
+}
 
-    Value* ctxt = new Value(root);
-    
-    for (;it != _ops.end(); it++)
+int Op::compileStr(Program& prog)
+{
+    return prog.addOperand(Program::Operand::CONST, _value);
+}
+
+int Program::emit(Instr::Code code, const std::string& name, bool flag)
+{
+    _code.push_back(Instr(code, name, flag));
+    return _code.size() - 1;
+}
+
+void Program::endPredicate(int at, int which)
+{
+    Instr& instr = _code[at];
+    int start = at + 1 + (which == 0 ? 0 : instr.len[0]);
+    instr.len[which] = _code.size() - start;
+}
+
+int Program::addOperand(Operand::Kind kind, const std::string& str)
+{
+    Operand operand;
+    operand.kind = kind;
+    operand.str = str;
+    operand.func = NULL;
+    operand.args = NULL;
+    _operands.push_back(operand);
+    return _operands.size() - 1;
+}
+
+void Program::compileCall(Function* func, const std::string& name, 
+                          Op::OpList& args)
+{
+    if (dynamic_cast<TextFunction*>(func) != NULL)
+        emit(Instr::TEXT);
+    else if (dynamic_cast<NameFunction*>(func) != NULL)
+        emit(Instr::NAME);
+    else if (dynamic_cast<NotFunction*>(func) != NULL)
+    {
+        if (args.empty())
+            throw Query::Invalid();
+        int at = emit(Instr::NOT);
+        args[0]->compile(*this);
+        endPredicate(at, 0);
+    }
+    else if (dynamic_cast<StartsWithFunction*>(func) != NULL)
+    {
+        if (args.size() < 2)
+            throw Query::Invalid();
+        int at = emit(Instr::STARTS_WITH);
+        int str0 = args[0]->compileStr(*this);
+        int str1 = args[1]->compileStr(*this);
+        _code[at].str[0] = str0;
+        _code[at].str[1] = str1;
+    }
+    else
+    {
+        int at = emit(Instr::CALL, name);
+        _code[at].func = func;
+        _code[at].args = &args;
+    }
+}
+
+int Program::compileCallStr(Function* func, const std::string& name, 
+                            Op::OpList& args)
+{
+    if (dynamic_cast<TextFunction*>(func) != NULL)
+        return addOperand(Operand::CDATA);
+    else if (dynamic_cast<NameFunction*>(func) != NULL)
+        return addOperand(Operand::NAME);
+    else if (dynamic_cast<NotFunction*>(func) != NULL ||
+             dynamic_cast<StartsWithFunction*>(func) != NULL)
+        return addOperand(Operand::CONST);
+
+    int idx = addOperand(Operand::CALL, name);
+    _operands[idx].func = func;
+    _operands[idx].args = &args;
+    return idx;
+}
+
+namespace
+{
+    const std::string empty_str;
+
+    // Move the node set built above top down to base
+    inline bool replaceSet(std::vector<const judo::Element*>& st, 
+                           size_t base, size_t top)
+    {
+        st.erase(st.begin() + base, st.begin() + top);
+        return st.size() > base;
+    }
+
+    void descend(std::vector<const judo::Element*>& st, 
+                 const judo::Element* elem, const Program::Instr& instr)
+    {
+        if (instr.flag || elem->getName() == instr.name)
+            st.push_back(elem);
+
+        for (judo::Element::const_iterator it = elem->begin(); 
+             it != elem->end(); ++it)
+        {
+            if ((*it)->getType() == Node::ntElement)
+                descend(st, static_cast<const judo::Element*>(*it), instr);
+        }
+    }
+}
+
+bool Program::run(const judo::Element& root, Value* result) const
+{
+    // Node sets live on one stack per thread, so running a query
+    // doesn't allocate once the stack has grown
+    static thread_local Stack stack;
+
+    struct Restore
+    {
+        Stack& st;
+        size_t base;
+        ~Restore() { st.resize(base); }
+    } restore = { stack, stack.size() };
+
+    size_t base = stack.size();
+    stack.push_back(&root);
+    bool matched = run(0, _code.size(), stack, base, false, result);
+
+    if (result != NULL)
     {
-        //(*it)->display();
-        if (!(*it)->isValid(ctxt))
+        Value::ElemList& elems = result->getList();
+        elems.clear();
+        elems.reserve(stack.size() - base);
+        for (size_t i = base; i < stack.size(); ++i)
+            elems.push_back(const_cast<judo::Element*>(stack[i]));
+    }
+    return matched;
+}
+
+bool Program::runOn(const judo::Element* elem, int pc, int end, Stack& st) const
+{
+    size_t base = st.size();
+    st.push_back(elem);
+    bool valid = run(pc, end, st, base, true, NULL);
+    st.resize(base);
+    return valid;
+}
+
+const std::string& Program::operandStr(int idx, const judo::Element* elem,
+                                       std::string& scratch) const
+{
+    const Operand& operand = _operands[idx];
+    switch (operand.kind)
+    {
+    case Operand::CONST:
+        return operand.str;
+    case Operand::CDATA:
+        for (judo::Element::const_iterator it = elem->begin(); 
+             it != elem->end(); ++it)
         {
-            //(*it)->display();
-            ctxt->setMatch(false);
-            return ctxt;
+            if ((*it)->getType() == Node::ntCDATA)
+                return static_cast<const judo::CDATA*>(*it)->getText();
         }
+        return empty_str;
+    case Operand::ATTRIB:
+    {
+        const std::string* value = elem->findAttrib(operand.str);
+        return (value != NULL) ? *value : empty_str;
+    }
+    case Operand::NAME:
+        return elem->getName();
+    case Operand::CALL:
+        scratch = operand.func->value(const_cast<judo::Element*>(elem), 
+                                      *operand.args);
+        return scratch;
     }
+    return empty_str;
+}
 
-    /* XXX DEBUG 
-    Value::ElemList elems = ctxt.getList();
-    for(Value::ElemList::iterator it = elems.begin(); it != elems.end(); 
-            it++)
+bool Program::run(int pc, int end, Stack& st, size_t base, 
+                  bool in_context, Value* result) const
+{
+    std::string scratch_lh, scratch_rh;
+
+    for (; pc < end; ++pc)
     {
-        std::cout << "Ctxt Entry: " << (*it)->toString() << std::endl;
+        const Instr& instr = _code[pc];
+        size_t top = st.size();
+        size_t out = base;
+
+        switch (instr.code)
+        {
+        case Instr::ROOT:
+            if (st[base]->getName() != instr.name)
+                return false;
+            break;
+
+        case Instr::CHILD:
+            // In a predicate this only tests for the children
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                bool valid = false;
+                for (judo::Element::const_iterator it = elem->begin(); 
+                     it != elem->end(); ++it)
+                {
+                    if ((*it)->getType() != Node::ntElement ||
+                        !(instr.flag || (*it)->getName() == instr.name))
+                        continue;
+                    if (in_context)
+                    {
+                        valid = true;
+                        break;
+                    }
+                    st.push_back(static_cast<const judo::Element*>(*it));
+                }
+                if (valid)
+                    st.push_back(elem);
+            }
+            if (!replaceSet(st, base, top))
+                return false;
+            break;
+
+        case Instr::DESCEND:
+            for (size_t i = base; i < top; ++i)
+                descend(st, st[i], instr);
+            if (!replaceSet(st, base, top))
+                return false;
+            break;
+
+        case Instr::ATTRIB:
+        {
+            Value::ValueList values;
+            Value::AttribMap attribs;
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                if (instr.flag)
+                {
+                    Value::AttribMap elem_attribs = elem->getAttribs();
+                    if (elem_attribs.empty())
+                        continue;
+                    if (result != NULL)
+                    {
+                        for (Value::AttribMap::iterator it = elem_attribs.begin();
+                             it != elem_attribs.end(); ++it)
+                            attribs[it->first] = it->second;
+                    }
+                }
+                else
+                {
+                    const std::string* value = elem->findAttrib(instr.name);
+                    if (value == NULL || value->empty())
+                        continue;
+                    if (result != NULL)
+                        values.push_back(*value);
+                }
+                st[out++] = elem;
+            }
+            st.resize(out);
+            if (out == base)
+                return false;
+            if (result != NULL)
+            {
+                result->setValues(values);
+                result->setAttribs(attribs);
+            }
+            break;
+        }
+
+        case Instr::POSITION:
+            if (instr.pos > (int)(top - base))
+                return false;
+            st[base] = st[base + instr.pos - 1];
+            st.resize(base + 1);
+            break;
+
+        case Instr::FILTER:
+        case Instr::NOT:
+        {
+            int sub_end = pc + 1 + instr.len[0];
+            bool keep = (instr.code == Instr::FILTER);
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                if (runOn(elem, pc + 1, sub_end, st) == keep)
+                    st[out++] = elem;
+            }
+            st.resize(out);
+            pc = sub_end - 1;
+            if (out == base)
+                return false;
+            break;
+        }
+
+        case Instr::OR:
+        {
+            int lh_end = pc + 1 + instr.len[0];
+            int rh_end = lh_end + instr.len[1];
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                if (runOn(elem, pc + 1, lh_end, st) || 
+                    runOn(elem, lh_end, rh_end, st))
+                    st[out++] = elem;
+            }
+            st.resize(out);
+            pc = rh_end - 1;
+            if (out == base)
+                return false;
+            break;
+        }
+
+        case Instr::COMPARE:
+        {
+            // Both sides run on a copy of the set, and the set holds
+            // if the operands are (un)equal on any node left in it
+            int lh_end = pc + 1 + instr.len[0];
+            int rh_end = lh_end + instr.len[1];
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                st.push_back(elem);
+            }
+            bool valid = run(pc + 1, lh_end, st, top, false, NULL) &&
+                run(lh_end, rh_end, st, top, false, NULL);
+            if (valid)
+            {
+                valid = false;
+                for (size_t i = top; i < st.size() && !valid; ++i)
+                {
+                    const std::string& lh = operandStr(instr.str[0], st[i], scratch_lh);
+                    const std::string& rh = operandStr(instr.str[1], st[i], scratch_rh);
+                    valid = ((lh == rh) == instr.flag);
+                }
+            }
+            st.resize(top);
+            pc = rh_end - 1;
+            if (!valid)
+                return false;
+            break;
+        }
+
+        case Instr::STARTS_WITH:
+            for (size_t i = base; i < top; ++i)
+            {
+                const judo::Element* elem = st[i];
+                const std::string& str = operandStr(instr.str[0], elem, scratch_lh);
+                const std::string& prefix = operandStr(instr.str[1], elem, scratch_rh);
+                if (str.compare(0, prefix.size(), prefix) == 0)
+                    st[out++] = elem;
+            }
+            st.resize(out);
+            if (out == base)
+                return false;
+            break;
+
+        case Instr::TEXT:
+        case Instr::NAME:
+            if (top == base)
+                return false;
+            if (result != NULL)
+            {
+                Value::ValueList values;
+                for (size_t i = base; i < top; ++i)
+                {
+                    if (instr.code == Instr::TEXT)
+                        values.push_back(st[i]->getCDATA());
+                    else
+                        values.push_back(st[i]->getName());
+                }
+                result->setValues(values);
+            }
+            break;
+
+        case Instr::CALL:
+        {
+            // Functions get the set as a Value, as they always have
+            Value ctxt;
+            Value::ElemList& elems = ctxt.getList();
+            elems.reserve(top - base);
+            for (size_t i = base; i < top; ++i)
+                elems.push_back(const_cast<judo::Element*>(st[i]));
+            ctxt.in_context(in_context);
+            bool valid = instr.func->run(&ctxt, *instr.args);
+
+            st.resize(base);
+            st.insert(st.end(), elems.begin(), elems.end());
+            if (result != NULL)
+            {
+                result->setValues(ctxt.getValues());
+                result->setAttribs(ctxt.getAttribs());
+            }
+            if (!valid)
+                return false;
+            break;
+        }
+        }
     }
-    */
-    ctxt->setMatch(true);
-    return ctxt;
+    return true;
 }
 
-void XPath::init_functions()
+namespace
 {
-    functions.clear();
-    functions.insert(FunctionMap::value_type("text", new TextFunction()));
-    functions.insert(FunctionMap::value_type("name", new NameFunction()));
-    functions.insert(FunctionMap::value_type("not", new NotFunction()));
-    functions.insert(FunctionMap::value_type("starts-with", new StartsWithFunction()));
+    // Functions by name, filled with the builtins on first use.  C++11
+    // makes the construction of the static itself thread-safe.
+    struct Registry
+    {
+        Registry()
+        {
+            functions.insert(FunctionMap::value_type("text", new TextFunction()));
+            functions.insert(FunctionMap::value_type("name", new NameFunction()));
+            functions.insert(FunctionMap::value_type("not", new NotFunction()));
+            functions.insert(FunctionMap::value_type("starts-with", new StartsWithFunction()));
+        }
+
+        ~Registry()
+        {
+            for (FunctionMap::iterator it = functions.begin();
+                 it != functions.end(); ++it)
+                delete it->second;
+        }
+
+        std::mutex lock;
+        FunctionMap functions;
+    };
+
+    Registry& registry()
+    {
+        static Registry reg;
+        return reg;
+    }
 }
 
-void XPath::add_function(const std::string& name, XPath::Function* func)
+Function* XPath::find_function(const std::string& name)
 {
-    if (XPath::functions.empty())
-        init_functions();
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    FunctionMap::iterator it = reg.functions.find(name);
+    return (it != reg.functions.end()) ? it->second : NULL;
+}
 
-    XPath::functions.insert(FunctionMap::value_type(name, func));
+bool XPath::add_function(const std::string& name, XPath::Function* func)
+{
+    Registry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.lock);
+    if (!reg.functions.insert(FunctionMap::value_type(name, func)).second)
+    {
+        delete func;
+        return false;
+    }
+    return true;
 }
 
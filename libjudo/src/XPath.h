@@ -4,6 +4,7 @@
 #include "judo.hpp"
 
 #include <vector>
+#include <memory>
 #include <iostream>
 
 namespace judo
@@ -11,13 +12,16 @@ namespace judo
     namespace XPath
     {
         /**
-         * Represents a result from a XPath query.
+         * Represents a result from a XPath query. Node sets are
+         * vectors; filter them in place rather than erasing one
+         * node at a time. Like Elements, they allocate from the
+         * default MemoryResource.
          */
         class Value
         {
         public:
-            typedef std::list<judo::Element*> ElemList;
-            typedef std::list<std::string> ValueList;
+            typedef std::vector<judo::Element*, Allocator<judo::Element*> > ElemList;
+            typedef std::vector<std::string, Allocator<std::string> > ValueList;
             typedef std::map<std::string,std::string> AttribMap;
 
             Value(judo::Element* elem)
@@ -52,17 +56,6 @@ namespace judo
                 _in_context = false;
             }
 
-            ~Value()
-            {
-                #if 0
-                for(ElemList::iterator it = _elems.begin(); 
-                    it != _elems.end(); ++ it)
-                {
-                    delete *it;
-                }
-                #endif
-            }
-            
             judo::Element* getElem() const { return _elems.front(); }
             ElemList&  getList() { return _elems; }
             void setElems(ElemList& elems) { _elems = elems; }
@@ -72,6 +65,19 @@ namespace judo
                 _elems.push_back(elem);
             }
 
+            /**
+             * Make this a fresh context for one element, keeping the
+             * storage, so one Value can be used for a whole node set.
+             */
+            void reset(judo::Element* elem, bool in_context)
+            {
+                setElems(elem);
+                _values.clear();
+                _attribs.clear();
+                _matched = false;
+                _in_context = in_context;
+            }
+
             const std::string getValue() const { return _values.front(); }
             ValueList& getValues() { return _values; }
             void setValues(ValueList& values) { _values = values; }
@@ -116,6 +122,8 @@ namespace judo
             bool _in_context;
         };
         
+        class Program;
+
         class Op
         {
         public:
@@ -135,6 +143,17 @@ namespace judo
                 OP_FUNCTION
             };
 
+            /**
+             * Outcome of deciding a query from a start tag alone.
+             * @see Query::checkStart
+             */
+            enum Match
+            {
+                MATCH_NO,
+                MATCH_YES,
+                MATCH_UNKNOWN
+            };
+
             Op(Type op, const std::string& value) :
                 _op(op), _value(value)
             { }
@@ -157,6 +176,46 @@ namespace judo
                 return true;
             }
 
+            /**
+             * Decide this op for an element of which only the start
+             * tag has been read.
+             * @param name Element name
+             * @param attribs Expat-style attributes of the element
+             */
+            virtual Match checkStart(const char* name, const char** attribs)
+            {
+                return MATCH_UNKNOWN;
+            }
+
+            /**
+             * Compute calcStr() for an element of which only the start
+             * tag has been read.
+             * @param attribs Expat-style attributes of the element
+             * @param value Receives the string
+             * @return MATCH_NO if isValid() would fail on the element
+             */
+            virtual Match startStr(const char** attribs, std::string& value)
+            {
+                if (_op != OP_LITERAL)
+                    return MATCH_UNKNOWN;
+                value = _value;
+                return MATCH_YES;
+            }
+
+            /**
+             * Append the instructions which do what isValid() does
+             * to a program.
+             */
+            virtual void compile(Program& prog)
+            { }
+
+            /**
+             * Add an operand to a program which computes what
+             * calcStr() does.
+             * @return Index of the operand
+             */
+            virtual int compileStr(Program& prog);
+
             void display()
             {
                 std::string type_str;
@@ -221,55 +280,161 @@ namespace judo
         // Function map
         struct Function
         {
+            virtual ~Function() { }
             virtual bool run(Value* ctxt, Op::OpList& args) = 0;
             virtual std::string value(judo::Element* elem, Op::OpList& args) 
             { return std::string(""); };
         };
         typedef std::map<std::string, XPath::Function*> FunctionMap;
-        extern FunctionMap functions;
-        void init_functions();
-        void add_function(const std::string& name, XPath::Function* func);
 
+        /**
+        * Find a query function by name.  The builtin functions are
+        * registered the first time the registry is used.  Lookups take
+        * the registry lock, so queries resolve their functions once when
+        * they are parsed and evaluation never touches the registry.
+        * @return The function, or NULL if none is registered under name.
+        */
+        Function* find_function(const std::string& name);
 
         /**
-        * Represents a single XPath query string.
+        * Register a query function.  The registry owns func from here
+        * on.  Functions are never replaced, so if name is already
+        * registered func is deleted and the existing function kept; this
+        * makes it safe to register from code which may run many times.
+        * @return true if func was registered under name.
+        */
+        bool add_function(const std::string& name, XPath::Function* func);
+
+        /**
+        * A query compiled into a flat list of instructions, which are
+        * run by a single interpreter loop over a stack of node sets.
+        * Predicates are stored inline after the instruction which
+        * applies them, so a program is one contiguous array.
         */
-        class Query
+        class Program
         {
         public:
-            typedef std::vector<Op*> OpList;
-            Query(const std::string query) : 
-                _query(query)
-            { 
-                _tokens.push_back('/');
-                _tokens.push_back('[');
-                _tokens.push_back(']');
-                _tokens.push_back('@');
-                _tokens.push_back('\"');
-                _tokens.push_back('\'');
-                _tokens.push_back('=');
-                _tokens.push_back('!');
-                _tokens.push_back('(');
-                _tokens.push_back(')');
-                _tokens.push_back(':');
-                _tokens.push_back(' ');
-                _tokens.push_back(',');
-
-                if (XPath::functions.empty())
-                    init_functions();
-                if (!parseQuery())
-                    throw Invalid();
-            }
-
-            ~Query()
+            struct Instr
             {
-                while (!_ops.empty())
+                enum Code
                 {
-                    Op *op = _ops.back();
-                    _ops.pop_back();
-                    delete op;
+                    ROOT,           // Check the name of the root
+                    CHILD,          // Step to the named children
+                    DESCEND,        // Step to the named descendants-or-self
+                    ATTRIB,         // Keep nodes with the attribute
+                    POSITION,       // Keep the pos'th node
+                    FILTER,         // Keep nodes the predicate holds for
+                    OR,             // Keep nodes either predicate holds for
+                    NOT,            // Keep nodes the predicate fails for
+                    COMPARE,        // Compare two operands on the nodes
+                    STARTS_WITH,    // Keep nodes str[0] starts with str[1]
+                    TEXT,           // Collect the CDATA of the nodes
+                    NAME,           // Collect the names of the nodes
+                    CALL            // Run a user defined function
+                };
+
+                Instr(Code c, const std::string& n, bool f) :
+                    code(c), name(n), flag(f), pos(0), func(NULL), args(NULL)
+                {
+                    len[0] = len[1] = 0;
+                    str[0] = str[1] = -1;
                 }
+
+                Code code;
+                std::string name;
+                bool flag;          // '*' for steps, equality for COMPARE
+                int pos;
+                int len[2];         // Lengths of the inline predicates
+                int str[2];         // Operands of COMPARE and STARTS_WITH
+                Function* func;
+                Op::OpList* args;
+            };
+
+            struct Operand
+            {
+                enum Kind
+                {
+                    CONST,
+                    CDATA,
+                    ATTRIB,
+                    NAME,
+                    CALL
+                };
+
+                Kind kind;
+                std::string str;
+                Function* func;
+                Op::OpList* args;
+            };
+
+            /**
+             * Append an instruction.
+             * @return Index of the instruction
+             */
+            int emit(Instr::Code code, const std::string& name = "", 
+                     bool flag = false);
+            /**
+             * Finish an inline predicate of an instruction, which is
+             * everything emitted since the instruction or its
+             * previous predicate.
+             */
+            void endPredicate(int at, int which);
+            int addOperand(Operand::Kind kind, const std::string& str = "");
+            Instr& at(int pos) { return _code[pos]; }
+            int size() const { return _code.size(); }
+
+            /**
+             * Compile a call to a function, replacing the built in
+             * ones with instructions.
+             */
+            void compileCall(Function* func, const std::string& name, 
+                             Op::OpList& args);
+            int compileCallStr(Function* func, const std::string& name, 
+                               Op::OpList& args);
+
+            /**
+             * Run the program on an element.
+             * @param root The element to run on.
+             * @param result Receives the nodes and values the query
+             * selects, if not NULL.
+             * @return true if the query matched.
+             */
+            bool run(const judo::Element& root, Value* result) const;
+
+        private:
+            typedef std::vector<const judo::Element*> Stack;
+
+            std::vector<Instr> _code;
+            std::vector<Operand> _operands;
+
+            bool run(int pc, int end, Stack& st, size_t base, 
+                     bool in_context, Value* result) const;
+            bool runOn(const judo::Element* elem, int pc, int end, 
+                       Stack& st) const;
+            const std::string& operandStr(int idx, const judo::Element* elem,
+                                          std::string& scratch) const;
+        };
+
+        // Look up an attribute in an expat-style attribute list
+        inline const char* findStartAttrib(const char** attribs, const std::string& name)
+        {
+            for (int i = 0; attribs != NULL && attribs[i] != NULL; i += 2)
+            {
+                if (name == attribs[i])
+                    return attribs[i + 1];
             }
+            return NULL;
+        }
+
+        /**
+        * Something that decides whether packets match, so compiled
+        * and static queries can be registered the same way.
+        */
+        class Matcher
+        {
+        public:
+            virtual ~Matcher()
+            { }
 
             /**
             * Check to see if the query would match on the given root.
@@ -277,7 +442,42 @@ namespace judo
             * @param root The element to check against.
             * @return true if the element would match the query.
             */
-            bool check(const judo::Element& root);
+            virtual bool check(const judo::Element& root) const = 0;
+            /**
+            * Check to see if the query would match an element of which
+            * only the start tag has been read. Queries which only test
+            * the name and attributes of the root are decided entirely;
+            * others can at least be ruled out by them.
+            *
+            * @param name Name of the root element.
+            * @param attribs Expat-style attributes of the root element.
+            * @return MATCH_YES or MATCH_NO if check() would return true
+            * or false on the element, or MATCH_UNKNOWN if that depends
+            * on its content.
+            */
+            virtual Op::Match checkStart(const char* name, const char** attribs) const = 0;
+        };
+
+        /**
+        * Represents a single XPath query string.
+        */
+        class Query : public Matcher
+        {
+        public:
+            typedef std::vector<Op*> OpList;
+            /**
+            * Compile a query. Compiled queries are shared through a
+            * process wide cache keyed by the query string, so
+            * constructing a query which another Query already holds
+            * only costs a lookup. An entry goes once the last Query
+            * holding it does.
+            *
+            * @param query The query string.
+            */
+            Query(const std::string query);
+
+            bool check(const judo::Element& root) const;
+            Op::Match checkStart(const char* name, const char** attribs) const;
             /**
             * Execute the query on the given element and return the result set.
             *
@@ -286,19 +486,18 @@ namespace judo
             */
             Value* execute(judo::Element* root);
 
-            const OpList& getOps() const
-            { return _ops; };
+            /**
+            * Get the ops the query was parsed into. Every Query of the
+            * same string shares them; running them changes none of them.
+            */
+            const OpList& getOps() const;
 
             class Invalid{};
         private:
-            std::list<char> _tokens;
-            std::string _query;
-            OpList _ops;
-
-            bool parseQuery();
-            char getNextToken(std::string::size_type& cur);
-            std::string getNextIdentifier(std::string::size_type& pos);
-            Op* getOp(std::string::size_type& pos, char in_context = 0);
+            class Compiled;
+            std::shared_ptr<const Compiled> _compiled;
+
+            static std::shared_ptr<const Compiled> compile(const std::string& query);
         };
     };
 };
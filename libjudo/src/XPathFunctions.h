@@ -85,24 +85,17 @@ namespace XPath {
         bool run(XPath::Value* ctxt, Op::OpList& args)
         {
             Value::ElemList& elems = ctxt->getList();
-            Value::ElemList::iterator it = elems.begin();
+            Value::ElemList::iterator out = elems.begin();
+            Value tmp_ctxt;
 
-            while (it != elems.end())
+            for (Value::ElemList::iterator it = elems.begin(); 
+                 it != elems.end(); ++it)
             {
-                std::string value;
-                Value::ElemList::iterator next = it;
-                ++next;
-
-                Value* tmp_ctxt = new Value(*it);
-                tmp_ctxt->in_context(true);
-
-                if (args[0]->isValid(tmp_ctxt))
-                {
-                    elems.erase(it);
-                }
-
-                it = next;
+                tmp_ctxt.reset(*it, true);
+                if (!args[0]->isValid(&tmp_ctxt))
+                    *out++ = *it;
             }
+            elems.erase(out, elems.end());
 
             if (elems.empty())
             {
@@ -118,25 +111,19 @@ namespace XPath {
         bool run(XPath::Value* ctxt, Op::OpList& args)
         {
             Value::ElemList& elems = ctxt->getList();
-            Value::ElemList::iterator it = elems.begin();
+            Value::ElemList::iterator out = elems.begin();
 
-            while (it != elems.end())
+            for (Value::ElemList::iterator it = elems.begin(); 
+                 it != elems.end(); ++it)
             {
-                std::string value;
-                Value::ElemList::iterator next = it;
-                ++next;
-
                 judo::Element* elem = *it;
                 std::string val1 = args[0]->calcStr(elem);
                 std::string val2 = args[1]->calcStr(elem);
 
-                if (val1.find(val2,0) != 0)
-                {
-                    elems.erase(it);
-                }
-
-                it = next;
+                if (val1.find(val2,0) == 0)
+                    *out++ = elem;
             }
+            elems.erase(out, elems.end());
 
             if (elems.empty())
             {
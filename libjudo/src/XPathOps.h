@@ -7,6 +7,33 @@ namespace judo
 {
     namespace XPath
     {
+        // Decide a comparison of two ops from a start tag
+        inline Op::Match checkStartCompare(Op* lh, Op* rh, const char** attribs, bool equal)
+        {
+            std::string lh_str, rh_str;
+            Op::Match l = lh->startStr(attribs, lh_str);
+            Op::Match r = rh->startStr(attribs, rh_str);
+            if (l == Op::MATCH_NO || r == Op::MATCH_NO)
+                return Op::MATCH_NO;
+            if (l == Op::MATCH_UNKNOWN || r == Op::MATCH_UNKNOWN)
+                return Op::MATCH_UNKNOWN;
+            return ((lh_str == rh_str) == equal) ? Op::MATCH_YES : Op::MATCH_NO;
+        }
+
+        // Compile an (in)equality of two ops
+        inline void compileCompare(Program& prog, Op* lh, Op* rh, bool equal)
+        {
+            int at = prog.emit(Program::Instr::COMPARE, "", equal);
+            lh->compile(prog);
+            prog.endPredicate(at, 0);
+            rh->compile(prog);
+            prog.endPredicate(at, 1);
+            int lh_str = lh->compileStr(prog);
+            int rh_str = rh->compileStr(prog);
+            prog.at(at).str[0] = lh_str;
+            prog.at(at).str[1] = rh_str;
+        }
+
         class PositionOp : public Op
         {
         public:
@@ -15,17 +42,18 @@ namespace judo
 
             bool isValid(XPath::Value* ctxt)
             {
-                Value::ElemList elems = ctxt->getList();
-
-                Value::ElemList::iterator it = elems.begin();
-                for (int x = 1; (x < _pos) && (it != elems.end()); x++) it++;
-                if (it == elems.end())
+                Value::ElemList& elems = ctxt->getList();
+                if (_pos < 1 || _pos > (int)elems.size())
                     return false;
-                //std::cout << "Got position " << (*it)->getName() << std::endl;
-                ctxt->setElems(*it);
+                ctxt->setElems(elems[_pos - 1]);
 
                 return true;
             }
+
+            void compile(Program& prog)
+            {
+                prog.at(prog.emit(Program::Instr::POSITION)).pos = _pos;
+            }
         private:
             int _pos;
         };
@@ -44,22 +72,16 @@ namespace judo
             bool isValid(XPath::Value* ctxt)
             {
                 Value::ElemList& elems = ctxt->getList();
-                Value::ElemList::iterator it = elems.begin();
-                while (it != elems.end())
+                Value::ElemList::iterator out = elems.begin();
+                Value tmp_ctxt;
+                for (Value::ElemList::iterator it = elems.begin(); 
+                     it != elems.end(); ++it)
                 {
-                    Value::ElemList::iterator next = it;
-                    ++next;
-
-                    Value* tmp_ctxt = new Value(*it);
-                    tmp_ctxt->in_context(true);
-
-                    if (!_op->isValid(tmp_ctxt))
-                    {
-                        elems.erase(it);
-                    }
-
-                    it = next;
+                    tmp_ctxt.reset(*it, true);
+                    if (_op->isValid(&tmp_ctxt))
+                        *out++ = *it;
                 }
+                elems.erase(out, elems.end());
 
                 if (elems.empty())
                     return false;
@@ -67,6 +89,18 @@ namespace judo
                 return true;
             }
 
+            Match checkStart(const char* name, const char** attribs)
+            {
+                return _op->checkStart(name, attribs);
+            }
+
+            void compile(Program& prog)
+            {
+                int at = prog.emit(Program::Instr::FILTER);
+                _op->compile(prog);
+                prog.endPredicate(at, 0);
+            }
+
         private:
             Op* _op;
         };
@@ -101,12 +135,7 @@ namespace judo
                 Value::ElemList valid_elems;
 
                 if (elems.empty())
-                {
-                    elem = ctxt->getElem();
-                    if (!elem)
-                        return false;
-                    elems.push_back(elem);
-                }
+                    return false;
 
                 for (Value::ElemList::iterator it = elems.begin(); 
                         it != elems.end(); it++)
@@ -119,7 +148,7 @@ namespace judo
                     for (; sit != elem->end(); sit++)
                     {
                         if ((*sit)->getType() == Node::ntElement && 
-                            (_value == "*") || ((*sit)->getName() == _value))
+                            (_value == "*" || (*sit)->getName() == _value))
                         {
                             if (ctxt->in_context())
                                 valid = true;
@@ -135,14 +164,37 @@ namespace judo
                 if (valid_elems.empty())
                     return false;
 
-                ctxt->setElems(valid_elems);
+                elems.swap(valid_elems);
 
                 return true;
             }
+
+            Match checkStart(const char* name, const char** attribs)
+            {
+                if (!_is_root)
+                    return MATCH_UNKNOWN;
+                return (_value == name) ? MATCH_YES : MATCH_NO;
+            }
+
+            void compile(Program& prog)
+            {
+                if (_is_root)
+                    prog.emit(Program::Instr::ROOT, _value);
+                else
+                    prog.emit(Program::Instr::CHILD, _value, _value == "*");
+            }
+
+            int compileStr(Program& prog)
+            {
+                return prog.addOperand(Program::Operand::CDATA);
+            }
         private:
             bool _is_root;
         };
 
+        // "//name": the context elements and all their descendants
+        // with the name, or all of them for "*". At the start of a
+        // query that is the whole packet, root included.
         class AllOp : public Op
         {
         public:
@@ -151,17 +203,6 @@ namespace judo
 
             bool isValid(XPath::Value* ctxt)
             {
-                judo::Element* elem = NULL;
-                
-                // If we're only checking the root node bail early
-                if (_is_root)
-                {
-                    elem = ctxt->getElem();
-                    if (elem->getName() != _value)
-                        return false;
-                    return true;
-                }
-
                 // Get children
                 Value::ElemList& elems = ctxt->getList();
                 Value::ElemList valid_elems;
@@ -181,7 +222,7 @@ namespace judo
                 if (valid_elems.empty())
                     return false;
 
-                ctxt->setElems(valid_elems);
+                elems.swap(valid_elems);
 
                 return true;
             }
@@ -206,9 +247,11 @@ namespace judo
                     }
                 }
             }
-            
-        private:
-            bool _is_root;
+
+            void compile(Program& prog)
+            {
+                prog.emit(Program::Instr::DESCEND, _value, _value == "*");
+            }
         };
 
         class EqualOp : public Op
@@ -226,26 +269,21 @@ namespace judo
 
             bool isValid(XPath::Value* ctxt)
             {
-                XPath::Value* tmp_ctxt = new Value(ctxt->getList());
+                XPath::Value tmp_ctxt(ctxt->getList());
 
-                if (!_op_lh->isValid(tmp_ctxt) || !_op_rh->isValid(tmp_ctxt))
+                if (!_op_lh->isValid(&tmp_ctxt) || !_op_rh->isValid(&tmp_ctxt))
                     return false;
 
-                Value::ElemList& elems = tmp_ctxt->getList();
-                Value::ElemList::iterator it = elems.begin();
-
-                while (it != elems.end())
+                Value::ElemList& elems = tmp_ctxt.getList();
+                Value::ElemList::iterator out = elems.begin();
+                for (Value::ElemList::iterator it = elems.begin(); 
+                     it != elems.end(); ++it)
                 {
-                    Value::ElemList::iterator next = it;
-                    ++next;
-
                     judo::Element* elem = *it;
-                    if (_op_lh->calcStr(elem) != _op_rh->calcStr(elem))
-                    {
-                        elems.erase(it);
-                    }
-                    it = next;
+                    if (!(_op_lh->calcStr(elem) != _op_rh->calcStr(elem)))
+                        *out++ = elem;
                 }
+                elems.erase(out, elems.end());
 
                 if (elems.empty())
                 {
@@ -257,6 +295,16 @@ namespace judo
                 return true;
             }
 
+            Match checkStart(const char* name, const char** attribs)
+            {
+                return checkStartCompare(_op_lh, _op_rh, attribs, true);
+            }
+
+            void compile(Program& prog)
+            {
+                compileCompare(prog, _op_lh, _op_rh, true);
+            }
+
         private:
             Op* _op_lh;
             Op* _op_rh;
@@ -277,26 +325,21 @@ namespace judo
 
             bool isValid(XPath::Value* ctxt)
             {
-                XPath::Value* tmp_ctxt = new Value(ctxt->getList());
+                XPath::Value tmp_ctxt(ctxt->getList());
 
-                if (!_op_lh->isValid(tmp_ctxt) || !_op_rh->isValid(tmp_ctxt))
+                if (!_op_lh->isValid(&tmp_ctxt) || !_op_rh->isValid(&tmp_ctxt))
                     return false;
 
-                Value::ElemList& elems = tmp_ctxt->getList();
-                Value::ElemList::iterator it = elems.begin();
-
-                while (it != elems.end())
+                Value::ElemList& elems = tmp_ctxt.getList();
+                Value::ElemList::iterator out = elems.begin();
+                for (Value::ElemList::iterator it = elems.begin(); 
+                     it != elems.end(); ++it)
                 {
-                    Value::ElemList::iterator next = it;
-                    ++next;
-
                     judo::Element* elem = *it;
-                    if (_op_lh->calcStr(elem) == _op_rh->calcStr(elem))
-                    {
-                        elems.erase(it);
-                    }
-                    it = next;
+                    if (!(_op_lh->calcStr(elem) == _op_rh->calcStr(elem)))
+                        *out++ = elem;
                 }
+                elems.erase(out, elems.end());
 
                 if (elems.empty())
                 {
@@ -308,6 +351,16 @@ namespace judo
                 return true;
             }
 
+            Match checkStart(const char* name, const char** attribs)
+            {
+                return checkStartCompare(_op_lh, _op_rh, attribs, false);
+            }
+
+            void compile(Program& prog)
+            {
+                compileCompare(prog, _op_lh, _op_rh, false);
+            }
+
         private:
             Op* _op_lh;
             Op* _op_rh;
@@ -319,11 +372,6 @@ namespace judo
             AttributeOp(const std::string& name) : Op(Op::OP_ATTRIBUTE, name)
             { }
 
-            std::string getValue()
-            {
-                return _val;
-            }
-
             std::string calcStr(judo::Element* elem)
             {
                 return elem->getAttrib(_value);
@@ -332,49 +380,41 @@ namespace judo
             bool isValid(XPath::Value* ctxt)
             {
                 Value::ElemList& elems = ctxt->getList();
-                Value::ElemList::iterator it = elems.begin();
+                Value::ElemList::iterator out = elems.begin();
 
                 Value::ValueList values;
                 Value::AttribMap attribs;
 
-                while (it != elems.end())
+                for (Value::ElemList::iterator it = elems.begin(); 
+                     it != elems.end(); ++it)
                 {
-                    Value::ElemList::iterator next = it;
-                    ++next;
-
                     judo::Element* elem = *it;
                     if (_value != "*")
                     {
-                        _val = calcStr(elem);
-                        if (_val.empty())
-                            elems.erase(it);
-                        else
-                            values.push_back(_val);
+                        std::string val = calcStr(elem);
+                        if (val.empty())
+                            continue;
+                        values.push_back(val);
                     }
                     else
                     {
                         Value::AttribMap temp_attribs = elem->getAttribs();
                         if (temp_attribs.empty())
+                            continue;
+
+                        Value::AttribMap::const_iterator ait = temp_attribs.begin();
+                        while(ait != temp_attribs.end())
                         {
-                            elems.erase(it);
-                        }
-                        else
-                        {
-                            Value::AttribMap::const_iterator ait = temp_attribs.begin();
-                            while(ait != temp_attribs.end())
-                            {
-                                attribs[ait->first] = ait->second;
-                                ait++;
-                            }
+                            attribs[ait->first] = ait->second;
+                            ait++;
                         }
                     }
-
-                    it = next;
+                    *out++ = elem;
                 }
+                elems.erase(out, elems.end());
 
                 if (elems.empty())
                 {
-                    //std::cout << "Invalid attribute: " << _value << std::endl;
                     return false;
                 }
 
@@ -383,8 +423,35 @@ namespace judo
 
                 return true;
             }
-        private:
-            std::string _val;
+
+            Match startStr(const char** attribs, std::string& value)
+            {
+                if (_value == "*")
+                    return MATCH_UNKNOWN;
+                const char* val = findStartAttrib(attribs, _value);
+                if (val == NULL || *val == '\0')
+                    return MATCH_NO;
+                value = val;
+                return MATCH_YES;
+            }
+
+            Match checkStart(const char* name, const char** attribs)
+            {
+                if (_value == "*")
+                    return (attribs != NULL && attribs[0] != NULL) ? MATCH_YES : MATCH_NO;
+                std::string val;
+                return startStr(attribs, val);
+            }
+
+            void compile(Program& prog)
+            {
+                prog.emit(Program::Instr::ATTRIB, _value, _value == "*");
+            }
+
+            int compileStr(Program& prog)
+            {
+                return prog.addOperand(Program::Operand::ATTRIB, _value);
+            }
         };
 
         class AndOp : public Op
@@ -406,6 +473,24 @@ namespace judo
                 else
                     return false;
             }
+
+            Match checkStart(const char* name, const char** attribs)
+            {
+                Match l = _lh->checkStart(name, attribs);
+                Match r = _rh->checkStart(name, attribs);
+                if (l == MATCH_NO || r == MATCH_NO)
+                    return MATCH_NO;
+                if (l == MATCH_UNKNOWN || r == MATCH_UNKNOWN)
+                    return MATCH_UNKNOWN;
+                return MATCH_YES;
+            }
+
+            void compile(Program& prog)
+            {
+                // Both run on the same context, one after the other
+                _lh->compile(prog);
+                _rh->compile(prog);
+            }
         private:
             Op* _lh;
             Op* _rh;
@@ -426,29 +511,48 @@ namespace judo
             bool isValid(XPath::Value* ctxt)
             {
                 Value::ElemList& elems = ctxt->getList();
-                Value::ElemList::iterator it = elems.begin();
-                while (it != elems.end())
+                Value::ElemList::iterator out = elems.begin();
+                Value tmp_ctxt;
+                for (Value::ElemList::iterator it = elems.begin(); 
+                     it != elems.end(); ++it)
                 {
-                    Value::ElemList::iterator next = it;
-                    ++next;
-
-                    Value* tmp_ctxt_l = new Value(*it);
-                    tmp_ctxt_l->in_context(true);
-                    Value* tmp_ctxt_r = new Value(*it);
-                    tmp_ctxt_r->in_context(true);
-                    if (!_lh->isValid(tmp_ctxt_l) && !_rh->isValid(tmp_ctxt_r))
+                    tmp_ctxt.reset(*it, true);
+                    bool valid = _lh->isValid(&tmp_ctxt);
+                    if (!valid)
                     {
-                        elems.erase(it);
+                        tmp_ctxt.reset(*it, true);
+                        valid = _rh->isValid(&tmp_ctxt);
                     }
-
-                    it = next;
+                    if (valid)
+                        *out++ = *it;
                 }
+                elems.erase(out, elems.end());
 
                 if (elems.empty())
                     return false;
 
                 return true;
             }
+
+            Match checkStart(const char* name, const char** attribs)
+            {
+                Match l = _lh->checkStart(name, attribs);
+                Match r = _rh->checkStart(name, attribs);
+                if (l == MATCH_YES || r == MATCH_YES)
+                    return MATCH_YES;
+                if (l == MATCH_UNKNOWN || r == MATCH_UNKNOWN)
+                    return MATCH_UNKNOWN;
+                return MATCH_NO;
+            }
+
+            void compile(Program& prog)
+            {
+                int at = prog.emit(Program::Instr::OR);
+                _lh->compile(prog);
+                prog.endPredicate(at, 0);
+                _rh->compile(prog);
+                prog.endPredicate(at, 1);
+            }
         private:
             Op* _lh;
             Op* _rh;
@@ -457,7 +561,8 @@ namespace judo
         class FunctionOp : public Op
         {
         public:
-            FunctionOp(const std::string& func) : Op(OP_FUNCTION, func) , _closed(false)
+            FunctionOp(const std::string& name, Function* func) : 
+                Op(OP_FUNCTION, name), _func(func), _closed(false)
             { }
 
             ~FunctionOp()
@@ -472,26 +577,12 @@ namespace judo
 
             bool isValid(XPath::Value* ctxt)
             {
-                FunctionMap::iterator it = XPath::functions.find(_value);
-                if (it == XPath::functions.end())
-                {
-                    std::cerr << "Unknown query function " << _value << "()" << std::endl;
-                    return false;
-                }
-                
-                return it->second->run(ctxt, _arg_list);
+                return _func->run(ctxt, _arg_list);
             }
 
             std::string calcStr(judo::Element* elem)
             {
-                FunctionMap::iterator it = XPath::functions.find(_value);
-                if (it == XPath::functions.end())
-                {
-                    std::cerr << "Unknown query function " << _value << "()" << std::endl;
-                    return "";
-                }
-                
-                return it->second->value(elem, _arg_list);
+                return _func->value(elem, _arg_list);
             }
             
             void addArg(Op* arg)
@@ -499,8 +590,19 @@ namespace judo
                 _arg_list.push_back(arg);
             }
 
+            void compile(Program& prog)
+            {
+                prog.compileCall(_func, _value, _arg_list);
+            }
+
+            int compileStr(Program& prog)
+            {
+                return prog.compileCallStr(_func, _value, _arg_list);
+            }
+
         private:
             Query::OpList _arg_list;
+            Function* _func;
             bool _closed;
         };
 
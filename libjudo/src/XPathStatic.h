@@ -0,0 +1,579 @@
+#ifndef INCL_XPATH_STATIC_H
+#define INCL_XPATH_STATIC_H
+
+#include "XPath.h"
+
+#include <cstring>
+#include <type_traits>
+
+/**
+* Build a matcher for a query literal at compile time. The query is
+* parsed by the compiler into a tree of types, so checking it against
+* an element runs a few inlined compares instead of the interpreter.
+* Only the forms packet dispatch uses are supported: paths of child
+* steps (names or *), each with predicates made of @attr, child,
+* @attr='literal', child='literal' (or !=), joined by "and" or by
+* "or". Anything else fails to compile; use XPath::Query for it.
+* Queries are limited to 127 characters.
+*
+* @code
+* session.registerXPath(JUDO_XPATH("/iq[@type='result']/query[@xmlns='jabber:iq:roster']"), f);
+* @endcode
+*/
+#define JUDO_XPATH(query) \
+    ::judo::XPath::StaticQuery< ::judo::XPath::Static::Parse< \
+        ::judo::XPath::Static::Trim< ::judo::XPath::Static::Chars<>, \
+            JUDO_XPATH_C64(query, 0), JUDO_XPATH_C64(query, 64) \
+        >::type >::type >()
+
+#define JUDO_XPATH_C1(s, i) ::judo::XPath::Static::charAt(s, i)
+#define JUDO_XPATH_C4(s, i) JUDO_XPATH_C1(s, i), JUDO_XPATH_C1(s, i + 1), \
+    JUDO_XPATH_C1(s, i + 2), JUDO_XPATH_C1(s, i + 3)
+#define JUDO_XPATH_C16(s, i) JUDO_XPATH_C4(s, i), JUDO_XPATH_C4(s, i + 4), \
+    JUDO_XPATH_C4(s, i + 8), JUDO_XPATH_C4(s, i + 12)
+#define JUDO_XPATH_C64(s, i) JUDO_XPATH_C16(s, i), JUDO_XPATH_C16(s, i + 16), \
+    JUDO_XPATH_C16(s, i + 32), JUDO_XPATH_C16(s, i + 48)
+
+namespace judo
+{
+    namespace XPath
+    {
+        /**
+        * A query parsed at compile time by JUDO_XPATH.
+        */
+        template <class Expr>
+        class StaticQuery : public Matcher
+        {
+        public:
+            bool check(const judo::Element& root) const
+            { return Expr::match(root); }
+
+            Op::Match checkStart(const char* name, const char** attribs) const
+            { return Expr::matchStart(name, attribs); }
+        };
+
+        namespace Static
+        {
+            template <size_t N>
+            constexpr char charAt(const char (&s)[N], size_t i)
+            {
+                return (i < N) ? s[i] : '\0';
+            }
+
+            template <class T>
+            struct Unsupported
+            {
+                enum { value = false };
+            };
+
+            // A string as a type
+            template <char... C>
+            struct Chars
+            {
+                static const std::string& str()
+                {
+                    static const char chars[] = { C..., '\0' };
+                    static const std::string s(chars, sizeof...(C));
+                    return s;
+                }
+
+                static bool equals(const std::string& s)
+                {
+                    static const char chars[] = { C..., '\0' };
+                    return s.size() == sizeof...(C) &&
+                        memcmp(s.data(), chars, sizeof...(C)) == 0;
+                }
+
+                static bool equals(const char* s)
+                {
+                    static const char chars[] = { C..., '\0' };
+                    return strcmp(s, chars) == 0;
+                }
+            };
+
+            // Child steps named * take any element
+            template <class Name>
+            struct NameTest
+            {
+                static bool match(const std::string& name)
+                { return Name::equals(name); }
+            };
+
+            template <>
+            struct NameTest<Chars<'*'> >
+            {
+                static bool match(const std::string& name)
+                { return true; }
+            };
+
+            inline const std::string& firstCDATA(const judo::Element& elem)
+            {
+                static const std::string empty;
+                for (judo::Element::const_iterator it = elem.begin();
+                     it != elem.end(); ++it)
+                {
+                    if ((*it)->getType() == Node::ntCDATA)
+                        return static_cast<const judo::CDATA*>(*it)->getText();
+                }
+                return empty;
+            }
+
+            // ---------------------------------------------------------
+            // Predicates
+            // ---------------------------------------------------------
+            struct True
+            {
+                static bool match(const judo::Element& elem)
+                { return true; }
+                static Op::Match matchStart(const char** attribs)
+                { return Op::MATCH_YES; }
+            };
+
+            template <class Name> struct Attr;
+            template <class Name> struct Child;
+
+            template <class Operand> struct Exists;
+
+            template <class Name>
+            struct Exists<Attr<Name> >
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    const std::string* value = elem.findAttrib(Name::str());
+                    return value != NULL && !value->empty();
+                }
+                static Op::Match matchStart(const char** attribs)
+                {
+                    const char* value = findStartAttrib(attribs, Name::str());
+                    return (value != NULL && *value != '\0') ?
+                        Op::MATCH_YES : Op::MATCH_NO;
+                }
+            };
+
+            template <>
+            struct Exists<Attr<Chars<'*'> > >
+            {
+                static bool match(const judo::Element& elem)
+                { return !elem.getAttribs().empty(); }
+                static Op::Match matchStart(const char** attribs)
+                {
+                    return (attribs != NULL && attribs[0] != NULL) ?
+                        Op::MATCH_YES : Op::MATCH_NO;
+                }
+            };
+
+            template <class Name>
+            struct Exists<Child<Name> >
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    for (judo::Element::const_iterator it = elem.begin();
+                         it != elem.end(); ++it)
+                    {
+                        if ((*it)->getType() == Node::ntElement &&
+                            NameTest<Name>::match((*it)->getName()))
+                            return true;
+                    }
+                    return false;
+                }
+                static Op::Match matchStart(const char** attribs)
+                { return Op::MATCH_UNKNOWN; }
+            };
+
+            template <class Operand, class Literal, bool Equal> struct Compare;
+
+            template <class Name, class Literal, bool Equal>
+            struct Compare<Attr<Name>, Literal, Equal>
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    const std::string* value = elem.findAttrib(Name::str());
+                    return value != NULL && !value->empty() &&
+                        Literal::equals(*value) == Equal;
+                }
+                static Op::Match matchStart(const char** attribs)
+                {
+                    const char* value = findStartAttrib(attribs, Name::str());
+                    if (value == NULL || *value == '\0')
+                        return Op::MATCH_NO;
+                    return (Literal::equals(value) == Equal) ?
+                        Op::MATCH_YES : Op::MATCH_NO;
+                }
+            };
+
+            template <class Name, class Literal, bool Equal>
+            struct Compare<Child<Name>, Literal, Equal>
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    for (judo::Element::const_iterator it = elem.begin();
+                         it != elem.end(); ++it)
+                    {
+                        if ((*it)->getType() != Node::ntElement ||
+                            !NameTest<Name>::match((*it)->getName()))
+                            continue;
+                        const judo::Element& child =
+                            static_cast<const judo::Element&>(**it);
+                        if (Literal::equals(firstCDATA(child)) == Equal)
+                            return true;
+                    }
+                    return false;
+                }
+                static Op::Match matchStart(const char** attribs)
+                { return Op::MATCH_UNKNOWN; }
+            };
+
+            template <class L, class R>
+            struct And
+            {
+                static bool match(const judo::Element& elem)
+                { return L::match(elem) && R::match(elem); }
+                static Op::Match matchStart(const char** attribs)
+                {
+                    Op::Match l = L::matchStart(attribs);
+                    Op::Match r = R::matchStart(attribs);
+                    if (l == Op::MATCH_NO || r == Op::MATCH_NO)
+                        return Op::MATCH_NO;
+                    if (l == Op::MATCH_UNKNOWN || r == Op::MATCH_UNKNOWN)
+                        return Op::MATCH_UNKNOWN;
+                    return Op::MATCH_YES;
+                }
+            };
+
+            template <class L, class R>
+            struct Or
+            {
+                static bool match(const judo::Element& elem)
+                { return L::match(elem) || R::match(elem); }
+                static Op::Match matchStart(const char** attribs)
+                {
+                    Op::Match l = L::matchStart(attribs);
+                    Op::Match r = R::matchStart(attribs);
+                    if (l == Op::MATCH_YES || r == Op::MATCH_YES)
+                        return Op::MATCH_YES;
+                    if (l == Op::MATCH_UNKNOWN || r == Op::MATCH_UNKNOWN)
+                        return Op::MATCH_UNKNOWN;
+                    return Op::MATCH_NO;
+                }
+            };
+
+            // ---------------------------------------------------------
+            // Paths
+            // ---------------------------------------------------------
+            struct End
+            {
+                static bool match(const judo::Element& elem)
+                { return true; }
+            };
+
+            template <class Name, class Pred, class Next>
+            struct Step
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    for (judo::Element::const_iterator it = elem.begin();
+                         it != elem.end(); ++it)
+                    {
+                        if ((*it)->getType() != Node::ntElement ||
+                            !NameTest<Name>::match((*it)->getName()))
+                            continue;
+                        const judo::Element& child =
+                            static_cast<const judo::Element&>(**it);
+                        if (Pred::match(child) && Next::match(child))
+                            return true;
+                    }
+                    return false;
+                }
+            };
+
+            template <class Name, class Pred, class Next>
+            struct Root
+            {
+                static bool match(const judo::Element& elem)
+                {
+                    return Name::equals(elem.getName()) &&
+                        Pred::match(elem) && Next::match(elem);
+                }
+
+                // The steps below depend on the content
+                static Op::Match matchStart(const char* name, const char** attribs)
+                {
+                    if (!Name::equals(name) || 
+                        Pred::matchStart(attribs) == Op::MATCH_NO)
+                        return Op::MATCH_NO;
+                    return Op::MATCH_UNKNOWN;
+                }
+            };
+
+            template <class Name, class Pred>
+            struct Root<Name, Pred, End>
+            {
+                static bool match(const judo::Element& elem)
+                { return Name::equals(elem.getName()) && Pred::match(elem); }
+
+                static Op::Match matchStart(const char* name, const char** attribs)
+                {
+                    if (!Name::equals(name))
+                        return Op::MATCH_NO;
+                    return Pred::matchStart(attribs);
+                }
+            };
+
+            // ---------------------------------------------------------
+            // Parser
+            // ---------------------------------------------------------
+
+            // Drop the padding after the query
+            template <class Out, char... In>
+            struct Trim
+            {
+                static_assert(Unsupported<Out>::value,
+                              "XPath query too long for JUDO_XPATH");
+            };
+
+            template <char... Out, char... In>
+            struct Trim<Chars<Out...>, '\0', In...>
+            {
+                typedef Chars<Out...> type;
+            };
+
+            template <char... Out, char C, char... In>
+            struct Trim<Chars<Out...>, C, In...> :
+                Trim<Chars<Out..., C>, In...>
+            { };
+
+            // The same characters end names as in XPath::Query
+            template <char C>
+            struct IsNameChar
+            {
+                enum { value = !(C == '/' || C == '[' || C == ']' ||
+                                 C == '@' || C == '\'' || C == '"' ||
+                                 C == '=' || C == '!' || C == '(' ||
+                                 C == ')' || C == ':' || C == ' ' ||
+                                 C == ',') };
+            };
+
+            template <bool Take, class Name, class S>
+            struct ReadNameChar;
+
+            template <class Name, class S>
+            struct ReadName
+            {
+                typedef Name type;
+                typedef S rest;
+            };
+
+            template <char... N, char C, char... R>
+            struct ReadName<Chars<N...>, Chars<C, R...> > :
+                ReadNameChar<IsNameChar<C>::value, Chars<N...>, Chars<C, R...> >
+            { };
+
+            template <bool Take, class Name, class S>
+            struct ReadNameChar
+            {
+                typedef Name type;
+                typedef S rest;
+            };
+
+            template <char... N, char C, char... R>
+            struct ReadNameChar<true, Chars<N...>, Chars<C, R...> > :
+                ReadName<Chars<N..., C>, Chars<R...> >
+            { };
+
+            template <class Out, class S>
+            struct ReadLiteral
+            {
+                static_assert(Unsupported<S>::value,
+                              "Unterminated literal in JUDO_XPATH");
+            };
+
+            template <char Q, char... O, char... R>
+            struct ReadLiteral<Chars<Q, O...>, Chars<Q, R...> >
+            {
+                typedef Chars<O...> type;
+                typedef Chars<R...> rest;
+            };
+
+            template <char Q, char... O, char C, char... R>
+            struct ReadLiteral<Chars<Q, O...>, Chars<C, R...> > :
+                ReadLiteral<Chars<Q, O..., C>, Chars<R...> >
+            { };
+
+            // An operand, then an optional comparison with a literal
+            template <class Operand, class S>
+            struct ParseCompare
+            {
+                typedef Exists<Operand> type;
+                typedef S rest;
+            };
+
+            template <class Operand, char Q, char... R>
+            struct ParseCompare<Operand, Chars<'=', Q, R...> >
+            {
+                static_assert(Q == '\'' || Q == '"',
+                              "JUDO_XPATH only compares with literals");
+                typedef ReadLiteral<Chars<Q>, Chars<R...> > L;
+                typedef Compare<Operand, typename L::type, true> type;
+                typedef typename L::rest rest;
+            };
+
+            template <class Operand, char Q, char... R>
+            struct ParseCompare<Operand, Chars<'!', '=', Q, R...> >
+            {
+                static_assert(Q == '\'' || Q == '"',
+                              "JUDO_XPATH only compares with literals");
+                typedef ReadLiteral<Chars<Q>, Chars<R...> > L;
+                typedef Compare<Operand, typename L::type, false> type;
+                typedef typename L::rest rest;
+            };
+
+            template <class S>
+            struct IsDigit
+            {
+                enum { value = false };
+            };
+
+            template <char C, char... R>
+            struct IsDigit<Chars<C, R...> >
+            {
+                enum { value = (C >= '0' && C <= '9') };
+            };
+
+            template <class S>
+            struct ParseTerm
+            {
+                typedef ReadName<Chars<>, S> N;
+                static_assert(!std::is_same<typename N::type, Chars<> >::value,
+                              "Unsupported predicate in JUDO_XPATH");
+                static_assert(!IsDigit<S>::value,
+                              "JUDO_XPATH doesn't support positions");
+                typedef ParseCompare<Child<typename N::type>, typename N::rest> C;
+                typedef typename C::type type;
+                typedef typename C::rest rest;
+            };
+
+            template <char... R>
+            struct ParseTerm<Chars<'@', R...> >
+            {
+                typedef ReadName<Chars<>, Chars<R...> > N;
+                static_assert(!std::is_same<typename N::type, Chars<> >::value,
+                              "Missing attribute name in JUDO_XPATH");
+                typedef ParseCompare<Attr<typename N::type>, typename N::rest> C;
+                typedef typename C::type type;
+                typedef typename C::rest rest;
+            };
+
+            // Terms joined by " and " or by " or "
+            template <class Pred, class S, int Joiner = 0>
+            struct ParseJoin
+            {
+                typedef Pred type;
+                typedef S rest;
+            };
+
+            template <class Pred, int Joiner, char... R>
+            struct ParseJoin<Pred, Chars<' ', 'a', 'n', 'd', ' ', R...>, Joiner>
+            {
+                static_assert(Joiner != 2, 
+                              "JUDO_XPATH can't mix \"and\" with \"or\"");
+                typedef ParseTerm<Chars<R...> > T;
+                typedef ParseJoin<And<Pred, typename T::type>, typename T::rest, 1> J;
+                typedef typename J::type type;
+                typedef typename J::rest rest;
+            };
+
+            template <class Pred, int Joiner, char... R>
+            struct ParseJoin<Pred, Chars<' ', 'o', 'r', ' ', R...>, Joiner>
+            {
+                static_assert(Joiner != 1, 
+                              "JUDO_XPATH can't mix \"and\" with \"or\"");
+                typedef ParseTerm<Chars<R...> > T;
+                typedef ParseJoin<Or<Pred, typename T::type>, typename T::rest, 2> J;
+                typedef typename J::type type;
+                typedef typename J::rest rest;
+            };
+
+            template <class S>
+            struct ParsePredEnd
+            {
+                static_assert(Unsupported<S>::value,
+                              "Unsupported predicate in JUDO_XPATH");
+            };
+
+            template <char... R>
+            struct ParsePredEnd<Chars<']', R...> >
+            {
+                typedef Chars<R...> rest;
+            };
+
+            // Any number of [predicates]
+            template <class S>
+            struct ParsePreds
+            {
+                typedef True type;
+                typedef S rest;
+            };
+
+            template <char... R>
+            struct ParsePreds<Chars<'[', R...> >
+            {
+                typedef ParseTerm<Chars<R...> > T;
+                typedef ParseJoin<typename T::type, typename T::rest> J;
+                typedef ParsePreds<typename ParsePredEnd<typename J::rest>::rest> P;
+                typedef And<typename J::type, typename P::type> type;
+                typedef typename P::rest rest;
+            };
+
+            template <char... R>
+            struct ParsePreds<Chars<'[', ']', R...> >
+            {
+                static_assert(Unsupported<Chars<R...> >::value,
+                              "Empty predicate in JUDO_XPATH");
+            };
+
+            template <class S>
+            struct ParseSteps
+            {
+                static_assert(Unsupported<S>::value,
+                              "Unsupported step in JUDO_XPATH");
+            };
+
+            template <>
+            struct ParseSteps<Chars<> >
+            {
+                typedef End type;
+            };
+
+            template <char... R>
+            struct ParseSteps<Chars<'/', R...> >
+            {
+                typedef ReadName<Chars<>, Chars<R...> > N;
+                static_assert(!std::is_same<typename N::type, Chars<> >::value,
+                              "JUDO_XPATH only supports child steps");
+                typedef ParsePreds<typename N::rest> P;
+                typedef Step<typename N::type, typename P::type, 
+                             typename ParseSteps<typename P::rest>::type> type;
+            };
+
+            template <class S>
+            struct Parse
+            {
+                static_assert(Unsupported<S>::value,
+                              "JUDO_XPATH queries start with /");
+            };
+
+            template <char... R>
+            struct Parse<Chars<'/', R...> >
+            {
+                typedef ReadName<Chars<>, Chars<R...> > N;
+                static_assert(!std::is_same<typename N::type, Chars<> >::value,
+                              "JUDO_XPATH only supports child steps");
+                typedef ParsePreds<typename N::rest> P;
+                typedef Root<typename N::type, typename P::type, 
+                             typename ParseSteps<typename P::rest>::type> type;
+            };
+        };
+    };
+};
+
+#endif // ifndef INCL_XPATH_STATIC_H
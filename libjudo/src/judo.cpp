@@ -26,9 +26,24 @@
 // $Id: judo.cpp,v 1.2 2002/07/13 19:30:19 temas Exp $
 //============================================================================
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "judo.hpp"
+#include "Probes.h"
 using namespace std;
 
+// Semaphores for the probes of libjudo and jabberoo
+JUDO_PROBES(JUDO_PROBE_DEFINE)
+
+// Whether the entity name follows the '&' at src[i], within srcLen
+static bool isEntity(const char* src, unsigned int i, unsigned int srcLen,
+		     const char* name, unsigned int namelen)
+{
+    return srcLen - i - 1 >= namelen && strncmp(&src[i+1], name, namelen) == 0;
+}
+
 void judo::unescape(const char* src, unsigned int srcLen, string& dest, bool append)
 {
     unsigned int i, j;
@@ -53,20 +68,20 @@ void judo::unescape(const char* src, unsigned int srcLen, string& dest, bool app
 	// See if this is an escape character
 	if (src[i] == '&')
 	{
-	    if (strncmp(&src[i+1],"amp;",4)==0)
+	    if (isEntity(src, i, srcLen, "amp;", 4))
 	    {
 		dest[j] = '&';
 		i += 4;
-	    } else if (strncmp(&src[i+1],"quot;",5)==0) {
+	    } else if (isEntity(src, i, srcLen, "quot;", 5)) {
 		dest[j] = '\"';
 		i += 5;
-	    } else if (strncmp(&src[i+1],"apos;",5)==0) {
+	    } else if (isEntity(src, i, srcLen, "apos;", 5)) {
 		dest[j] = '\'';
 		i += 5;
-	    } else if (strncmp(&src[i+1],"lt;",3)==0) {
+	    } else if (isEntity(src, i, srcLen, "lt;", 3)) {
 		dest[j] = '<';
 		i += 3;
-	    } else if (strncmp(&src[i+1],"gt;",3)==0) {
+	    } else if (isEntity(src, i, srcLen, "gt;", 3)) {
 		dest[j] = '>';
 		i += 3;
 	    } else {
@@ -133,3 +148,12 @@ string judo::escape(const string& src)
     }
     return result;
 }
+
+size_t judo::heapSize(const string& s)
+{
+    const char* text = s.data();
+    const char* self = reinterpret_cast<const char*>(&s);
+    if (text >= self && text < self + sizeof(s))
+	return 0;
+    return s.capacity() + 1;
+}
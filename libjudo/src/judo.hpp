@@ -36,15 +36,23 @@
 
 #include <assert.h>
 
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <list>
 #include <map>
+#include <memory>
+#include <new>
 #include <string>
+#include <utility>
 #include <set>
+#include <vector>
 #include <algorithm>
+#include <atomic>
+#include <iterator>
 
 #include "expat.h"
+#include "MemoryResource.h"
 
 #ifdef TEST
 #define TESTER(s) friend class s;
@@ -58,6 +66,8 @@
 namespace judo
 {
     class XMLAccumulator;
+    class Element;
+    template <class E> class ChildIterator;
 
     /**
        Parent class for all XML objects
@@ -77,9 +87,43 @@ namespace judo
            @param type Node type classifier
         */
         Node(const std::string& name, Type ntype)
-	    : _name(name), _type(ntype)
+	    : _name(name), _type(ntype),
+	      _parent(NULL), _prev(NULL), _next(NULL)
+	    {}
+
+        /**
+           Copy constructor. The copy is not linked into any Element.
+        */
+        Node(const Node& n)
+	    : _name(n._name), _type(n._type),
+	      _parent(NULL), _prev(NULL), _next(NULL)
 	    {}
         virtual ~Node() {}
+
+        /**
+           Assignment; only the name and type are copied, the node
+           stays where it is in its parent Element.
+        */
+        Node& operator=(const Node& n)
+	    { _name = n._name; _type = n._type; return *this; }
+
+        /**
+           Nodes are allocated from getDefaultResource(), and remember
+           which resource that was so they can be deleted anywhere.
+        */
+        static void* operator new(std::size_t size);
+        static void  operator delete(void* p, std::size_t size);
+        static void* operator new(std::size_t size, const std::nothrow_t&) noexcept;
+        static void  operator delete(void* p, const std::nothrow_t&) noexcept;
+
+        /**
+           Placement: the caller owns the memory, and destroys the
+           node without deleting it.
+        */
+        static void* operator new(std::size_t, void* where) noexcept
+	    { return where; }
+        static void  operator delete(void*, void*) noexcept
+	    {}
     public:
         /**
            Accessor for the nodes name
@@ -111,6 +155,20 @@ namespace judo
 	*/
 	virtual void accumulate(XMLAccumulator& acc) const = 0;
 
+	/**
+	   Get the bytes this Node holds: itself, its text and
+	   attributes, and its children.
+	*/
+	virtual std::size_t getMemorySize() const = 0;
+
+        /**
+           Accessor for the Element this node is a child of
+           @return The parent Element, or NULL if this node is not
+           attached to one
+        */
+        Element* getParent() const
+	    { return _parent; }
+
     protected:
         std::string        _name;
         Node::Type _type;    
@@ -118,12 +176,94 @@ namespace judo
         // Ensure that no one can initialize this variable without
         // using the proper constructor
         Node();
+
+    private:
+	friend class Element;
+	template <class E> friend class ChildIterator;
+
+	// Intrusive sibling links, maintained by the parent Element
+	Element* _parent;
+	Node*    _prev;
+	Node*    _next;
+    };
+
+    /**
+       Bidirectional iterator over the child nodes of an
+       Element. Dereferencing yields the child Node pointer, so it is
+       used exactly like an iterator over a std::list<Node*>. Like a
+       list iterator it stays valid while other children are added
+       or removed.
+    */
+    template <class E>
+    class ChildIterator
+    {
+    public:
+	typedef std::bidirectional_iterator_tag iterator_category;
+	typedef Node*          value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef Node* const*   pointer;
+	typedef Node*          reference;
+
+	ChildIterator()
+	    : _node(NULL), _owner(NULL) {}
+	ChildIterator(Node* n, E* owner)
+	    : _node(n), _owner(owner) {}
+	// Allow iterator -> const_iterator conversion
+	template <class E2>
+	ChildIterator(const ChildIterator<E2>& it)
+	    : _node(it._node), _owner(it._owner) {}
+
+	reference operator*() const
+	    { return _node; }
+	pointer operator->() const
+	    { return &_node; }
+
+	ChildIterator& operator++()
+	    { _node = _node->_next; return *this; }
+	ChildIterator operator++(int)
+	    { ChildIterator tmp(*this); ++*this; return tmp; }
+	// Decrementing end() yields the last child
+	ChildIterator& operator--()
+	    { _node = (_node != NULL) ? _node->_prev : _owner->_last; return *this; }
+	ChildIterator operator--(int)
+	    { ChildIterator tmp(*this); --*this; return tmp; }
+
+	template <class E2>
+	bool operator==(const ChildIterator<E2>& it) const
+	    { return _node == it._node; }
+	template <class E2>
+	bool operator!=(const ChildIterator<E2>& it) const
+	    { return _node != it._node; }
+
+    private:
+	friend class Element;
+	template <class E2> friend class ChildIterator;
+
+	Node* _node;
+	E*    _owner;
     };
 
     // Utility routines
     void   unescape(const char* src, unsigned int srcLen, std::string& dest, bool append = false);  
     std::string escape(const std::string& src);
 
+    /**
+       Get the bytes a string has allocated for its text, which is
+       none while the text fits inside the string itself.
+    */
+    std::size_t heapSize(const std::string& s);
+
+    /**
+       What each node of a std::map or std::set costs beyond its
+       value: the tree links and colour, padded.
+    */
+    const std::size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+
+    /**
+       What each node of a std::list costs beyond its value.
+    */
+    const std::size_t LIST_NODE_OVERHEAD = 2 * sizeof(void*);
+
     class XMLAccumulator
     {
     public:
@@ -139,6 +279,8 @@ namespace judo
 	template <class T>
 	XMLAccumulator& operator<<(T data)
 	    { _result += data; return *this; }
+	XMLAccumulator& operator<<(const std::string& data)
+	    { _result += data; return *this; }
     private:
 	std::string& _result;
     };
@@ -165,6 +307,15 @@ namespace judo
 		    _text.assign(text, textsz);
 		}
 	    }
+
+        /**
+           Construct from unescaped character data, taking over the
+           string's buffer instead of copying it.
+           @param text Unescaped character data
+        */
+        explicit CDATA(std::string&& text)
+            : Node("#CDATA", Node::ntCDATA), _text(std::move(text))
+	    {}
 	
         /**
            Overwrite all existing character data in this object with
@@ -223,6 +374,8 @@ namespace judo
 	void accumulate(XMLAccumulator& acc) const
 	    { acc << escape(_text); }
 
+	std::size_t getMemorySize() const;
+
     private:
 	TESTER(CDATATest)
 
@@ -236,59 +389,87 @@ namespace judo
         public Node
     {
     public:
+	/**
+	   Attributes, allocated from the resource which was the
+	   default when the Element was made.
+	*/
+	typedef std::map<std::string, std::string, std::less<std::string>,
+			 Allocator<std::pair<const std::string, std::string> > > AttribMap;
+
         Element(const std::string& name, const char** attribs = NULL);
 	Element(const Element& e);
+	Element(Element&& e);
         ~Element();
 
         Element& operator=(const Element& e);
+	Element& operator=(Element&& e);
 
         Element* addElement(const std::string& name, const char** attribs = NULL);
 	Element* addElement(const std::string& name, const std::string& cdata, 
 			    bool escaped = false);
+	Element* addElement(std::string&& name, std::string&& cdata);
+	Element* addElement(Element&& e);
         CDATA*   addCDATA(const char* data, int datasz, bool escaped = false);	
+        CDATA*   addCDATA(std::string&& data);
 
 
         bool hasAttrib(const std::string& name) const;
         void   putAttrib(const std::string& name, const std::string& value);
+        void   putAttrib(std::string&& name, std::string&& value);
         std::string getAttrib(const std::string& name) const;
+        const std::string* findAttrib(const std::string& name) const;
         void   delAttrib(const std::string& name);
         bool   cmpAttrib(const std::string& name, const std::string& value) const;
-        std::map<std::string,std::string> getAttribs() const { return _attribs; }
+        std::map<std::string,std::string> getAttribs() const
+	    { return std::map<std::string,std::string>(_attribs.begin(), _attribs.end()); }
 
         std::string toString() const;
 	std::string toStringEx(bool recursive = false, bool closetag = false) const;
+	std::string toStringRaw(const std::map<std::string,std::string>* attribs = NULL) const;
 
 	void accumulate(XMLAccumulator& acc) const;
 
+	std::size_t getMemorySize() const;
+
 	std::string getCDATA() const;
 	
 
-	typedef std::list<Node*>::iterator iterator;
-	typedef std::list<Node*>::const_iterator const_iterator;
-	typedef std::list<Node*>::reverse_iterator reverse_iterator;
-	typedef std::list<Node*>::const_reverse_iterator const_reverse_iterator;
+	typedef ChildIterator<Element> iterator;
+	typedef ChildIterator<const Element> const_iterator;
+	typedef std::reverse_iterator<iterator> reverse_iterator;
+	typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
 	/**
 	   Append child node to this Element
 	   @param child child node pointer
 	*/
 	void appendChild(Node* child)
-	    { _children.push_back(child); }
+	    { link(child); }
+
+	/**
+	   Append child node to this Element, taking ownership of it.
+	   @param child child node
+	   @returns Pointer to the child, now owned by this Element
+	*/
+	template <class T>
+	T* appendChild(std::unique_ptr<T> child)
+	    { link(child.get()); return child.release(); }
         
         Node* detachChild(iterator it);
+        std::unique_ptr<Node> releaseChild(iterator it);
         
 	/** 
 	    Determine if this Element is empty (i.e. has no child nodes)
 	    @returns True if no child nodes exist
 	*/
 	bool empty() const
-	    { return _children.empty(); }
+	    { materialize(); return _first == NULL; }
 
     /**
-        Remove all children elements.
+        Remove all children elements. The children are unlinked,
+        not deleted.
     */
-    void clear()
-    { _children.clear(); }
+    void clear();
 
 	/**
 	   Determine the number of child nodes this Element
@@ -296,43 +477,43 @@ namespace judo
 	   @returns Number of child nodes in this Element
 	*/
 	int size() const
-	    { return _children.size(); }
+	    { materialize(); return _count; }
 	
 	/**
 	   Return an iterator to the first child Node.
 	*/
 	iterator begin()
-	    { return _children.begin(); }
+	    { materialize(); return iterator(_first, this); }
 
 	/**
 	   Return a const iterator to the first child Node.
 	*/
 	const_iterator begin() const
-	    { return _children.begin(); }
+	    { materialize(); return const_iterator(_first, this); }
 
     reverse_iterator rbegin()
-    { return _children.rbegin(); }
+    { return reverse_iterator(end()); }
 
     const_reverse_iterator rbegin() const
-    { return _children.rbegin(); }
+    { return const_reverse_iterator(end()); }
 
 	/**
 	   Return a iterator indicating the end of child nodes.
 	*/
 	iterator end()
-	    { return _children.end(); }
+	    { materialize(); return iterator(NULL, this); }
 
 	/**
 	   Return a const iterator indicating the end of child nodes.
 	*/
 	const_iterator end() const
-	    { return _children.end(); }
+	    { materialize(); return const_iterator(NULL, this); }
 
 	reverse_iterator rend()
-	    { return _children.rend(); }
+	    { return reverse_iterator(begin()); }
 
 	const_reverse_iterator rend() const
-	    { return _children.rend(); }
+	    { return const_reverse_iterator(begin()); }
 
 	iterator find(const std::string& name, Node::Type type = Node::ntElement);
 
@@ -341,22 +522,74 @@ namespace judo
 	   Delete the child Node designated by the supplied iterator.
 	   @param it Iterator pointing to the child Node 
 	*/
-	void Element::erase(Element::iterator it)
-	    { delete *it; _children.erase(it); }
+	void erase(Element::iterator it)
+	    { delete detachChild(it); }
 
 	Element* findElement(const std::string& name);
 	const Element* findElement(const std::string& name) const;
+	Element* findElementByXmlns(const std::string& xmlns);
+	const Element* findElementByXmlns(const std::string& xmlns) const;
 	void     eraseElement(const std::string& name);
 
 	std::string getChildCData(const std::string& name) const;
 	int         getChildCDataAsInt(const std::string& name, int defaultvalue) const;
 
+	/**
+	   Elements with at least this many children build a name
+	   and xmlns index on the first lookup.
+	*/
+	static const int INDEX_THRESHOLD = 16;
+
+	/**
+	   Determine if the children of this Element have been built. An
+	   Element read by a lazy ElementStream holds its content as raw
+	   XML until the first access to its children, which parses
+	   it. This happens even through const methods; threads reading
+	   a shared Element at once take turns, and only the first
+	   builds the children.
+	   @returns False if the children are still held as raw XML
+	*/
+	bool isMaterialized() const
+	    { return _lazy.load(std::memory_order_acquire) == NULL; }
 
     protected:
 	TESTER(ElementTest)
 	
-        std::list<Node*>        _children;
-        std::map<std::string,std::string> _attribs;
+	Node*        _first;
+	Node*        _last;
+	int          _count;
+        AttribMap    _attribs;
+
+    private:
+	template <class E> friend class ChildIterator;
+	friend class ElementStream;
+	friend class BinaryEncoder;
+
+	// Lazily built first-match lookup tables for large elements.
+	// Readers build it under the same lock as the lazy children.
+	struct ChildIndex;
+	mutable std::atomic<ChildIndex*> _index;
+
+	// Unparsed content (the XML between our start and end tags)
+	// captured by a lazy ElementStream; see materialize(). Once it
+	// is set only buildLazy() clears it, under the build lock, after
+	// the children are linked in.
+	mutable std::atomic<std::string*> _lazy;
+
+	void materialize() const
+	    { if (_lazy.load(std::memory_order_acquire) != NULL) buildLazy(); }
+	void buildLazy() const;
+	std::string* copyLazy() const;
+	void accumulateRaw(XMLAccumulator& acc, 
+			   const std::map<std::string,std::string>* attribs) const;
+
+	void link(Node* child);
+	void unlink(Node* child);
+	void takeChildren(Element& e);
+	void releaseChildren();
+	const ChildIndex& index() const;
+	void dropIndex() const;
+	void attribChanged(const std::string& name);
     };
     
     /**
@@ -383,6 +616,18 @@ namespace judo
 	*/
 	virtual void onElement(Element* e) = 0;
 
+	/**
+	   Event point for the start tag of an immediate child of the
+	   XML document root, before any of it has been built. Override
+	   this method to filter packets early; an element which is
+	   skipped is never built and onElement is not called for it.
+	   @param name Element name
+	   @param attribs Expat-style attributes of the element
+	   @returns False to skip the element
+	*/
+	virtual bool onElementStart(const char* name, const char** attribs)
+	    { return true; }
+
 	/**
 	   Event point for immediate CDATA of an XML document
 	   root. Override this method to get notified when CDATA is
@@ -405,22 +650,285 @@ namespace judo
     };
     
 
+    /**
+       SAX style event interface for elements which should not be
+       built as trees, such as packets carrying large payloads. The
+       listener picks elements by name or depth, and is then told
+       about the element and everything inside it as the parser reads
+       it. Depths count from 1 for packet-level elements.
+       @see ElementStream::setSAXListener
+    */
+    class ElementStreamSAXListener
+    {
+    public:
+	virtual ~ElementStreamSAXListener() {}
+	/**
+	   Decide whether an element should be delivered as events. If
+	   it is a packet-level element, onElement will not be called
+	   for it; otherwise its parent gets an empty child with the
+	   same name and attributes in its place. With a lazy depth
+	   set, elements below it are not offered.
+	   @param name Element name
+	   @param attribs Expat-style attributes of the element
+	   @param depth Depth of the element
+	   @returns True to receive the element as events
+	*/
+	virtual bool selectElement(const char* name, const char** attribs, int depth) = 0;
+
+	/**
+	   Event point for the start of a selected element or one of
+	   its descendants.
+	*/
+	virtual void onStartElement(const char* name, const char** attribs, int depth) = 0;
+
+	/**
+	   Event point for the end of a selected element or one of
+	   its descendants.
+	*/
+	virtual void onEndElement(const char* name, int depth) = 0;
+
+	/**
+	   Event point for character data within a selected
+	   element. The text of an element may arrive in any number
+	   of chunks, which point into the parser's buffer and are
+	   only valid during the call.
+	   @param text Unescaped character data
+	   @param textsz Length of the character data
+	   @param depth Depth of the element the text is in
+	*/
+	virtual void onText(const char* text, int textsz, int depth) = 0;
+    };
+
+    /**
+       Interface to the tokenizer behind an ElementStream. A backend
+       reports elements and character data through expat-style
+       handlers; errors are reported as expat XML_Error codes.
+    */
+    class ParserBackend
+    {
+    public:
+	typedef void (*StartHandler)(void* userdata, const char* name, const char** attribs);
+	typedef void (*EndHandler)(void* userdata, const char* name);
+	typedef void (*CDATAHandler)(void* userdata, const char* cdata, int cdatasz);
+
+	virtual ~ParserBackend() {}
+
+	/**
+	   Prepare for a new XML document/stream.
+	*/
+	virtual void reset(void* userdata, StartHandler start, EndHandler end, 
+			   CDATAHandler cdata) = 0;
+
+	/**
+	   Parse more of the document.
+	   @returns False if the data is not well-formed
+	*/
+	virtual bool parse(const char* data, int datasz) = 0;
+
+	/**
+	   Get a buffer of at least size bytes for parseBuffer()
+	*/
+	virtual char* getBuffer(int size) = 0;
+
+	/**
+	   Parse data placed into the buffer from getBuffer()
+	   @returns False if the data is not well-formed
+	*/
+	virtual bool parseBuffer(int datasz) = 0;
+
+	/**
+	   Get the stream offset of the markup or text being
+	   reported. Only valid within a handler.
+	*/
+	virtual long getCurrentByteIndex() const = 0;
+
+	/**
+	   Get the length of the markup or text being
+	   reported. Only valid within a handler.
+	*/
+	virtual int getCurrentByteCount() const = 0;
+
+	/**
+	   Get the XML_Error code of the last failure
+	*/
+	virtual int getErrorCode() const = 0;
+
+	/**
+	   Determine if the input within the root element parses the
+	   same on its own: as UTF-8, and with only the predefined
+	   entities. A lazy ElementStream keeps such input as it is,
+	   and otherwise rewrites it from the events.
+	*/
+	virtual bool isVerbatim() const = 0;
+    };
+
+    /**
+       Parser backend using the bundled expat. This is the default.
+    */
+    class ExpatBackend
+	: public ParserBackend
+    {
+    public:
+	ExpatBackend();
+	~ExpatBackend();
+
+	void reset(void* userdata, StartHandler start, EndHandler end, CDATAHandler cdata);
+	bool parse(const char* data, int datasz);
+	char* getBuffer(int size);
+	bool parseBuffer(int datasz);
+	long getCurrentByteIndex() const;
+	int getCurrentByteCount() const;
+	int getErrorCode() const;
+	bool isVerbatim() const
+	    { return _verbatim; }
+
+    private:
+	XML_Parser _parser;
+
+	// Expat calls back with the backend, and these pass the events
+	// on with the stream's userdata
+	void*             _userdata;
+	StartHandler      _start;
+	EndHandler        _end;
+	CDATAHandler      _cdata;
+
+	// Cleared by a declared encoding other than UTF-8, UTF-16 read
+	// from the first bytes, or any DTD
+	bool              _verbatim;
+	int               _sniffed;
+	char*             _buffer;
+
+	void sniff(const char* data, int datasz);
+	static void onStart(void* backend, const char* name, const char** attribs);
+	static void onEnd(void* backend, const char* name);
+	static void onCDATA(void* backend, const char* cdata, int cdatasz);
+	static void onXmlDecl(void* backend, const XML_Char* version,
+			      const XML_Char* encoding, int standalone);
+	static void onDoctype(void* backend, const XML_Char* name, const XML_Char* sysid,
+			      const XML_Char* pubid, int has_internal_subset);
+    };
+
+    /**
+       Parser backend for the restricted XML which XMPP allows: UTF-8
+       only, with no DTD, comments or processing instructions other
+       than the XML declaration. It skips the generic machinery of
+       expat and scans with memchr, which is considerably faster for
+       XMPP traffic. It checks what well-formedness needs, as expat
+       does: text and attribute values are UTF-8 made up of XML
+       characters, character references name such characters,
+       references are whole and to the predefined entities only,
+       element and attribute names are names, attributes are not
+       repeated, text has no "]]>", and tags nest. Names are only
+       checked against the ASCII name characters; any character
+       beyond ASCII is let through in a name. Anything else is an
+       error, so it is safe on input from an untrusted peer.
+    */
+    class XMPPBackend
+	: public ParserBackend
+    {
+    public:
+	XMPPBackend();
+
+	void reset(void* userdata, StartHandler start, EndHandler end, CDATAHandler cdata);
+	bool parse(const char* data, int datasz);
+	char* getBuffer(int size);
+	bool parseBuffer(int datasz);
+	long getCurrentByteIndex() const
+	    { return _event_index; }
+	int getCurrentByteCount() const
+	    { return _event_count; }
+	int getErrorCode() const
+	    { return _error; }
+	bool isVerbatim() const
+	    { return true; }
+
+    private:
+	TESTER(ElementStreamTest)
+
+	// Unparsed input is _buf[_pos, _end), which is at stream
+	// offset _base + _pos
+	std::vector<char> _buf;
+	size_t            _pos;
+	size_t            _end;
+	long              _base;
+
+	std::vector<std::string> _open;
+	std::vector<std::string> _strings;
+	std::vector<const char*> _attribs;
+	std::string       _text;
+	bool              _prolog;
+	bool              _finished;
+	long              _event_index;
+	int               _event_count;
+	int               _error;
+
+	void*             _userdata;
+	StartHandler      _start;
+	EndHandler        _end_handler;
+	CDATAHandler      _cdata;
+
+	// Each tokenizing step returns the number of bytes it used,
+	// 0 if it needs more input or -1 on error
+	bool run();
+	int  text(const char* p, const char* end);
+	int  startTag(const char* p, const char* end);
+	int  endTag(const char* p, const char* end);
+	int  special(const char* p, const char* end);
+	bool emitText(const char* p, const char* end, const char* token, bool section);
+	bool decode(const char* p, const char* end, std::string& dest, bool attrib);
+	int  fail(int code)
+	    { _error = code; return -1; }
+	long offset(const char* p) const
+	    { return _base + (p - &_buf[0]); }
+    };
+
     /**
        XML parser wrapper class
     */
     class ElementStream 
     {
     public:
-	ElementStream(ElementStreamEventListener* l);
+	ElementStream(ElementStreamEventListener* l, ParserBackend* backend = NULL);
 	virtual ~ElementStream();
 
+	void setBackend(ParserBackend* backend);
+
     void push(const std::string& data)
     { push(data.c_str(), data.size()); }
 	void push(const char* data, int datasz);
+	char* getBuffer(int size);
+	void commit(int datasz);
 	void reset();
 
+	void setLazyDepth(int depth);
+	/**
+	   Get the lazy parsing depth.
+	   @see ElementStream::setLazyDepth
+	*/
+	int getLazyDepth() const
+	    { return _lazy_depth; }
+
+	void setSAXListener(ElementStreamSAXListener* l);
+
 	static Element* parseAtOnce(const char* buffer);
 
+	/**
+	   Get the size in bytes of the top-level element most recently
+	   parsed, tags included. This is set before onElement() is
+	   called for it.
+	*/
+	long getElementSize() const
+	    { return _element_size; }
+
+	/**
+	   Get the bytes held for the top-level element being parsed:
+	   the Elements built for it so far, the input kept for lazy
+	   parsing, and input the backend has buffered but not yet
+	   reported, such as the first part of a long tag.
+	*/
+	std::size_t getPendingSize() const
+	    { return _pending + heapSize(_raw) + heapSize(_lazy_xml) + (_pushed - _consumed); }
+
 	struct exception
 	{
 	    class ParserError 
@@ -443,12 +951,43 @@ namespace judo
     private:
 	TESTER(ElementStreamTest)
 
-	XML_Parser     _parser;
-	bool           _parser_ready;
+	ParserBackend* _backend;
 	std::list<Element*> _element_stack;
 	bool           _document_started;
 	bool           _document_ended;
 
+	// Lazy mode state; _raw holds the input from the start of the
+	// current top-level element, which begins at stream offset
+	// _raw_base
+	int            _lazy_depth;
+	int            _lazy_nesting;
+	long           _lazy_body;
+	std::string    _raw;
+	long           _raw_base;
+	// Lazy content written out from the events instead, when the
+	// backend's input isn't verbatim
+	std::string    _lazy_xml;
+
+	char*          _buffer;
+
+	ElementStreamSAXListener* _sax_listener;
+	int            _sax_nesting;
+
+	// Depth within a packet the listener skipped
+	int            _skip_nesting;
+
+	// Where the current top-level element starts in the stream, and
+	// its size once it has ended
+	long           _element_start;
+	long           _element_size;
+
+	// Bytes of the Elements built for the current top-level element;
+	// the stream offsets pushed so far and of the end of the last
+	// event the backend reported
+	std::size_t    _pending;
+	long           _pushed;
+	long           _consumed;
+
 	ElementStreamEventListener* _event_listener;
 
 	// Expat callbacks
@@ -456,9 +995,14 @@ namespace judo
 	static void onEndElement(void* userdata, const char* name);
 	static void onCDATA(void* userdata, const char* cdata, int cdatasz);
 
-	// Expat initializers
-	void initExpat();
-	void cleanupExpat();
+	void consumed()
+	    { _consumed = _backend->getCurrentByteIndex() + _backend->getCurrentByteCount(); }
+	void trimRaw(long offset);
+	void trimRawEvent();
+	void endElement(const char* name);
+	void lazyStart(const char* name, const char** attribs);
+	void lazyEnd(const char* name);
+	void lazyText(const char* cdata, int cdatasz);
        };
 };
 #endif
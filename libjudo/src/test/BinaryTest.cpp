@@ -0,0 +1,238 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      BinaryTest.cpp
+// Description:   judo::BinaryEncoder and judo::BinaryDocument unit tests
+//
+//   License:
+//
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//
+//============================================================================
+
+#include "judo.hpp"
+#include "Binary.h"
+#include "judo_test.hpp"
+using namespace judo;
+
+#include <iostream>
+using namespace std;
+
+Test* BinaryTest::getTestSuite()
+{
+    TestSuite* s = new TestSuite();
+    s->addTest(new TestCaller<BinaryTest>("roundTrip",
+					  &BinaryTest::roundTrip));
+    s->addTest(new TestCaller<BinaryTest>("views",
+					  &BinaryTest::views));
+    s->addTest(new TestCaller<BinaryTest>("encoder",
+					  &BinaryTest::encoder));
+    s->addTest(new TestCaller<BinaryTest>("malformed",
+					  &BinaryTest::malformed));
+    return s;
+}
+
+namespace
+{
+    const char* STANZA =
+	"<message from='juliet@capulet.com/balcony' to='romeo@montague.net' type='chat'>"
+	"<body>Wherefore art thou, &lt;Romeo&gt; and &apos;co&apos;?</body>"
+	"<x xmlns='jabber:x:event'><composing/></x>"
+	"text<thread>e0ffe42b</thread>more text"
+	"</message>";
+
+    bool rejected(const string& data)
+    {
+	try
+	{
+	    BinaryDocument doc(data.data(), data.size());
+	}
+	catch (BinaryDocument::exception::FormatError&)
+	{
+	    return true;
+	}
+	return false;
+    }
+}
+
+void BinaryTest::roundTrip()
+{
+    Element* e = ElementStream::parseAtOnce(STANZA);
+    string bin = BinaryEncoder::encodeAtOnce(*e);
+
+    // Unescaped text and shared names make it smaller than the XML
+    Assert(bin.size() < e->toString().size());
+
+    BinaryDocument doc(bin.data(), bin.size());
+    Assert(doc.getRoot().toString() == e->toString());
+
+    Element* copy = BinaryDocument::decodeAtOnce(bin.data(), bin.size());
+    Assert(copy->toString() == e->toString());
+    Assert(copy->size() == e->size());
+
+    // Encoding the copy gives the same bytes
+    Assert(BinaryEncoder::encodeAtOnce(*copy) == bin);
+    delete copy;
+    delete e;
+
+    // Empty text and values survive
+    Element empty("a");
+    empty.putAttrib("b", "");
+    empty.addCDATA(string());
+    bin = BinaryEncoder::encodeAtOnce(empty);
+    copy = BinaryDocument::decodeAtOnce(bin.data(), bin.size());
+    Assert(copy->toString() == empty.toString());
+    Assert(copy->size() == 1);
+    delete copy;
+}
+
+void BinaryTest::views()
+{
+    Element* e = ElementStream::parseAtOnce(STANZA);
+    string bin = BinaryEncoder::encodeAtOnce(*e);
+    delete e;
+
+    BinaryDocument doc(bin.data(), bin.size());
+    BinaryNode root = doc.getRoot();
+    Assert(root.getType() == Node::ntElement);
+    Assert(root.getName() == "message");
+    Assert(root.getAttrib("to") == "romeo@montague.net");
+    TextView value;
+    Assert(!root.findAttrib("id", value));
+    Assert(root.findAttrib("type", value) && value == "chat");
+
+    // Views point into the buffer
+    Assert(value.data > bin.data() && value.data < bin.data() + bin.size());
+
+    int attribs = 0;
+    for (BinaryNode::AttribIterator it = root.attribBegin(); it != root.attribEnd(); ++it)
+	attribs++;
+    Assert(attribs == 3);
+
+    int children = 0;
+    for (BinaryNode::iterator it = root.begin(); it != root.end(); ++it)
+	children++;
+    Assert(children == 5);
+
+    BinaryNode body = root.findElement("body");
+    Assert(bool(body));
+    Assert(body.getCDATA() == "Wherefore art thou, <Romeo> and 'co'?");
+    Assert(root.findElement("x").findElement("composing").begin() ==
+	   root.findElement("x").findElement("composing").end());
+    Assert(!root.findElement("subject"));
+    // Only the first text, as Element::getCDATA gives
+    Assert(root.getCDATA() == "text");
+    Assert(root.findElement("x").getCDATA() == "");
+
+    BinaryNode text = *root.findElement("x").begin();
+    Assert(text.getName() == "composing");
+    text = *(++(++root.begin()));
+    Assert(text.getType() == Node::ntCDATA);
+    Assert(text.getText() == "text");
+    Assert(text.getName() == "#CDATA");
+}
+
+void BinaryTest::encoder()
+{
+    BinaryEncoder enc;
+    enc.startElement("iq");
+    enc.putAttrib("type", "get");
+    enc.putAttrib("id", "1");
+    enc.putAttrib("type", "result");
+    enc.startElement("query");
+    enc.putAttrib("xmlns", "jabber:iq:roster");
+    enc.addText("a<b&c", 5);
+    enc.endElement();
+
+    Element item("item");
+    item.putAttrib("jid", "romeo@montague.net");
+    enc.encode(item);
+    enc.endElement();
+
+    string bin = enc.finish();
+    BinaryDocument doc(bin.data(), bin.size());
+    Assert(doc.getRoot().toString() ==
+	   "<iq type='result' id='1'><query xmlns='jabber:iq:roster'>a&lt;b&amp;c</query>"
+	   "<item jid='romeo@montague.net'/></iq>");
+
+    // The encoder starts over after finish()
+    enc.startElement("presence");
+    enc.endElement();
+    bin = enc.finish();
+    BinaryDocument doc2(bin.data(), bin.size());
+    Assert(doc2.getRoot().toString() == "<presence/>");
+}
+
+void BinaryTest::malformed()
+{
+    Element* e = ElementStream::parseAtOnce(STANZA);
+    string bin = BinaryEncoder::encodeAtOnce(*e);
+    delete e;
+
+    Assert(!rejected(bin));
+    Assert(rejected(""));
+    Assert(rejected("JBX0" + bin.substr(4)));
+
+    // Every truncation is caught
+    bool all = true;
+    for (size_t i = 0; i < bin.size(); i++)
+	all = all && rejected(bin.substr(0, i));
+    Assert(all);
+    Assert(rejected(bin + '\0'));
+
+    // As is a length which runs past its element
+    string bad = bin;
+    bad[13]++;
+    Assert(rejected(bad));
+
+    // A name which is not in the table
+    bad = bin;
+    bad[9] = 0x7f;
+    Assert(rejected(bad));
+
+    // <a b='x' a='y'/>, by hand since the encoder won't repeat an
+    // attribute: the element's name, then two attributes naming
+    // entries of the table
+    const char attribs[] =
+	"JBX1\x15\0\0\0"
+	"\x01\x00\x07\0\0\0" "\x02" "\x01\x01x" "\x00\x01y"
+	"\x02" "\x01" "a" "\x01" "b";
+    bad.assign(attribs, sizeof(attribs) - 1);
+    Assert(!rejected(bad));
+    Assert(BinaryDocument(bad.data(), bad.size()).getRoot().toString() == "<a b='x' a='y'/>");
+
+    // Names can't repeat, through the same index or through two
+    // entries with the same text
+    bad[18] = 0x01;
+    Assert(rejected(bad));
+    bad[18] = 0x00;
+    bad[bad.size() - 1] = 'a';
+    Assert(rejected(bad));
+
+    // Any corruption of any byte is caught or yields a readable
+    // document; the checks mean nothing is read out of bounds
+    for (size_t i = 0; i < bin.size(); i++)
+    {
+	for (int v = 0; v < 256; v += 37)
+	{
+	    bad = bin;
+	    bad[i] = char(v);
+	    try
+	    {
+		BinaryDocument doc(bad.data(), bad.size());
+		doc.getRoot().toString();
+	    }
+	    catch (BinaryDocument::exception::FormatError&)
+	    {
+	    }
+	}
+    }
+}
@@ -27,10 +27,14 @@
 //============================================================================
 
 #include "judo.hpp"
+#include "XPath.h"
 #include "judo_test.hpp"
 using namespace judo;
 
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
 using namespace std;
 
 Test* ElementStreamTest::getTestSuite()
@@ -40,8 +44,24 @@ Test* ElementStreamTest::getTestSuite()
 					     &ElementStreamTest::construct));
     s->addTest(new TestCaller<ElementStreamTest>("push",
 					     &ElementStreamTest::push));
+    s->addTest(new TestCaller<ElementStreamTest>("lazyPush",
+					     &ElementStreamTest::lazyPush));
+    s->addTest(new TestCaller<ElementStreamTest>("lazyDecoded",
+					     &ElementStreamTest::lazyDecoded));
+    s->addTest(new TestCaller<ElementStreamTest>("sharedLazy",
+					     &ElementStreamTest::sharedLazy));
+    s->addTest(new TestCaller<ElementStreamTest>("saxListener",
+					     &ElementStreamTest::saxListener));
+    s->addTest(new TestCaller<ElementStreamTest>("skipElement",
+					     &ElementStreamTest::skipElement));
+    s->addTest(new TestCaller<ElementStreamTest>("bufferPush",
+					     &ElementStreamTest::bufferPush));
+    s->addTest(new TestCaller<ElementStreamTest>("backends",
+					     &ElementStreamTest::backends));
     s->addTest(new TestCaller<ElementStreamTest>("parseAtOnce",
 					     &ElementStreamTest::parseAtOnce));
+    s->addTest(new TestCaller<ElementStreamTest>("pendingSize",
+					     &ElementStreamTest::pendingSize));
     return s;
 }
 
@@ -127,6 +147,384 @@ void ElementStreamTest::push()
     }
 }
 
+void ElementStreamTest::lazyPush()
+{
+    Assert(G_results.empty());
+
+    ElementStreamTestImpl es;
+    es._stream.setLazyDepth(1);
+
+    es._stream.push("<root>  <message to='dizzy@j.org'><body>He");
+    es._stream.push("llo bye</body><x xmlns=\"a\"/></message><presence/> ");
+    Assert(G_results.size() == 3);
+
+    // Only the headers have been built
+    Element* m = *++G_results.begin();
+    Assert(!m->isMaterialized());
+    Assert(m->getAttrib("to") == "dizzy@j.org");
+
+    // Raw serialization copies the unparsed content verbatim
+    Assert(m->toStringRaw() == "<message to='dizzy@j.org'><body>Hello bye</body><x xmlns=\"a\"/></message>");
+    map<string, string> attribs;
+    attribs["to"] = "temas@j.org";
+    Assert(m->toStringRaw(&attribs) == "<message to='temas@j.org'><body>Hello bye</body><x xmlns=\"a\"/></message>");
+    Assert(!m->isMaterialized());
+
+    // Copies stay unparsed until used
+    Element copy(*m);
+    Assert(!copy.isMaterialized());
+    Assert(copy.getChildCData("body") == "Hello bye");
+    Assert(copy.isMaterialized());
+    Assert(!m->isMaterialized());
+
+    Assert(m->toString() == "<message to='dizzy@j.org'><body>Hello bye</body><x xmlns='a'/></message>");
+    Assert(m->isMaterialized());
+    Assert(G_results.back()->isMaterialized());
+    Assert(G_results.back()->empty());
+
+    // Build the first level of children as well
+    es._stream.push("</root>");
+    es._stream.reset();
+    es._stream.setLazyDepth(2);
+    es._stream.push("<root><iq><query xmlns='jabber:iq:roster'><item/></query>text</iq>");
+    Element* iq = G_results.back();
+    Assert(iq->isMaterialized());
+    Assert(iq->size() == 2);
+    Element* query = iq->findElementByXmlns("jabber:iq:roster");
+    Assert(query != NULL);
+    Assert(!query->isMaterialized());
+    Assert(query->findElement("item") != NULL);
+
+    // Packets with nothing at the lazy depth don't leave their input
+    // behind
+    for (int i = 0; i < 100; i++)
+	es._stream.push("<presence from='a@b/c'/> <message><body>hi</body></message>");
+    Assert(es._stream._raw.empty());
+    es._stream.push("<message><body>hi");
+    Assert(es._stream._raw == "hi");
+    es._stream.push("</body></message>");
+    es._stream.push("</root>");
+}
+
+void ElementStreamTest::sharedLazy()
+{
+    Assert(G_results.empty());
+
+    ElementStreamTestImpl es;
+    es._stream.setLazyDepth(1);
+    // Enough children for lookups to build the child index
+    string items;
+    for (int i = 0; i < Element::INDEX_THRESHOLD; i++)
+	items += "<item/>";
+    const string expected = "<message to='a'><body>hi</body><x xmlns='b'><y/></x>" + items + "</message>";
+    es._stream.push("<root>" + expected);
+    const Element* m = G_results.back();
+
+    // Readers of a shared element race to build its children and
+    // index; each must see them whole, and the content must not be
+    // freed under a reader copying it
+    for (int round = 0; round < 50; round++)
+    {
+	Element shared(*m);
+	vector<int> ok(8, 0);
+	vector<thread> readers;
+	for (int i = 0; i < 8; i++)
+	    readers.push_back(thread([&shared, &ok, &expected, i]() {
+		switch (i % 4)
+		{
+		case 0:
+		    ok[i] = shared.getChildCData("body") == "hi";
+		    break;
+		case 1:
+		    ok[i] = Element(shared).toString() == expected;
+		    break;
+		case 2:
+		    ok[i] = shared.toStringRaw() == expected;
+		    break;
+		default:
+		    ok[i] = shared.getMemorySize() > 0 && shared.findElementByXmlns("b") != NULL;
+		}
+	    }));
+	for (int i = 0; i < 8; i++)
+	{
+	    readers[i].join();
+	    Assert(ok[i]);
+	}
+	Assert(shared.isMaterialized());
+    }
+    es._stream.push("</root>");
+}
+
+void ElementStreamTest::lazyDecoded()
+{
+    Assert(G_results.empty());
+
+    // Lazy content which would not parse the same on its own, without
+    // the stream's encoding or DTD, is kept as UTF-8 instead
+    const char* docs[] = {
+	"<?xml version='1.0' encoding='ISO-8859-1'?><root>"
+	"<message to='caf\xe9'><body a='&apos;'>caf\xe9 &amp; &lt;</body></message>",
+	"<!DOCTYPE root [<!ENTITY w 'caf&#xe9;'>]><root>"
+	"<message to='&w;'><body a='&apos;'>&w; &amp; &lt;</body></message>"
+    };
+    const string expected = "<message to='caf\xc3\xa9'><body a='&apos;'>caf\xc3\xa9 &amp; &lt;</body></message>";
+    for (int i = 0; i < 2; i++)
+    {
+	ElementStreamTestImpl es;
+	es._stream.setLazyDepth(1);
+	es._stream.push(docs[i]);
+	Element* m = G_results.back();
+	Assert(!m->isMaterialized());
+	Assert(m->toStringRaw() == expected);
+	Assert(m->toString() == expected);
+	Assert(m->isMaterialized());
+	// Once more, now that the content has gone
+	Assert(m->toString() == expected);
+	Assert(m->getChildCData("body") == "caf\xc3\xa9 & <");
+	es._stream.push("</root>");
+    }
+
+    // As does UTF-16
+    string utf16;
+    const string doc = "<root><message><body>hi</body></message>";
+    for (size_t i = 0; i < doc.size(); i++)
+    {
+	utf16 += doc[i];
+	utf16 += '\0';
+    }
+    ElementStreamTestImpl es;
+    es._stream.setLazyDepth(1);
+    es._stream.push(utf16.data(), utf16.size());
+    Assert(G_results.back()->toString() == "<message><body>hi</body></message>");
+    es._stream.push(string("<\0/\0r\0o\0o\0t\0>\0", 14));
+}
+
+class SAXTestImpl
+    : public ElementStreamSAXListener
+{
+public:
+    bool selectElement(const char* name, const char** attribs, int depth)
+	{ return string(name) == "data"; }
+    void onStartElement(const char* name, const char** attribs, int depth)
+	{ _events << "<" << name << depth << ">"; }
+    void onEndElement(const char* name, int depth)
+	{ _events << "</" << name << depth << ">"; }
+    void onText(const char* text, int textsz, int depth)
+	{ _events.write(text, textsz) << depth; }
+    ostringstream _events;
+};
+
+void ElementStreamTest::saxListener()
+{
+    Assert(G_results.empty());
+
+    ElementStreamTestImpl es;
+    SAXTestImpl sax;
+    es._stream.setSAXListener(&sax);
+    es._stream.setLazyDepth(2);
+
+    es._stream.push("<root><iq id='1'><data sid='s'>AAAA");
+    es._stream.push("BBBB<b/></data></iq>");
+    Assert(sax._events.str() == "<data2>AAAA2BBBB2<b3></b3></data2>");
+    // Input already given to the listener is not kept
+    Assert(es._stream._raw.empty());
+    Assert(G_results.size() == 2);
+    Assert(G_results.back()->toString() == "<iq id='1'><data sid='s'/></iq>");
+
+    // Packet-level elements are not delivered at all
+    es._stream.push("<data>CC</data>");
+    Assert(sax._events.str() == "<data2>AAAA2BBBB2<b3></b3></data2><data1>CC1</data1>");
+    Assert(G_results.size() == 2);
+    es._stream.push("</root>");
+}
+
+class SkipTestImpl
+    : public ElementStreamTestImpl
+{
+public:
+    SkipTestImpl(const string& query)
+	: _query(query)
+	{}
+
+    bool onElementStart(const char* name, const char** attribs)
+	{
+	    _match = _query.checkStart(name, attribs);
+	    return _match != XPath::Op::MATCH_NO;
+	}
+    XPath::Query _query;
+    XPath::Op::Match _match;
+};
+
+void ElementStreamTest::skipElement()
+{
+    Assert(G_results.empty());
+
+    SkipTestImpl es("/message[@type='chat']");
+    es._stream.setLazyDepth(1);
+
+    es._stream.push("<root><message type='chat'><body>Hi</body></message>");
+    Assert(es._match == XPath::Op::MATCH_YES);
+    Assert(G_results.size() == 2);
+
+    // Neither built nor kept in the raw buffer
+    es._stream.push("<message type='groupchat'><body>Hi</body></message>");
+    Assert(es._match == XPath::Op::MATCH_NO);
+    Assert(G_results.size() == 2);
+    Assert(es._stream._raw.empty());
+    es._stream.push("<presence type='chat'/>");
+    Assert(es._match == XPath::Op::MATCH_NO);
+    Assert(G_results.size() == 2);
+
+    // Queries on the content can't be decided from the start tag
+    XPath::Query body("/message/body");
+    const char* attribs[] = { "type", "chat", NULL };
+    Assert(body.checkStart("message", attribs) == XPath::Op::MATCH_UNKNOWN);
+    Assert(body.checkStart("iq", attribs) == XPath::Op::MATCH_NO);
+    XPath::Query any("/iq[@*]");
+    Assert(any.checkStart("iq", attribs) == XPath::Op::MATCH_YES);
+
+    es._stream.push("</root>");
+}
+
+void ElementStreamTest::bufferPush()
+{
+    Assert(G_results.empty());
+
+    ElementStreamTestImpl es;
+    es._stream.setLazyDepth(1);
+
+    const char* data[] = { "<root><message to='a'>", "<body>hi</body>", "</message>" };
+    for (int i = 0; i < 3; i++)
+    {
+	char* buf = es._stream.getBuffer(64);
+	int len = strlen(data[i]);
+	memcpy(buf, data[i], len);
+	es._stream.commit(len);
+    }
+    Assert(G_results.size() == 2);
+    Assert(G_results.back()->toString() == "<message to='a'><body>hi</body></message>");
+    es._stream.push("</root>");
+}
+
+class SerializeImpl
+    : public ElementStreamEventListener
+{
+public:
+    void onDocumentStart(Element* t)
+	{ _out += t->toStringEx(); delete t; }
+    void onElement(Element* t)
+	{ _out += t->toString(); delete t; }
+    void onCDATA(CDATA* c)
+	{ _out += c->toString(); delete c; }
+    void onDocumentEnd()
+	{ _out += "</>"; _ended = true; }
+    string _out;
+    bool _ended;
+};
+
+// Parse a document in pieces of the given size and serialize it
+static string parseWith(ParserBackend* backend, const string& doc, size_t chunk)
+{
+    SerializeImpl l;
+    l._ended = false;
+    ElementStream stream(&l, backend);
+    try
+    {
+	for (size_t i = 0; i < doc.size() && !l._ended; i += chunk)
+	    stream.push(doc.substr(i, chunk));
+    } catch (ElementStream::exception::ParserError& e)
+    {
+	ostringstream err;
+	err << "error " << e.getCode();
+	return err.str();
+    }
+    return l._out;
+}
+
+static string error(int code)
+{
+    ostringstream err;
+    err << "error " << code;
+    return err.str();
+}
+
+void ElementStreamTest::backends()
+{
+    // expat is the reference for the XMPP tokenizer
+    const char* docs[] = {
+	"<?xml version='1.0' encoding='utf-8'?>\n<stream:stream xmlns='jabber:client' to=\"j.org\">"
+	"<message to='a@b/c' type=\"chat\"><body>Hi &lt;&#x263A;&#65; &quot;x&gt;</body>"
+	"<x xmlns='jabber:x:delay' stamp='1'/></message>\r\n"
+	"<iq id='1' ><query a='1&#10;2\t3' b = \"'\">x\r\ny<![CDATA[<raw> ]] ]]>z</query></iq >"
+	"</stream:stream>",
+	"\xEF\xBB\xBF<root><a/><b></b></root>",
+	"<root><a></b></root>",
+	"<root><a x='1' x='2'/></root>",
+	"<root><a>&foo;</a></root>",
+	"<root><a>&#0;</a></root>",
+	"<root/>junk",
+	"<root><a x='<'/></root>",
+	"<root><a x='1'y='2'/></root>",
+	" <?xml version='1.0'?><root/>",
+	"<message to='me'><x\"<body>injected</body>\"/></message>",
+	"<root><1a/><a-b.c_d:e/></root>",
+	"<root><a 1x='1'/></root>",
+	"<root><a x='1\"/></root>",
+	"<root><a x/></root>",
+	"<root\x01/>",
+	"<r\xC3\xA9 \xC3\xA9='\xE2\x98\xBA'>\xF0\x9F\x98\x80 a]]b ]</r\xC3\xA9>",
+	"<root>a]]>b</root>",
+	"<root>\x01</root>",
+	"<root a='\x01'/>",
+	"<root>\xED\xA0\x80</root>",
+	"<root>\xEF\xBF\xBE</root>",
+	"<root>\xF4\x90\x80\x80</root>",
+	"<root><![CDATA[\x01]]></root>",
+	"<root>&#1;</root>",
+	"<root>&#x00000000000041;&#0000000000000000066;</root>",
+	"<root>&#xG;</root>",
+	"<root>&a#b;</root>",
+	"<root>&#;</root>"
+    };
+
+    for (size_t i = 0; i < sizeof(docs) / sizeof(docs[0]); i++)
+    {
+	string doc = docs[i];
+	for (size_t chunk = 1; chunk <= doc.size(); chunk += (chunk < 8) ? 1 : 50)
+	    Assert(parseWith(new XMPPBackend(), doc, chunk) == 
+		   parseWith(new ExpatBackend(), doc, chunk));
+    }
+
+    // Markup can't be slipped into a name
+    Assert(parseWith(new XMPPBackend(), "<message to='me'><x\"<body>injected</body>\"/></message>", 64) ==
+	   error(XML_ERROR_INVALID_TOKEN));
+
+    // A reference is held back until its ';' comes, however long it is
+    Assert(parseWith(new XMPPBackend(), "<root>&#x00000000000041;</root>", 1) == "<root>A</>");
+    Assert(parseWith(new XMPPBackend(), "<root>&#x00000000000041;</root>", 3) == "<root>A</>");
+
+    // Bad UTF-8, which this expat lets through
+    Assert(parseWith(new XMPPBackend(), "<root>\xC3\x28</root>", 1) == error(XML_ERROR_INVALID_TOKEN));
+    Assert(parseWith(new XMPPBackend(), "<root>\xC0\x80</root>", 64) == error(XML_ERROR_INVALID_TOKEN));
+    Assert(parseWith(new XMPPBackend(), "<root a='\x80'/>", 64) == error(XML_ERROR_INVALID_TOKEN));
+
+    // Outside the restricted XML which XMPP allows
+    Assert(parseWith(new XMPPBackend(), "<root><!-- c --></root>", 32) == error(XML_ERROR_SYNTAX));
+    Assert(parseWith(new XMPPBackend(), "<root><?pi x?></root>", 32) == error(XML_ERROR_SYNTAX));
+    Assert(parseWith(new XMPPBackend(), "<?xml version='1.0' encoding='ISO-8859-1'?><root/>", 64) ==
+	   error(XML_ERROR_UNKNOWN_ENCODING));
+
+    // Lazy content spans match expat's
+    ElementStreamTestImpl es;
+    es._stream.setBackend(new XMPPBackend());
+    es._stream.setLazyDepth(1);
+    es._stream.push("<root><message to='a'><body>hi</body><x/></message><presence/>");
+    Assert(G_results.back()->isMaterialized());
+    Element* m = *++G_results.begin();
+    Assert(m->toStringRaw() == "<message to='a'><body>hi</body><x/></message>");
+    es._stream.push("</root>");
+}
+
 void ElementStreamTest::parseAtOnce()
 {
     // Standard test
@@ -158,3 +556,45 @@ void ElementStreamTest::parseAtOnce()
     Assert(successful3 == true);
     
 }
+
+void ElementStreamTest::pendingSize()
+{
+    ElementStreamTestImpl es;
+
+    es._stream.push("<root>", 6);
+    Assert(es._stream.getPendingSize() == 0);
+
+    // The tree built so far is counted
+    es._stream.push("<message to='dizzy@j.org'><body>Hello", 37);
+    size_t built = es._stream._element_stack.front()->getMemorySize();
+    Assert(built > sizeof(Element));
+    Assert(es._stream.getPendingSize() >= built);
+
+    es._stream.push("</body></message>", 17);
+    Assert(es._stream.getPendingSize() == 0);
+    Assert(G_results.back()->getMemorySize() >= built);
+
+    // So is a tag which hasn't been finished
+    string tag = "<iq id='" + string(1000, 'x');
+    es._stream.push(tag.c_str(), tag.size());
+    Assert(es._stream._element_stack.empty());
+    Assert(es._stream.getPendingSize() >= 1000);
+
+    es._stream.push("'/>", 3);
+    Assert(es._stream.getPendingSize() == 0);
+
+    es._stream.push("</root>", 7);
+
+    // A stream destroyed part way through a packet frees what it
+    // built of it
+    CountingResource counter;
+    {
+	ResourceScope scope(&counter);
+	ElementStreamTestImpl partial;
+	partial._stream.push("<stream><message><body>partial");
+	Assert(partial._stream.getPendingSize() > 0);
+	delete G_results.back();
+	G_results.clear();
+    }
+    Assert(counter.getBytesInUse() == 0);
+}
@@ -58,6 +58,18 @@ Test* ElementTest::getTestSuite()
 				       &ElementTest::findElement));
     s->addTest(new TestCaller<ElementTest>("testing detachChild",
                                        &ElementTest::detachChild));
+    s->addTest(new TestCaller<ElementTest>("testing move",
+				       &ElementTest::move));
+    s->addTest(new TestCaller<ElementTest>("testing releaseChild",
+				       &ElementTest::releaseChild));
+    s->addTest(new TestCaller<ElementTest>("testing child index",
+				       &ElementTest::childIndex));
+    s->addTest(new TestCaller<ElementTest>("testing iteration",
+				       &ElementTest::iterate));
+    s->addTest(new TestCaller<ElementTest>("testing memory resources",
+				       &ElementTest::resource));
+    s->addTest(new TestCaller<ElementTest>("testing the node pool",
+				       &ElementTest::pool));
     return s;
 }
 
@@ -87,8 +99,8 @@ void ElementTest::addElement()
 	
 	Element* e1 = e.addElement("body");
 	
-	Assert(e._children.size() == 1);
-	Assert(e._children.front() == (Element*)e1);
+	Assert(e.size() == 1);
+	Assert(*e.begin() == (Element*)e1);
 	Assert(e1->getType() == Node::ntElement);
 	Assert(e1->getName() == "body");
     }
@@ -98,16 +110,16 @@ void ElementTest::addElement()
 	
 	Element* e1 = e.addElement("body", "hello, world!");
 	
-	Assert(e._children.size() == 1);
+	Assert(e.size() == 1);
 	
-	Assert(e._children.front() == (Element*)e1);
+	Assert(*e.begin() == (Element*)e1);
 	
 	Assert(e1->getType() == Node::ntElement);
 	Assert(e1->getName() == "body");
 	
-	Assert(e1->_children.size() == 1);
-	Assert(e1->_children.front()->getType() == Node::ntCDATA);
-	Assert(e1->_children.front()->getName() == "#CDATA");
+	Assert(e1->size() == 1);
+	Assert((*e1->begin())->getType() == Node::ntCDATA);
+	Assert((*e1->begin())->getName() == "#CDATA");
     }
 }
 
@@ -117,9 +129,9 @@ void ElementTest::addCDATA()
 
     CDATA* c = e.addCDATA("hello, world!", strlen("hello, world!"));
 
-    Assert(e._children.size() == 1);
+    Assert(e.size() == 1);
 
-    Assert(e._children.front() == (Element*)c);
+    Assert(*e.begin() == (Element*)c);
     Assert(c->getType() == Node::ntCDATA);
     Assert(c->getName() == "#CDATA");
 }
@@ -227,3 +239,190 @@ void ElementTest::detachChild()
    delete bar;
    delete e;
 }
+
+void ElementTest::move()
+{
+    Element e("message");
+    e.putAttrib("to", "dizzyd");
+    Element* body = e.addElement("body", "Hello, dizzyd");
+
+    // Move construction steals the children
+    Element e1(std::move(e));
+    Assert(e1.getName() == "message");
+    Assert(e1.size() == 1);
+    Assert(*e1.begin() == body);
+    Assert(e.empty());
+    Assert(e._attribs.empty());
+
+    // Moving a subtree in as a child
+    Element iq("iq");
+    Element* child = iq.addElement(std::move(e1));
+    Assert(child->findElement("body") == body);
+    Assert(iq.toString() == "<iq><message to='dizzyd'><body>Hello, dizzyd</body></message></iq>");
+
+    // rvalue attribute and CDATA overloads
+    Element e2("presence");
+    e2.putAttrib(string("type"), string("unavailable"));
+    e2.addElement(string("status"), string("gone & back"));
+    Assert(e2.toString() == "<presence type='unavailable'><status>gone &amp; back</status></presence>");
+}
+
+void ElementTest::releaseChild()
+{
+    Element e("foo");
+    Element* bar = e.appendChild(unique_ptr<Element>(new Element("bar")));
+    Assert(*e.begin() == bar);
+
+    unique_ptr<Node> n = e.releaseChild(e.begin());
+    Assert(n.get() == bar);
+    Assert(e.empty());
+}
+
+void ElementTest::childIndex()
+{
+    Element query("query");
+    for (int i = 0; i < 2 * Element::INDEX_THRESHOLD; i++)
+    {
+	Element* item = query.addElement("item");
+	item->putAttrib("jid", string(1, 'a' + i));
+    }
+    Element* x = query.addElement("x");
+    x->putAttrib("xmlns", "jabber:x:data");
+
+    // First lookup builds the index; first match must win
+    Assert(query.findElement("item")->getAttrib("jid") == "a");
+    Assert(query.findElementByXmlns("jabber:x:data") == x);
+    Assert(query.findElement("nope") == NULL);
+
+    // Removing the first item falls back to the next one
+    query.eraseElement("item");
+    Assert(query.findElement("item")->getAttrib("jid") == "b");
+
+    // Changing a child's xmlns is seen by the parent
+    x->putAttrib("xmlns", "jabber:x:oob");
+    Assert(query.findElementByXmlns("jabber:x:data") == NULL);
+    Assert(query.findElementByXmlns("jabber:x:oob") == x);
+
+    // Appending after the index exists
+    Element* y = query.addElement("y");
+    Assert(query.findElement("y") == y);
+
+    // Copies get their own index
+    Element copy(query);
+    Assert(copy.findElement("y") != y);
+    Assert(copy.findElement("y")->getParent() == &copy);
+}
+
+void ElementTest::iterate()
+{
+    Element e("foo");
+    e.addElement("a");
+    e.addCDATA("b", 1);
+    e.addElement("c");
+
+    string fwd, rev;
+    for (Element::const_iterator it = e.begin(); it != e.end(); ++it)
+	fwd += (*it)->getName();
+    for (Element::reverse_iterator it = e.rbegin(); it != e.rend(); ++it)
+	rev += (*it)->getName();
+    Assert(fwd == "a#CDATAc");
+    Assert(rev == "c#CDATAa");
+    Assert(e.size() == 3);
+
+    // Erasing leaves other iterators valid
+    Element::iterator first = e.begin();
+    Element::iterator last = --e.end();
+    e.erase(++e.begin());
+    Assert(++first == last);
+    Assert(e.size() == 2);
+}
+
+void ElementTest::resource()
+{
+    CountingResource counter;
+    Element* e;
+    {
+	ResourceScope scope(&counter);
+	e = new Element("message");
+	e->putAttrib("to", "a@b");
+	e->addElement("body", "hello");
+	Assert(getDefaultResource() == &counter);
+    }
+    Assert(getDefaultResource() == newDeleteResource());
+    Assert(counter.getBytesInUse() > 0);
+
+    // Copies go to the default resource of where they are made
+    Element* copy = new Element(*e);
+    size_t in_use = counter.getBytesInUse();
+
+    // Nodes go back to their own resource wherever they are deleted
+    delete e;
+    Assert(counter.getBytesInUse() == 0);
+    Assert(counter.getPeakBytes() >= in_use);
+    delete copy;
+
+    // A resource made within a scope doesn't draw on the scope's,
+    // so one session's memory isn't counted against another's
+    {
+	ResourceScope scope(&counter);
+	CountingResource child;
+	Assert(child.getUpstream() == newDeleteResource());
+	void* p = child.allocate(64);
+	Assert(child.getBytesInUse() == 64);
+	Assert(counter.getBytesInUse() == 0);
+	child.deallocate(p, 64);
+
+	MonotonicResource arena;
+	arena.allocate(64);
+	Assert(counter.getBytesInUse() == 0);
+    }
+
+    // A first block of 0 takes its size from the first allocation
+    {
+	CountingResource upstream;
+	MonotonicResource arena(0, &upstream);
+	Assert(arena.allocate(100) != NULL);
+	Assert(upstream.getBytesInUse() >= 100);
+	Assert(arena.allocate(1000) != NULL);
+	Assert(upstream.getBytesInUse() >= 1100);
+    }
+
+    // The placement and nothrow forms are still there
+    {
+	ResourceScope scope(&counter);
+	alignas(Element) char buf[sizeof(Element)];
+	Element* placed = new (buf) Element("presence");
+	placed->addElement("show", "away");
+	Assert(placed->toString() == "<presence><show>away</show></presence>");
+	placed->~Element();
+
+	CDATA* text = new (nothrow) CDATA("hello", 5);
+	Assert(text != NULL && text->getText() == "hello");
+	delete text;
+	Assert(counter.getBytesInUse() == 0);
+    }
+}
+
+void ElementTest::pool()
+{
+    ResourceScope scope(poolResource());
+    trimPool();
+
+    // The first stanza comes from the heap, and the next of the same
+    // shape reuses its blocks
+    for (int i = 0; i < 2; i++)
+    {
+	Element* e = new Element("message");
+	e->putAttrib("to", "a@b");
+	e->addElement("body", "hello");
+	delete e;
+    }
+    PoolStats s = getPoolStats();
+    Assert(s.reused > 0);
+    Assert(s.reused * 2 <= s.allocations);
+    Assert(s.cached > 0);
+    Assert(s.reuseRate() > 0.0);
+
+    trimPool();
+    Assert(getPoolStats().cached < s.cached);
+}
@@ -0,0 +1,335 @@
+//============================================================================
+// Project:       Jabber Universal Document Objects (Judo)
+// Filename:      XPathTest.cpp
+// Description:   judo::XPath unit tests
+//
+//   License:
+// 
+// The contents of this file are subject to the Jabber Open Source License
+// Version 1.0 (the "License").  You may not copy or use this file, in either
+// source code or executable form, except in compliance with the License.  You
+// may obtain a copy of the License at http://www.jabber.com/license/ or at
+// http://www.opensource.org/.  
+//
+// Software distributed under the License is distributed on an "AS IS" basis,
+// WITHOUT WARRANTY OF ANY KIND, either express or implied.  See the License
+// for the specific language governing rights and limitations under the
+// License.
+//
+//   Copyrights
+//
+// Portions created by or assigned to Jabber.com, Inc. are 
+// Copyright (c) 1999-2001 Jabber.com, Inc.  All Rights Reserved.  
+//============================================================================
+
+#include "judo.hpp"
+#include "XPath.h"
+#include "XPathStatic.h"
+#include "judo_test.hpp"
+using namespace judo;
+
+#include <iostream>
+#include <thread>
+#include <vector>
+using namespace std;
+
+Test* XPathTest::getTestSuite()
+{
+    TestSuite* s = new TestSuite();
+    s->addTest(new TestCaller<XPathTest>("compiled queries",
+					     &XPathTest::compiled));
+    s->addTest(new TestCaller<XPathTest>("interpreted queries",
+					     &XPathTest::interpreted));
+    s->addTest(new TestCaller<XPathTest>("descendants",
+					     &XPathTest::descendants));
+    s->addTest(new TestCaller<XPathTest>("static queries",
+					     &XPathTest::staticQuery));
+    s->addTest(new TestCaller<XPathTest>("function registry",
+					     &XPathTest::functions));
+    return s;
+}
+
+static const char* G_packets[] = {
+    "<message type='chat' to='a@b/c'><body>Hello</body><x xmlns='jabber:x:event'><composing/></x></message>",
+    "<message type='groupchat'><body>Hi</body></message>",
+    "<iq type='result' id='1'><query xmlns='jabber:iq:roster'><item jid='a@b'/><item jid='c@d' name='C'/></query></iq>",
+    "<iq type='get'><query xmlns='jabber:iq:browse'/></iq>",
+    "<presence from='a@b/r'><show>away</show><status>gone</status></presence>",
+    "<presence type='unavailable'/>",
+    "<message type='normal'>text<body>Hi</body>more</message>",
+    NULL
+};
+
+void XPathTest::compiled()
+{
+    Element* iq = ElementStream::parseAtOnce(G_packets[2]);
+
+    XPath::Query items("/iq/query/item/@jid");
+    XPath::Value* val = items.execute(iq);
+    Assert(val->check());
+    Assert(val->getList().size() == 2);
+    Assert(val->getValues().front() == "a@b");
+    Assert(val->getValues().back() == "c@d");
+    delete val;
+
+    XPath::Query named("/iq[@type='result']/query/item[@name='C' or @jid='x']");
+    val = named.execute(iq);
+    Assert(val->check());
+    Assert(val->getElem()->getAttrib("jid") == "c@d");
+    delete val;
+
+    Assert(!XPath::Query("/iq/query/item[3]").check(*iq));
+    Assert(XPath::Query("/iq/query/item[starts-with(@jid,'c@')]").check(*iq));
+
+    // Queries with the same text share their compiled form
+    XPath::Query again("/iq/query/item/@jid");
+    Assert(&again.getOps() == &items.getOps());
+
+    bool invalid = false;
+    try 
+    {
+        XPath::Query bad("/iq[nofunc()]");
+    } catch (XPath::Query::Invalid)
+    {
+        invalid = true;
+    }
+    Assert(invalid);
+
+    delete iq;
+}
+
+// Every query the tests use
+static const char* G_queries[] = {
+    "/message",
+    "/message[@type='chat']",
+    "/message[@type!='chat']",
+    "/message[@to]",
+    "/message/body",
+    "/message[body='Hi']",
+    "/message/x[@xmlns='jabber:x:event']/composing",
+    "/message/*",
+    "/message/#CDATA",
+    "/message/body/*",
+    "/iq[@type='result']/*[@xmlns='jabber:iq:roster']",
+    "/iq[@type='result']/*[@xmlns='jabber:iq:browse']",
+    "/iq/query/item[@name]",
+    "/iq/query/item/@jid",
+    "/iq/query/item[2]",
+    "/iq/query/item[3]",
+    "/iq/query/item[starts-with(@jid,'c@')]",
+    "/iq[@type='result']/query/item[@name='C' or @jid='x']",
+    "/iq[@type='get' or @type='set']/query",
+    "/iq[@type='result' and @id='1'][query]",
+    "/iq[not(@id)]",
+    "/presence[@*]",
+    "/presence[show='away' and status]",
+    "/presence[@type='unavailable']",
+    "/presence/status[text()='gone']",
+    "/*[name()='presence']",
+    "//item",
+    "//item[@jid='c@d']",
+    "//*",
+    "//body",
+    "/iq//item",
+    "/iq/query//item[@name]",
+    "//query/item",
+    "/message//composing",
+    NULL
+};
+
+// Run a query's ops one at a time, the way queries were run before
+// they were compiled
+static XPath::Value* interpret(const XPath::Query& q, Element* root)
+{
+    XPath::Value* ctxt = new XPath::Value(root);
+    const XPath::Query::OpList& ops = q.getOps();
+    bool matched = true;
+    for (XPath::Query::OpList::const_iterator it = ops.begin(); 
+         matched && it != ops.end(); ++it)
+        matched = (*it)->isValid(ctxt);
+    ctxt->setMatch(matched);
+    return ctxt;
+}
+
+void XPathTest::interpreted()
+{
+    // The compiled program gives the same matches and node sets as
+    // the ops it was compiled from
+    for (int i = 0; G_queries[i] != NULL; ++i)
+    {
+        XPath::Query q(G_queries[i]);
+        for (int j = 0; G_packets[j] != NULL; ++j)
+        {
+            Element* e = ElementStream::parseAtOnce(G_packets[j]);
+            XPath::Value* run = q.execute(e);
+            XPath::Value* ref = interpret(q, e);
+
+            bool same = (run->check() == ref->check()) && (q.check(*e) == ref->check());
+            if (same && ref->check())
+                same = (run->getList() == ref->getList()) && 
+                    (run->getValues() == ref->getValues());
+            if (!same)
+                cerr << "Compiled query differs: " << G_queries[i] << " on " << G_packets[j] << endl;
+            Assert(same);
+
+            delete ref;
+            delete run;
+            delete e;
+        }
+    }
+
+    // Every Query of a string shares its ops, so running them must
+    // not write to them
+    XPath::Query q("/presence[@from='a@b/r' and not(@type)]");
+    vector<int> ok(4, 0);
+    vector<thread> runners;
+    for (int i = 0; i < 4; i++)
+        runners.push_back(thread([&q, &ok, i]() {
+            Element* e = ElementStream::parseAtOnce(G_packets[4]);
+            bool all = true;
+            for (int round = 0; round < 100; round++)
+            {
+                XPath::Value* ref = interpret(q, e);
+                all = all && ref->check();
+                delete ref;
+            }
+            ok[i] = all;
+            delete e;
+        }));
+    for (int i = 0; i < 4; i++)
+    {
+        runners[i].join();
+        Assert(ok[i]);
+    }
+}
+
+void XPathTest::descendants()
+{
+    Element* iq = ElementStream::parseAtOnce(G_packets[2]);
+    Element* msg = ElementStream::parseAtOnce(G_packets[0]);
+    Element* item = ElementStream::parseAtOnce("<item jid='c@d'/>");
+
+    // "//" is descendant-or-self, from wherever it is in the query;
+    // at the start it takes in the whole packet
+    Assert(XPath::Query("//item").check(*iq));
+    Assert(XPath::Query("//item[@jid='c@d']").check(*iq));
+    Assert(!XPath::Query("//item[@jid='e@f']").check(*iq));
+    Assert(XPath::Query("//item").check(*item));
+    Assert(!XPath::Query("//item").check(*msg));
+    Assert(XPath::Query("/iq//item").check(*iq));
+    Assert(!XPath::Query("/message//item").check(*iq));
+    Assert(XPath::Query("/message//composing").check(*msg));
+
+    XPath::Value* val = XPath::Query("//*").execute(iq);
+    Assert(val->getList().size() == 4);
+    Assert(val->getList().front() == iq);
+    delete val;
+
+    val = XPath::Query("//item[@jid='c@d']").execute(iq);
+    Assert(val->getList().size() == 1);
+    Assert(val->getElem()->getAttrib("name") == "C");
+    delete val;
+
+    delete item;
+    delete msg;
+    delete iq;
+}
+
+// Compare a static query with the compiled one on every packet
+template <class M>
+static bool sameAsQuery(const M& m, const char* query)
+{
+    XPath::Query q(query);
+    for (int i = 0; G_packets[i] != NULL; ++i)
+    {
+        Element* e = ElementStream::parseAtOnce(G_packets[i]);
+        bool matched = q.check(*e);
+        bool same = (m.check(*e) == matched);
+
+        // A start tag decision has to agree with the packet
+        const char** attribs = new const char*[e->getAttribs().size() * 2 + 1];
+        map<string, string> attrib_map = e->getAttribs();
+        int n = 0;
+        for (map<string, string>::iterator it = attrib_map.begin(); 
+             it != attrib_map.end(); ++it)
+        {
+            attribs[n++] = it->first.c_str();
+            attribs[n++] = it->second.c_str();
+        }
+        attribs[n] = NULL;
+        XPath::Op::Match start = m.checkStart(e->getName().c_str(), attribs);
+        if (start != XPath::Op::MATCH_UNKNOWN)
+            same = same && ((start == XPath::Op::MATCH_YES) == matched);
+        delete[] attribs;
+        delete e;
+
+        if (!same)
+        {
+            cerr << "Static query differs: " << query << " on " << G_packets[i] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+#define SAME_AS_QUERY(q) sameAsQuery(JUDO_XPATH(q), q)
+
+void XPathTest::staticQuery()
+{
+    Assert(SAME_AS_QUERY("/message"));
+    Assert(SAME_AS_QUERY("/message[@type='chat']"));
+    Assert(SAME_AS_QUERY("/message[@type!='chat']"));
+    Assert(SAME_AS_QUERY("/message[@to]"));
+    Assert(SAME_AS_QUERY("/message/body"));
+    Assert(SAME_AS_QUERY("/message[body='Hi']"));
+    Assert(SAME_AS_QUERY("/message/x[@xmlns='jabber:x:event']/composing"));
+    Assert(SAME_AS_QUERY("/iq[@type='result']/*[@xmlns='jabber:iq:roster']"));
+    Assert(SAME_AS_QUERY("/iq[@type='result']/*[@xmlns='jabber:iq:browse']"));
+    Assert(SAME_AS_QUERY("/iq/query/item[@name]"));
+    Assert(SAME_AS_QUERY("/iq[@type='get' or @type='set']/query"));
+    Assert(SAME_AS_QUERY("/iq[@type='result' and @id='1'][query]"));
+    Assert(SAME_AS_QUERY("/presence[@*]"));
+    Assert(SAME_AS_QUERY("/presence[show='away' and status]"));
+    Assert(SAME_AS_QUERY("/presence[@type='unavailable']"));
+
+    // Decided from the start tag where possible
+    const char* attribs[] = { "type", "result", NULL };
+    Assert(JUDO_XPATH("/iq[@type='result']").checkStart("iq", attribs) == XPath::Op::MATCH_YES);
+    Assert(JUDO_XPATH("/iq[@type='get']/query").checkStart("iq", attribs) == XPath::Op::MATCH_NO);
+    Assert(JUDO_XPATH("/iq/query").checkStart("iq", attribs) == XPath::Op::MATCH_UNKNOWN);
+}
+
+// Keeps the context nodes which have children
+struct HasChildrenFunction : public XPath::Function
+{
+    bool run(XPath::Value* ctxt, XPath::Op::OpList& args)
+    {
+        XPath::Value::ElemList& elems = ctxt->getList();
+        XPath::Value::ElemList::iterator out = elems.begin();
+        for (XPath::Value::ElemList::iterator it = elems.begin();
+             it != elems.end(); ++it)
+        {
+            if ((*it)->size() > 0)
+                *out++ = *it;
+        }
+        elems.erase(out, elems.end());
+        return !elems.empty();
+    }
+};
+
+void XPathTest::functions()
+{
+    Assert(XPath::find_function("text") != NULL);
+    Assert(XPath::find_function("has-children") == NULL);
+
+    // Registering a name twice keeps the first function
+    XPath::Function* func = new HasChildrenFunction();
+    Assert(XPath::add_function("has-children", func));
+    Assert(!XPath::add_function("has-children", new HasChildrenFunction()));
+    Assert(XPath::find_function("has-children") == func);
+
+    Element* msg = ElementStream::parseAtOnce(G_packets[0]);
+    Assert(XPath::Query("/message/x[has-children()]").check(*msg));
+    Assert(!XPath::Query("/message/body/*[has-children()]").check(*msg));
+    delete msg;
+}
@@ -38,6 +38,8 @@ int main(int argc, char** argv)
     r.addTest("judo::CDATA", judo::CDATATest::getTestSuite());
     r.addTest("judo::Element", judo::ElementTest::getTestSuite());
     r.addTest("judo::ElementStream", judo::ElementStreamTest::getTestSuite());
+    r.addTest("judo::XPath", judo::XPathTest::getTestSuite());
+    r.addTest("judo::Binary", judo::BinaryTest::getTestSuite());
 
     // Start processing
     r.run(argc, argv);
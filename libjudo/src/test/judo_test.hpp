@@ -89,6 +89,12 @@ namespace judo
         void findElement();
 	void addCDATA();
         void detachChild();
+	void move();
+	void releaseChild();
+	void childIndex();
+	void iterate();
+	void resource();
+	void pool();
 	
 	void getAttrib();
 	void putAttrib();
@@ -115,7 +121,52 @@ namespace judo
 	// Tests
 	void construct();
 	void push();
+	void lazyPush();
+	void lazyDecoded();
+	void sharedLazy();
+	void saxListener();
+	void skipElement();
+	void bufferPush();
+	void backends();
 	void parseAtOnce();
+	void pendingSize();
+    };
+
+    class BinaryTest
+	: public TestCase
+    {
+    public:
+	BinaryTest(const std::string& name)
+	    : TestCase(name)
+	    {}
+
+	// Test suite generator
+	static Test* getTestSuite();
+
+	// Tests
+	void roundTrip();
+	void views();
+	void encoder();
+	void malformed();
+    };
+
+    class XPathTest
+	: public TestCase
+    {
+    public:
+	XPathTest(const std::string& name)
+	    : TestCase(name)
+	    {}
+
+	// Test suite generator
+	static Test* getTestSuite();
+
+	// Tests
+	void compiled();
+	void interpreted();
+	void descendants();
+	void staticQuery();
+	void functions();
     };
 };
 #endif
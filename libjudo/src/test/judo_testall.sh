@@ -1,3 +1,3 @@
 #!/bin/sh
 
-./judo_test judo judo::CDATA judo::Element judo::ElementStream
+./judo_test judo judo::CDATA judo::Element judo::ElementStream judo::XPath judo::Binary
@@ -303,7 +303,7 @@ BOOST_PYTHON_MODULE(JabberOO)
         .def("addX", (Element* (Packet::*)())&Packet::addX, rir())
         .def("addX", (Element* (Packet::*)(const std::string&))&Packet::addX, 
                 rir())
-        .def("findX", &Packet::findX, rir())
+        .def("findX", (Element* (Packet::*)(const std::string&))&Packet::findX, rir())
         .def("eraseX", &Packet::eraseX)
     ;
 
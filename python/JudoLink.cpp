@@ -100,13 +100,15 @@ BOOST_PYTHON_MODULE(Judo)
         
         .def("addElement", (Element* (Element::*)(const std::string&, const
                         std::string&, bool))&Element::addElement, rir())
-        .def("addCDATA", &Element::addCDATA, rir())
-        .def("putAttrib", &Element::putAttrib)
+        .def("addCDATA", (CDATA* (Element::*)(const char*, int, bool))
+                &Element::addCDATA, rir())
+        .def("putAttrib", (void (Element::*)(const std::string&,
+                        const std::string&))&Element::putAttrib)
         .def("getAttrib", &Element::getAttrib)
         .def("delAttrib", &Element::delAttrib)
         .def("cmpAttrib", &Element::cmpAttrib)
         .def("toString", &Element::toString)
-        .def("appendChild", &Element::appendChild,
+        .def("appendChild", (void (Element::*)(Node*))&Element::appendChild,
                 with_custodian_and_ward<1,2>())
         .def("empty", &Element::empty)
         .def("size", &Element::size)
@@ -38,25 +38,19 @@ struct JIDEqualsFunction : public judo::XPath::Function
     bool run(judo::XPath::Value* ctxt, judo::XPath::Op::OpList& args)
     {
         judo::XPath::Value::ElemList& elems = ctxt->getList();
-        judo::XPath::Value::ElemList::iterator it = elems.begin();
+        judo::XPath::Value::ElemList::iterator out = elems.begin();
                                                                             
-        while (it != elems.end())
+        for (judo::XPath::Value::ElemList::iterator it = elems.begin(); 
+             it != elems.end(); ++it)
         {
-            std::string value;
-            judo::XPath::Value::ElemList::iterator next = it;
-            ++next;
-                                                                            
             judo::Element* elem = *it;
             std::string val1 = args[0]->calcStr(elem);
             std::string val2 = args[1]->calcStr(elem);
                                                                             
-            if (JID::compare(val1, val2) != 0)
-            {
-                elems.erase(it);
-            }
-
-            it = next;
+            if (JID::compare(val1, val2) == 0)
+                *out++ = elem;
         }
+        elems.erase(out, elems.end());
                                                                             
         if (elems.empty())
         {
@@ -70,8 +64,10 @@ struct JIDEqualsFunction : public judo::XPath::Function
 
 void JID::init()
 {
-    // Add our XPath ops
-    judo::XPath::add_function("jid-equals", new jabberoo::JIDEqualsFunction());
+    // Add our XPath ops, once per process however many sessions call us
+    static const bool added = 
+        judo::XPath::add_function("jid-equals", new jabberoo::JIDEqualsFunction());
+    (void) added;
 }
 
 std::string JID::getResource(const std::string& jid)
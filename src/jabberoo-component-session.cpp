@@ -22,13 +22,18 @@
  *
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "jabberoo-component.hh"
 #include <sha.h>
 
 using namespace jabberoo;
 
 ComponentSession::ComponentSession() : 
-    judo::ElementStream(this), _connState(csNotConnected)
+    judo::ElementStream(this), _connState(csNotConnected),
+    _XPDecisionGeneration(0), _XPGeneration(1)
 { }
 
 ComponentSession::~ComponentSession()
@@ -73,6 +78,8 @@ void ComponentSession::disconnect()
 
 void ComponentSession::push(const char* data, int datasz)
 {
+    JABBEROO_STAT(SessionCounters::add(_counters.bytesIn, datasz));
+    JABBEROO_STAT(SessionCounters::ParseTimer timer(_counters));
     try 
     {
         judo::ElementStream::push(data, datasz);
@@ -83,23 +90,70 @@ void ComponentSession::push(const char* data, int datasz)
     }
 }
 
+void ComponentSession::commit(int datasz)
+{
+    JABBEROO_STAT(SessionCounters::add(_counters.bytesIn, datasz));
+    JABBEROO_STAT(SessionCounters::ParseTimer timer(_counters));
+    try 
+    {
+        judo::ElementStream::commit(datasz);
+    } 
+    catch (const judo::ElementStream::exception::ParserError& error) 
+    {
+        disconnect();
+    }
+}
+
+SessionStats ComponentSession::getStats() const
+{
+    SessionStats s;
+    _counters.snapshot(s);
+    return s;
+}
+
+void ComponentSession::transmit(const char* xml)
+{
+    JABBEROO_STAT(_counters.transmitted(xml, strlen(xml)));
+    evtTransmitXML(xml);
+}
+
 judo::XPath::Query* ComponentSession::registerXPath(const std::string& query, 
         ElementCallbackFunc f)
 {
     judo::XPath::Query* xpq = new judo::XPath::Query(query);
     _XPaths.push_front(xpq);
     _XPCallbacks.insert(std::make_pair(xpq, f));
+    _XPGeneration++;
 
     return xpq;
 }
 
 void ComponentSession::unregisterXPath(judo::XPath::Query* id)
 {
-    remove(_XPaths.begin(), _XPaths.end(), id);
+    _XPaths.remove(id);
     _XPCallbacks.erase(id);
+    _XPGeneration++;
     delete id;
 }
 
+/**
+ * Send a received element on to another address. Only the to and
+ * from attributes are rewritten; content which the parser left
+ * unbuilt (see judo::ElementStream::setLazyDepth) is sent as it was
+ * received, without being parsed or serialized again.
+ * @param e The element to forward
+ * @param to The new to attribute
+ * @param from The new from attribute
+ */
+void ComponentSession::forward(const judo::Element& e, const std::string& to,
+        const std::string& from)
+{
+    std::map<std::string, std::string> attribs = e.getAttribs();
+    attribs["to"] = to;
+    attribs["from"] = from;
+    transmit(e.toStringRaw(&attribs).c_str());
+}
+
 void ComponentSession::onDocumentStart(judo::Element* t)
 {
     // Retrieve the SID from the stream header
@@ -119,18 +173,53 @@ void ComponentSession::onElement(judo::Element* t)
         return;
     }
 
+    JABBEROO_STAT(unsigned long long start = SessionCounters::now());
     judo::Element& tref = *t;
-    // See if a judo::xpath handles this
+    std::vector<judo::XPath::Op::Match> decisions;
+    decisions.swap(_XPDecisions);
+
+    // See if a judo::xpath handles this; those decided from the start
+    // tag need no evaluation, unless a handler has changed the list
+    // since
     typedef std::list<judo::XPath::Query*>::iterator IT;
-    for (IT it = _XPaths.begin(); it != _XPaths.end(); it++)
+    size_t i = 0;
+    JABBEROO_STAT(SessionCounters::add(_counters.xpathEvals, _XPaths.size()));
+    for (IT it = _XPaths.begin(); it != _XPaths.end(); it++, i++)
     {
-        if ((*it)->check(tref))
+        bool decided = (_XPDecisionGeneration == _XPGeneration && i < decisions.size());
+        judo::XPath::Op::Match m = decided ? decisions[i] : judo::XPath::Op::MATCH_UNKNOWN;
+        if (m == judo::XPath::Op::MATCH_YES || 
+            (m == judo::XPath::Op::MATCH_UNKNOWN && (*it)->check(tref)))
         {
+            JABBEROO_STAT(SessionCounters::add(_counters.xpathMatches));
             _XPCallbacks[(*it)](tref);
         }
     }
 
     delete t;
+    JABBEROO_STAT(SessionCounters::add(_counters.dispatchNanos, SessionCounters::now() - start));
+}
+
+bool ComponentSession::onElementStart(const char* name, const char** attribs)
+{
+    JABBEROO_STAT(SessionCounters::add(_counters.stanzasIn[SessionStats::classify(name)]));
+
+    _XPDecisions.clear();
+    _XPDecisionGeneration = _XPGeneration;
+    if (_connState != csConnected)
+        return true;
+
+    // Packets which no xpath can match are dropped without being built
+    bool wanted = false;
+    typedef std::list<judo::XPath::Query*>::iterator IT;
+    for (IT it = _XPaths.begin(); it != _XPaths.end(); it++)
+    {
+        judo::XPath::Op::Match m = (*it)->checkStart(name, attribs);
+        _XPDecisions.push_back(m);
+        if (m != judo::XPath::Op::MATCH_NO)
+            wanted = true;
+    }
+    return wanted;
 }
 
 void ComponentSession::onCDATA(judo::CDATA* c)
@@ -61,7 +61,7 @@ DiscoDB::Item::~Item()
     }
 }
 
-DiscoDB::Item::Item(const std::string& jid) : _jid(jid)
+DiscoDB::Item::Item(const std::string& jid) : _counted(0), _jid(jid)
 { }
 
 const std::string& DiscoDB::Item::getJID() const
@@ -113,10 +113,28 @@ void DiscoDB::Item::addIdentity(const std::string& category,
          const std::string& type)
 { _identities.push_back(new Identity(category, type)); }
 
+size_t DiscoDB::Item::getMemorySize() const
+{
+    size_t bytes = sizeof(*this) + judo::heapSize(_jid) + 
+        judo::heapSize(_node) + judo::heapSize(_name) +
+        _children.size() * (judo::LIST_NODE_OVERHEAD + sizeof(Item*));
+    for (FeatureList::const_iterator it = _features.begin(); 
+         it != _features.end(); ++it)
+        bytes += judo::LIST_NODE_OVERHEAD + sizeof(*it) + judo::heapSize(*it);
+    for (IdentityList::const_iterator it = _identities.begin(); 
+         it != _identities.end(); ++it)
+        bytes += judo::LIST_NODE_OVERHEAD + sizeof(*it) + sizeof(Identity) +
+            judo::heapSize((*it)->getCategory()) + judo::heapSize((*it)->getType());
+    return bytes;
+}
+
 
 
 DiscoDB::DiscoDB(Session& sess) : 
-    _session(sess) 
+    _session(sess),
+    _callbacks(CallbackMap::key_compare(), CallbackMap::allocator_type(sess.getMemoryResource())),
+    _items(ItemMap::key_compare(), ItemMap::allocator_type(sess.getMemoryResource())),
+    _bytes(0)
 {
 }
 
@@ -139,7 +157,7 @@ DiscoDB::Item& DiscoDB::operator[](const std::string& jid)
 void DiscoDB::cache(const std::string& jid, DiscoCallbackFunc f, bool get_items)
 {
     // Hook up the callback
-    _callbacks.insert(CallbackMap::value_type(jid, f));
+    addCallback(jid, f);
     
     // Build our node
     judo::Element iq("iq");
@@ -152,12 +170,14 @@ void DiscoDB::cache(const std::string& jid, DiscoCallbackFunc f, bool get_items)
     if (get_items)
     {
         query->putAttrib("xmlns", "http://jabber.org/protocol/disco#items");
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoItemsCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoItemsCB),
+            "http://jabber.org/protocol/disco#items");
     }
     else
     {
         query->putAttrib("xmlns", "http://jabber.org/protocol/disco#info");
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB),
+            "http://jabber.org/protocol/disco#info");
     }
 
     // Send it out
@@ -170,7 +190,7 @@ void DiscoDB::cache(const std::string& jid, const std::string& node,
     DiscoCallbackFunc f, bool get_items)
 {
     // Hook up the callback
-    _callbacks.insert(CallbackMap::value_type(jid + "::" + node, f));
+    addCallback(jid + "::" + node, f);
     
     // Build our node
     judo::Element iq("iq");
@@ -182,12 +202,14 @@ void DiscoDB::cache(const std::string& jid, const std::string& node,
     if (get_items)
     {
         query->putAttrib("xmlns", "http://jabber.org/protocol/disco#items");
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoItemsCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoItemsCB),
+            "http://jabber.org/protocol/disco#items");
     }
     else
     {
         query->putAttrib("xmlns", "http://jabber.org/protocol/disco#info");
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB),
+            "http://jabber.org/protocol/disco#info");
     }
     query->putAttrib("node", node);
 
@@ -203,6 +225,30 @@ void DiscoDB::clear()
     }
 
     _items.clear();
+    _bytes = 0;
+    for (CallbackMap::iterator it = _callbacks.begin(); it != _callbacks.end(); ++it)
+        _bytes += judo::MAP_NODE_OVERHEAD + sizeof(*it) + judo::heapSize(it->first);
+}
+
+void DiscoDB::counted(DiscoDB::Item* item)
+{
+    // The item's map entry is counted along with it
+    size_t bytes = judo::MAP_NODE_OVERHEAD + sizeof(ItemMap::value_type) +
+        judo::heapSize(item->getJID()) + item->getMemorySize();
+    _bytes += bytes - item->_counted;
+    item->_counted = bytes;
+}
+
+void DiscoDB::uncount(iterator it)
+{
+    _bytes -= it->second->_counted;
+    it->second->_counted = 0;
+}
+
+void DiscoDB::addCallback(const std::string& key, DiscoCallbackFunc f)
+{
+    CallbackMap::iterator it = _callbacks.insert(CallbackMap::value_type(key, f));
+    _bytes += judo::MAP_NODE_OVERHEAD + sizeof(*it) + judo::heapSize(it->first);
 }
 
 void DiscoDB::discoInfoCB(const judo::Element& e)
@@ -218,9 +264,10 @@ void DiscoDB::discoInfoCB(const judo::Element& e)
         judo::Element* item_query = iq.addElement("item");
         item_query->putAttrib("xmlns", "jabber:iq:browse");
 
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::browseCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::browseCB),
+            "jabber:iq:browse");
 
-        jabberoo::Packet pkt(iq);
+        jabberoo::Packet pkt(std::move(iq));
         _session << pkt;
 
         return;
@@ -280,6 +327,8 @@ void DiscoDB::discoInfoCB(const judo::Element& e)
         }
     }
 
+    if (item != NULL)
+        counted(item);
     runCallbacks(jid, item);
 }
 
@@ -297,9 +346,10 @@ void DiscoDB::discoItemsCB(const judo::Element& e)
         judo::Element* item_query = iq.addElement("item");
         item_query->putAttrib("xmlns", "jabber:iq:browse");
 
-        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::browseCB));
+        _session.registerIQ(id, SigC::slot(*this, &DiscoDB::browseCB),
+            "jabber:iq:browse");
 
-        jabberoo::Packet pkt(iq);
+        jabberoo::Packet pkt(std::move(iq));
         _session << pkt;
 
         return;
@@ -364,6 +414,7 @@ void DiscoDB::discoItemsCB(const judo::Element& e)
                         child->setNode(cnode);
                     _items.insert(ItemMap::value_type(cjid, child));
                     item->appendChild(child);
+                    counted(child);
                 }
                 else
                 {
@@ -386,12 +437,15 @@ void DiscoDB::discoItemsCB(const judo::Element& e)
     if (!node.empty())
         info_query->putAttrib("node", node);
 
-    _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB));
+    _session.registerIQ(id, SigC::slot(*this, &DiscoDB::discoInfoCB),
+        "http://jabber.org/protocol/disco#info");
 
     // Send it out
     _session << iq.toString().c_str();
 #endif
 
+    if (item != NULL)
+        counted(item);
     runCallbacks(jid, item);
 }
 
@@ -423,6 +477,7 @@ void DiscoDB::browseCB(const judo::Element& e)
     DiscoDB::iterator it = _items.find(jid);
     if (it != _items.end())
     {
+        uncount(it);
         _items.erase(it);
     }
 
@@ -482,9 +537,11 @@ void DiscoDB::browseCB(const judo::Element& e)
                     citem->addFeature(ns->getCDATA());
                 }
             }
+            counted(citem);
         }
     }
     _items.insert(ItemMap::value_type(jid, item));
+    counted(item);
 
     runCallbacks(jid, item);
 }
@@ -508,10 +565,11 @@ void DiscoDB::runCallbacks(const std::string& jid, const DiscoDB::Item* item)
     }
 
     // XXX this could be a for_each
-    for(CallbackMap::iterator i = cis.first; i != cis.second; ++i)
+    for(CallbackMap::iterator i = cis.first; i != cis.second; )
     {
         i->second(item);
-        _callbacks.erase(i);
+        _bytes -= judo::MAP_NODE_OVERHEAD + sizeof(*i) + judo::heapSize(i->first);
+        _callbacks.erase(i++);
     }
 }
 } // namespace jabberoo
@@ -39,17 +39,31 @@ const unsigned int Message::numTypes = 5;
 Message::Message(const Element& t)
      : Packet(t)
 {
+     init();
+}
+
+Message::Message(const Packet& p)
+     : Packet(p)
+{
+     init();
+}
+
+void Message::init()
+{
+     const Element& base = static_cast<const Packet*>(this)->getBaseElement();
+
      // Determine message type..
-     _type = translateType(t.getAttrib("type"));
+     _type = translateType(base.getAttrib("type"));
 
 #ifndef WIN32
-     Element *x;
+     const Element* delay;
+     Element* x;
      std::string date;
 
-     x = findX("jabber:x:delay");
-     if (x) 
+     delay = static_cast<const Packet*>(this)->findX("jabber:x:delay");
+     if (delay) 
      {
-	  date = x->getAttrib("stamp");
+	  date = delay->getAttrib("stamp");
 	  if (!date.empty()) 
 	  {
 	       struct tm ts;
@@ -92,14 +106,14 @@ Message::Message(const std::string& jid, const std::string& body, Message::Type
 {
      setTo(jid);
      if (!body.empty())
-	  _base.addElement("body", body);
+	  getBaseElement().addElement("body", body);
      _timestamp = time(0);
      setType(mtype);
 }
 
 void Message::setBody(const std::string& body)
 {
-     Element* body_tag = _base.findElement("body");
+     Element* body_tag = getBaseElement().findElement("body");
      if (body_tag)
      {
 	  Element::iterator it = body_tag->begin();
@@ -111,12 +125,12 @@ void Message::setBody(const std::string& body)
           }
      }
      else
-	  _base.addElement("body", body);
+	  getBaseElement().addElement("body", body);
 }
 
 void Message::setSubject(const std::string& subject)
 {
-     Element* subject_tag = _base.findElement("subject");
+     Element* subject_tag = getBaseElement().findElement("subject");
      if (subject_tag)
      {
 	  Element::iterator it = subject_tag->begin();
@@ -128,12 +142,12 @@ void Message::setSubject(const std::string& subject)
 	  }
      }
      else
-	  _base.addElement("subject", subject);
+	  getBaseElement().addElement("subject", subject);
 }
 
 void Message::setThread(const std::string& thread)
 {
-     Element* thread_tag = _base.findElement("thread");
+     Element* thread_tag = getBaseElement().findElement("thread");
      if (thread_tag)
      {
 	  Element::iterator it = thread_tag->begin();
@@ -145,12 +159,12 @@ void Message::setThread(const std::string& thread)
           }
      }
      else
-	  _base.addElement("thread", thread);
+	  getBaseElement().addElement("thread", thread);
 }
 
 void Message::setType(Message::Type mtype)
 {
-     _base.putAttrib("type", translateType(mtype));
+     getBaseElement().putAttrib("type", translateType(mtype));
      _type      = mtype;
 }
 
@@ -198,17 +212,17 @@ void Message::requestComposing()
 
 const std::string Message::getBody() const
 {
-     return std::string(_base.getChildCData("body"));
+     return std::string(getBaseElement().getChildCData("body"));
 }
 
 const std::string Message::getSubject() const
 {
-     return std::string(_base.getChildCData("subject"));
+     return std::string(getBaseElement().getChildCData("subject"));
 }
 
 const std::string Message::getThread() const
 {
-     return std::string(_base.getChildCData("thread"));
+     return std::string(getBaseElement().getChildCData("thread"));
 }
 
 Message::Type Message::getType() const
@@ -240,12 +254,12 @@ Message::Message(const Message& m, const std::string& body)
      // Setup basic stuff
      setTo(m.getFrom());
      setType(m.getType());
-     _base.addElement("body", body);
+     getBaseElement().addElement("body", body);
 
      // Get thread if available..
      std::string thread = m.getThread();
      if (!thread.empty())
-	  _base.addElement("thread", thread);
+	  getBaseElement().addElement("thread", thread);
 }
 
 Message Message::replyTo(const std::string& body) const
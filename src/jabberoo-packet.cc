@@ -35,36 +35,118 @@ using namespace judo;
 namespace jabberoo {
 
 Packet::Packet(const std::string& name)
-     : _base(name)
+     : _shared(new Shared(new Element(name)))
 {}
 
 Packet::Packet(const Element& t)
-     : _base(t)
+     : _shared(new Shared(new Element(t)))
 {}
 
+Packet::Packet(Element* t)
+     : _shared(new Shared(t))
+{}
+
+Packet::Packet(Element&& t)
+     : _shared(new Shared(new Element(std::move(t))))
+{}
+
+Packet::Packet(const Packet& p)
+     : _shared(p._shared)
+{
+     _shared->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+Packet::Packet(Packet&& p)
+     : _shared(p._shared)
+{
+     p._shared = empty();
+}
+
+Packet& Packet::operator=(const Packet& p)
+{
+     // Take the reference first so self assignment is harmless
+     p._shared->refs.fetch_add(1, std::memory_order_relaxed);
+     release();
+     _shared = p._shared;
+     return *this;
+}
+
+Packet& Packet::operator=(Packet&& p)
+{
+     if (this != &p)
+     {
+	  release();
+	  _shared = p._shared;
+	  p._shared = empty();
+     }
+     return *this;
+}
+
+Packet::~Packet()
+{
+     release();
+}
+
+void Packet::release()
+{
+     if (_shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	  delete _shared;
+}
+
+Packet::Shared* Packet::empty()
+{
+     // Never destroyed, so Packets which outlive main() can still
+     // release it
+     static Shared* s = new Shared(new Element(""));
+     s->refs.fetch_add(1, std::memory_order_relaxed);
+     return s;
+}
+
+void Packet::detach()
+{
+     // Copy on write: only the first modification of a shared
+     // base element pays for the copy
+     if (_shared->refs.load(std::memory_order_acquire) > 1)
+     {
+	  Shared* copy = new Shared(new Element(*_shared->elem));
+	  release();
+	  _shared = copy;
+     }
+}
+
+bool Packet::isShared() const
+{
+     return _shared->refs.load(std::memory_order_acquire) > 1;
+}
+
+size_t Packet::getMemorySize() const
+{
+     return sizeof(Shared) + _shared->elem->getMemorySize();
+}
+
 const std::string Packet::getFrom() const
 {
-     return _base.getAttrib("from");
+     return _shared->elem->getAttrib("from");
 }
 
 const std::string Packet::getTo() const
 {
-     return _base.getAttrib("to");
+     return _shared->elem->getAttrib("to");
 }
 
 const std::string Packet::getID() const
 {
-     return _base.getAttrib("id");
+     return _shared->elem->getAttrib("id");
 }
 
 const std::string Packet::getError() const
 {
-     return std::string(_base.getChildCData("error"));
+     return std::string(_shared->elem->getChildCData("error"));
 }
 
 const int Packet::getErrorCode() const
 {
-     const Element* error = _base.findElement("error");
+     const Element* error = _shared->elem->findElement("error");
      if (error)
 	  return atoi(error->getAttrib("code").c_str());
      else
@@ -73,72 +155,75 @@ const int Packet::getErrorCode() const
 
 const std::string Packet::toString() const
 {
-     return _base.toString();
+     return _shared->elem->toString();
 }
 
 const Element& Packet::getBaseElement() const
 {
-     return _base;
+     return *_shared->elem;
 }
 
 void Packet::setFrom(const std::string& from)
 {
-     _base.putAttrib("from", from);
+     getBaseElement().putAttrib("from", from);
 }
 
 void Packet::setTo(const std::string& to)
 {
-     _base.putAttrib("to", to);
+     getBaseElement().putAttrib("to", to);
 }
 
 void Packet::setID(const std::string& id)
 {
-     _base.putAttrib("id", id);
+     getBaseElement().putAttrib("id", id);
 }
 
 Element* Packet::addX()
 {
-     return _base.addElement("x");
+     return getBaseElement().addElement("x");
 }
 
 Element* Packet::addX(const std::string& tnamespace)
 {
-     Element* x = _base.addElement("x");
+     Element* x = getBaseElement().addElement("x");
      x->putAttrib("xmlns", tnamespace);
      return x;
 }
 
-Element* Packet::findX(const std::string& tnamespace) const
+const Element* Packet::findX(const std::string& tnamespace) const
 {
-     Element::const_iterator it = _base.begin();
-     for (; it != _base.end(); it++)
-     {
-	  if (((*it)->getType() == Node::ntElement) && 
-	      ((static_cast<Element*>(*it))->cmpAttrib("xmlns", tnamespace)))
-	       break;
-     }
-     if (it != _base.end())
-	  return static_cast<Element*>(*it);
-     else
+     return _shared->elem->findElementByXmlns(tnamespace);
+}
+
+Element* Packet::findX(const std::string& tnamespace)
+{
+     // Avoid copying the base element if there is nothing to find
+     if (_shared->elem->findElementByXmlns(tnamespace) == NULL)
 	  return NULL;
+     return getBaseElement().findElementByXmlns(tnamespace);
 }
 
 void Packet::eraseX(const std::string& tnamespace)
 {
-     Element::iterator it = _base.begin();
-     for (; it != _base.end(); it++)
+     if (_shared->elem->findElementByXmlns(tnamespace) == NULL)
+	  return;
+
+     Element& base = getBaseElement();
+     Element::iterator it = base.begin();
+     for (; it != base.end(); it++)
      {
 	  if (((*it)->getType() == Node::ntElement) && 
 	      ((static_cast<Element*>(*it))->cmpAttrib("xmlns", tnamespace)))
 	       break;
      }
-     if (it != _base.end())
-	  static_cast<Element*>(*it)->erase(it);
+     if (it != base.end())
+	  base.erase(it);
 }
 
 Element& Packet::getBaseElement()
 {
-     return _base;
+     detach();
+     return *_shared->elem;
 }
 
 } // namespace jabberoo
@@ -42,6 +42,14 @@ Presence::Presence(const judo::Element& t)
      _show = translateShow(_type, t.getChildCData("show"));
 }
 
+Presence::Presence(const Packet& p)
+     : Packet(p)
+{
+     const judo::Element& base = static_cast<const Packet*>(this)->getBaseElement();
+     _type = translateType(base.getAttrib("type"));
+     _show = translateShow(_type, base.getChildCData("show"));
+}
+
 Presence::Presence(const std::string& jid, Presence::Type ptype, Presence::Show stype, const std::string& status, const std::string& priority)
      : Packet("presence")
 {
@@ -56,21 +64,21 @@ Presence::Presence(const std::string& jid, Presence::Type ptype, Presence::Show
 void Presence::setType(Presence::Type ptype)
 {
      if (ptype != Presence::ptAvailable)
-	  _base.putAttrib("type", translateType(ptype));
+	  getBaseElement().putAttrib("type", translateType(ptype));
      _type = ptype;
 }
 
 void Presence::setStatus(const std::string& status)
 {
      if (!status.empty())
-	  _base.addElement("status", status);
+	  getBaseElement().addElement("status", status);
 }
 
 void Presence::setShow(Presence::Show stype)
 {
      if (stype > stOnline)
      {
-	  _base.addElement("show", translateShow(stype));
+	  getBaseElement().addElement("show", translateShow(stype));
      }
      _show = stype;
 }
@@ -79,7 +87,7 @@ void Presence::setPriority(const std::string& priority)
 {
      if (priority != "0")
      {
-	  _base.addElement("priority", priority);
+	  getBaseElement().addElement("priority", priority);
      }
      _priority = atoi(priority.c_str());
 }
@@ -91,10 +99,10 @@ Presence::Type Presence::getType() const
 
 const std::string Presence::getStatus() const
 {
-     if (_base.getChildCData("status").empty())
-	  return _base.getChildCData("error");
+     if (getBaseElement().getChildCData("status").empty())
+	  return getBaseElement().getChildCData("error");
      else
-	  return _base.getChildCData("status");
+	  return getBaseElement().getChildCData("status");
 }
 
 Presence::Show Presence::getShow() const
@@ -112,7 +120,7 @@ int Presence::getPriority() const
      if (_type == Presence::ptUnavailable)
 	  return -1;
      else
-	  return atoi(_base.getChildCData("priority").c_str());
+	  return atoi(getBaseElement().getChildCData("priority").c_str());
 }
 
 std::string Presence::translateType(Type ptype)
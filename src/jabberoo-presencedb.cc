@@ -27,11 +27,16 @@
  * 01/20/2002       IBM Corp.       Updated to libjudo 1.1.1
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <presenceDB.hh>
 #include <presence.hh>
 #include <session.hh>
 #include <JID.hh>
 #include <iostream>
+#include <Probes.h>
 
 namespace jabberoo {
 
@@ -59,9 +64,52 @@ public:
 };
 
 PresenceDB::PresenceDB(Session& s)
-     : _Owner(s)
+     : _Owner(s),
+       _DB(jutil::CaseInsensitiveCmp(), db::allocator_type(s.getMemoryResource())),
+       _Ages(s.getMemoryResource()),
+       _Bytes(0)
 {}
 
+PresenceDB::db::iterator PresenceDB::entry(const std::string& jid)
+{
+     db::iterator it = _DB.find(jid);
+     if (it == _DB.end())
+     {
+	  it = _DB.insert(std::make_pair(jid, Entry(_DB.get_allocator()))).first;
+	  it->second.age = _Ages.insert(_Ages.end(), jid);
+	  updated(it);
+     }
+     return it;
+}
+
+void PresenceDB::updated(db::iterator it)
+{
+     Entry& e = it->second;
+     size_t bytes = judo::MAP_NODE_OVERHEAD + sizeof(*it) + judo::heapSize(it->first) +
+	  judo::LIST_NODE_OVERHEAD + sizeof(std::string) + judo::heapSize(*e.age);
+     for (const_iterator p = e.presences.begin(); p != e.presences.end(); ++p)
+	  bytes += judo::LIST_NODE_OVERHEAD + sizeof(Presence) + p->getMemorySize();
+     _Bytes += bytes - e.bytes;
+     e.bytes = bytes;
+     _Ages.splice(_Ages.end(), _Ages, e.age);
+}
+
+void PresenceDB::erase(db::iterator it)
+{
+     _Bytes -= it->second.bytes;
+     _Ages.erase(it->second.age);
+     _DB.erase(it);
+}
+
+bool PresenceDB::dropOldest()
+{
+     if (_Ages.empty())
+	  return false;
+     JUDO_PROBE1(presencedb_remove, _Ages.front().c_str());
+     erase(_DB.find(_Ages.front()));
+     return true;
+}
+
 PresenceDB::db::const_iterator PresenceDB::find_or_throw(const std::string& jid) const
 {
      db::const_iterator it = _DB.find(JID::getUserHost(jid));
@@ -79,8 +127,16 @@ void display(const Presence& p)
 
 void PresenceDB::insert(const Presence& p)
 {
+     if (JUDO_PROBE_ENABLED(presencedb_insert))
+	  JUDO_PROBE2(presencedb_insert, p.getFrom().c_str(), (int) p.getType());
+
+     // Copies of the presence belong to the session, wherever this
+     // was called from
+     judo::ResourceScope scope(_Owner.getMemoryResource());
+
      // Get a reference to the list (create one if necessary)
-     std::list<Presence>& l = _DB[JID::getUserHost(p.getFrom())];
+     db::iterator e = entry(JID::getUserHost(p.getFrom()));
+     PresenceList& l = e->second.presences;
      
      // If this presence is ptUnavailable, remove it from the cache
      if (p.getType() == Presence::ptUnavailable ||
@@ -89,7 +145,7 @@ void PresenceDB::insert(const Presence& p)
 	  // Empty list? Then exit..
 	  if (l.empty())
 	  {
-	       _DB.erase(JID::getUserHost(p.getFrom()));
+	       erase(e);
 	       return;
 	  }
 	  else
@@ -100,7 +156,10 @@ void PresenceDB::insert(const Presence& p)
 		    l.erase(it);
 	       // If the list is now empty, remove this entry from the _DB map
 	       if (l.empty())
-		    _DB.erase(JID::getUserHost(p.getFrom()));
+	       {
+		    erase(e);
+		    return;
+	       }
 	}
     }
     // Otherwise, insert/update 
@@ -123,6 +182,7 @@ void PresenceDB::insert(const Presence& p)
 		    {
 			 // Replace and exit
 			 *it = p;
+			 updated(e);
 			 return;
 		    }
 		    // Otherwise erase the element 
@@ -134,16 +194,20 @@ void PresenceDB::insert(const Presence& p)
 	       l.insert(it, p);
 	  }
      }
+     updated(e);
 }
 
 void PresenceDB::remove(const std::string& jid)
 {
-     std::list<Presence>& l = _DB[JID::getUserHost(jid)];
+     JUDO_PROBE1(presencedb_remove, jid.c_str());
+
+     db::iterator e = entry(JID::getUserHost(jid));
+     PresenceList& l = e->second.presences;
      
      // Empty list? Then exit..
      if (l.empty())
      {
-	  _DB.erase(JID::getUserHost(jid));
+	  erase(e);
 	  return;
      }
      else
@@ -154,7 +218,9 @@ void PresenceDB::remove(const std::string& jid)
 	       l.erase(it);
 	  // If the list is now empty, remove this entry from the _DB map
 	  if (l.empty())
-	       _DB.erase(JID::getUserHost(jid));
+	       erase(e);
+	  else
+	       updated(e);
      }
 }
 
@@ -162,7 +228,7 @@ void PresenceDB::remove(const std::string& jid)
 PresenceDB::range PresenceDB::equal_range(const std::string& jid) const
 {
     db::const_iterator it = find_or_throw(jid);
-    return make_pair(it->second.begin(), it->second.end());
+    return make_pair(it->second.presences.begin(), it->second.presences.end());
 }
 
 Presence PresenceDB::findExact(const std::string& jid) const
@@ -170,14 +236,14 @@ Presence PresenceDB::findExact(const std::string& jid) const
      PresenceDB::db::const_iterator it = find_or_throw(jid);
 
      // If the list is empty, throw an exception
-     if (it->second.begin() == it->second.end())
+     if (it->second.presences.begin() == it->second.presences.end())
 	  throw XCP_InvalidJID();
 
      // otherwise check for a resource
      std::string::size_type i = jid.find("/");
      if (i != std::string::npos)
      {
-	  std::list<Presence> l= it->second;
+	  PresenceList l= it->second.presences;
 
 	  //return matching resource
 	  // Identify any existing items w/ this JID 
@@ -193,7 +259,7 @@ Presence PresenceDB::findExact(const std::string& jid) const
      else
      {
 	  //return the first item in the list
-	  return *find_or_throw(jid)->second.begin();
+	  return *find_or_throw(jid)->second.presences.begin();
      }
 }
 
@@ -202,8 +268,8 @@ PresenceDB::const_iterator PresenceDB::find(const std::string& jid) const
      PresenceDB::db::const_iterator it = find_or_throw(jid);
      // If the list is empty, throw an exception, otherwise return the first
      // item in the list
-     if (it->second.begin() != it->second.end())
-	  return find_or_throw(jid)->second.begin();
+     if (it->second.presences.begin() != it->second.presences.end())
+	  return find_or_throw(jid)->second.presences.begin();
      else
 	  throw XCP_InvalidJID();
 }
@@ -219,8 +285,8 @@ bool PresenceDB::available(const std::string& jid) const
      // it->second is a list that could be empty so we need to check
      // if there is actually an item in the list before we call getType
      // on the first iitem
-     if (it != _DB.end() && it->second.begin() != it->second.end())
-	  return (it->second.begin()->getType() == Presence::ptAvailable);
+     if (it != _DB.end() && it->second.presences.begin() != it->second.presences.end())
+	  return (it->second.presences.begin()->getType() == Presence::ptAvailable);
      else
 	  return false;
 }
@@ -230,8 +296,9 @@ void PresenceDB::send_unavailable(const std::string& jid)
      Presence p(jid, Presence::ptUnavailable);
 
      for (db::const_iterator it = _DB.begin(); it != _DB.end(); ++it) {
-          if (it->second.begin() != it->second.end() && it->second.begin()->getType() == Presence::ptAvailable) {
-               p.setFrom(it->second.begin()->getFrom());
+          const PresenceList& l = it->second.presences;
+          if (l.begin() != l.end() && l.begin()->getType() == Presence::ptAvailable) {
+               p.setFrom(l.begin()->getFrom());
                _Owner.evtPresence(p, Presence::ptUnavailable);
           }
      }
@@ -240,6 +307,9 @@ void PresenceDB::send_unavailable(const std::string& jid)
 void PresenceDB::clear()
 {
      // Erase all entries from the DB
+     JUDO_PROBE1(presencedb_clear, (long) _DB.size());
      _DB.clear();
+     _Ages.clear();
+     _Bytes = 0;
 }
 } //  namespace jabberoo
@@ -0,0 +1,132 @@
+// jabberoo-recvring.cc
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include <recvring.hh>
+
+#include <algorithm>
+
+namespace jabberoo {
+
+RecvRing::RecvRing(int capacity)
+     : _written(0), _read(0),
+       _writer_waiting(false), _reader_waiting(false), _closed(false)
+{
+     size_t size = 1;
+     while (size < (size_t) capacity)
+	  size <<= 1;
+     _data.resize(size);
+     _mask = size - 1;
+}
+
+char* RecvRing::getWriteBuffer(int& size)
+{
+     size_t written = _written.load(std::memory_order_relaxed);
+     size_t used = written - _read.load(std::memory_order_acquire);
+     size_t start = written & _mask;
+
+     // Stop at the end of the ring; the rest comes round next time
+     size = std::min(_data.size() - used, _data.size() - start);
+     return &_data[start];
+}
+
+bool RecvRing::commit(int datasz)
+{
+     size_t written = _written.load(std::memory_order_relaxed);
+     bool was_empty = (written == _read.load(std::memory_order_acquire));
+
+     // Sequentially consistent so either the reader sees the data or
+     // we see that it is waiting
+     _written.store(written + datasz);
+     wake(_reader_waiting);
+     return was_empty;
+}
+
+int RecvRing::writable() const
+{
+     return _data.size() - (_written.load(std::memory_order_relaxed) -
+			    _read.load(std::memory_order_acquire));
+}
+
+bool RecvRing::waitWritable()
+{
+     std::unique_lock<std::mutex> lock(_lock);
+     _writer_waiting = true;
+     while (!_closed &&
+	    _written.load(std::memory_order_relaxed) - _read.load() == _data.size())
+	  _wakeup.wait(lock);
+     _writer_waiting = false;
+     return !_closed;
+}
+
+const char* RecvRing::getReadBuffer(int& size)
+{
+     size_t read = _read.load(std::memory_order_relaxed);
+     size_t ready = _written.load(std::memory_order_acquire) - read;
+     size_t start = read & _mask;
+
+     size = std::min(ready, _data.size() - start);
+     return &_data[start];
+}
+
+void RecvRing::consume(int datasz)
+{
+     _read.store(_read.load(std::memory_order_relaxed) + datasz);
+     wake(_writer_waiting);
+}
+
+int RecvRing::readable() const
+{
+     return _written.load(std::memory_order_acquire) -
+	  _read.load(std::memory_order_relaxed);
+}
+
+bool RecvRing::waitReadable()
+{
+     std::unique_lock<std::mutex> lock(_lock);
+     _reader_waiting = true;
+     while (!_closed &&
+	    _written.load() == _read.load(std::memory_order_relaxed))
+	  _wakeup.wait(lock);
+     _reader_waiting = false;
+     return !_closed || _written.load() != _read.load(std::memory_order_relaxed);
+}
+
+void RecvRing::close()
+{
+     {
+	  std::lock_guard<std::mutex> lock(_lock);
+	  _closed = true;
+     }
+     _wakeup.notify_all();
+}
+
+void RecvRing::wake(std::atomic<bool>& waiting)
+{
+     // Taking the lock makes sure the waiter is really asleep, not
+     // between its check and its wait
+     if (waiting.load())
+     {
+	  std::lock_guard<std::mutex> lock(_lock);
+	  _wakeup.notify_all();
+     }
+}
+
+}; // namespace jabberoo
@@ -28,19 +28,45 @@
  * 2002-03-05       IBM Corp.       Updated to libjudo 1.1.5
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <roster.hh>
 #include <judo.hpp>
 #include <session.hh>
 #include <JID.hh>
+#include <Probes.h>
 #include <sigc++/object_slot.h>
 #include <sigc++/signal.h>
 
 namespace jabberoo {
 
 Roster::Roster(Session& s)
-     : _owner(s)
+     : _items(jutil::CaseInsensitiveCmp(), ItemMap::allocator_type(s.getMemoryResource())),
+       _owner(s), _bytes(0)
 {}
 
+namespace {
+     // What a string costs as a member of a std::set
+     size_t setEntrySize(const std::string& s)
+     {
+	  return judo::MAP_NODE_OVERHEAD + sizeof(std::string) + judo::heapSize(s);
+     }
+}
+
+// Recount an item which has been added or changed
+void Roster::counted(ItemMap::value_type& v)
+{
+     Item& i = v.second;
+     size_t bytes = judo::MAP_NODE_OVERHEAD + sizeof(v) + judo::heapSize(v.first) +
+	  judo::heapSize(i._nickname) + judo::heapSize(i._jid);
+     for (Item::iterator it = i.begin(); it != i.end(); ++it)
+	  bytes += setEntrySize(*it);
+     _bytes += bytes - i._counted;
+     i._counted = bytes;
+}
+
 const Roster::Item& Roster::operator[](const std::string& jid) const
 {
      ItemMap::const_iterator it = _items.find(filterJID(jid));
@@ -61,7 +87,10 @@ Roster::Item& Roster::operator[](const std::string& jid)
 
 void Roster::reset()
 {
+     JUDO_PROBE1(roster_reset, (long) _items.size());
      _items.clear();
+     _groups.clear();
+     _bytes = 0;
      evtRefresh(); // notify people that the overall Roster has been changed (emptied!)
 }
 
@@ -104,15 +133,19 @@ void Roster::update(const judo::Element& t)
           updateFlag = true;
           if (item.cmpAttrib("subscription", "remove"))
           {
+              JUDO_PROBE1(roster_remove, jid.c_str());
               evtRemovingItem(rit->second);
               removeItemFromAllGroups(rit->second);
+              _bytes -= rit->second._counted;
               _items.erase(rit);
           }
           // Otherwise, update the roster item
           else
           {
+              JUDO_PROBE1(roster_update, jid.c_str());
               evtUpdating(rit->second);
               rit->second.update(*this, item);
+              counted(*rit);
               evtUpdateDone(rit->second);
           }
 
@@ -120,7 +153,8 @@ void Roster::update(const judo::Element& t)
 	  // Otherwise, create a new item on the map
 	  else if (!item.cmpAttrib("subscription", "remove"))
 	  {
-	       _items.insert(make_pair(jid, Item(*this, item)));
+	       JUDO_PROBE1(roster_add, jid.c_str());
+	       counted(*_items.insert(make_pair(jid, Item(*this, item))).first);
 	       updateFlag = true;
 	  }
      }
@@ -259,6 +293,16 @@ std::string Roster::filterJID(const std::string& jid)
      
 }
 
+void Roster::addItemToGroup(const std::string& group, const std::string& jid)
+{
+     typedef std::map<std::string, std::set<std::string> >::iterator GIT;
+     std::pair<GIT, bool> g = _groups.insert(std::make_pair(group, std::set<std::string>()));
+     if (g.second)
+	  _bytes += judo::MAP_NODE_OVERHEAD + sizeof(*g.first) + judo::heapSize(group);
+     if (g.first->second.insert(jid).second)
+	  _bytes += setEntrySize(jid);
+}
+
 void Roster::removeItemFromGroup(const std::string& group, const std::string& jid)
 {
      typedef std::map<std::string, std::set<std::string> >::iterator GIT;
@@ -270,11 +314,15 @@ void Roster::removeItemFromGroup(const std::string& group, const std::string& ji
          std::set<std::string>::iterator member = it->second.find(jid);
 	  if (member != it->second.end()) 
 	  {
+	       _bytes -= setEntrySize(*member);
 	       it->second.erase(member);
 	  } 
 	  // Erase the group-std::set if it's empty n
 	  if (it->second.empty())
+	  {
+	       _bytes -= judo::MAP_NODE_OVERHEAD + sizeof(*it) + judo::heapSize(it->first);
 	       _groups.erase(it);
+	  }
      }
 }
 
@@ -298,7 +346,7 @@ void Roster::mergeItemGroups(const std::string& itemjid, const std::set<std::str
      {
 	  if ((old_it == oldgrp.end()) && (new_it != newgrp.end()))
 	  {
-	       _groups[*new_it].insert(itemjid);
+	       addItemToGroup(*new_it, itemjid);
 	       ++new_it;
 	  }
 	  else if ((old_it != oldgrp.end()) && (new_it == newgrp.end()))
@@ -326,19 +374,19 @@ void Roster::mergeItemGroups(const std::string& itemjid, const std::set<std::str
 // Roster::Item
 // ---------------------------------------------------------
 Roster::Item::Item(const judo::Element& t)
-     : _rescnt(0)
+     : _rescnt(0), _counted(0)
 {
      update(t);
 }
 
 Roster::Item::Item(Roster& r, const judo::Element& t)
-     : _rescnt(0)
+     : _rescnt(0), _counted(0)
 {
      update(r, t);
 }
 
 Roster::Item::Item(const std::string& jid, const std::string& nickname)
-     : _jid(jid), _nickname(nickname)
+     : _nickname(nickname), _jid(jid), _counted(0)
 {}
 
 Roster::Item::~Item()
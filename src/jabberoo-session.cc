@@ -34,7 +34,9 @@
 #endif
 
 #include <session.hh>
+#include <wiretrace.hh>
 #include <XPath.h>
+#include <Probes.h>
 #include <sigc++/object_slot.h>
 #include <sha.h>
 #include "JID.hh"
@@ -43,11 +45,25 @@ namespace jabberoo {
 // ---------------------------------------------------------
 // Initializers
 // ---------------------------------------------------------
-Session::Session()
+Session::Session(judo::MemoryResource* upstream)
      : ElementStream(this),
        _ID(0),
        _ConnState(csNotConnected),
+       _StreamElement(NULL),
        _StreamStart(false),
+       _RecvBuffer(NULL),
+       _Strand(NULL),
+       _RingDrainPosted(false),
+       _WireTap(NULL),
+       _Budget(0),
+       _BudgetPolicy(bpEvictCaches),
+       _OverBudget(false),
+       _Shed(false),
+       _PostedIn(0),
+       _PostedOut(0),
+       _MemResource(new judo::CountingResource(upstream)),
+       _CallbackBytes(0),
+       _XPGeneration(1),
        _Roster(*this),
        _DDB(*this),
        _PDB(*this)
@@ -70,17 +86,26 @@ Session::~Session()
         std::cerr << "Disconnecting in Jabberoo-Session" << std::endl;
         disconnect();
     }
+    setWireTap(NULL);
 
     for (XPQueryList::iterator it = _incoming_queries.begin();
          it != _incoming_queries.end(); ++it)
     {
-        delete it->first;
+        delete it->query;
     }
     for (XPQueryList::iterator it = _outgoing_queries.begin();
          it != _outgoing_queries.end(); ++it)
     {
-        delete it->first;
+        delete it->query;
     }
+
+    // Unless authentication finished, the stream header is still ours
+    delete _StreamElement;
+
+    // The caches are freed after this, and anything a handler kept
+    // may be freed later still; so is a packet ElementStream was
+    // part way through
+    _MemResource->deleteWhenUnused();
 }
 
 // ---------------------------------------------------------
@@ -88,29 +113,43 @@ Session::~Session()
 // ---------------------------------------------------------
 Session& Session::operator<<(const Packet& p)
 {
+    judo::ResourceScope scope(_MemResource);
     const judo::Element& elem(p.getBaseElement());
     // Fire callbacks for anyone that cares
+    JABBEROO_STAT(SessionCounters::add(_Counters.xpathEvals, _outgoing_queries.size()));
     for (XPQueryList::iterator it = _outgoing_queries.begin(); 
          it != _outgoing_queries.end(); ++it)
     {
-        if ( it->first->check(elem) )
+        if ( it->query->check(elem) )
         {
-            it->second(elem);
+            JABBEROO_STAT(SessionCounters::add(_Counters.xpathMatches));
+            JABBEROO_STAT(LatencyTimer timer(it->timing));
+            it->func(elem);
         }
     }
 
      if (elem.getName() == "presence")
      {
 	  // Send out evtMyPresence if it seems appropriate
-	  Presence pres = Presence(elem);
+	  Presence pres(p);
 	  if (pres.getFrom().empty() && pres.getTo().empty())
 	       evtMyPresence(pres);
      }
      evtTransmitPacket(p); 
-     evtTransmitXML(p.toString().c_str()); 
+     transmit(p.toString().c_str()); 
      return *this;
 }
 
+void Session::transmit(const char* xml)
+{
+     JABBEROO_STAT(_Counters.transmitted(xml, strlen(xml)));
+     if (JUDO_PROBE_ENABLED(transmit))
+	  JUDO_PROBE2(transmit, xml, strlen(xml));
+     if (_WireTap != NULL)
+	  _WireTap->capture(WireTrace::dirTransmit, xml, strlen(xml));
+     evtTransmitXML(xml);
+}
+
 // ---------------------------------------------------------
 // Connection setup/teardown ops (inc. authentication)
 // ---------------------------------------------------------
@@ -136,6 +175,7 @@ void Session::connect(const std::string& server, AuthType atype,
      if (_ConnState == csNotConnected)
      {
 	  this->reset(); // Reset ElementStream for new connection
+	  _OverBudget = _Shed = false;
 	  // Transmit opening sequence to establish the XML stream..    
 	  *this << "<stream:stream to='" << server.c_str()
 		<< "' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>";  
@@ -176,6 +216,107 @@ bool Session::disconnect()
 // ---------------------------------------------------------
 // Accessors
 // ---------------------------------------------------------
+SessionStats Session::getStats() const
+{
+     SessionStats s;
+     _Counters.snapshot(s);
+     return s;
+}
+
+Session::MemoryUsage Session::getMemoryUsage() const
+{
+     MemoryUsage u;
+     u.parse = getPendingSize() + _PostedIn.load(std::memory_order_relaxed);
+     if (_Ring)
+	  u.parse += _Ring->readable();
+     u.presence = _PDB.getMemoryUsed();
+     u.roster = _Roster.getMemoryUsed();
+     u.disco = _DDB.getMemoryUsed();
+     u.iq = _CallbackBytes;
+     u.output = _PostedOut.load(std::memory_order_relaxed);
+     return u;
+}
+
+void Session::setMemoryBudget(size_t bytes, BudgetPolicy policy)
+{
+     _Budget = bytes;
+     _BudgetPolicy = policy;
+}
+
+void Session::checkBudget(bool parsing)
+{
+     if (_Budget == 0 || _Shed)
+	  return;
+
+     if (!_OverBudget)
+     {
+	  MemoryUsage u = getMemoryUsage();
+	  if (u.total() <= _Budget)
+	       return;
+	  evtOverBudget(u);
+
+	  if (_BudgetPolicy == bpEvictCaches)
+	       _DDB.clear();
+	  if (_BudgetPolicy != bpDisconnect)
+	  {
+	       while (getMemoryUsage().total() > _Budget && _PDB.dropOldest())
+		    ;
+	  }
+	  _OverBudget = (getMemoryUsage().total() > _Budget);
+     }
+
+     if (_OverBudget && !parsing)
+	  shed();
+}
+
+// Drop the connection and everything held for the peer
+void Session::shed()
+{
+     _OverBudget = false;
+     _Shed = true;
+
+     disconnect();
+     ElementStream::reset();
+     _Roster.reset();
+     _PDB.send_unavailable(_local_jid);
+     _PDB.clear();
+     _DDB.clear();
+     evtDisconnected();
+}
+
+LatencyTable Session::getHandlerLatencies() const
+{
+     return summarize(_HandlerTimes);
+}
+
+LatencyTable Session::getIQLatencies() const
+{
+     return summarize(_ReplyTimes);
+}
+
+LatencyHistogram* Session::latencies(std::map<std::string, LatencyHistogram>& table,
+				     const std::string& label)
+{
+#ifdef JABBEROO_STATS
+     std::lock_guard<std::mutex> guard(_TimesLock);
+     return &table[label.empty() ? "(unlabelled)" : label];
+#else
+     return NULL;
+#endif
+}
+
+LatencyTable Session::summarize(const std::map<std::string, LatencyHistogram>& table) const
+{
+     LatencyTable result;
+     std::lock_guard<std::mutex> guard(_TimesLock);
+     for (std::map<std::string, LatencyHistogram>::const_iterator it = table.begin();
+	  it != table.end(); ++it)
+     {
+	  result[it->first] = it->second.summarize();
+     }
+     return result;
+}
+
 const Roster& Session::roster() const
 {
      return _Roster;
@@ -237,7 +378,15 @@ std::string Session::getDigest()
 // ---------------------------------------------------------
 void Session::push(const char* data, int datasz)
 {
+     judo::ResourceScope scope(_MemResource);
+     checkBudget(false);
+     if (_Shed)
+	  return;
+     if (_WireTap != NULL)
+	  _WireTap->capture(WireTrace::dirRecv, data, datasz);
      evtRecvXML(data);
+     JABBEROO_STAT(SessionCounters::add(_Counters.bytesIn, datasz));
+     JABBEROO_STAT(SessionCounters::ParseTimer timer(_Counters));
      try {
 	  ElementStream::push(data, datasz);
      } catch (const ElementStream::exception::ParserError& error) {
@@ -250,38 +399,211 @@ void Session::push(const char* data, int datasz)
 
 	  disconnect();
      }
+     checkBudget(false);
+}
+
+char* Session::getBuffer(int size)
+{
+     // Leave room to terminate the data for evtRecvXML
+     _RecvBuffer = ElementStream::getBuffer(size + 1);
+     return _RecvBuffer;
+}
+
+void Session::commit(int datasz)
+{
+     judo::ResourceScope scope(_MemResource);
+     checkBudget(false);
+     if (_Shed)
+	  return;
+     _RecvBuffer[datasz] = '\0';
+     if (_WireTap != NULL)
+	  _WireTap->capture(WireTrace::dirRecv, _RecvBuffer, datasz);
+     evtRecvXML(_RecvBuffer);
+     JABBEROO_STAT(SessionCounters::add(_Counters.bytesIn, datasz));
+     JABBEROO_STAT(SessionCounters::ParseTimer timer(_Counters));
+     try {
+	  ElementStream::commit(datasz);
+     } catch (const ElementStream::exception::ParserError& error) {
+	  evtXMLParserError(error.getCode(), error.getMessage());
+
+	  _ConnState = csNotConnected;
+	  _StreamStart = false;
+
+	  disconnect();
+     }
+     checkBudget(false);
+}
+
+void Session::post(const char* data, int datasz)
+{
+     if (_Strand == NULL)
+     {
+	  push(data, datasz);
+	  return;
+     }
+
+     std::string buf(data, datasz);
+     size_t bytes = sizeof(buf) + judo::heapSize(buf);
+     _PostedIn.fetch_add(bytes, std::memory_order_relaxed);
+     _Strand->post([this, buf, bytes]() {
+	       _PostedIn.fetch_sub(bytes, std::memory_order_relaxed);
+	       push(buf.c_str(), buf.size());
+	  });
+}
+
+void Session::postPacket(const Packet& p)
+{
+     if (_Strand == NULL)
+     {
+	  *this << p;
+	  return;
+     }
+
+     // Elements aren't safe to read from two threads, so the strand
+     // gets a copy of its own
+     Packet copy(p.getBaseElement());
+     size_t bytes = sizeof(copy) + copy.getMemorySize();
+     _PostedOut.fetch_add(bytes, std::memory_order_relaxed);
+     _Strand->post([this, copy, bytes]() {
+	       _PostedOut.fetch_sub(bytes, std::memory_order_relaxed);
+	       *this << copy;
+	  });
+}
+
+void Session::setRecvRing(int capacity)
+{
+     if (capacity > 0)
+	  _Ring.reset(new RecvRing(capacity));
+     else
+	  _Ring.reset();
+}
+
+void Session::setWireTap(WireTap* tap)
+{
+     if (_WireTap != NULL)
+	  _WireTap->close();
+     _WireTap = tap;
+}
+
+void Session::commitRecv(int datasz)
+{
+     _Ring->commit(datasz);
+
+     // Clearing the flag is the first thing a drain does, so anything
+     // committed after that gets a drain of its own
+     if (_Strand != NULL && !_RingDrainPosted.exchange(true))
+     {
+	  _Strand->post([this]() {
+		    _RingDrainPosted = false;
+		    drainRecv();
+	       });
+     }
 }
 
-void Session::registerIQ(const std::string& id, ElementCallbackFunc f)
+int Session::drainRecv()
 {
-     _Callbacks.insert(std::make_pair(id, f));
+     int total = 0;
+
+     // Only take what is there now, in at most two pieces if it wraps,
+     // so a fast reader can't keep the session's thread here forever
+     for (int pieces = 0; pieces < 2; ++pieces)
+     {
+	  int size;
+	  const char* data = _Ring->getReadBuffer(size);
+	  if (size == 0)
+	       break;
+
+	  // Parse from our own buffer, since commit() terminates it for
+	  // evtRecvXML and the ring space goes back to the reader
+	  memcpy(getBuffer(size), data, size);
+	  _Ring->consume(size);
+	  commit(size);
+	  total += size;
+     }
+     return total;
+}
+
+void Session::registerIQ(const std::string& id, ElementCallbackFunc f,
+			 const std::string& label)
+{
+     IQCallback cb;
+     cb.func = f;
+     cb.sent = std::chrono::steady_clock::now();
+     cb.label = label;
+     cb.handlerTime = latencies(_HandlerTimes, "iq " + (label.empty() ? "(unlabelled)" : label));
+     cb.replyTime = latencies(_ReplyTimes, label);
+     _CallbackBytes += callbackSize(*_Callbacks.insert(std::make_pair(id, cb)));
+     JABBEROO_STAT(SessionCounters::set(_Counters.iqPending, _Callbacks.size()));
+}
+
+size_t Session::callbackSize(const IQCallbackMap::value_type& cb)
+{
+     return judo::MAP_NODE_OVERHEAD + sizeof(cb) + 
+	  judo::heapSize(cb.first) + judo::heapSize(cb.second.label);
+}
+
+int Session::expireIQ(int seconds)
+{
+     std::chrono::steady_clock::time_point cutoff =
+	  std::chrono::steady_clock::now() - std::chrono::seconds(seconds);
+     int expired = 0;
+     typedef std::multimap<std::string, IQCallback>::iterator CIT;
+     for (CIT it = _Callbacks.begin(); it != _Callbacks.end(); )
+     {
+	  if (it->second.sent < cutoff)
+	  {
+	       _CallbackBytes -= callbackSize(*it);
+	       _Callbacks.erase(it++);
+	       expired++;
+	  }
+	  else
+	       ++it;
+     }
+     JABBEROO_STAT(SessionCounters::add(_Counters.iqTimedOut, expired));
+     JABBEROO_STAT(SessionCounters::set(_Counters.iqPending, _Callbacks.size()));
+     return expired;
 }
 
 judo::XPath::Query* Session::registerXPath(const std::string& query, 
-        ElementCallbackFunc f, bool incoming)
+        ElementCallbackFunc f, bool incoming, const std::string& label)
 {
     judo::XPath::Query* xpq = new judo::XPath::Query(query);
-    XPQueryList::value_type vt = std::make_pair(xpq, f);
+    addXPath(xpq, f, incoming, label);
+    return xpq;
+}
+
+judo::XPath::Matcher* Session::addXPath(judo::XPath::Matcher* matcher, 
+        ElementCallbackFunc f, bool incoming, const std::string& label)
+{
+    XPHandler vt;
+    vt.query = matcher;
+    vt.func = f;
+    vt.label = label;
+    vt.timing = latencies(_HandlerTimes, label);
     if (incoming)
     {
         _incoming_queries.push_front(vt);
+        _XPGeneration++;
     }
     else
     {
         _outgoing_queries.push_front(vt);
     }
 
-    return xpq;
+    return matcher;
 }
 
-void Session::unregisterXPath(judo::XPath::Query* id, bool incoming)
+void Session::unregisterXPath(judo::XPath::Matcher* id, bool incoming)
 {
     if (incoming)
     {
         XPQueryList::iterator it = std::find_if(_incoming_queries.begin(),
             _incoming_queries.end(), queryFinder(id));
         if (it != _incoming_queries.end())
+        {
             _incoming_queries.erase(it);
+            _XPGeneration++;
+        }
     }
     else
     {
@@ -308,7 +630,7 @@ void Session::queryNamespace(const std::string& nspace, ElementCallbackFunc f, c
      iq.addElement("query")->putAttrib("xmlns", nspace);
 
      // Register a callback for this IQ
-     _Callbacks.insert(std::make_pair(id, f));
+     registerIQ(id, f, nspace);
 
      // Transmit the IQ
      *this << iq.toString().c_str();
@@ -322,30 +644,61 @@ void Session::addFeature(const std::string& feature)
 
 void Session::dispatch(judo::Element* elem)
 {
-    judo::Element& eref(*elem);
+    judo::ResourceScope scope(_MemResource);
+    dispatch(elem, XPDecisionList(), 0);
+    // This may be a handler dispatching from within a parse
+    checkBudget(true);
+}
+
+void Session::dispatch(judo::Element* elem, const XPDecisionList& decisions, long size)
+{
+    JABBEROO_STAT(unsigned long long start = SessionCounters::now());
+    JUDO_PROBE2(dispatch_entry, elem->getName().c_str(), size);
+
+    // The packet takes ownership of the element, so handlers and the
+    // presence db all share this one tree instead of copying it
+    Packet pkt(elem);
+    const judo::Element& eref(pkt.getBaseElement());
 
     // Determine what kind of packet we recv'd and call the 
     // appropriate handler
     if (eref.getName() == "message")
-        handleMessage(eref);
+        handleMessage(pkt);
     else if (eref.getName() == "presence")
-        handlePresence(eref);
+        handlePresence(pkt);
     else if (eref.getName() == "iq")
         handleIQ(eref);
     else
         evtUnknownPacket(eref);
 
-    // See if a xpath handles this
+    // See if a xpath handles this; queries which were decided from
+    // the start tag aren't evaluated again, unless a handler, above or
+    // in this loop, has changed the query list since
+    std::vector<judo::XPath::Op::Match>::const_iterator dit = decisions.matches.begin();
+    JABBEROO_STAT(SessionCounters::add(_Counters.xpathEvals, _incoming_queries.size()));
     for (XPQueryList::iterator it = _incoming_queries.begin(); 
     it != _incoming_queries.end(); ++it)
     {
-        if ( it->first->check(eref) )
+        bool decided = (decisions.generation == _XPGeneration && 
+                        dit != decisions.matches.end());
+        judo::XPath::Op::Match m = decided ? *dit++ : judo::XPath::Op::MATCH_UNKNOWN;
+        if ( m == judo::XPath::Op::MATCH_YES || 
+             (m == judo::XPath::Op::MATCH_UNKNOWN && it->query->check(eref)) )
         {
-            it->second(eref);
+            JABBEROO_STAT(SessionCounters::add(_Counters.xpathMatches));
+            JABBEROO_STAT(LatencyTimer timer(it->timing));
+            JUDO_PROBE2(xpath_match, eref.getName().c_str(), it->label.c_str());
+            it->func(eref);
         }
     }
+    JUDO_PROBE2(dispatch_return, eref.getName().c_str(), size);
 
-    delete elem;
+#ifdef JABBEROO_STATS
+    SessionCounters::set(_Counters.rosterItems, _Roster.size());
+    SessionCounters::set(_Counters.presenceJIDs, _PDB.size());
+    SessionCounters::set(_Counters.discoItems, _DDB.size());
+    SessionCounters::add(_Counters.dispatchNanos, SessionCounters::now() - start);
+#endif
 }
 
 // ---------------------------------------------------------
@@ -370,7 +723,7 @@ void Session::authenticate()
      if (_AuthType != Session::atAutoAuth)
 	  sendLogin(_AuthType, NULL);
      else
-	  registerIQ(id, SigC::slot(*this, &Session::OnAuthTypeReceived));
+	  registerIQ(id, SigC::slot(*this, &Session::OnAuthTypeReceived), "jabber:iq:auth");
 }
 
 void Session::OnAuthTypeReceived(const judo::Element& t)
@@ -424,7 +777,7 @@ void Session::sendLogin(Session::AuthType atype, const judo::Element* squery)
 	  query->putAttrib("xmlns", "jabber:iq:register");
 	  query->addElement("password", _Password);
 	  // Register the create user callback
- 	  registerIQ(id, SigC::slot(*this, &Session::IQHandler_CreateUser)); 
+ 	  registerIQ(id, SigC::slot(*this, &Session::IQHandler_CreateUser), "jabber:iq:register");
 
      }
      else if (_ConnState == csAuthReq)
@@ -450,7 +803,7 @@ void Session::sendLogin(Session::AuthType atype, const judo::Element* squery)
 	       break;
 	  }
 	  // Register the auth callback
-	  registerIQ(id, SigC::slot(*this, &Session::IQHandler_Auth));
+	  registerIQ(id, SigC::slot(*this, &Session::IQHandler_Auth), "jabber:iq:auth");
      }
 
      // Transmit the buffer
@@ -470,6 +823,7 @@ void Session::onDocumentStart(judo::Element* t)
      // Retrieve the SID from the stream header
      _SessionID = t->getAttrib("id");
      // Save stream header
+     delete _StreamElement;
      _StreamElement = t;
      _StreamStart = true;
      // Authenticate
@@ -479,10 +833,36 @@ void Session::onDocumentStart(judo::Element* t)
 	  evtConnected(*_StreamElement);
 }
 
+bool Session::onElementStart(const char* name, const char** attribs)
+{
+    JABBEROO_STAT(SessionCounters::add(_Counters.stanzasIn[SessionStats::classify(name)]));
+
+    // Decide what we can of the xpaths now, so dispatch doesn't have
+    // to evaluate them against the whole packet
+    _XPDecisions.matches.clear();
+    _XPDecisions.generation = _XPGeneration;
+    for (XPQueryList::iterator it = _incoming_queries.begin(); 
+    it != _incoming_queries.end(); ++it)
+    {
+        _XPDecisions.matches.push_back(it->query->checkStart(name, attribs));
+    }
+    return true;
+}
+
 void Session::onElement(judo::Element* t) 
 {
-    evtOnRecvElement(*t);
-    dispatch(t);
+    XPDecisionList decisions;
+    decisions.matches.swap(_XPDecisions.matches);
+    decisions.generation = _XPDecisions.generation;
+
+    // Handlers may modify the element, which voids the decisions
+    if (!evtOnRecvElement.empty())
+    {
+        evtOnRecvElement(*t);
+        decisions.matches.clear();
+    }
+    dispatch(t, decisions, getElementSize());
+    checkBudget(true);
 }
 
 void Session::onCDATA(judo::CDATA* c)
@@ -517,13 +897,13 @@ void Session::onDocumentEnd()
 //
 // Routing handlers (see also: IQ handlers)
 // ---------------------------------------------------------
-void Session::handleMessage(judo::Element& t)
+void Session::handleMessage(const Packet& t)
 {
      // Call the signal handler
      evtMessage(Message(t));
 }
 
-void Session::handlePresence(judo::Element& t)
+void Session::handlePresence(const Packet& t)
 {
      Presence p(t);
 
@@ -564,10 +944,10 @@ void Session::handlePresence(judo::Element& t)
      }
 }
 
-void Session::handleIQ(judo::Element& t)
+void Session::handleIQ(const judo::Element& t)
 {
      // Check for callback w/ ID
-     typedef std::multimap<std::string, ElementCallbackFunc>::iterator CIT;
+     typedef std::multimap<std::string, IQCallback>::iterator CIT;
      std::pair<CIT, CIT> cb = _Callbacks.equal_range(t.getAttrib("id"));
      if (cb.first != cb.second)
      {
@@ -579,20 +959,30 @@ void Session::handleIQ(judo::Element& t)
                // equal.  Is there a way to prevent the iterator from being broken?
                if (it->first == t.getAttrib("id")) {
 	            // Fire the requested function
-	            ElementCallbackFunc& f = it->second;
+#ifdef JABBEROO_STATS
+		    IQCallback& iqcb = it->second;
+		    iqcb.replyTime->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			 std::chrono::steady_clock::now() - iqcb.sent).count());
+		    SessionCounters::add(_Counters.iqCompleted);
+		    LatencyTimer timer(iqcb.handlerTime);
+#endif
+		    JUDO_PROBE2(iq_callback, it->first.c_str(), it->second.label.c_str());
+	            ElementCallbackFunc& f = it->second.func;
 	            f(t);
 		    // erasing it then incrementing it doesn't work right so increment first
 		    // then delete
                     CIT nit = it++;
+	            _CallbackBytes -= callbackSize(*nit);
 	            _Callbacks.erase(nit);
 	       } else
                     it++;
 	  }
+	  JABBEROO_STAT(SessionCounters::set(_Counters.iqPending, _Callbacks.size()));
      }
      // Proceed with xmlns examination
      else
      {
-	  judo::Element* q = t.findElement("query");
+	  const judo::Element* q = t.findElement("query");
 
 	  // Catch the odd case of an IQ not having a <query> tag..
 	  if (q == NULL) return;
@@ -709,6 +1099,7 @@ void Session::IQHandler_Auth(const judo::Element& t)
 	  if (_Authenticate)                           // If they wanted authentication, then
 	       _Roster.fetch();	                       // Request roster
 	  delete _StreamElement;		       // Release stream header tag
+	  _StreamElement = NULL;
      }
      else
      {
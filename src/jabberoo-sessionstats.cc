@@ -0,0 +1,274 @@
+// jabberoo-sessionstats.cc
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sessionstats.hh>
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+namespace jabberoo {
+
+namespace {
+     const char* STANZA_NAMES[SessionStats::stCount] = {
+	  "message", "presence", "iq", "other"
+     };
+
+     // Every live SessionCounters, and what the dead ones counted
+     struct Registry
+     {
+	  std::mutex                   lock;
+	  std::set<SessionCounters*>   live;
+	  SessionStats                 retired;
+     };
+
+     Registry& registry()
+     {
+	  // Never destroyed, so sessions which outlive main() can still
+	  // take themselves off it
+	  static Registry* r = new Registry;
+	  return *r;
+     }
+
+     // Whether name starts with word, followed by the end of the name
+     bool isName(const char* name, const char* word, size_t len)
+     {
+	  if (strncmp(name, word, len) != 0)
+	       return false;
+	  char c = name[len];
+	  return c == '\0' || c == ' ' || c == '>' || c == '/' ||
+	       c == '\t' || c == '\r' || c == '\n';
+     }
+}
+
+SessionStats::SessionStats()
+{
+     memset(this, 0, sizeof(*this));
+#ifdef JABBEROO_STATS
+     enabled = true;
+#endif
+}
+
+SessionStats::StanzaType SessionStats::classify(const char* xml)
+{
+     if (isName(xml, "message", 7))
+	  return stMessage;
+     if (isName(xml, "presence", 8))
+	  return stPresence;
+     if (isName(xml, "iq", 2))
+	  return stIQ;
+     return stOther;
+}
+
+SessionStats& SessionStats::operator+=(const SessionStats& s)
+{
+     bytesIn += s.bytesIn;
+     bytesOut += s.bytesOut;
+     for (int i = 0; i < stCount; ++i)
+     {
+	  stanzasIn[i] += s.stanzasIn[i];
+	  stanzasOut[i] += s.stanzasOut[i];
+     }
+     parseNanos += s.parseNanos;
+     dispatchNanos += s.dispatchNanos;
+     xpathEvals += s.xpathEvals;
+     xpathMatches += s.xpathMatches;
+     iqPending += s.iqPending;
+     iqCompleted += s.iqCompleted;
+     iqTimedOut += s.iqTimedOut;
+     rosterItems += s.rosterItems;
+     presenceJIDs += s.presenceJIDs;
+     discoItems += s.discoItems;
+     return *this;
+}
+
+std::string SessionStats::toString() const
+{
+     std::ostringstream out;
+     out << "enabled " << (enabled ? "yes" : "no") << "\n"
+	 << "bytes_in " << bytesIn << "\n"
+	 << "bytes_out " << bytesOut << "\n";
+     for (int i = 0; i < stCount; ++i)
+	  out << "stanzas_in." << STANZA_NAMES[i] << " " << stanzasIn[i] << "\n";
+     for (int i = 0; i < stCount; ++i)
+	  out << "stanzas_out." << STANZA_NAMES[i] << " " << stanzasOut[i] << "\n";
+     out << "parse_ns " << parseNanos << "\n"
+	 << "dispatch_ns " << dispatchNanos << "\n"
+	 << "xpath_evals " << xpathEvals << "\n"
+	 << "xpath_matches " << xpathMatches << "\n"
+	 << "iq_pending " << iqPending << "\n"
+	 << "iq_completed " << iqCompleted << "\n"
+	 << "iq_timed_out " << iqTimedOut << "\n"
+	 << "roster_items " << rosterItems << "\n"
+	 << "presence_jids " << presenceJIDs << "\n"
+	 << "disco_items " << discoItems << "\n";
+     return out.str();
+}
+
+std::string SessionStats::toJSON() const
+{
+     std::ostringstream out;
+     out << "{\"enabled\": " << (enabled ? "true" : "false")
+	 << ", \"bytes_in\": " << bytesIn
+	 << ", \"bytes_out\": " << bytesOut;
+     out << ", \"stanzas_in\": {";
+     for (int i = 0; i < stCount; ++i)
+	  out << (i ? ", \"" : "\"") << STANZA_NAMES[i] << "\": " << stanzasIn[i];
+     out << "}, \"stanzas_out\": {";
+     for (int i = 0; i < stCount; ++i)
+	  out << (i ? ", \"" : "\"") << STANZA_NAMES[i] << "\": " << stanzasOut[i];
+     out << "}, \"parse_ns\": " << parseNanos
+	 << ", \"dispatch_ns\": " << dispatchNanos
+	 << ", \"xpath_evals\": " << xpathEvals
+	 << ", \"xpath_matches\": " << xpathMatches
+	 << ", \"iq_pending\": " << iqPending
+	 << ", \"iq_completed\": " << iqCompleted
+	 << ", \"iq_timed_out\": " << iqTimedOut
+	 << ", \"roster_items\": " << rosterItems
+	 << ", \"presence_jids\": " << presenceJIDs
+	 << ", \"disco_items\": " << discoItems << "}";
+     return out.str();
+}
+
+SessionCounters::SessionCounters()
+     : bytesIn(0), bytesOut(0), parseNanos(0), dispatchNanos(0),
+       xpathEvals(0), xpathMatches(0), iqCompleted(0), iqTimedOut(0),
+       iqPending(0), rosterItems(0), presenceJIDs(0), discoItems(0)
+{
+     for (int i = 0; i < SessionStats::stCount; ++i)
+     {
+	  stanzasIn[i] = 0;
+	  stanzasOut[i] = 0;
+     }
+
+     Registry& r = registry();
+     std::lock_guard<std::mutex> guard(r.lock);
+     r.live.insert(this);
+}
+
+SessionCounters::~SessionCounters()
+{
+     SessionStats s;
+     snapshot(s);
+     s.iqPending = s.rosterItems = s.presenceJIDs = s.discoItems = 0;
+
+     Registry& r = registry();
+     std::lock_guard<std::mutex> guard(r.lock);
+     r.live.erase(this);
+     r.retired += s;
+}
+
+void SessionCounters::snapshot(SessionStats& s) const
+{
+     const std::memory_order relaxed = std::memory_order_relaxed;
+     s.bytesIn = bytesIn.load(relaxed);
+     s.bytesOut = bytesOut.load(relaxed);
+     for (int i = 0; i < SessionStats::stCount; ++i)
+     {
+	  s.stanzasIn[i] = stanzasIn[i].load(relaxed);
+	  s.stanzasOut[i] = stanzasOut[i].load(relaxed);
+     }
+     s.parseNanos = parseNanos.load(relaxed);
+     s.dispatchNanos = dispatchNanos.load(relaxed);
+     s.xpathEvals = xpathEvals.load(relaxed);
+     s.xpathMatches = xpathMatches.load(relaxed);
+     s.iqPending = iqPending.load(relaxed);
+     s.iqCompleted = iqCompleted.load(relaxed);
+     s.iqTimedOut = iqTimedOut.load(relaxed);
+     s.rosterItems = rosterItems.load(relaxed);
+     s.presenceJIDs = presenceJIDs.load(relaxed);
+     s.discoItems = discoItems.load(relaxed);
+}
+
+LatencyHistogram::LatencyHistogram()
+     : _count(0), _total(0), _max(0)
+{
+     for (int i = 0; i < BUCKETS; ++i)
+	  _buckets[i] = 0;
+}
+
+unsigned long long LatencyHistogram::highest(int i)
+{
+     if (i < SUB_COUNT)
+	  return i;
+     int m = (i - SUB_COUNT) / SUB_COUNT + SUB_BITS;
+     unsigned long long sub = (i - SUB_COUNT) % SUB_COUNT;
+     return ((SUB_COUNT + sub + 1) << (m - SUB_BITS)) - 1;
+}
+
+unsigned long long LatencyHistogram::percentile(double fraction) const
+{
+     const std::memory_order relaxed = std::memory_order_relaxed;
+
+     // Count from the buckets rather than _count, so a histogram being
+     // written to as we read it is still consistent
+     unsigned long long total = 0;
+     for (int i = 0; i < BUCKETS; ++i)
+	  total += _buckets[i].load(relaxed);
+     if (total == 0)
+	  return 0;
+
+     unsigned long long target = (unsigned long long) (fraction * total + 0.999999);
+     if (target < 1)
+	  target = 1;
+     unsigned long long seen = 0;
+     for (int i = 0; i < BUCKETS; ++i)
+     {
+	  seen += _buckets[i].load(relaxed);
+	  if (seen >= target)
+	       return std::min(highest(i), _max.load(relaxed));
+     }
+     return _max.load(relaxed);
+}
+
+LatencyHistogram::Summary LatencyHistogram::summarize() const
+{
+     Summary s;
+     s.count = _count.load(std::memory_order_relaxed);
+     s.mean = s.count ? _total.load(std::memory_order_relaxed) / s.count : 0;
+     s.p50 = percentile(0.5);
+     s.p99 = percentile(0.99);
+     s.p999 = percentile(0.999);
+     s.max = _max.load(std::memory_order_relaxed);
+     return s;
+}
+
+SessionStats getProcessStats()
+{
+     Registry& r = registry();
+     std::lock_guard<std::mutex> guard(r.lock);
+     SessionStats total = r.retired;
+     for (std::set<SessionCounters*>::const_iterator it = r.live.begin();
+	  it != r.live.end(); ++it)
+     {
+	  SessionStats s;
+	  (*it)->snapshot(s);
+	  total += s;
+     }
+     return total;
+}
+
+}; // namespace jabberoo
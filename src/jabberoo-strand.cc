@@ -0,0 +1,196 @@
+// jabberoo-strand.cc
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include <strand.hh>
+
+namespace jabberoo {
+
+namespace {
+     // What the calling thread is running, if it is a worker
+     thread_local const Strand*     current_strand = NULL;
+     thread_local const WorkerPool* current_pool = NULL;
+     thread_local unsigned          current_worker = 0;
+}
+
+Strand::Strand(WorkerPool& pool)
+     : _pool(pool), _pending(0)
+{}
+
+Strand::~Strand()
+{}
+
+void Strand::post(Task task)
+{
+     _tasks.push(std::move(task));
+     if (_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+	  _pool.schedule(this);
+}
+
+bool Strand::isCurrent() const
+{
+     return current_strand == this;
+}
+
+void Strand::run()
+{
+     const Strand* outer = current_strand;
+     current_strand = this;
+
+     for (int n = 0; n < WorkerPool::BATCH; ++n)
+     {
+	  {
+	       Task task;
+	       // _pending says a task is there, but its post() may not
+	       // have linked it into the queue yet
+	       while (!_tasks.pop(task))
+		    std::this_thread::yield();
+	       task();
+	  }
+
+	  // Once this drops to zero the strand may be scheduled again
+	  // and run elsewhere, or destroyed, so don't touch it after
+	  if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	  {
+	       current_strand = outer;
+	       return;
+	  }
+     }
+
+     // Still has work; go to the back of the line
+     current_strand = outer;
+     _pool.schedule(this);
+}
+
+WorkerPool::WorkerPool(unsigned threads)
+     : _next_worker(0), _ready(0), _sleeping(0), _stopping(false)
+{
+     if (threads == 0)
+	  threads = std::thread::hardware_concurrency();
+     if (threads == 0)
+	  threads = 1;
+
+     for (unsigned i = 0; i < threads; ++i)
+	  _workers.push_back(std::unique_ptr<Worker>(new Worker));
+
+     // Only start once every worker exists, since they steal
+     for (unsigned i = 0; i < threads; ++i)
+	  _workers[i]->thread = std::thread(&WorkerPool::run, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+     {
+	  std::lock_guard<std::mutex> lock(_idle_lock);
+	  _stopping = true;
+     }
+     _idle.notify_all();
+
+     for (unsigned i = 0; i < _workers.size(); ++i)
+	  _workers[i]->thread.join();
+}
+
+void WorkerPool::schedule(Strand* strand)
+{
+     // Workers keep what they schedule, which keeps a strand's data
+     // in the cache it was used from; anyone else spreads the load
+     unsigned index;
+     if (current_pool == this)
+	  index = current_worker;
+     else
+	  index = _next_worker.fetch_add(1, std::memory_order_relaxed) % _workers.size();
+
+     Worker& worker = *_workers[index];
+     {
+	  std::lock_guard<std::mutex> lock(worker.lock);
+	  worker.ready.push_back(strand);
+     }
+
+     _ready.fetch_add(1);
+     if (_sleeping.load() > 0)
+     {
+	  std::lock_guard<std::mutex> lock(_idle_lock);
+	  _idle.notify_one();
+     }
+}
+
+Strand* WorkerPool::next(unsigned index)
+{
+     Strand* strand = NULL;
+
+     // Our own strands come off the front, in the order they were
+     // scheduled
+     {
+	  Worker& worker = *_workers[index];
+	  std::lock_guard<std::mutex> lock(worker.lock);
+	  if (!worker.ready.empty())
+	  {
+	       strand = worker.ready.front();
+	       worker.ready.pop_front();
+	  }
+     }
+
+     // Steal from the back of the others, away from their owners
+     for (unsigned i = 1; strand == NULL && i < _workers.size(); ++i)
+     {
+	  Worker& victim = *_workers[(index + i) % _workers.size()];
+	  std::lock_guard<std::mutex> lock(victim.lock);
+	  if (!victim.ready.empty())
+	  {
+	       strand = victim.ready.back();
+	       victim.ready.pop_back();
+	  }
+     }
+
+     if (strand != NULL)
+	  _ready.fetch_sub(1);
+     return strand;
+}
+
+void WorkerPool::run(unsigned index)
+{
+     current_pool = this;
+     current_worker = index;
+
+     for (;;)
+     {
+	  Strand* strand = next(index);
+	  if (strand != NULL)
+	  {
+	       strand->run();
+	       continue;
+	  }
+
+	  // A strand may be counted in _ready slightly before or after
+	  // it can be taken, so only trust the count to decide to sleep
+	  std::unique_lock<std::mutex> lock(_idle_lock);
+	  _sleeping.fetch_add(1);
+	  while (_ready.load() <= 0 && !_stopping)
+	       _idle.wait(lock);
+	  _sleeping.fetch_sub(1);
+
+	  if (_stopping && _ready.load() <= 0)
+	       break;
+     }
+
+     current_pool = NULL;
+}
+
+}; // namespace jabberoo
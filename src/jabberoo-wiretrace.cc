@@ -0,0 +1,400 @@
+// jabberoo-wiretrace.cc
+// Jabber client library
+//
+// Original Code Copyright (C) 1999-2001 Dave Smith (dave@jabber.org)
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+// =====================================================================================
+
+#include <wiretrace.hh>
+#include <session.hh>
+#include <sigc++/object_slot.h>
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace jabberoo {
+
+namespace {
+     const char MAGIC[] = "JTRACE1\n";
+     const size_t MAGIC_SIZE = 8;
+     // Far more than any chunk read off a socket; a bigger size in a
+     // record means the trace is corrupt
+     const unsigned long long MAX_RECORD = 64 << 20;
+
+     void putVarint(std::ofstream& out, unsigned long long v)
+     {
+	  char buf[10];
+	  int n = 0;
+	  do
+	  {
+	       buf[n] = v & 0x7f;
+	       v >>= 7;
+	       if (v != 0)
+		    buf[n] |= 0x80;
+	       n++;
+	  } while (v != 0);
+	  out.write(buf, n);
+     }
+
+     // Everything in a record before its data
+     void putRecord(std::ofstream& out, WireTrace::Direction dir,
+		    long long delta, size_t datasz)
+     {
+	  out.put((char) dir);
+	  putVarint(out, delta);
+	  putVarint(out, datasz);
+     }
+
+     // Copy into and out of a ring which has room for, or holds, all
+     // of the bytes, wrapping around its end if need be
+     void putRing(RecvRing& ring, const void* data, size_t datasz)
+     {
+	  const char* p = static_cast<const char*>(data);
+	  while (datasz > 0)
+	  {
+	       int size;
+	       char* buf = ring.getWriteBuffer(size);
+	       size = std::min((size_t) size, datasz);
+	       memcpy(buf, p, size);
+	       ring.commit(size);
+	       p += size;
+	       datasz -= size;
+	  }
+     }
+
+     void getRing(RecvRing& ring, void* data, size_t datasz)
+     {
+	  char* p = static_cast<char*>(data);
+	  while (datasz > 0)
+	  {
+	       int size;
+	       const char* buf = ring.getReadBuffer(size);
+	       size = std::min((size_t) size, datasz);
+	       memcpy(p, buf, size);
+	       ring.consume(size);
+	       p += size;
+	       datasz -= size;
+	  }
+     }
+
+     // Characters a JID may keep in a file name
+     char fileChar(char c)
+     {
+	  if (isalnum((unsigned char) c) || c == '@' || c == '.' || c == '-')
+	       return c;
+	  return '_';
+     }
+
+     bool getVarint(std::ifstream& in, unsigned long long& v)
+     {
+	  v = 0;
+	  for (int shift = 0; shift < 64; shift += 7)
+	  {
+	       int c = in.get();
+	       if (c == EOF)
+		    return false;
+	       v |= (unsigned long long) (c & 0x7f) << shift;
+	       if ((c & 0x80) == 0)
+		    return true;
+	  }
+	  return false;
+     }
+}
+
+WireTrace::WireTrace(Session& s, const std::string& filename)
+     : _out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc),
+       _last(std::chrono::steady_clock::now())
+{
+     if (!_out)
+	  throw XCP_BadTrace("can't write trace file");
+     _out.write(MAGIC, MAGIC_SIZE);
+
+     s.evtRecvXML.connect(SigC::slot(*this, &WireTrace::onRecv));
+     s.evtTransmitXML.connect(SigC::slot(*this, &WireTrace::onTransmit));
+}
+
+void WireTrace::flush()
+{
+     _out.flush();
+}
+
+void WireTrace::onRecv(const char* xml)
+{
+     write(dirRecv, xml, strlen(xml));
+}
+
+void WireTrace::onTransmit(const char* xml)
+{
+     write(dirTransmit, xml, strlen(xml));
+}
+
+void WireTrace::write(Direction dir, const char* data, size_t datasz)
+{
+     std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+     long long delta = std::chrono::duration_cast<std::chrono::microseconds>(now - _last).count();
+     _last = now;
+
+     putRecord(_out, dir, delta, datasz);
+     _out.write(data, datasz);
+}
+
+WireTrace::Reader::Reader(const std::string& filename)
+     : _in(filename.c_str(), std::ios::in | std::ios::binary), _time(0), _size(0)
+{
+     char magic[MAGIC_SIZE];
+     if (!_in.read(magic, MAGIC_SIZE) || memcmp(magic, MAGIC, MAGIC_SIZE) != 0)
+	  throw XCP_BadTrace("not a trace file");
+
+     _in.seekg(0, std::ios::end);
+     _size = _in.tellg();
+     _in.seekg(MAGIC_SIZE);
+}
+
+bool WireTrace::Reader::next(Record& r)
+{
+     int dir = _in.get();
+     if (dir == EOF)
+	  return false;
+
+     unsigned long long delta, size;
+     if ((dir != dirRecv && dir != dirTransmit) ||
+	 !getVarint(_in, delta) || !getVarint(_in, size))
+	  throw XCP_BadTrace("corrupt trace record");
+
+     // Check the size before allocating for it
+     if (size > MAX_RECORD)
+	  throw XCP_BadTrace("corrupt trace record");
+     if ((long long) size > _size - (long long) _in.tellg())
+	  throw XCP_BadTrace("trace cut short");
+
+     r.dir = (Direction) dir;
+     _time += delta;
+     r.time = _time;
+     r.data.resize(size);
+     if (size > 0 && !_in.read(&r.data[0], size))
+	  throw XCP_BadTrace("trace cut short");
+     return true;
+}
+
+WireTap::WireTap(WireLog& log, Session& s, int capacity)
+     : _log(log), _session(s), _state(tsUndecided), _ring(capacity),
+       _closed(false), _have_header(false), _last(0)
+{ }
+
+void WireTap::capture(WireTrace::Direction dir, const char* data, size_t datasz)
+{
+     if (_state == tsUndecided)
+	  _state = _log.decide(*this) ? tsRecording : tsIgnored;
+     if (_state != tsRecording)
+	  return;
+
+     Header h;
+     h.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  std::chrono::steady_clock::now().time_since_epoch()).count();
+     h.size = datasz;
+     h.dir = dir;
+
+     // All or nothing, so the flusher never sees half a chunk for good
+     if ((size_t) _ring.writable() < sizeof(h) + datasz)
+     {
+	  _log._dropped.fetch_add(1, std::memory_order_relaxed);
+	  return;
+     }
+     putRing(_ring, &h, sizeof(h));
+     putRing(_ring, data, datasz);
+}
+
+void WireTap::close()
+{
+     _closed.store(true, std::memory_order_release);
+}
+
+WireLog::WireLog(const std::string& dir, int capacity)
+     : _dir(dir), _capacity(capacity), _sampling(1), _candidates(0), _files(0),
+       _dropped(0), _unwritable(0), _stopping(false), _passes(0), _wanted(0)
+{
+     _flusher = std::thread(&WireLog::run, this);
+}
+
+WireLog::~WireLog()
+{
+     {
+	  std::lock_guard<std::mutex> guard(_lock);
+	  _stopping = true;
+     }
+     _wakeup.notify_all();
+     _flusher.join();
+}
+
+void WireLog::setSampling(unsigned n)
+{
+     std::lock_guard<std::mutex> guard(_lock);
+     _sampling = std::max(n, 1u);
+}
+
+void WireLog::addJID(const std::string& jid)
+{
+     std::lock_guard<std::mutex> guard(_lock);
+     _jids.insert(jid);
+}
+
+void WireLog::attach(Session& s)
+{
+     WireTap* tap = new WireTap(*this, s, _capacity);
+     {
+	  std::lock_guard<std::mutex> guard(_lock);
+	  _taps.push_back(tap);
+     }
+     s.setWireTap(tap);
+}
+
+void WireLog::detach(Session& s)
+{
+     s.setWireTap(NULL);
+}
+
+void WireLog::flush()
+{
+     std::unique_lock<std::mutex> lock(_lock);
+
+     // A pass may be part way through already, so wait for the one
+     // after it
+     unsigned long target = _passes + 2;
+     _wanted = std::max(_wanted, target);
+     _wakeup.notify_all();
+     while (_passes < target && !_stopping)
+	  _wakeup.wait(lock);
+}
+
+bool WireLog::decide(WireTap& tap)
+{
+     const std::string& jid = tap._session.getLocalJID();
+     std::string bare = JID::getUserHost(jid);
+
+     std::lock_guard<std::mutex> guard(_lock);
+     if (!_jids.empty() && _jids.count(jid) == 0 && _jids.count(bare) == 0)
+	  return false;
+     if (_candidates++ % _sampling != 0)
+	  return false;
+
+     std::string name = bare.empty() ? "unknown" : bare;
+     std::transform(name.begin(), name.end(), name.begin(), fileChar);
+     char seq[16];
+     snprintf(seq, sizeof(seq), "-%lu", _files++);
+     tap._filename = _dir + "/" + name + seq + ".jtrace";
+     return true;
+}
+
+void WireLog::run()
+{
+     std::unique_lock<std::mutex> lock(_lock);
+     while (true)
+     {
+	  bool stopping = _stopping;
+	  std::list<WireTap*> taps = _taps;
+
+	  // Attaching only appends, so the copy stays valid while the
+	  // rings are written out without the lock
+	  lock.unlock();
+	  for (std::list<WireTap*>::iterator it = taps.begin(); it != taps.end(); ++it)
+	       drain(**it);
+	  lock.lock();
+
+	  for (std::list<WireTap*>::iterator it = _taps.begin(); it != _taps.end(); )
+	  {
+	       WireTap* tap = *it;
+	       // The flag is set after the session's last capture, so
+	       // once it is seen a drain which empties the ring is final
+	       if ((tap->_closed.load(std::memory_order_acquire) &&
+		    tap->_ring.readable() == 0) || stopping)
+	       {
+		    delete tap;
+		    it = _taps.erase(it);
+	       }
+	       else
+		    ++it;
+	  }
+
+	  _passes++;
+	  _wakeup.notify_all();
+	  if (stopping)
+	       break;
+	  _wakeup.wait_for(lock, std::chrono::milliseconds(50),
+			   [this]() { return _stopping || _passes < _wanted; });
+     }
+}
+
+void WireLog::drain(WireTap& tap)
+{
+     while (true)
+     {
+	  if (!tap._have_header)
+	  {
+	       if ((size_t) tap._ring.readable() < sizeof(WireTap::Header))
+		    break;
+	       getRing(tap._ring, &tap._header, sizeof(WireTap::Header));
+	       tap._have_header = true;
+	  }
+
+	  // The session may still be copying the rest of the chunk
+	  size_t size = tap._header.size;
+	  if ((size_t) tap._ring.readable() < size)
+	       break;
+	  tap._have_header = false;
+
+	  if (!tap._out.is_open() && !tap._filename.empty())
+	  {
+	       tap._out.open(tap._filename.c_str(),
+			     std::ios::out | std::ios::binary | std::ios::trunc);
+	       if (tap._out.is_open())
+	       {
+		    tap._out.write(MAGIC, MAGIC_SIZE);
+		    tap._last = tap._header.time;
+	       }
+	       else
+		    _unwritable.fetch_add(1, std::memory_order_relaxed);
+	       // Either way it's the one try; a session whose file can't
+	       // be made has the rest of its chunks thrown away
+	       tap._filename.clear();
+	  }
+	  bool keep = tap._out.is_open();
+
+	  if (keep)
+	  {
+	       // Keep the remainder, so rounding to microseconds doesn't drift
+	       unsigned long long delta = (tap._header.time - tap._last) / 1000;
+	       tap._last += delta * 1000;
+	       putRecord(tap._out, (WireTrace::Direction) tap._header.dir, delta, size);
+	  }
+	  while (size > 0)
+	  {
+	       int piece;
+	       const char* buf = tap._ring.getReadBuffer(piece);
+	       piece = std::min((size_t) piece, size);
+	       if (keep)
+		    tap._out.write(buf, piece);
+	       tap._ring.consume(piece);
+	       size -= piece;
+	  }
+     }
+     if (tap._out.is_open())
+	  tap._out.flush();
+}
+
+}; // namespace jabberoo
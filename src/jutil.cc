@@ -59,14 +59,20 @@ std::string jutil::getTimeStamp()
 {
     time_t t;
     struct tm *new_time;
-    static char timestamp[18];
+    char timestamp[18];
     int ret;
 
     t = time(NULL);
 
     if(t == (time_t)-1)
-        return NULL;
+        return "";
+#ifdef WIN32
+    // gmtime() uses thread local storage on win32
     new_time = gmtime(&t);
+#else
+    struct tm tm_buf;
+    new_time = gmtime_r(&t, &tm_buf);
+#endif
 
     ret = snprintf(timestamp, 18, "%d%02d%02dT%02d:%02d:%02d", 1900+new_time->tm_year,
                    new_time->tm_mon+1, new_time->tm_mday, new_time->tm_hour,
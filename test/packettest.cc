@@ -0,0 +1,79 @@
+#include "jabberoo.hh"
+using namespace jabberoo;
+
+#include <iostream>
+#include <utility>
+using namespace std;
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+     if (!ok)
+     {
+	  cerr << "FAILED: " << what << endl;
+	  failures++;
+     }
+}
+
+// Copy-on-write sharing of Packet base elements, and what moving
+// leaves behind
+int main(int argc, char** argv)
+{
+     Packet a("message");
+     a.setTo("romeo@montague.net");
+     check(!a.isShared(), "a new packet is not shared");
+
+     // Copies share the tree until one of them is written
+     {
+	  Packet b(a);
+	  check(a.isShared() && b.isShared(), "a copy shares the base element");
+	  check(&((const Packet&) a).getBaseElement() == &((const Packet&) b).getBaseElement(),
+		"a copy has the same base element");
+
+	  b.setTo("juliet@capulet.com");
+	  check(!a.isShared() && !b.isShared(), "writing a copy unshares it");
+	  check(a.getTo() == "romeo@montague.net", "the original is unchanged");
+	  check(b.getTo() == "juliet@capulet.com", "the copy is changed");
+
+	  Packet c(a);
+	  c.getBaseElement().addElement("body", "Hello");
+	  check(a.getBaseElement().findElement("body") == NULL,
+		"changes through getBaseElement() are not seen by the original");
+     }
+
+     // Dropping the copies drops the references
+     {
+	  Packet b(a);
+	  Packet c(a);
+	  check(a.isShared(), "shared with two copies");
+	  b = Packet("presence");
+	  check(a.isShared(), "still shared with one copy");
+     }
+     check(!a.isShared(), "not shared once the copies are gone");
+
+     // Moving takes the tree without copying it
+     const judo::Element* base = &((const Packet&) a).getBaseElement();
+     Packet d(std::move(a));
+     check(&((const Packet&) d).getBaseElement() == base, "moving takes the base element");
+     check(!d.isShared(), "the moved-to packet is not shared");
+
+     // The moved-from packet is empty but usable
+     check(a.getTo() == "" && a.getBaseElement().getName() == "",
+	   "a moved-from packet is empty");
+     check(a.toString() == "</>", "a moved-from packet can be written out");
+     a.setTo("mercutio@verona.lit");
+     check(a.getTo() == "mercutio@verona.lit", "a moved-from packet can be written to");
+
+     Packet e("iq");
+     e = std::move(d);
+     check(e.getTo() == "romeo@montague.net", "move assignment takes the base element");
+     check(d.getTo() == "", "move assignment leaves an empty packet");
+     Packet f(d);
+     f.setID("1");
+     check(d.getID() == "" && f.getID() == "1",
+	   "writing a copy of a moved-from packet leaves it empty");
+
+     cerr << failures << " failures" << endl;
+     return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,53 @@
+#include "recvring.hh"
+using namespace jabberoo;
+
+#include <iostream>
+#include <thread>
+using namespace std;
+
+// Stream bytes through a small ring from one thread to another and
+// check they arrive intact and in order
+int main(int argc, char** argv)
+{
+     const long total = 10000000;
+     RecvRing ring(1000);
+     cerr << "capacity: " << ring.capacity() << endl;
+
+     thread writer([&]() {
+	  long sent = 0;
+	  while (sent < total)
+	  {
+	       int size;
+	       char* buf = ring.getWriteBuffer(size);
+	       if (size == 0)
+	       {
+		    ring.waitWritable();
+		    continue;
+	       }
+	       // Write in uneven pieces to exercise the wrap
+	       size = min<long>(min(size, 333), total - sent);
+	       for (int i = 0; i < size; ++i)
+		    buf[i] = (char) ((sent + i) % 251);
+	       ring.commit(size);
+	       sent += size;
+	  }
+	  ring.close();
+     });
+
+     long received = 0, bad = 0;
+     while (ring.waitReadable())
+     {
+	  int size;
+	  const char* buf = ring.getReadBuffer(size);
+	  for (int i = 0; i < size; ++i)
+	       if (buf[i] != (char) ((received + i) % 251))
+		    bad++;
+	  ring.consume(size);
+	  received += size;
+     }
+     writer.join();
+
+     cerr << "received " << received << " of " << total << " bytes, "
+	  << bad << " wrong" << endl;
+     return (received == total && bad == 0) ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include "jabberoo.hh"
+using namespace jabberoo;
+
+#include <iostream>
+using namespace std;
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+     if (!ok)
+     {
+	  cerr << "FAILED: " << what << endl;
+	  failures++;
+     }
+}
+
+Session* G_session;
+judo::XPath::Query* G_presence = NULL;
+int G_chats = 0;
+int G_messages = 0;
+int G_presences = 0;
+
+void onChat(const judo::Element& t) { G_chats++; }
+void onAnyMessage(const judo::Element& t) { G_messages++; }
+void onPresence(const judo::Element& t) { G_presences++; }
+
+// Runs after a message's start tag has been checked against the
+// queries, but before they are dispatched to: swap the presence query
+// for one on every message
+void onMessage(const Message& m)
+{
+     if (G_presence == NULL)
+	  return;
+     G_session->unregisterXPath(G_presence);
+     G_presence = NULL;
+     G_session->registerXPath("/message", SigC::slot(&onAnyMessage));
+}
+
+// XPath handlers see every packet they match, even when the handlers
+// change the query list while the packet is in flight
+int main(int argc, char** argv)
+{
+     Session s;
+     G_session = &s;
+     s.connect("capulet.com", Session::atPlaintextAuth, "juliet", "balcony", "r0me0", false, false);
+     s >> "<stream:stream xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams' id='1'>";
+
+     s.registerXPath("/message[@type='chat']", SigC::slot(&onChat));
+     G_presence = s.registerXPath("/presence", SigC::slot(&onPresence));
+
+     s >> "<presence from='romeo@montague.net/orchard'/>";
+     check(G_presences == 1 && G_chats == 0, "a presence is matched from its start tag");
+
+     // The start tag decided "/presence" no and the chat query yes;
+     // neither decision may be applied to the query which replaced
+     // the presence one
+     s.evtMessage.connect(SigC::slot(&onMessage));
+     s >> "<message from='romeo@montague.net/orchard' type='chat'><body>Hi</body></message>";
+     check(G_chats == 1, "the chat query sees the message");
+     check(G_messages == 1, "a query registered during dispatch sees the message");
+     check(G_presences == 1, "the unregistered query sees nothing");
+
+     s >> "<message type='normal'><body>Hi</body></message>";
+     check(G_chats == 1 && G_messages == 2, "decisions are used again once the list settles");
+
+     cerr << failures << " failures" << endl;
+     return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+#include "jabberoo.hh"
+#include "strand.hh"
+using namespace jabberoo;
+
+#include <iostream>
+using namespace std;
+
+// Post from several threads at once to a set of strands, and check
+// that each strand ran its tasks one at a time and lost none
+int main(int argc, char** argv)
+{
+     const int strands = 100, producers = 4, posts = 10000;
+     vector<long> counts(strands, 0);
+     vector<atomic<int> > running(strands);
+     atomic<int> overlaps(0);
+
+     unique_ptr<WorkerPool> pool(new WorkerPool());
+     vector<unique_ptr<Strand> > list;
+     for (int i = 0; i < strands; ++i)
+	  list.push_back(unique_ptr<Strand>(new Strand(*pool)));
+
+     vector<thread> threads;
+     for (int p = 0; p < producers; ++p)
+	  threads.push_back(thread([&, p]() {
+	       for (int n = 0; n < posts; ++n)
+	       {
+		    int s = (n + p) % strands;
+		    list[s]->post([&, s]() {
+			 if (running[s]++ != 0)
+			      overlaps++;
+			 counts[s]++;
+			 running[s]--;
+		    });
+	       }
+	  }));
+     for (size_t i = 0; i < threads.size(); ++i)
+	  threads[i].join();
+
+     // Destroying the pool runs whatever is still queued
+     cerr << "workers: " << pool->size() << endl;
+     pool.reset();
+
+     long total = 0;
+     for (int i = 0; i < strands; ++i)
+	  total += counts[i];
+     cerr << "ran " << total << " of " << producers * posts << " tasks, "
+	  << overlaps << " overlapping" << endl;
+
+     return (total == producers * posts && overlaps == 0) ? 0 : 1;
+}